@@ -1 +1,285 @@
+// lib/displayer.cc – Base class for stimulus displayers
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include <cmath>
+
 #include "displayer.h"
+
+namespace plstim
+{
+
+FrameTimings FrameTimings::fromSwapTimes(const QVector<qint64>& swaps,
+					 qint64 refreshInterval)
+{
+  FrameTimings timings;
+  timings.frames = swaps.size();
+  if (swaps.isEmpty())
+    return timings;
+
+  timings.onset = swaps.first();
+  for (int i = 1; i < swaps.size(); i++) {
+    qint64 dt = swaps.at(i) - swaps.at(i-1);
+    timings.maxInterval = qMax(timings.maxInterval, dt);
+    // Number of retraces elapsed, minus the expected one
+    if (refreshInterval > 0 && 2*dt > 3*refreshInterval)
+      timings.dropped += static_cast<int>((dt + refreshInterval/2) / refreshInterval) - 1;
+  }
+
+  return timings;
+}
+
+float ProceduralStimulus::luminance(float x, float y, int frame) const
+{
+  float ph = phase + frame*phaseStep;
+  auto carrier = [&] (float theta) {
+    return std::sin(2*M_PI*frequency*(x*std::cos(theta) + y*std::sin(theta)) + ph);
+  };
+
+  float l = carrier(orientation);
+  if (kind == Plaid)
+    l = 0.5f*(l + carrier(orientation + plaidAngle));
+  if (sigma > 0 && kind != Grating)
+    l *= std::exp(-(x*x + y*y)/(2*sigma*sigma));
+  return 0.5f + 0.5f*contrast*l;
+}
+
+void Displayer::rasterise(QImage& image, const FrameDrawing& drawing)
+{
+  image.fill(0);
+  QPainter painter(&image);
+  drawing(painter);
+}
+
+void Displayer::addProceduralFrames(const QString& name,
+				    const ProceduralStimulus& stimulus)
+{
+  // Frames of a gray level per pixel
+  auto compute = [&] (int frame) {
+    QImage img = frameBuffer(stimulus.width, stimulus.height,
+			     QImage::Format_Grayscale8);
+    for (int j = 0; j < img.height(); j++) {
+      uchar* line = img.scanLine(j);
+      float y = 0.5f*img.height() - j - 0.5f;
+      for (int i = 0; i < img.width(); i++) {
+	float x = i + 0.5f - 0.5f*img.width();
+	float l = stimulus.luminance(x, y, frame);
+	line[i] = static_cast<uchar>(qBound(0, qRound(255*l), 255));
+      }
+    }
+    return img;
+  };
+
+  if (stimulus.frames <= 0) {
+    addFixedFrame(name, compute(0));
+    return;
+  }
+  reserveAnimatedFrames(name, stimulus.frames);
+  for (int frame = 0; frame < stimulus.frames; frame++)
+    addAnimatedFrame(name, compute(frame));
+}
+
+FrameDrawing Displayer::dotDrawing(const DotFrames& dots, int frame)
+{
+  return [dots, frame] (QPainter& painter) {
+    const float* pos = dots.frame(frame);
+    QPolygonF points;
+    points.reserve(dots.count);
+    for (int i = 0; i < dots.count; i++)
+      points << QPointF(pos[2*i], pos[2*i+1]);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setPen(QPen(dots.color, dots.dotSize, Qt::SolidLine,
+			Qt::RoundCap));
+    painter.drawPoints(points);
+  };
+}
+
+void Displayer::addDotFrames(const QString& name, const DotFrames& dots)
+{
+  if (dots.frames <= 0) {
+    paintFixedFrame(name, dots.width, dots.height, QImage::Format_RGB32,
+		    dotDrawing(dots, 0));
+    return;
+  }
+  reserveAnimatedFrames(name, dots.frames);
+  for (int frame = 0; frame < dots.frames; frame++)
+    paintAnimatedFrame(name, dots.width, dots.height, QImage::Format_RGB32,
+		       dotDrawing(dots, frame));
+}
+
+/// Paint an element centred on the origin, its side along the axes.
+static void paintElement(QPainter& painter, const ElementFrames& elements,
+			 float side, float contrast, int index)
+{
+  QRectF rect(-side/2, -side/2, side, side);
+  int gray = qBound(0, qRound(255 * elements.luminance(contrast)), 255);
+  switch (elements.shape) {
+  case ElementFrames::Disc:
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(QColor(gray, gray, gray));
+    painter.drawEllipse(rect);
+    break;
+  case ElementFrames::Gabor: {
+    int n = qCeil(side);
+    QImage patch(n, n, QImage::Format_Grayscale8);
+    float s = elements.sigma * n;
+    for (int y = 0; y < n; y++) {
+      uchar* line = patch.scanLine(y);
+      for (int x = 0; x < n; x++) {
+	float u = (x + 0.5f) / n - 0.5f;
+	float v = (y + 0.5f) / n - 0.5f;
+	float r2 = (u * u + v * v) * n * n;
+	float g = std::exp(-r2 / (2 * s * s))
+	  * std::sin(2 * M_PI * elements.frequency * u);
+	line[x] = qBound(0, qRound(255 * elements.luminance(contrast, g)),
+			 255);
+      }
+    }
+    painter.drawImage(rect, patch);
+    break;
+  }
+  case ElementFrames::Glyph: {
+    if (index < 0 || index >= elements.glyphCount)
+      break;
+    int cell = elements.glyphs.height();
+    QImage glyph = elements.glyphs.copy(index * cell, 0, cell, cell)
+      .convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    QPainter tint(&glyph);
+    tint.setCompositionMode(QPainter::CompositionMode_SourceIn);
+    tint.fillRect(glyph.rect(), QColor(gray, gray, gray));
+    tint.end();
+    painter.drawImage(rect, glyph);
+    break;
+  }
+  }
+}
+
+FrameDrawing Displayer::elementDrawing(const ElementFrames& elements,
+				       int frame)
+{
+  return [elements, frame] (QPainter& painter) {
+    const float* attr = elements.frame(frame);
+    int gray = qBound(0, qRound(255 * elements.background), 255);
+    painter.fillRect(0, 0, elements.width, elements.height,
+		     QColor(gray, gray, gray));
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    for (int i = 0; i < elements.count;
+	 i++, attr += ElementFrames::AttributeCount) {
+      painter.save();
+      painter.translate(attr[ElementFrames::X], attr[ElementFrames::Y]);
+      // Counter-clockwise on screen, with y going down
+      painter.rotate(-qRadiansToDegrees(attr[ElementFrames::Orientation]));
+      paintElement(painter, elements, attr[ElementFrames::Size],
+		   attr[ElementFrames::Contrast],
+		   qRound(attr[ElementFrames::Index]));
+      painter.restore();
+    }
+  };
+}
+
+void Displayer::addElementFrames(const QString& name,
+				 const ElementFrames& elements)
+{
+  if (elements.frames <= 0) {
+    paintFixedFrame(name, elements.width, elements.height,
+		    QImage::Format_RGB32, elementDrawing(elements, 0));
+    return;
+  }
+  reserveAnimatedFrames(name, elements.frames);
+  for (int frame = 0; frame < elements.frames; frame++)
+    paintAnimatedFrame(name, elements.width, elements.height,
+		       QImage::Format_RGB32, elementDrawing(elements, frame));
+}
+
+/// Scale the colours of an image around the mid gray level.
+static QImage contrastScaled(const QImage& img, float contrast)
+{
+  if (contrast == 1)
+    return img;
+  QImage scaled = img;
+  int width = scaled.width();
+  switch (scaled.format()) {
+  case QImage::Format_Grayscale8:
+    for (int y = 0; y < scaled.height(); y++) {
+      uchar* line = scaled.scanLine(y);
+      for (int x = 0; x < width; x++)
+	line[x] = static_cast<uchar>(qBound(0, qRound(127.5f + contrast*(line[x] - 127.5f)), 255));
+    }
+    break;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+  case QImage::Format_Grayscale16:
+    for (int y = 0; y < scaled.height(); y++) {
+      auto line = reinterpret_cast<quint16*>(scaled.scanLine(y));
+      for (int x = 0; x < width; x++)
+	line[x] = static_cast<quint16>(qBound(0, qRound(32767.5f + contrast*(line[x] - 32767.5f)), 65535));
+    }
+    break;
+#endif
+  default: {
+    if (scaled.format() != QImage::Format_RGB32)
+      scaled = scaled.convertToFormat(QImage::Format_ARGB32);
+    auto scale = [contrast] (int c) {
+      return qBound(0, qRound(127.5f + contrast*(c - 127.5f)), 255);
+    };
+    for (int y = 0; y < scaled.height(); y++) {
+      auto line = reinterpret_cast<QRgb*>(scaled.scanLine(y));
+      for (int x = 0; x < width; x++)
+	line[x] = qRgba(scale(qRed(line[x])), scale(qGreen(line[x])),
+			scale(qBlue(line[x])), qAlpha(line[x]));
+    }
+    break;
+  }
+  }
+  return scaled;
+}
+
+void Displayer::addScheduledFrames(const QString& name, const QImage& img,
+				   const FrameSchedule& schedule)
+{
+  reserveAnimatedFrames(name, schedule.frames);
+  for (int frame = 0; frame < schedule.frames; frame++) {
+    QImage scaled = contrastScaled(img, schedule.contrast(frame));
+    QTransform transform = schedule.transform(frame);
+    paintAnimatedFrame(name, img.width(), img.height(), img.format(),
+		       [scaled, transform] (QPainter& painter) {
+			 painter.setRenderHint(QPainter::SmoothPixmapTransform);
+			 painter.setTransform(transform);
+			 painter.drawImage(0, 0, scaled);
+		       });
+  }
+}
+
+void Displayer::addStreamedFrames(const QString& name, int frames,
+				  int width, int height, QImage::Format format,
+				  int lookahead, const FrameProducer& producer)
+{
+  Q_UNUSED(lookahead);
+  reserveAnimatedFrames(name, frames);
+  for (int frame = 0; frame < frames; frame++) {
+    QImage img = frameBuffer(width, height, format);
+    producer(frame, img);
+    addAnimatedFrame(name, img);
+  }
+}
+
+void Displayer::paintFixedFrame(const QString& name, int width, int height,
+				QImage::Format format,
+				const FrameDrawing& drawing)
+{
+  QImage img = frameBuffer(width, height, format);
+  rasterise(img, drawing);
+  addFixedFrame(name, img);
+}
+
+void Displayer::paintAnimatedFrame(const QString& name, int width, int height,
+				   QImage::Format format,
+				   const FrameDrawing& drawing)
+{
+  QImage img = frameBuffer(width, height, format);
+  rasterise(img, drawing);
+  addAnimatedFrame(name, img);
+}
+
+} // namespace plstim
@@ -5,11 +5,201 @@
 
 #pragma once
 
+#include <functional>
+
 #include <QtGui>
 
+#include "framestream.h"
+
 namespace plstim
 {
 
+/**
+ * Presentation timing of a fixed frame or animated series.
+ *
+ * Times are given in nanoseconds, with onsets on the
+ * monotonicNsecs() clock.
+ */
+struct FrameTimings
+{
+  /// Completion time of the first buffer swap
+  qint64 onset = 0;
+  /// Number of presented frames
+  int frames = 0;
+  /// Estimated number of missed vertical retraces
+  int dropped = 0;
+  /// Longest interval between two consecutive frames
+  qint64 maxInterval = 0;
+  /// Streamed frames which were not painted yet when due
+  int underruns = 0;
+
+  /**
+   * Summarise buffer swap completion times.
+   * Intervals longer than one and a half refresh interval are
+   * counted as missed vertical retraces.
+   */
+  static FrameTimings fromSwapTimes(const QVector<qint64>& swaps,
+				    qint64 refreshInterval);
+};
+
+/// Reuse of frame storage by a displayer.
+struct TexturePoolStats
+{
+  /// Frames uploaded to recycled storage
+  qint64 hits = 0;
+  /// Frames which required an allocation
+  qint64 misses = 0;
+};
+
+/**
+ * Stimulus computed per pixel, and per frame, by the displayer.
+ *
+ * Luminance is 0.5 + 0.5 × contrast × envelope × carrier, where the
+ * carrier is a sine wave or, for plaids, the mean of two sine waves.
+ * Positions are in pixels from the frame centre, y going up.
+ */
+struct ProceduralStimulus
+{
+  enum Kind { Grating, Gabor, Plaid };
+  Kind kind = Grating;
+  /// Frame size in pixels
+  int width = 0;
+  int height = 0;
+  /// Number of animated frames, zero for a fixed frame
+  int frames = 0;
+  /// Spatial frequency in cycles per pixel
+  float frequency = 0;
+  /// Phase of the first frame, and its increment per frame, in radians
+  float phase = 0;
+  float phaseStep = 0;
+  /// Orientation of the carrier, counter-clockwise in radians
+  float orientation = 0;
+  /// Angle between the two plaid components, in radians
+  float plaidAngle = 0;
+  float contrast = 1;
+  /// Gaussian envelope deviation in pixels of Gabors and plaids, none
+  /// if zero, a Gabor then being a plain grating
+  float sigma = 0;
+
+  /// Luminance at a pixel position, in [0, 1].
+  float luminance(float x, float y, int frame) const;
+};
+
+/**
+ * Round dots drawn at given positions on each frame, e.g. the dots
+ * of a random-dot kinematogram.
+ */
+struct DotFrames
+{
+  /// Frame size in pixels
+  int width = 0;
+  int height = 0;
+  /// Number of animated frames, zero for a fixed frame
+  int frames = 0;
+  /// Number of dots on each frame
+  int count = 0;
+  /// Positions from the top left corner, x then y for each dot of each frame
+  QVector<float> positions;
+  /// Dot diameter in pixels
+  float dotSize = 1;
+  QColor color = Qt::white;
+
+  /// Positions of the dots of a frame.
+  const float* frame(int index) const
+  { return positions.constData() + 2 * count * index; }
+};
+
+/**
+ * Identical elements (discs, Gabors or glyphs) drawn over a uniform
+ * background, with a position, orientation, contrast and size for
+ * each element of each frame.
+ */
+struct ElementFrames
+{
+  enum Shape { Disc, Gabor, Glyph };
+  /// Attributes of an element, in order
+  enum Attribute { X, Y, Orientation, Size, Contrast, Index, AttributeCount };
+
+  Shape shape = Disc;
+  /// Frame size in pixels
+  int width = 0;
+  int height = 0;
+  /// Number of animated frames, zero for a fixed frame
+  int frames = 0;
+  /// Number of elements on each frame
+  int count = 0;
+  /**
+   * Attributes of each element of each frame: centre in pixels from
+   * the top left corner, orientation counter-clockwise in radians,
+   * side in pixels, contrast in [-1, 1] and glyph index.
+   */
+  QVector<float> attributes;
+  /// Background gray level in [0, 1]
+  float background = 0.5f;
+  /// Gabor frequency in cycles per element side
+  float frequency = 4;
+  /// Gabor envelope deviation, relative to the element side
+  float sigma = 1.f / 6;
+  /// Square glyph cells side by side, white on transparent
+  QImage glyphs;
+  int glyphCount = 0;
+
+  /// Attributes of the elements of a frame.
+  const float* frame(int index) const
+  { return attributes.constData() + AttributeCount * count * index; }
+
+  /// Gray level of an element, its shape being at the given strength.
+  float luminance(float contrast, float strength=1) const
+  { return background * (1 + contrast * strength); }
+};
+
+/**
+ * Animation of a single frame, moved and scaled in contrast on each
+ * frame while presenting, instead of painting every frame.
+ */
+struct FrameSchedule
+{
+  /// Values of a frame: transform then contrast
+  enum Value { M11, M12, M21, M22, Dx, Dy, Contrast, ValueCount };
+
+  int frames = 0;
+  QVector<float> values;
+
+  /**
+   * Add a frame, transformed in pixels from the top left corner, its
+   * colours scaled by contrast around the mid gray level.
+   */
+  void append(const QTransform& transform, float contrast=1)
+  {
+    values << transform.m11() << transform.m12()
+	   << transform.m21() << transform.m22()
+	   << transform.dx() << transform.dy() << contrast;
+    frames++;
+  }
+
+  QTransform transform(int frame) const
+  {
+    const float* v = values.constData() + ValueCount * frame;
+    return QTransform(v[M11], v[M12], v[M21], v[M22], v[Dx], v[Dy]);
+  }
+
+  float contrast(int frame) const
+  { return values.at(ValueCount * frame + Contrast); }
+};
+
+/// Fixed frame drawn over the frames of a page, at a place in pixels
+struct FrameLayer
+{
+  QString frame;
+  QRect rect;
+};
+
+/**
+ * Drawing of a frame, called with a painter on a transparent black
+ * frame. Drawings may be called from another thread.
+ */
+typedef std::function<void (QPainter&)> FrameDrawing;
+
 /**
  * Abstract base class for stimulus displayers.
  * 
@@ -20,19 +210,163 @@ namespace plstim
 class Displayer
 {
 public:
+  /**
+   * Get an image to paint a frame in, later given to addFixedFrame()
+   * or addAnimatedFrame(). Displayers may hand out images backed by
+   * upload buffers to save copies: such images must not be used
+   * anymore once added. Grayscale formats are stored as a single
+   * channel and displayed as gray levels.
+   */
+  virtual QImage frameBuffer(int width, int height,
+			     QImage::Format format=QImage::Format_RGB32)
+  { return QImage(width, height, format); }
+
+  /**
+   * Maximal number of images from frameBuffer() which may be held at
+   * once without being added, zero for no limit.
+   */
+  virtual int maxFrameBuffers()
+  { return 0; }
+
   /// Define the content of a fixed frame.
   virtual void addFixedFrame(const QString& name, const QImage& img) = 0;
   /// Append a single frame to an animated series.
   virtual void addAnimatedFrame(const QString& name, const QImage& img) = 0;
+  /**
+   * Append to an animated series the same frame as one of its earlier
+   * frames, given by its index in the series, sharing its storage.
+   */
+  virtual void repeatAnimatedFrame(const QString& name, int frame) = 0;
+  /**
+   * Append to an animated series a frame of another series, given by
+   * its index in that series, sharing its storage. The storage is
+   * kept until no series presents the frame anymore, and series
+   * sharing frames are not evicted.
+   */
+  virtual void shareAnimatedFrame(const QString& name, const QString& source,
+				  int frame) = 0;
+
+  /**
+   * Define the content of a fixed frame from its drawing. Displayers
+   * may paint directly in graphics memory, by default the frame is
+   * rasterised on the CPU and added as an image.
+   */
+  virtual void paintFixedFrame(const QString& name, int width, int height,
+			       QImage::Format format,
+			       const FrameDrawing& drawing);
+  /// Append a frame to an animated series from its drawing.
+  virtual void paintAnimatedFrame(const QString& name, int width, int height,
+				  QImage::Format format,
+				  const FrameDrawing& drawing);
+
+  /// Rasterise a drawing in an image on the CPU.
+  static void rasterise(QImage& image, const FrameDrawing& drawing);
+
+  /**
+   * Define a fixed frame or an animated series from a procedural
+   * stimulus. Displayers may compute it on the fly while presenting,
+   * by default the frames are computed on the CPU and added as images.
+   */
+  virtual void addProceduralFrames(const QString& name,
+				   const ProceduralStimulus& stimulus);
+
+  /**
+   * Define a fixed frame or an animated series of dots. Displayers
+   * may draw them as point sprites while presenting, by default the
+   * frames are painted and added as drawings.
+   */
+  virtual void addDotFrames(const QString& name, const DotFrames& dots);
+  /// Drawing of a frame of dots, as painted by default.
+  static FrameDrawing dotDrawing(const DotFrames& dots, int frame);
 
+  /**
+   * Define a fixed frame or an animated series of elements.
+   * Displayers may draw all the elements of a frame at once while
+   * presenting, by default the frames are painted and added as
+   * drawings.
+   */
+  virtual void addElementFrames(const QString& name,
+				const ElementFrames& elements);
+  /// Drawing of a frame of elements, as painted by default.
+  static FrameDrawing elementDrawing(const ElementFrames& elements,
+				     int frame);
+
+  /**
+   * Define an animated series from a single frame and its schedule.
+   * Displayers may apply the schedule while presenting, by default
+   * every frame is painted.
+   */
+  virtual void addScheduledFrames(const QString& name, const QImage& img,
+				  const FrameSchedule& schedule);
+
+  /**
+   * Define an animated series painted by a producer thread while
+   * presenting, at most lookahead frames ahead (see FrameStream). By
+   * default all the frames are painted at once and added as images.
+   */
+  virtual void addStreamedFrames(const QString& name, int frames,
+				 int width, int height, QImage::Format format,
+				 int lookahead, const FrameProducer& producer);
+
+  /**
+   * Draw fixed frames over the frames of a page while presenting it,
+   * in order, blended by their alpha channel. The page itself needs
+   * no frame when it only has layers.
+   */
+  virtual void setFrameLayers(const QString& name,
+			      const QVector<FrameLayer>& layers) = 0;
+
+  /**
+   * Present a fixed frame.
+   * Presentation may be asynchronous: framesShown() is emitted once
+   * the frame actually reached the screen.
+   */
   virtual void showFixedFrame(const QString& name) = 0;
+  /**
+   * Present all the frames of an animated series.
+   * Presentation may be asynchronous: framesShown() is emitted once
+   * the last frame of the series reached the screen.
+   */
   virtual void showAnimatedFrames(const QString& name) = 0;
 
   /// Remove all frames in an animated series.
   virtual void deleteAnimatedFrames(const QString& name) = 0;
+  /// Remove all frames of a name, fixed, animated or computed.
+  virtual void deleteFrames(const QString& name) = 0;
+  /**
+   * Announce the number of frames about to be added to an animated
+   * series, so that storage can be allocated once for all of them.
+   */
+  virtual void reserveAnimatedFrames(const QString& name, int count)
+  { Q_UNUSED(name); Q_UNUSED(count); }
   /// Destroy all frames.
   virtual void clear() = 0;
 
+  /**
+   * Whether the frames of a page may leave the graphics memory when
+   * over budget, to be restored before being shown. Only frames
+   * painted once per experiment should be evictable, and they are
+   * only evicted once shown.
+   */
+  virtual void setFramesEvictable(const QString& name, bool evictable)
+  { Q_UNUSED(name); Q_UNUSED(evictable); }
+  /// Limit the graphics memory used by frames, zero for no limit.
+  virtual void setMemoryBudget(qint64 bytes)
+  { Q_UNUSED(bytes); }
+  /// Hint that frames will be shown soon, restoring them if evicted.
+  virtual void prepareFrames(const QString& name)
+  { Q_UNUSED(name); }
+  /// Draw all the frames offscreen once, making them resident.
+  virtual void prewarm() {}
+
+  /// Frame storage reuse since the displayer creation.
+  virtual TexturePoolStats texturePoolStats()
+  { return TexturePoolStats(); }
+
+  /**
+   * Set the size of the frames in pixels.
+   * Sizes need not be powers of two, nor square.
+   */
   virtual void setTextureSize(int width, int height) = 0;
 
   /// Show the displayer in normal (fullscreen) mode.
@@ -49,10 +383,21 @@ signals:
   virtual void keyPressed(QKeyEvent* event) = 0;
   /// Sent when the displayer becomes visible.
   virtual void exposed() = 0;
+  /// Sent when a fixed frame or animated series has been presented.
+  virtual void framesShown(const QString& name,
+			   const plstim::FrameTimings& timings) = 0;
+  /**
+   * Sent when the memory used by the frames of a page changed, bytes
+   * being zero once deleted. Evicted frames are not resident.
+   */
+  virtual void frameMemoryChanged(const QString& name, qint64 bytes,
+				  bool resident) = 0;
 };
 
 } // namespace plstim
 
+Q_DECLARE_METATYPE(plstim::FrameTimings)
+
 // Local Variables:
 // mode: c++
 // End:
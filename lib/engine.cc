@@ -5,10 +5,12 @@
 
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 using namespace std;
 
 #include "engine.h"
+#include "offscreendisplayer.h"
 #include "../lib/experiment.h"
 using namespace plstim;
 
@@ -29,105 +31,913 @@ Engine::error(const QString& title, const QString& description)
   return err;
 }
 
+namespace {
+
+const QPainter::RenderHints FrameRenderHints = QPainter::Antialiasing|QPainter::SmoothPixmapTransform|QPainter::HighQualityAntialiasing;
+
+/// Appended to the frame names of per-trial pages in the second set
+const char* const FrameSetSuffix = "#1";
+
+/// Onset saved for pages whose frames were not presented
+const qint64 MissingOnset = std::numeric_limits<qint64>::min ();
+
+/// Drawing replaying a recorded frame
+FrameDrawing frameDrawing (const DisplayList& list, const QTransform& transform)
+{
+  return [list, transform] (QPainter& painter) {
+    // Reset QPainter states
+    painter.setPen (Qt::NoPen);
+    painter.setRenderHints (FrameRenderHints);
+    painter.setTransform (transform);
+    list.replay (painter);
+  };
+}
+
+/// Digest of the drawing of a frame in a kind of texture, the same
+/// for identical frames
+QByteArray frameHash (const QByteArray& kind, const QByteArray& listHash,
+		      const QTransform& transform)
+{
+  QByteArray key;
+  QDataStream stream (&key, QIODevice::WriteOnly);
+  stream << kind << listHash << transform;
+  return key;
+}
+
+/// Rasterise a frame drawing, possibly in a worker thread
+class FrameRasteriser : public QRunnable
+{
+public:
+  FrameRasteriser (QImage* image, const FrameDrawing& drawing)
+    : m_image (image), m_drawing (drawing)
+  {}
+
+  virtual void run () override
+  {
+    Displayer::rasterise (*m_image, m_drawing);
+  }
+
+private:
+  QImage* m_image;
+  FrameDrawing m_drawing;
+};
+
+/// Generate one or two noise frames, possibly in a worker thread
+class NoiseRasteriser : public QRunnable
+{
+public:
+  NoiseRasteriser (const NoiseSpectrum& spectrum, float contrast,
+		   QImage* first, quint32 firstSeed,
+		   QImage* second=nullptr, quint32 secondSeed=0)
+    : m_spectrum (spectrum), m_contrast (contrast),
+      m_first (first), m_second (second),
+      m_firstSeed (firstSeed), m_secondSeed (secondSeed)
+  {}
+
+  virtual void run () override
+  {
+    if (m_second != nullptr)
+      plstim::paintNoise (*m_first, *m_second, m_spectrum, m_contrast,
+			  m_firstSeed, m_secondSeed);
+    else
+      plstim::paintNoise (*m_first, m_spectrum, m_contrast, m_firstSeed);
+  }
+
+private:
+  NoiseSpectrum m_spectrum;
+  float m_contrast;
+  QImage* m_first;
+  QImage* m_second;
+  quint32 m_firstSeed;
+  quint32 m_secondSeed;
+};
+
+} // namespace
+
+const DisplayList*
+Engine::recordFrame (Page* page, int frame, DisplayList* list)
+{
+  // Drawing of replayed pages is recorded once
+  auto pageList = page->displayList ();
+  if (page->replay () && pageList->recorded ())
+    return pageList;
+  if (page->replay ())
+    list = pageList;
+
+  Painter recorder (list);
+  emit page->paint (&recorder, frame);
+  list->finish ();
+  return list;
+}
+
+int
+Engine::recordFrames (Page* page, const QString& name, bool gpu,
+		       QVector<DisplayList>& lists,
+		       QVector<const DisplayList*>& drawings,
+		       QVector<StoredFrame>& sources)
+{
+  int frames = page->frameCount ();
+  lists.resize (frames);
+  drawings.resize (frames);
+  sources.resize (frames);
+
+  // Frames are only shared by textures of the same size and format,
+  // rasterised the same way
+  QByteArray kind;
+  QDataStream stream (&kind, QIODevice::WriteOnly);
+  stream << m_experiment->textureWidth () << m_experiment->textureHeight ()
+	 << static_cast<qint32> (page->imageFormat ()) << gpu;
+
+  // First stored frame of each drawing
+  const DisplayList* previous = nullptr;
+  QByteArray listHash;
+  int unique = 0;
+  for (int i = 0; i < frames; i++) {
+    drawings[i] = recordFrame (page, i, &lists[i]);
+    // Replayed pages share a single list
+    if (drawings.at (i) != previous)
+      listHash = drawings.at (i)->hash ();
+    previous = drawings.at (i);
+    auto key = frameHash (kind, listHash, page->frameTransform (i));
+    auto it = m_storedFrames.constFind (key);
+    if (it != m_storedFrames.constEnd ()) {
+      sources[i] = it.value ();
+    }
+    else {
+      sources[i].name = name;
+      sources[i].frame = i;
+      m_storedFrames.insert (key, sources.at (i));
+      m_storedHashes[name].append (key);
+      unique++;
+    }
+  }
+
+  m_animatedFrameCount += frames;
+  m_sharedFrameCount += frames - unique;
+  if (unique < frames)
+    qDebug () << "page" << page->name () << ":" << frames - unique
+	      << "of" << frames << "frames identical to stored ones";
+  return unique;
+}
+
+ProceduralStimulus
+Engine::proceduralStimulus (ShaderPage* page)
+{
+  ProceduralStimulus stim;
+  switch (page->stimulus ()) {
+  case ShaderPage::GABOR:
+    stim.kind = ProceduralStimulus::Gabor;
+    break;
+  case ShaderPage::PLAID:
+    stim.kind = ProceduralStimulus::Plaid;
+    break;
+  default:
+    stim.kind = ProceduralStimulus::Grating;
+    break;
+  }
+  stim.width = m_experiment->textureWidth ();
+  stim.height = m_experiment->textureHeight ();
+  stim.frames = page->animated () ? page->frameCount () : 0;
+
+  // Convert visual angles to pixels, and drift to phase per frame
+  if (page->spatialFrequency () > 0) {
+    float period = m_experiment->degreesToPixels (1 / page->spatialFrequency ());
+    stim.frequency = period > 0 ? 1 / period : 0;
+  }
+  float frameRate = m_setup.refreshRate () / swap_interval;
+  if (frameRate > 0)
+    stim.phaseStep = 2 * M_PI * page->temporalFrequency () / frameRate;
+  stim.phase = radians (page->phase ());
+  stim.orientation = radians (page->orientation ());
+  stim.plaidAngle = radians (page->plaidAngle ());
+  stim.contrast = page->contrast ();
+  stim.sigma = m_experiment->degreesToPixels (page->sigma ());
+  return stim;
+}
+
+DotFrames
+Engine::dotFrames (KinematogramPage* page)
+{
+  auto dots = page->dots ();
+  DotFrames frames;
+  frames.width = m_experiment->textureWidth ();
+  frames.height = m_experiment->textureHeight ();
+  frames.frames = page->animated () ? page->frameCount () : 0;
+  frames.count = dots->count ();
+  frames.dotSize = dots->dotSize ();
+  frames.color = dots->color ();
+
+  // Hidden dots are kept, so that all frames have the same count
+  QPointF centre (0.5 * frames.width, 0.5 * frames.height);
+  int count = qMax (1, frames.frames);
+  frames.positions.reserve (2 * frames.count * count);
+  for (int i = 0; i < count; i++)
+    for (const auto& p : dots->points (i, centre, true))
+      frames.positions << p.x () << p.y ();
+  return frames;
+}
+
+ElementFrames
+Engine::elementFrames (ElementArrayPage* page)
+{
+  ElementFrames frames;
+  frames.shape = static_cast<ElementFrames::Shape> (page->shape ());
+  frames.width = m_experiment->textureWidth ();
+  frames.height = m_experiment->textureHeight ();
+  frames.frames = page->animated () ? page->frameCount () : 0;
+  frames.background = page->background ();
+  frames.frequency = page->frequency ();
+  frames.sigma = page->sigma ();
+
+  // Attributes are set by the page for each frame in turn
+  int count = qMax (1, frames.frames);
+  for (int i = 0; i < count; i++) {
+    emit page->updateElements (i);
+    if (i == 0)
+      frames.count = page->count ();
+    else if (page->count () != frames.count) {
+      qCritical () << "error: element count changed in" << page->name ();
+      page->setCount (frames.count);
+    }
+    frames.attributes << page->attributes ();
+  }
+
+  // Glyphs in square cells, white on transparent
+  auto glyphs = page->glyphs ();
+  if (frames.shape == ElementFrames::Glyph && ! glyphs.isEmpty ()) {
+    const int cell = 64;
+    frames.glyphCount = glyphs.size ();
+    frames.glyphs = QImage (cell * glyphs.size (), cell,
+			    QImage::Format_ARGB32_Premultiplied);
+    frames.glyphs.fill (Qt::transparent);
+    QPainter painter (&frames.glyphs);
+    QFont font;
+    font.setPixelSize (cell * 3 / 4);
+    painter.setFont (font);
+    painter.setPen (Qt::white);
+    for (int i = 0; i < glyphs.size (); i++)
+      painter.drawText (QRect (i * cell, 0, cell, cell), Qt::AlignCenter,
+			QString (glyphs.at (i)));
+  }
+  return frames;
+}
+
+void
+Engine::paintNoise (NoisePage* page, const QString& name)
+{
+  int tex_width = m_experiment->textureWidth ();
+  int tex_height = m_experiment->textureHeight ();
+  QImage::Format format = page->imageFormat ();
+
+  // Frequencies in cycles per pixel
+  NoiseSpectrum spectrum;
+  float pixels = m_experiment->degreesToPixels (1);
+  spectrum.exponent = page->exponent ();
+  if (pixels > 0) {
+    spectrum.lowFrequency = page->lowFrequency () / pixels;
+    spectrum.highFrequency = page->highFrequency () / pixels;
+  }
+  spectrum.orientation = radians (page->orientation ());
+  spectrum.orientationBandwidth = radians (page->orientationBandwidth ());
+
+  // Frame seeds derive from the trial seed, of the trial prepared
+  // when painted ahead
+  int trial = page->paintTime () == Page::TRIAL
+    ? m_preparedTrial : m_currentTrial;
+  quint32 trialSeed;
+  if (page->seed () != 0) {
+    std::seed_seq seq {static_cast<quint32> (page->seed ()),
+		       static_cast<quint32> (trial)};
+    seq.generate (&trialSeed, &trialSeed + 1);
+  }
+  else {
+    RandomDevSeedSequence rdss;
+    rdss.generate (&trialSeed, &trialSeed + 1);
+  }
+  page->setTrialSeed (trialSeed);
+  int frames = page->animated () ? page->frameCount () : 1;
+  QVector<quint32> seeds (frames);
+  std::seed_seq seq {trialSeed};
+  seq.generate (seeds.begin (), seeds.end ());
+
+  if (page->animated ())
+    deleteAnimatedFrames (name);
+
+  // Generated while presented
+  if (page->animated () && page->lookahead () > 0) {
+    float contrast = page->contrast ();
+    m_displayer->addStreamedFrames (name, frames, tex_width, tex_height,
+				    format, page->lookahead (),
+				    [spectrum, contrast, seeds] (int frame, QImage& img) {
+				      plstim::paintNoise (img, spectrum, contrast,
+							  seeds.at (frame));
+				    });
+    return;
+  }
+  if (page->animated ())
+    m_displayer->reserveAnimatedFrames (name, frames);
+
+  // Pairs of frames share a transform, written in the frame buffers
+  int batch = 2 * qMax (1, m_rasterPool.maxThreadCount ());
+  if (m_displayer->maxFrameBuffers () > 0)
+    batch = qMin (batch, m_displayer->maxFrameBuffers ());
+  for (int first = 0; first < frames; first += batch) {
+    int count = qMin (batch, frames - first);
+    QVector<QImage> images (count);
+    for (int k = 0; k < count; k++)
+      images[k] = m_displayer->frameBuffer (tex_width, tex_height, format);
+    for (int k = 0; k < count; k += 2) {
+      auto rasteriser = k + 1 < count
+	? new NoiseRasteriser (spectrum, page->contrast (),
+			       &images[k], seeds[first + k],
+			       &images[k + 1], seeds[first + k + 1])
+	: new NoiseRasteriser (spectrum, page->contrast (),
+			       &images[k], seeds[first + k]);
+      m_rasterPool.start (rasteriser);
+    }
+    m_rasterPool.waitForDone ();
+
+    for (const auto& img : images) {
+      if (page->animated ())
+	m_displayer->addAnimatedFrame (name, img);
+      else
+	m_displayer->addFixedFrame (name, img);
+    }
+  }
+}
+
+void
+Engine::saveDots (int trial)
+{
+  int index = 0;
+  for (auto dots : m_experiment->findChildren<Kinematogram*> ()) {
+    index++;
+    if (! dots->logged () || dots->loggedFrames () == 0)
+      continue;
+
+    // Dots of a session are grouped, one dataset per trial
+    auto group = QString ("session_%1_dots").arg (session_number).toUtf8 ();
+    if (H5Lexists (hf->getId (), group.data (), H5P_DEFAULT) <= 0)
+      hf->createGroup (group.data ());
+    auto name = dots->name ().isEmpty ()
+      ? QString ("dots%1").arg (index) : dots->name ();
+    auto path = QString ("%1/trial_%2_%3").arg (QString (group))
+      .arg (trial).arg (name).toUtf8 ();
+
+    // Frames of x, y, age and coherent flag arrays
+    hsize_t dims[3] = {static_cast<hsize_t> (dots->loggedFrames ()),
+		       Kinematogram::LogFields,
+		       static_cast<hsize_t> (dots->count ())};
+    DataSpace space (3, dims);
+    auto ds = hf->createDataSet (path.data (), PredType::IEEE_F32LE, space);
+    ds.write (dots->log ().constData (), PredType::NATIVE_FLOAT);
+
+    quint32 seed = dots->trialSeed ();
+    DataSpace scalar_space (H5S_SCALAR);
+    ds.createAttribute ("seed", PredType::STD_U32LE, scalar_space)
+      .write (PredType::NATIVE_UINT32, &seed);
+  }
+}
+
 void
-Engine::paintPage(Page* page, QImage& img, QPainter& painter)
+Engine::paintPage(Page* page, QPainter& painter, int set)
 {
-  QPainter::RenderHints render_hints = QPainter::Antialiasing|QPainter::SmoothPixmapTransform|QPainter::HighQualityAntialiasing;
+  QString name = frameName (page, set);
+  int tex_width = m_experiment->textureWidth ();
+  int tex_height = m_experiment->textureHeight ();
+  QImage::Format format = page->imageFormat ();
+  // Drawings replayed by the upload thread may render text, which
+  // otherwise falls back to raster painting in this thread
+  bool gpu = page->paintBackend () == Page::OPENGL
+    && QFontDatabase::supportsThreadedFontRendering ();
+
+  // Frames painted once per experiment may leave the graphics memory
+  m_displayer->setFramesEvictable (name,
+				   page->paintTime () == Page::EXPERIMENT);
+
+  // Stimuli computed by the displayer
+  auto shaderPage = qobject_cast<ShaderPage*> (page);
+  if (shaderPage != nullptr) {
+    if (page->animated ())
+      deleteAnimatedFrames (name);
+    m_displayer->addProceduralFrames (name,
+				      proceduralStimulus (shaderPage));
+    return;
+  }
+  auto dotsPage = qobject_cast<KinematogramPage*> (page);
+  if (dotsPage != nullptr && dotsPage->dots () != nullptr) {
+    if (page->animated ())
+      deleteAnimatedFrames (name);
+    m_displayer->addDotFrames (name, dotFrames (dotsPage));
+    return;
+  }
+  auto elementsPage = qobject_cast<ElementArrayPage*> (page);
+  if (elementsPage != nullptr) {
+    if (page->animated ())
+      deleteAnimatedFrames (name);
+    m_displayer->addElementFrames (name,
+				   elementFrames (elementsPage));
+    return;
+  }
 
-  // Wraps the QPainter for QML
-  Painter wrappedPainter (painter);
+  // Noise generated natively, straight in the frame buffers
+  auto noisePage = qobject_cast<NoisePage*> (page);
+  if (noisePage != nullptr) {
+    paintNoise (noisePage, name);
+    return;
+  }
+
+  // Nothing under the layers
+  if (! page->layerList ().isEmpty () && ! page->paintsFrames ())
+    return;
+
+  // Animation of a single frame, moved by the displayer
+  if (page->animated () && page->transformed ()) {
+    DisplayList own;
+    auto list = recordFrame (page, 0, &own);
+    QImage img = m_displayer->frameBuffer (tex_width, tex_height, format);
+    Displayer::rasterise (img, frameDrawing (*list, QTransform ()));
+    FrameSchedule schedule;
+    for (int i = 0; i < page->frameCount (); i++)
+      schedule.append (page->frameTransform (i), page->frameContrast (i));
+    deleteAnimatedFrames (name);
+    m_displayer->addScheduledFrames (name, img, schedule);
+    return;
+  }
+
+  // Single frames painted by the displayer
+  if (! page->animated () && gpu) {
+    DisplayList own;
+    auto list = recordFrame (page, 0, &own);
+    m_displayer->paintFixedFrame (name, tex_width, tex_height, format,
+				  frameDrawing (*list, page->frameTransform (0)));
+  }
 
   // Single frames
-  if (! page->animated ()) {
+  else if (! page->animated ()) {
+    // Wraps the QPainter for QML
+    Painter wrappedPainter (painter);
+    auto list = page->displayList ();
+
+    // Paint directly in the displayer upload memory
+    QImage img = m_displayer->frameBuffer (tex_width, tex_height, format);
     painter.begin (&img);
     // Reset QImage/QPainter states
     img.fill (0); painter.setPen (Qt::NoPen);
     
-    painter.setRenderHints (render_hints);
-    
-    emit page->paint (&wrappedPainter, 0);
+    painter.setRenderHints (FrameRenderHints);
+    painter.setTransform (page->frameTransform (0));
+
+    // Call the paint handler, or replay the drawing it recorded
+    if (page->replay () && list->recorded ()) {
+      list->replay (painter);
+    }
+    else {
+      wrappedPainter.setRecording (page->replay () ? list : nullptr);
+      emit page->paint (&wrappedPainter, 0);
+      if (page->replay ())
+	list->finish ();
+    }
     
     painter.end ();
     
-    //img.save (QString ("page-") + page->name () + ".png");
-    m_displayer->addFixedFrame(page->name(), img);
+    //img.save (QString ("page-") + name + ".png");
+    m_displayer->addFixedFrame(name, img);
   }
 
-  // Multiple frames
+  // Multiple frames painted by the displayer, identical ones once
+  else if (gpu) {
+    deleteAnimatedFrames(name);
+    QVector<DisplayList> lists;
+    QVector<const DisplayList*> drawings;
+    QVector<StoredFrame> sources;
+    int unique = recordFrames (page, name, gpu, lists, drawings, sources);
+    m_displayer->reserveAnimatedFrames(name, unique);
+    for (int i = 0; i < page->frameCount (); i++) {
+      const auto& source = sources.at (i);
+      if (source.name != name)
+	m_displayer->shareAnimatedFrame (name, source.name, source.frame);
+      else if (source.frame != i)
+	m_displayer->repeatAnimatedFrame (name, source.frame);
+      else
+	m_displayer->paintAnimatedFrame (name, tex_width, tex_height,
+					 format,
+					 frameDrawing (*drawings.at (i), page->frameTransform (i)));
+    }
+  }
+
+  // Multiple frames, recorded here then rasterised while presented
+  else if (page->lookahead () > 0
+	   && QFontDatabase::supportsThreadedFontRendering ()) {
+    deleteAnimatedFrames (name);
+    QVector<FrameDrawing> drawings;
+    for (int i = 0; i < page->frameCount (); i++) {
+      DisplayList own;
+      auto list = recordFrame (page, i, &own);
+      drawings << frameDrawing (*list, page->frameTransform (i));
+    }
+    m_displayer->addStreamedFrames (name, page->frameCount (),
+				    tex_width, tex_height, format,
+				    page->lookahead (),
+				    [drawings] (int frame, QImage& img) {
+				      Displayer::rasterise (img, drawings.at (frame));
+				    });
+  }
+
+  // Multiple frames, recorded here then rasterised in parallel
   else {
     //timer.start ();
-    m_displayer->deleteAnimatedFrames(page->name());
+    deleteAnimatedFrames(name);
     //qDebug () << "deleting unamed took: " << timer.elapsed () << " milliseconds" << endl;
     //timer.start ();
 
-    qDebug () << "number of frames to be painted:"
-	      << page->frameCount ();
-    for (int i = 0; i < page->frameCount (); i++) {
+    // The paint handler must be called from this thread
+    QVector<DisplayList> lists;
+    QVector<const DisplayList*> drawings;
+    QVector<StoredFrame> sources;
+    int unique = recordFrames (page, name, gpu, lists, drawings, sources);
+    m_displayer->reserveAnimatedFrames(name, unique);
 
-      painter.begin (&img);
-      // Reset QImage/QPainter states
-      img.fill (0); painter.setPen (Qt::NoPen);
+    // Frame buffers of a batch are all held until it is rasterised
+    int batch = qMax (1, m_rasterPool.maxThreadCount ());
+    if (m_displayer->maxFrameBuffers () > 0)
+      batch = qMin (batch, m_displayer->maxFrameBuffers ());
+    bool threaded = batch > 1
+      && QFontDatabase::supportsThreadedFontRendering ();
 
-      painter.setRenderHints (render_hints);
+    qDebug () << "number of frames to be painted:"
+	      << unique << "by batches of" << batch;
+    for (int first = 0; first < page->frameCount (); first += batch) {
+      int count = qMin (batch, page->frameCount () - first);
+      QVector<QImage> images (count);
+      for (int k = 0; k < count; k++) {
+	int frame = first + k;
+	if (sources.at (frame).name != name || sources.at (frame).frame != frame)
+	  continue;
+
+	// Images cannot be reused once given to the displayer
+	images[k] = m_displayer->frameBuffer (tex_width, tex_height, format);
+	auto rasteriser = new FrameRasteriser (&images[k],
+					       frameDrawing (*drawings.at (frame), page->frameTransform (frame)));
+	if (threaded) {
+	  m_rasterPool.start (rasteriser);
+	}
+	else {
+	  rasteriser->run ();
+	  delete rasteriser;
+	}
+      }
+      m_rasterPool.waitForDone ();
+
+      // Frames are added in order, identical ones sharing their storage
+      for (int k = 0; k < count; k++) {
+	int frame = first + k;
+	const auto& source = sources.at (frame);
+	if (source.name != name)
+	  m_displayer->shareAnimatedFrame (name, source.name, source.frame);
+	else if (source.frame != frame)
+	  m_displayer->repeatAnimatedFrame (name, source.frame);
+	else
+	  m_displayer->addAnimatedFrame(name, images.at (k));
+      }
+    }
+    //qDebug () << "generating frames took: " << timer.elapsed () << " milliseconds" << endl;
+  }
+}
 
-      emit page->paint (&wrappedPainter, i);
+void
+Engine::updateLayers (Page* page, Page::PaintTime occasion, int set,
+		      bool paintedAhead)
+{
+  const auto& layers = page->layerList ();
+  if (layers.isEmpty ())
+    return;
 
+  QVector<FrameLayer> shown;
+  for (int i = 0; i < layers.size (); i++) {
+    auto layer = layers.at (i);
+    QString name = QString ("%1/layer%2").arg (page->name ()).arg (i);
+    if (set != 0 && layer->paintTime () == Page::TRIAL)
+      name += FrameSetSuffix;
+    int width = layer->width () > 0
+      ? layer->width () : m_experiment->textureWidth ();
+    int height = layer->height () > 0
+      ? layer->height () : m_experiment->textureHeight ();
+    QRect rect (layer->x (), layer->y (), width, height);
+
+    // Transparent where not painted, and only as large as the layer
+    if (paintedAhead ? layer->stale () : layer->needsPaint (occasion)) {
+      QImage img = m_displayer->frameBuffer (width, height,
+					     QImage::Format_ARGB32);
+      img.fill (Qt::transparent);
+      QPainter painter (&img);
+      painter.setPen (Qt::NoPen);
+      painter.setRenderHints (FrameRenderHints);
+      Painter wrappedPainter (painter);
+      emit layer->paint (&wrappedPainter);
       painter.end ();
-
-      m_displayer->addAnimatedFrame(page->name(), img);
+      m_displayer->addFixedFrame (name, img);
+      layer->setPainted ();
     }
-    //qDebug () << "generating frames took: " << timer.elapsed () << " milliseconds" << endl;
+    if (layer->visible ())
+      shown << FrameLayer { name, rect };
   }
+
+  // Visibility and places may change until the page is shown
+  if (occasion == Page::ON_SHOW)
+    m_displayer->setFrameLayers (frameName (page, set), shown);
+}
+
+QString
+Engine::frameName (Page* page, int set) const
+{
+  // Cached frames are shared by the sets
+  auto key = m_cacheKeys.value (qMakePair (page, set));
+  if (! key.isEmpty ())
+    return QString ("%1@%2").arg (page->name ()).arg (key);
+  if (set == 0 || page->paintTime () != Page::TRIAL)
+    return page->name ();
+  return page->name () + FrameSetSuffix;
+}
+
+int
+Engine::frameSet (int trial) const
+{
+  return m_experiment->pipelined () ? trial % 2 : 0;
+}
+
+int
+Engine::lastPaintedPage () const
+{
+  int last = -1;
+  for (int i = 0; i < m_experiment->pageCount (); i++) {
+    auto page = m_experiment->page (i);
+    bool painted = page->paintTime () == Page::TRIAL
+      || page->paintTime () == Page::ON_SHOW;
+    for (auto layer : page->layerList ())
+      painted = painted || layer->paintTime () == Page::TRIAL
+	|| layer->paintTime () == Page::ON_SHOW;
+    if (painted)
+      last = i;
+  }
+  return last;
 }
 
 void
-Engine::run_trial ()
+Engine::prepareTrial (int trial)
 {
-  qint64 now = QDateTime::currentMSecsSinceEpoch ();
-  timer.start ();
+  // Logged dots of the current trial are about to be drawn anew
+  if (hf != nullptr && m_running && trial == m_currentTrial + 1)
+    saveDots (m_currentTrial);
+
+  m_preparedTrial = trial;
+  emit preparedTrialChanged (trial);
+  int set = frameSet (trial);
+
+  // Random dots are drawn anew for each trial
+  for (auto dots : m_experiment->findChildren<Kinematogram*> ())
+    dots->startTrial (trial);
 
   // Emit the newTrial () signal
   emit m_experiment->newTrial ();
 
   // Paint each per-trial frame
-  int tex_size = m_experiment->textureSize ();
-  QImage img (tex_size, tex_size, QImage::Format_RGB32);
   QPainter painter;
   for (int i = 0; i < m_experiment->pageCount (); i++) {
     auto page = m_experiment->page (i);
-    if (page->paintTime () == Page::TRIAL)
-      paintPage (page, img, painter);
+    if (page->paintTime () == Page::TRIAL && ! lookupFrameCache (page, set))
+      paintPage (page, painter, set);
+    updateLayers (page, Page::TRIAL, set);
   }
 
-  // Record trial parameters
-  memset (trial_record, 0, record_size);
+  // Parameters may change again before the trial is run
+  m_preparedRecord.fill (0, static_cast<int> (record_size));
+  recordTrialParameters (m_preparedRecord.data ());
+}
+
+void
+Engine::prepareNextTrial ()
+{
+  // Only once the stimuli of the current trial are shown
+  int next = m_currentTrial + 1;
+  if (! m_running || m_experiment == nullptr
+      || next >= m_experiment->trialCount () || m_preparedTrial == next
+      || current_page < lastPaintedPage ())
+    return;
+  qDebug () << "preparing trial" << next;
+  prepareTrial (next);
+}
+
+QString
+Engine::cacheKey (Page* page) const
+{
+  auto names = page->cacheParameters ();
+  if (names.isEmpty ())
+    names = m_experiment->trialParameters ().keys ();
+
+  // Values serialised with their names, in order
+  QByteArray values;
+  QDataStream stream (&values, QIODevice::WriteOnly);
+  for (const auto& name : names) {
+    QVariant value = m_experiment->property (name.toUtf8 ());
+    if (value.userType () == qMetaTypeId<QJSValue> ())
+      value = value.value<QJSValue> ().toVariant ();
+    stream << name;
+    if (value.canConvert<plstim::Vector*> ()) {
+      auto vec = value.value<plstim::Vector*> ();
+      for (int i = 0; vec != nullptr && i < vec->length (); i++)
+	stream << vec->at (i);
+    }
+    else {
+      stream << value;
+    }
+  }
+  auto hash = QCryptographicHash::hash (values, QCryptographicHash::Sha1);
+  return QString::fromLatin1 (hash.left (8).toHex ());
+}
+
+bool
+Engine::lookupFrameCache (Page* page, int set)
+{
+  auto slot = qMakePair (page, set);
+  if (! page->cached ()) {
+    m_cacheKeys.remove (slot);
+    return false;
+  }
+  m_cacheKeys.insert (slot, cacheKey (page));
+  auto name = frameName (page, set);
+  auto it = m_frameCache.find (name);
+  if (it != m_frameCache.end ()) {
+    it->lastUse = ++m_cacheUses;
+    m_cacheHits++;
+    return true;
+  }
+
+  // Frames about to be painted
+  m_cacheMisses++;
+  qint64 depth = 4;
+  if (page->frameFormat () == Page::LUMINANCE8)
+    depth = 1;
+  else if (page->frameFormat () == Page::LUMINANCE16)
+    depth = 2;
+  CachedFrames frames;
+  frames.bytes = depth * m_experiment->textureWidth ()
+    * m_experiment->textureHeight ()
+    * (page->animated () ? qMax (1, page->frameCount ()) : 1);
+  frames.lastUse = ++m_cacheUses;
+  m_frameCache.insert (name, frames);
+  trimFrameCache ();
+  return false;
+}
+
+void
+Engine::trimFrameCache ()
+{
+  // Frames of the current and prepared trials are kept
+  QSet<QString> used;
+  for (auto it = m_cacheKeys.constBegin (); it != m_cacheKeys.constEnd (); ++it)
+    used << frameName (it.key ().first, it.key ().second);
+
+  qint64 budget = static_cast<qint64> (m_experiment->cacheBudget ()) << 20;
+  for (;;) {
+    qint64 total = 0;
+    QString oldest;
+    quint64 oldestUse = 0;
+    for (auto it = m_frameCache.constBegin (); it != m_frameCache.constEnd (); ++it) {
+      // Sizes reported by the displayer are exact
+      auto usage = m_pageMemory.value (it.key ()).toMap ();
+      total += usage.contains ("bytes")
+	? usage["bytes"].toLongLong () : it->bytes;
+      if (! used.contains (it.key ())
+	  && (oldest.isEmpty () || it->lastUse < oldestUse)) {
+	oldest = it.key ();
+	oldestUse = it->lastUse;
+      }
+    }
+    if (total <= budget || oldest.isEmpty ())
+      break;
+    qDebug () << "evicting cached frames" << oldest;
+    deleteFrames (oldest);
+    m_frameCache.remove (oldest);
+  }
+}
+
+void
+Engine::clearFrameCache ()
+{
+  for (auto it = m_frameCache.constBegin (); it != m_frameCache.constEnd (); ++it)
+    deleteFrames (it.key ());
+  m_frameCache.clear ();
+  m_cacheKeys.clear ();
+}
+
+void
+Engine::deleteAnimatedFrames (const QString& name)
+{
+  for (const auto& key : m_storedHashes.take (name))
+    m_storedFrames.remove (key);
+  m_displayer->deleteAnimatedFrames (name);
+}
+
+void
+Engine::deleteFrames (const QString& name)
+{
+  for (const auto& key : m_storedHashes.take (name))
+    m_storedFrames.remove (key);
+  m_displayer->deleteFrames (name);
+}
+
+void
+Engine::recordTrialParameters (void* record)
+{
   for (auto it : trial_offsets) {
     const QString& param_name = it.first;
     auto name = it.first.toUtf8 ();
     size_t offset = it.second;
 
-    // Special case: trial start time
-    if (param_name == "trialStart") {
-      qint64* pos = reinterpret_cast<qint64*> (reinterpret_cast<char*> (trial_record)+offset);
-      *pos = now;
+    // Special case: trial start time, set when run
+    if (param_name == "trialStart")
       continue;
-    }
 
     QVariant prop = m_experiment->property (name);
     if (prop.canConvert<float> ()) {
-      float* pos = reinterpret_cast<float*> (reinterpret_cast<char*> (trial_record)+offset);
+      float* pos = reinterpret_cast<float*> (reinterpret_cast<char*> (record)+offset);
       *pos = prop.toFloat ();
       qDebug () << "storing" << *pos << "for" << param_name;
     }
     else if (prop.canConvert<plstim::Vector*> ()) {
       plstim::Vector* vec = prop.value<plstim::Vector*> ();
-      float* pos = reinterpret_cast<float*> (reinterpret_cast<char*> (trial_record)+offset);
+      float* pos = reinterpret_cast<float*> (reinterpret_cast<char*> (record)+offset);
       int len = vec->length ();
-      for (int i = 0; i <= len; i++)
+      for (int i = 0; i < len; i++)
 	pos[i] = vec->at (i);
       qDebug () << "storing" << "array" << "for" << param_name;
     }
   }
+}
+
+QVariantMap
+Engine::comparePaintBackends (const QString& pageName)
+{
+  QVariantMap result;
+  Page* page = nullptr;
+  for (int i = 0; m_experiment != nullptr && i < m_experiment->pageCount (); i++)
+    if (m_experiment->page (i)->name () == pageName)
+      page = m_experiment->page (i);
+  if (page == nullptr) {
+    error ("Unknown page", pageName);
+    return result;
+  }
+
+  OffscreenDisplayer offscreen (0);
+  if (offscreen.backend () != OffscreenDisplayer::OpenGL) {
+    error ("Cannot compare paint backends", "OpenGL is not available");
+    return result;
+  }
+
+  // First frame painted by both backends
+  int tex_width = m_experiment->textureWidth ();
+  int tex_height = m_experiment->textureHeight ();
+  DisplayList own;
+  auto drawing = frameDrawing (*recordFrame (page, 0, &own),
+			       page->frameTransform (0));
+  QImage raster (tex_width, tex_height, page->imageFormat ());
+  Displayer::rasterise (raster, drawing);
+  offscreen.setTextureSize (tex_width, tex_height);
+  offscreen.paintFixedFrame (pageName, tex_width, tex_height,
+			     page->imageFormat (), drawing);
+  offscreen.showFixedFrame (pageName);
+
+  auto diff = pixelDifference (raster, offscreen.lastFrame ());
+  qDebug () << "paint backends difference on" << pageName << ":"
+	    << diff.pixels << "pixels, max" << diff.maximum
+	    << "mean" << diff.mean;
+  result["pixels"] = diff.pixels;
+  result["maximum"] = diff.maximum;
+  result["mean"] = diff.mean;
+  return result;
+}
+
+void
+Engine::run_trial ()
+{
+  qint64 now = QDateTime::currentMSecsSinceEpoch ();
+  timer.start ();
+  m_trialStart = monotonicNsecs ();
+
+  // Parameters and frames of the trial, unless prepared ahead
+  if (m_preparedTrial != m_currentTrial)
+    prepareTrial (m_currentTrial);
+  m_frameSet = frameSet (m_currentTrial);
+  discardBranches ();
+
+  // Record trial parameters
+  memcpy (trial_record, m_preparedRecord.constData (), record_size);
+  auto it = trial_offsets.find ("trialStart");
+  if (it != trial_offsets.end ()) {
+    qint64* pos = reinterpret_cast<qint64*> (reinterpret_cast<char*> (trial_record)+it->second);
+    *pos = now;
+  }
 
 #ifdef HAVE_EYELINK
   // Save trial timestamp in EDF file
@@ -167,6 +977,10 @@ Engine::show_page (int index)
       else if (param_name == "key") {
 	// Key will be known at the end of the page
       }
+      else if (param_name == "onset" || param_name == "frames"
+	       || param_name == "dropped" || param_name == "maxInterval") {
+	// Timings will be known once the frames are presented
+      }
 #ifdef HAVE_POWERMATE
       else if (param_name == "rotation") {
       }
@@ -180,13 +994,16 @@ Engine::show_page (int index)
     }
   }
 
+  // Frames of branches painted ahead are ready
+  bool paintedAhead = m_paintedBranches.contains (page);
+  discardBranches (page);
+
   // TODO: ugly hack!
-  if (page->paintTime () == Page::ON_SHOW) {
-    int tex_size = m_experiment->textureSize ();
+  if (page->paintTime () == Page::ON_SHOW && ! paintedAhead) {
     QPainter painter;
-    QImage img (tex_size, tex_size, QImage::Format_RGB32);
-    paintPage (page, img, painter);
+    paintPage (page, painter, m_frameSet);
   }
+  updateLayers (page, Page::ON_SHOW, m_frameSet, paintedAhead);
 
   qDebug () << ">>> showing page" << page->name ();
 #ifdef HAVE_EYELINK
@@ -195,15 +1012,26 @@ Engine::show_page (int index)
     eyemsg_printf ("showing page %s", page->name ().toUtf8 ().data ());
 #endif // HAVE_EYELINK
 
+  m_pendingPresentations.enqueue (m_trialStart);
   if (page->animated ()) {
-    m_displayer->showAnimatedFrames(page->name());
+    m_displayer->showAnimatedFrames(frameName (page, m_frameSet));
   }
   else {
-    m_displayer->showFixedFrame(page->name());
+    m_displayer->showFixedFrame(frameName (page, m_frameSet));
   }
 
+  // Restore the next page frames while this one is shown
+  if (index + 1 < m_experiment->pageCount ())
+    m_displayer->prepareFrames (frameName (m_experiment->page (index + 1),
+					   m_frameSet));
+
   current_page = index;
 
+  // Paint the branches once the page frames are submitted
+  quint64 request = ++m_branchRequest;
+  if (! page->branchList ().isEmpty ())
+    QTimer::singleShot (0, this, [this, request] { paintBranches (request); });
+
   // Wait for showPage signals
   m_showPageCon = QObject::connect (page, &Page::showPage,
 				    [this] (Page* p) {
@@ -257,23 +1085,142 @@ Engine::show_page (int index)
   }
 #endif // HAVE_EYELINK
 
+  // If no keyboard event expected, go to the next page. Timed fixed
+  // frames and animated frames rather wait for their presentation,
+  // see onFramesShown ()
+  if (! page->duration () && ! page->animated ()
+      && ! page->waitKey ()
+#ifdef HAVE_POWERMATE
+      && ! page->waitRotation ()
+#endif // HAVE_POWERMATE
+      ) {
+    qDebug () << "nothing to wait, going to next page";
+    nextPage ();
+  }
+}
+
+void
+Engine::paintBranches (quint64 request, int next)
+{
+  // An accepted response or another page may have come first
+  if (! m_running || request != m_branchRequest)
+    return;
+
+  auto page = m_experiment->page (current_page);
+  const auto& branches = page->branchList ();
+  if (next >= branches.size ())
+    return;
+
+  auto branch = branches.at (next);
+  if (branch != page && ! m_paintedBranches.contains (branch)) {
+    bool onShow = branch->paintTime () == Page::ON_SHOW;
+    for (auto layer : branch->layerList ())
+      onShow = onShow || layer->paintTime () == Page::ON_SHOW;
+    if (! onShow)
+      m_displayer->prepareFrames (frameName (branch, m_frameSet));
+    else {
+      QElapsedTimer elapsed;
+      elapsed.start ();
+      if (branch->paintTime () == Page::ON_SHOW) {
+	QPainter painter;
+	paintPage (branch, painter, m_frameSet);
+      }
+      updateLayers (branch, Page::ON_SHOW, m_frameSet);
+      m_paintedBranches << branch;
+      qDebug () << "painted branch" << branch->name () << "of"
+		<< page->name () << "in" << elapsed.elapsed () << "ms";
+    }
+  }
+
+  // Let input be handled before the next branch
+  if (next + 1 < branches.size ())
+    QTimer::singleShot (0, this, [this, request, next] {
+	paintBranches (request, next + 1);
+      });
+}
+
+void
+Engine::discardBranches (Page* kept)
+{
+  for (auto branch : m_paintedBranches) {
+    // Other frames of the branch are kept with their paint time
+    if (branch != kept && branch->paintTime () == Page::ON_SHOW)
+      deleteFrames (frameName (branch, m_frameSet));
+  }
+  m_paintedBranches.clear ();
+}
+
+void
+Engine::onFramesShown (const QString& name, const FrameTimings& timings)
+{
+  // Each presentation is notified once, in order
+  if (m_pendingPresentations.isEmpty ())
+    return;
+  qint64 trialStart = m_pendingPresentations.dequeue ();
+  if (! m_running || current_page < 0 || trialStart != m_trialStart)
+    return;
+
+  // Frames of the trial are in its frame set
+  QString pageName = name;
+  for (int i = 0; i < m_experiment->pageCount (); i++)
+    if (frameName (m_experiment->page (i), m_frameSet) == name)
+      pageName = m_experiment->page (i)->name ();
+
+  // Save presentation timing
+  if (timings.frames > 0)
+    savePageParameter (pageName, "onset", timings.onset - m_trialStart);
+  else
+    savePageParameter (pageName, "onset", MissingOnset);
+  savePageParameter (pageName, "frames", timings.frames);
+  savePageParameter (pageName, "dropped", timings.dropped);
+  savePageParameter (pageName, "maxInterval", timings.maxInterval);
+  if (timings.dropped > 0)
+    qWarning () << "warning:" << timings.dropped << "dropped frames on page" << pageName;
+  if (timings.underruns > 0)
+    qWarning () << "warning:" << timings.underruns << "frames painted too late on page" << pageName;
+
+  // Ignore late notifications for pages we already left
+  auto page = m_experiment->page (current_page);
+  if (page->name () != pageName)
+    return;
+
+  // Paint the next trial while the rest of this one is shown
+  if (m_experiment->pipelined ())
+    QTimer::singleShot (0, this, SLOT (prepareNextTrial ()));
+
   // Fixed frame of defined duration
   if (page->duration () && ! page->animated ()) {
     qDebug () << "fixed frame for" << page->duration () << "ms";
     QTimer::singleShot (page->duration (), this, SLOT (nextPage ()));
   }
 
-  // If no keyboard event expected, go to the next page
-  else if (! page->waitKey ()
+  // Animated frames are over, go to the next page unless waiting
+  else if (page->animated ()
+	   && ! page->waitKey ()
 #ifdef HAVE_POWERMATE
 	   && ! page->waitRotation ()
 #endif // HAVE_POWERMATE
 	   ) {
-    qDebug () << "nothing to wait, going to next page";
+    qDebug () << "animated frames presented, going to next page";
     nextPage ();
   }
 }
 
+void
+Engine::onFrameMemoryChanged (const QString& name, qint64 bytes, bool resident)
+{
+  if (bytes == 0) {
+    m_pageMemory.remove (name);
+  }
+  else {
+    QVariantMap usage;
+    usage["bytes"] = bytes;
+    usage["resident"] = resident;
+    m_pageMemory[name] = usage;
+  }
+  emit pageMemoryChanged ();
+}
+
 void
 Engine::nextPage (Page* wantedPage)
 {
@@ -292,6 +1239,9 @@ Engine::nextPage (Page* wantedPage)
   if ((page && page->last ())
       || current_page + 1 == m_experiment->pageCount ()) {
     qDebug () << "End of trial " << m_currentTrial << "of" << m_experiment->trialCount ();
+    auto poolStats = m_displayer->texturePoolStats ();
+    qDebug () << "texture pool:" << poolStats.hits << "hits,"
+	      << poolStats.misses << "misses";
 
     // Save the page record on HDF5
     if (hf != nullptr && current_page >= 0) {
@@ -301,6 +1251,9 @@ Engine::nextPage (Page* wantedPage)
       fspace.selectHyperslab (H5S_SELECT_SET, &one, &hframe);
       DataSpace mspace (1, &one);
       dset.write (trial_record, *record_type, mspace, fspace);
+      // Already saved when the next trial was prepared
+      if (m_preparedTrial != m_currentTrial + 1)
+	saveDots (m_currentTrial);
 
       hf->flush (H5F_SCOPE_GLOBAL);	// Store everything on file
     }
@@ -350,6 +1303,23 @@ Engine::savePageParameter (const QString& pageTitle,
   }
 }
 
+void
+Engine::savePageParameter (const QString& pageTitle,
+			   const QString& paramName,
+			   qint64 paramValue)
+{
+  auto it = record_offsets.find (pageTitle);
+  if (it != record_offsets.end ()) {
+    const std::map<QString,size_t>& params = it->second;
+    auto jt = params.find (paramName);
+    if (jt != params.end ()) {
+      size_t offset = jt->second;
+      qint64* pos = reinterpret_cast<qint64*> (reinterpret_cast<char*> (trial_record)+offset);
+      *pos = paramValue;
+    }
+  }
+}
+
 #ifdef HAVE_POWERMATE
 void
 Engine::powerMateRotation (PowerMateEvent* evt)
@@ -359,6 +1329,7 @@ Engine::powerMateRotation (PowerMateEvent* evt)
 
   auto page = m_experiment->page (current_page);
   if (page->waitRotation ()) {
+    m_branchRequest++;
     //qDebug () << "RECORDING PowerMate event with step of" << evt->step;
     savePageParameter (page->name (), "rotation", evt->step);
 
@@ -380,6 +1351,7 @@ Engine::powerMateButtonPressed (PowerMateEvent* evt)
 
   auto page = m_experiment->page (current_page);
   if (page->waitKey () && page->acceptAnyKey ()) {
+    m_branchRequest++;
     qDebug () << "powermate button → next page";
     nextPage ();
   }
@@ -408,6 +1380,9 @@ Engine::stimKeyPressed (QKeyEvent* evt)
     // Check if the key is accepted
     if ((page->acceptAnyKey () && nextPageKeys.contains (evt->key ()))
 	|| page->acceptKey (evt->key ())) {
+      // Branches are no longer painted ahead once a key is accepted
+      m_branchRequest++;
+
       // Save pressed key
       if (! page->acceptAnyKey ())
 	savePageParameter (page->name (), "key", evt->key ());
@@ -456,7 +1431,15 @@ Engine::endSession ()
 #endif // HAVE_EYELINK
     hf->flush (H5F_SCOPE_GLOBAL);	// Store everything on file
   }
+  if (m_cacheHits + m_cacheMisses > 0)
+    qDebug () << "frame cache:" << m_cacheHits << "hits,"
+	      << m_cacheMisses << "misses,"
+	      << (100 * m_cacheHits / (m_cacheHits + m_cacheMisses)) << "% hit ratio";
+  if (m_sharedFrameCount > 0)
+    qDebug () << "frame de-duplication:" << m_sharedFrameCount << "of"
+	      << m_animatedFrameCount << "animated frames shared";
   current_page = -1;
+  m_paintedBranches.clear ();
   m_displayer->end();
   setRunning (false);
 }
@@ -503,6 +1486,13 @@ Engine::unloadExperiment ()
   m_experiment_loaded = false;
   emit experimentLoadedChanged(false);
   
+  m_frameCache.clear ();
+  m_cacheKeys.clear ();
+  m_paintedBranches.clear ();
+  m_animatedFrameCount = 0;
+  m_sharedFrameCount = 0;
+  m_storedFrames.clear ();
+  m_storedHashes.clear ();
   m_displayer->clear ();
 }
 
@@ -672,6 +1662,14 @@ void Engine::experimentReady()
     // Compute required memory for the page
     record_offsets[page_title]["begin"] = record_size;
     record_size += sizeof (qint64);	// Start page presentation
+    record_offsets[page_title]["onset"] = record_size;
+    record_size += sizeof (qint64);	// First frame on screen, or MissingOnset
+    record_offsets[page_title]["frames"] = record_size;
+    record_size += sizeof (int);	// Presented frames
+    record_offsets[page_title]["dropped"] = record_size;
+    record_size += sizeof (int);	// Missed vertical retraces
+    record_offsets[page_title]["maxInterval"] = record_size;
+    record_size += sizeof (qint64);	// Longest inter-frame interval
     if (! page->acceptAnyKey ()) {
       record_offsets[page_title]["key"] = record_size;
       record_size += sizeof (int);	// Pressed key
@@ -707,9 +1705,11 @@ void Engine::experimentReady()
 	auto param_name = param.first;
 	auto offset = param.second;
 	H5::DataType param_type;
-	if (param_name == "begin")
+	if (param_name == "begin" || param_name == "onset"
+	    || param_name == "maxInterval")
 	  param_type = PredType::NATIVE_INT64;
-	else if (param_name == "key")
+	else if (param_name == "key" || param_name == "frames"
+		 || param_name == "dropped")
 	  param_type = PredType::NATIVE_INT;
 #ifdef HAVE_POWERMATE
 	else if (param_name == "rotation")
@@ -766,7 +1766,10 @@ void
 Engine::init_session ()
 {
   setCurrentTrial (0);
-
+  m_cacheHits = 0;
+  m_cacheMisses = 0;
+  m_animatedFrameCount = 0;
+  m_sharedFrameCount = 0;
 
   // Disable screensaver
 #ifdef HAVE_WIN32
@@ -778,6 +1781,12 @@ Engine::init_session ()
   qint64 now = QDateTime::currentMSecsSinceEpoch ();
   m_sessionStart = now;
 
+  // Show the first stimulus as soon as the displayer is exposed
+  prepareTrial (0);
+
+  // Avoid residency stalls on first presentations
+  m_displayer->prewarm ();
+
   // Check if a subject datafile is opened
   if (hf != nullptr) {
     // Parse the HDF5 datasets to get a block number
@@ -931,6 +1940,14 @@ Engine::Engine (Displayer* displayer)
   , trial_record (nullptr)
   , record_size (0)
   , hf (nullptr)
+  , m_trialStart (0)
+  , m_preparedTrial (-1)
+  , m_frameSet (0)
+  , m_cacheUses (0)
+  , m_cacheHits (0)
+  , m_cacheMisses (0)
+  , m_animatedFrameCount (0)
+  , m_sharedFrameCount (0)
 {
   plstim::initialise ();
 
@@ -965,6 +1982,12 @@ Engine::Engine (Displayer* displayer)
   //this, &Engine::stimKeyPressed);
   connect(dynamic_cast<QObject*>(m_displayer), SIGNAL(keyPressed(QKeyEvent*)),
 	  this, SLOT(stimKeyPressed(QKeyEvent*)));
+  connect(dynamic_cast<QObject*>(m_displayer),
+	  SIGNAL(framesShown(QString,plstim::FrameTimings)),
+	  this, SLOT(onFramesShown(QString,plstim::FrameTimings)));
+  connect(dynamic_cast<QObject*>(m_displayer),
+	  SIGNAL(frameMemoryChanged(QString,qint64,bool)),
+	  this, SLOT(onFrameMemoryChanged(QString,qint64,bool)));
 #ifdef HAVE_POWERMATE
   connect (stim, &StimWindow::powerMateRotation,
 	   this, &Engine::powerMateRotation);
@@ -978,6 +2001,14 @@ Engine::Engine (Displayer* displayer)
   qDebug () << "Data location:" << QStandardPaths::writableLocation (QStandardPaths::DataLocation);
   qDebug () << "Generic data location:" << QStandardPaths::writableLocation (QStandardPaths::GenericDataLocation);
 
+  // Budget changes apply to the displayer, and are saved with the setup
+  connect (&m_setup, &Setup::memoryBudgetChanged, this, [this] (int budget) {
+      m_displayer->setMemoryBudget (static_cast<qint64> (budget) * 1024 * 1024);
+      if (save_setup && ! m_setup.name ().isEmpty ())
+	m_settings->setValue (QString ("setups/%1/vram_mb")
+			      .arg (m_setup.name ()), budget);
+    });
+
   // Try to fetch back setup
   m_settings = new QSettings;
   m_settings->beginGroup ("setups");
@@ -1001,6 +2032,7 @@ Engine::Engine (Displayer* displayer)
     m_settings->setValue ("phy_h", screen->physicalSize ().height ());
     m_settings->setValue ("dst", 400);
     m_settings->setValue ("rate", screen->refreshRate ());
+    m_settings->setValue ("vram_mb", 0);
     m_settings->endGroup ();
     m_settings->sync ();
     loadSetup (setupName);
@@ -1193,33 +2225,34 @@ Engine::setup_updated ()
   // Make sure converters are up to date
 
   if (m_experiment) {
-    // Compute the minimal texture size
-    float size_degs = m_experiment->size ();
-    double size_px = ceil (m_experiment->degreesToPixels (size_degs));
+    // Compute the exact texture size, square unless a height is given
+    float width_degs = m_experiment->size ();
+    float height_degs = m_experiment->height () > 0
+      ? m_experiment->height () : width_degs;
+    int tex_width = qMax (1, static_cast<int> (ceil (m_experiment->degreesToPixels (width_degs))));
+    int tex_height = qMax (1, static_cast<int> (ceil (m_experiment->degreesToPixels (height_degs))));
 
-    // Minimal base-2 texture size
-    int tex_size = 1 << static_cast<int> (floor (log2 (size_px)));
-    if (tex_size < size_px)
-      tex_size <<= 1;
+    qDebug () << "Texture size:" << tex_width << "x" << tex_height;
 
-    qDebug () << "Texture size:" << tex_size << "x" << tex_size;
+    // Update experiment properties
+    m_experiment->setTextureDimensions (tex_width, tex_height);
 
-    // Update experiment property
-    m_experiment->setTextureSize (tex_size);
-
-    // Notify the GLWidget of a new texture size
-    m_displayer->setTextureSize (tex_size, tex_size);
+    // Notify the displayer of a new texture size
+    m_displayer->setTextureSize (tex_width, tex_height);
 
     // Notify of setup changes
     emit m_experiment->setupUpdated ();
 
-    // QImage and associated QPainter for frames painting
-    QImage img (tex_size, tex_size, QImage::Format_RGB32);
+    // QPainter for frames painting
     QPainter painter;
 
     swap_interval = 1;
     for (int i = 0; i < m_experiment->pageCount (); i++) {
       auto page = m_experiment->page (i);
+      // Recorded drawings depend on the texture size
+      page->invalidate ();
+      for (auto layer : page->layerList ())
+	layer->invalidate ();
       if (page->animated ()) {
 	// Make sure animated frames have updated number of frames
 	int nframes = static_cast<int> (round ((m_setup.refreshRate () / swap_interval)*page->duration ()/1000.0));
@@ -1229,8 +2262,14 @@ Engine::setup_updated ()
       }
 
       if (page->paintTime () == Page::EXPERIMENT)
-	paintPage (page, img, painter);
+	paintPage (page, painter);
+      updateLayers (page, Page::EXPERIMENT);
     }
+
+    // Frames of a prepared trial depend on the setup
+    m_preparedTrial = -1;
+    emit preparedTrialChanged (-1);
+    clearFrameCache ();
   }
 
   //emit setupUpdated (&setup);
@@ -1254,6 +2293,7 @@ Engine::loadSetup (const QString& setupName)
 
   m_setup.setDistance (m_settings->value ("dst").toInt ());
   m_setup.setRefreshRate (m_settings->value ("rate").toFloat ());
+  m_setup.setMemoryBudget (m_settings->value ("vram_mb").toInt ());
 
   // Make sure the data directory exists
   auto dataDir = m_settings->value ("dataDir").toString ();
@@ -37,8 +37,10 @@ class Engine : public QObject
   Q_PROPERTY(bool sessionRunning READ isRunning WRITE setRunning NOTIFY runningChanged)
   Q_PROPERTY(bool experimentLoaded READ isExperimentLoaded NOTIFY experimentLoadedChanged)
   Q_PROPERTY(int currentTrial READ currentTrial WRITE setCurrentTrial NOTIFY currentTrialChanged)
+  Q_PROPERTY(int preparedTrial READ preparedTrial NOTIFY preparedTrialChanged)
   Q_PROPERTY(int eta READ eta WRITE setEta NOTIFY etaChanged)
   Q_PROPERTY(QString subjectName READ subjectName WRITE setSubjectName NOTIFY subjectChanged)
+  Q_PROPERTY(QVariantMap pageMemory READ pageMemory NOTIFY pageMemoryChanged)
 
 public:
   plstim::Setup* setup ()
@@ -50,6 +52,9 @@ public:
 protected:
   /// Stimulus displayer
   Displayer* m_displayer;
+
+  /// Workers rasterising animated frames
+  QThreadPool m_rasterPool;
   
   QMetaObject::Connection m_exposed_conn;
   
@@ -119,6 +124,14 @@ public slots:
   Error* error(const QString& msg, const QString& description="");
 
   void onDisplayerExposed();
+
+  /// Called when the displayer has presented the frames of a page.
+  void onFramesShown(const QString& name, const plstim::FrameTimings& timings);
+  /// Called when the memory used by the frames of a page changed.
+  void onFrameMemoryChanged(const QString& name, qint64 bytes, bool resident);
+
+  /// Prepare the next trial of a pipelined session, if due.
+  void prepareNextTrial();
   
 public:
   void run_trial();
@@ -139,6 +152,10 @@ public:
   
   int currentTrial() const
   { return m_currentTrial; }
+
+  /// Trial of the last newTrial() signal, or -1.
+  int preparedTrial() const
+  { return m_preparedTrial; }
   
   void setCurrentTrial(int trial)
   {
@@ -156,6 +173,9 @@ public:
     m_subjectName = name;
     emit subjectChanged (name);
   }
+
+  /// Memory used by the frames of each page, with its residency.
+  const QVariantMap& pageMemory() const { return m_pageMemory; }
   
 public slots:
   
@@ -168,24 +188,132 @@ public slots:
   void runSessionInline();
   
   void set_trial_count(int ntrials);
+
+  /**
+   * Paint the first frame of a page on the CPU and on the GPU, and
+   * compare the results: number of differing pixels, maximal and mean
+   * channel difference.
+   */
+  QVariantMap comparePaintBackends(const QString& pageName);
   
 protected:
   void init_session();
   
   void setup_updated();
   
-  void paintPage(Page* page, QImage& img, QPainter& painter);
+  /// Paint the frames of a page, in a frame set for per-trial pages.
+  void paintPage(Page* page, QPainter& painter, int set=0);
+
+  /**
+   * Name of the frames of a page in a frame set. Pipelined sessions
+   * paint the per-trial frames of a trial while the previous trial
+   * shows those of the other set.
+   */
+  QString frameName(Page* page, int set) const;
+  /// Frame set of the frames of a trial.
+  int frameSet(int trial) const;
+  /// Index of the last page painted during trials, or -1.
+  int lastPaintedPage() const;
+
+  /**
+   * Emit newTrial() for a trial, paint its per-trial frames and
+   * record its parameters, ahead of running it.
+   */
+  void prepareTrial(int trial);
+  /// Store the trial parameters of the experiment in a record.
+  void recordTrialParameters(void* record);
+
+  /// Hash of the values of the cache parameters of a page.
+  QString cacheKey(Page* page) const;
+  /**
+   * Name the frames of a cached page in a frame set after the current
+   * values of its cache parameters. Returns whether these frames are
+   * already in the displayer, else they are to be painted.
+   */
+  bool lookupFrameCache(Page* page, int set);
+  /// Delete least recently used frames until within the cache budget.
+  void trimFrameCache();
+  void clearFrameCache();
+  /// Delete animated frames, which later pages cannot share anymore.
+  void deleteAnimatedFrames(const QString& name);
+  /// Delete all the frames of a page, as deleteAnimatedFrames().
+  void deleteFrames(const QString& name);
+
+  /**
+   * Record the drawing of a page frame in list, or get the recorded
+   * drawing of a replayed page.
+   */
+  const DisplayList* recordFrame(Page* page, int frame, DisplayList* list);
+  /// Animated frame stored in the displayer
+  struct StoredFrame
+  {
+    QString name;
+    int frame = 0;
+  };
+  /**
+   * Record the drawing of all the frames of an animated page named
+   * name, and find identical frames by the hash of their drawing and
+   * texture: sources holds the first stored frame identical to each
+   * frame, of this page or of another one still in the displayer.
+   * Returns the number of frames to be painted.
+   */
+  int recordFrames(Page* page, const QString& name, bool gpu,
+		   QVector<DisplayList>& lists,
+		   QVector<const DisplayList*>& drawings,
+		   QVector<StoredFrame>& sources);
+
+  /// Parameters of a shader page, in pixels and frames.
+  ProceduralStimulus proceduralStimulus(ShaderPage* page);
+
+  /// Dot positions of a kinematogram page, for all its frames.
+  DotFrames dotFrames(KinematogramPage* page);
+
+  /// Element attributes of an element array page, for all its frames.
+  ElementFrames elementFrames(ElementArrayPage* page);
+
+  /// Generate the noise frames of a page in parallel.
+  void paintNoise(NoisePage* page, const QString& name);
+
+  /**
+   * Paint the layers of a page due on an occasion (see
+   * Layer::needsPaint()) as fixed frames of their own. When the page
+   * is shown, also hand its visible layers to the displayer.
+   */
+  void updateLayers(Page* page, Page::PaintTime occasion, int set=0,
+		    bool paintedAhead=false);
+
+  /**
+   * Paint the branches of the shown page due on show, and restore the
+   * frames of the others, one per event loop turn starting with the
+   * next one, until a response is accepted.
+   */
+  void paintBranches(quint64 request, int next=0);
+  /// Delete the frames painted ahead for the branches but the kept one.
+  void discardBranches(Page* kept=nullptr);
+
+  /// Save the dots of a trial for the logged kinematograms.
+  void saveDots(int trial);
   
   void connectStimWindowExposed();
   
   void savePageParameter(const QString& pageTitle,
 			 const QString& paramName,
 			 int paramValue);
+  void savePageParameter(const QString& pageTitle,
+			 const QString& paramName,
+			 qint64 paramValue);
   
   /// Called when the QML experiment is ready to be created.
   void experimentReady();
 					 
 protected slots:
+  /**
+   * Load a setup from its "setups/<name>" settings group: screen
+   * resolution (res_x, res_y) in pixels, physical size (phy_w,
+   * phy_h) and viewing distance (dst) in millimetres, refresh rate
+   * (rate) in Hz, graphics memory for frames (vram_mb) in MiB or
+   * zero for no limit, and data directory (dataDir).
+   */
   void loadSetup(const QString& setupName);
   void about_to_quit();
   void quit();
@@ -212,6 +340,9 @@ protected:
   /// Estimated remaining time for the session (in seconds)
   int m_eta;
 
+  /// Page name to a map of frame bytes and residency
+  QVariantMap m_pageMemory;
+
   QMetaObject::Connection m_showPageCon;
 
 public:
@@ -265,6 +396,49 @@ public:
 
   QElapsedTimer timer;
 
+  /// Start of the current trial on the monotonicNsecs() clock
+  qint64 m_trialStart;
+
+  /// Trials of the presentations not yet notified by the displayer
+  QQueue<qint64> m_pendingPresentations;
+
+  /// Trial whose parameters and frames are prepared, or -1
+  int m_preparedTrial;
+  /// Parameters of m_preparedTrial, copied to the trial record
+  QByteArray m_preparedRecord;
+  /// Frame set of the current trial
+  int m_frameSet;
+
+  /// Frames of a cached page for some parameter values
+  struct CachedFrames
+  {
+    /// Estimated size, until reported by the displayer
+    qint64 bytes = 0;
+    quint64 lastUse = 0;
+  };
+  /// Cached frames by frame name
+  QHash<QString,CachedFrames> m_frameCache;
+  /// Parameter hashes of the cached pages in each frame set
+  QHash<QPair<Page*,int>,QString> m_cacheKeys;
+  quint64 m_cacheUses;
+  int m_cacheHits;
+  int m_cacheMisses;
+
+  /// Branches painted ahead of being shown
+  QSet<Page*> m_paintedBranches;
+  /// Painting of the branches, outdated by accepted responses and
+  /// shown pages
+  quint64 m_branchRequest = 0;
+
+  /// Animated frames recorded in the session, and those identical to
+  /// a stored frame of their page or of another one
+  qint64 m_animatedFrameCount;
+  qint64 m_sharedFrameCount;
+  /// Animated frames in the displayer by hash, and the hashes of
+  /// the frames of each name
+  QHash<QByteArray,StoredFrame> m_storedFrames;
+  QHash<QString,QVector<QByteArray>> m_storedHashes;
+
 #ifdef HAVE_EYELINK
 protected:
   bool eyelink_connected;
@@ -284,9 +458,11 @@ signals:
   void runningChanged(bool running);
   void experimentLoadedChanged(bool loaded);
   void currentTrialChanged(int trial);
+  void preparedTrialChanged(int trial);
   void etaChanged(int eta);
   void subjectChanged(const QString& subject);
   void experimentChanged(Experiment* experiment);
+  void pageMemoryChanged();
 };
 
 } // namespace plstim
@@ -0,0 +1,169 @@
+// lib/framestream.cc – Animated frames produced while presented
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include "framestream.h"
+
+namespace plstim
+{
+
+class FrameStream::Producer : public QThread
+{
+public:
+  explicit Producer (FrameStream* stream)
+    : m_stream (stream)
+  {}
+
+protected:
+  virtual void run () override
+  { m_stream->produce (); }
+
+private:
+  FrameStream* m_stream;
+};
+
+FrameStream::FrameStream (int frames, int width, int height,
+			  QImage::Format format, int lookahead,
+			  const FrameProducer& producer)
+  : m_frames (qMax (0, frames)), m_producer (producer),
+    m_produced (0), m_consumed (0), m_underruns (0), m_stopping (false),
+    m_thread (new Producer (this))
+{
+  int slots = qBound (1, lookahead, qMax (1, m_frames));
+  for (int i = 0; i < slots; i++)
+    m_ring << QImage (width, height, format);
+  m_thread->start ();
+}
+
+FrameStream::~FrameStream ()
+{
+  stop ();
+  delete m_thread;
+}
+
+QSize
+FrameStream::size () const
+{
+  return m_ring.first ().size ();
+}
+
+QImage::Format
+FrameStream::format () const
+{
+  return m_ring.first ().format ();
+}
+
+qint64
+FrameStream::bytes () const
+{
+  qint64 bytes = 0;
+  for (const auto& img : m_ring)
+    bytes += static_cast<qint64> (img.bytesPerLine ()) * img.height ();
+  return bytes;
+}
+
+void
+FrameStream::produce ()
+{
+  QMutexLocker lock (&m_mutex);
+  for (;;) {
+    // Back-pressure from the consumer
+    while (! m_stopping && m_produced < m_frames
+	   && m_produced - m_consumed >= m_ring.size ())
+      m_changed.wait (&m_mutex);
+    if (m_stopping || m_produced == m_frames)
+      return;
+
+    // The slot is not read until the frame is counted as produced
+    int frame = m_produced;
+    QImage& img = m_ring[frame % m_ring.size ()];
+    lock.unlock ();
+    m_producer (frame, img);
+    lock.relock ();
+    m_produced++;
+    m_changed.wakeAll ();
+    if (m_notify) {
+      auto notify = m_notify;
+      lock.unlock ();
+      notify ();
+      lock.relock ();
+    }
+  }
+}
+
+void
+FrameStream::stop ()
+{
+  {
+    QMutexLocker lock (&m_mutex);
+    m_stopping = true;
+    m_changed.wakeAll ();
+  }
+  m_thread->wait ();
+}
+
+void
+FrameStream::rewind ()
+{
+  stop ();
+  m_produced = 0;
+  m_consumed = 0;
+  m_underruns = 0;
+  m_stopping = false;
+  m_thread->start ();
+}
+
+const QImage&
+FrameStream::acquire ()
+{
+  QMutexLocker lock (&m_mutex);
+  if (m_consumed >= m_frames)
+    return m_end;
+  if (m_produced <= m_consumed) {
+    m_underruns++;
+    while (m_produced <= m_consumed)
+      m_changed.wait (&m_mutex);
+  }
+  return m_ring.at (m_consumed % m_ring.size ());
+}
+
+void
+FrameStream::release ()
+{
+  QMutexLocker lock (&m_mutex);
+  if (m_consumed < m_produced) {
+    m_consumed++;
+    m_changed.wakeAll ();
+  }
+}
+
+bool
+FrameStream::ready () const
+{
+  QMutexLocker lock (&m_mutex);
+  return m_consumed < m_frames && m_produced > m_consumed;
+}
+
+void
+FrameStream::setNotifier (const std::function<void ()>& notify)
+{
+  QMutexLocker lock (&m_mutex);
+  m_notify = notify;
+}
+
+int
+FrameStream::position () const
+{
+  QMutexLocker lock (&m_mutex);
+  return m_consumed;
+}
+
+int
+FrameStream::underruns () const
+{
+  QMutexLocker lock (&m_mutex);
+  return m_underruns;
+}
+
+} // namespace plstim
@@ -0,0 +1,101 @@
+// lib/framestream.h – Animated frames produced while presented
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#pragma once
+
+#include <functional>
+
+#include <QtGui>
+
+namespace plstim
+{
+
+/**
+ * Painting of a frame of a stream in an image of the stream size
+ * and format, called from the producer thread.
+ */
+typedef std::function<void (int frame, QImage& image)> FrameProducer;
+
+/**
+ * Frames of an animated series painted by a producer thread while
+ * they are presented, at most a given number of frames ahead.
+ *
+ * Frames are painted in a ring of lookahead images, reused once
+ * consumed: memory does not depend on the number of frames. The
+ * producer waits while the ring is full, and the consumer while the
+ * frame it needs is not painted yet, which counts as an underrun.
+ * Frames are consumed in order by a single thread.
+ */
+class FrameStream
+{
+public:
+  /// Start painting the first frames at once.
+  FrameStream (int frames, int width, int height, QImage::Format format,
+	       int lookahead, const FrameProducer& producer);
+  ~FrameStream ();
+
+  int frameCount () const
+  { return m_frames; }
+
+  int lookahead () const
+  { return m_ring.size (); }
+
+  QSize size () const;
+  QImage::Format format () const;
+  /// Memory held by the ring of images.
+  qint64 bytes () const;
+
+  /// Paint again from the first frame, e.g. before a new presentation.
+  void rewind ();
+
+  /**
+   * Wait for the next frame and get its image, or a null image past
+   * the last frame. The image must not be used after release().
+   */
+  const QImage& acquire ();
+  /// Give the acquired image back to the producer.
+  void release ();
+  /// Whether the next frame is painted, so that acquire() does not wait.
+  bool ready () const;
+  /**
+   * Function called from the producer thread after each painted
+   * frame, e.g. to wake a consumer waiting for other events too.
+   */
+  void setNotifier (const std::function<void ()>& notify);
+
+  /// Index of the next frame to be acquired.
+  int position () const;
+  /// Number of frames which were not painted yet when acquired,
+  /// since the last rewind.
+  int underruns () const;
+
+private:
+  class Producer;
+
+  void produce ();
+  void stop ();
+
+  int m_frames;
+  FrameProducer m_producer;
+  std::function<void ()> m_notify;
+  QVector<QImage> m_ring;
+  QImage m_end;
+
+  mutable QMutex m_mutex;
+  /// Signalled when a frame is painted or released
+  QWaitCondition m_changed;
+  /// Number of frames painted and acquired
+  int m_produced;
+  int m_consumed;
+  int m_underruns;
+  bool m_stopping;
+  Producer* m_thread;
+};
+
+} // namespace plstim
+
+// Local Variables:
+// mode: c++
+// End:
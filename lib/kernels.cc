@@ -0,0 +1,464 @@
+// lib/kernels.cc – Native stimulus kernels
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include <atomic>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PLSTIM_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "kernels.h"
+
+namespace plstim
+{
+
+namespace
+{
+
+const float Pi = 3.14159265358979f;
+const float TwoPi = 2 * Pi;
+
+/// Evaluate a function in place on an array of floats
+typedef void (*ArrayFunction) (float* values, int count);
+
+void sinScalar (float* v, int n)
+{
+  for (int i = 0; i < n; i++)
+    v[i] = std::sin (v[i]);
+}
+
+void expScalar (float* v, int n)
+{
+  for (int i = 0; i < n; i++)
+    v[i] = std::exp (v[i]);
+}
+
+void sqrtScalar (float* v, int n)
+{
+  for (int i = 0; i < n; i++)
+    v[i] = std::sqrt (v[i]);
+}
+
+#ifdef PLSTIM_X86_KERNELS
+
+/*
+ * Vector sines reduce their arguments to [-π/2,π/2] and evaluate a
+ * Taylor polynomial of degree 11, exponentials split the exponent in
+ * an integer power of two and a polynomial of the remainder. Both
+ * are far more accurate than 8 or 16 bits frames need.
+ */
+
+const float SinCoeffs[] = {
+  -1.f / 39916800, 1.f / 362880, -1.f / 5040, 1.f / 120, -1.f / 6, 1
+};
+const float ExpCoeffs[] = {
+  1.f / 5040, 1.f / 720, 1.f / 120, 1.f / 24, 1.f / 6, 1.f / 2, 1, 1
+};
+const float Log2e = 1.44269504089f;
+const float Ln2 = 0.69314718056f;
+/// Smallest argument for which the power of two stays normal
+const float ExpMin = -87;
+
+__attribute__((target("sse2")))
+void sinSSE2 (float* v, int n)
+{
+  const __m128 signMask = _mm_set1_ps (-0.f);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps (v + i);
+    // Reduce to [-π,π], rounding to the nearest turn
+    __m128 k = _mm_cvtepi32_ps (_mm_cvtps_epi32 (
+                  _mm_mul_ps (x, _mm_set1_ps (1 / TwoPi))));
+    x = _mm_sub_ps (x, _mm_mul_ps (k, _mm_set1_ps (TwoPi)));
+    // Fold to [-π/2,π/2] as sin(x) = sin(π-x)
+    __m128 sign = _mm_and_ps (x, signMask);
+    __m128 ax = _mm_andnot_ps (signMask, x);
+    ax = _mm_min_ps (ax, _mm_sub_ps (_mm_set1_ps (Pi), ax));
+    x = _mm_or_ps (ax, sign);
+
+    __m128 x2 = _mm_mul_ps (x, x);
+    __m128 p = _mm_set1_ps (SinCoeffs[0]);
+    for (int c = 1; c < 6; c++)
+      p = _mm_add_ps (_mm_mul_ps (p, x2), _mm_set1_ps (SinCoeffs[c]));
+    _mm_storeu_ps (v + i, _mm_mul_ps (p, x));
+  }
+  sinScalar (v + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void expSSE2 (float* v, int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_max_ps (_mm_loadu_ps (v + i), _mm_set1_ps (ExpMin));
+    __m128 t = _mm_mul_ps (x, _mm_set1_ps (Log2e));
+    // Floor of the power of two, from a truncation
+    __m128 k = _mm_cvtepi32_ps (_mm_cvttps_epi32 (t));
+    k = _mm_sub_ps (k, _mm_and_ps (_mm_cmpgt_ps (k, t), _mm_set1_ps (1)));
+    __m128 y = _mm_mul_ps (_mm_sub_ps (t, k), _mm_set1_ps (Ln2));
+
+    __m128 p = _mm_set1_ps (ExpCoeffs[0]);
+    for (int c = 1; c < 8; c++)
+      p = _mm_add_ps (_mm_mul_ps (p, y), _mm_set1_ps (ExpCoeffs[c]));
+    __m128i e = _mm_slli_epi32 (_mm_add_epi32 (_mm_cvtps_epi32 (k),
+                                               _mm_set1_epi32 (127)), 23);
+    _mm_storeu_ps (v + i, _mm_mul_ps (p, _mm_castsi128_ps (e)));
+  }
+  expScalar (v + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void sqrtSSE2 (float* v, int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps (v + i, _mm_sqrt_ps (_mm_loadu_ps (v + i)));
+  sqrtScalar (v + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+void sinAVX2 (float* v, int n)
+{
+  const __m256 signMask = _mm256_set1_ps (-0.f);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps (v + i);
+    __m256 k = _mm256_cvtepi32_ps (_mm256_cvtps_epi32 (
+                  _mm256_mul_ps (x, _mm256_set1_ps (1 / TwoPi))));
+    x = _mm256_fnmadd_ps (k, _mm256_set1_ps (TwoPi), x);
+    __m256 sign = _mm256_and_ps (x, signMask);
+    __m256 ax = _mm256_andnot_ps (signMask, x);
+    ax = _mm256_min_ps (ax, _mm256_sub_ps (_mm256_set1_ps (Pi), ax));
+    x = _mm256_or_ps (ax, sign);
+
+    __m256 x2 = _mm256_mul_ps (x, x);
+    __m256 p = _mm256_set1_ps (SinCoeffs[0]);
+    for (int c = 1; c < 6; c++)
+      p = _mm256_fmadd_ps (p, x2, _mm256_set1_ps (SinCoeffs[c]));
+    _mm256_storeu_ps (v + i, _mm256_mul_ps (p, x));
+  }
+  sinSSE2 (v + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+void expAVX2 (float* v, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_max_ps (_mm256_loadu_ps (v + i),
+                              _mm256_set1_ps (ExpMin));
+    __m256 t = _mm256_mul_ps (x, _mm256_set1_ps (Log2e));
+    __m256 k = _mm256_cvtepi32_ps (_mm256_cvttps_epi32 (t));
+    k = _mm256_sub_ps (k, _mm256_and_ps (_mm256_cmp_ps (k, t, _CMP_GT_OQ),
+                                         _mm256_set1_ps (1)));
+    __m256 y = _mm256_mul_ps (_mm256_sub_ps (t, k), _mm256_set1_ps (Ln2));
+
+    __m256 p = _mm256_set1_ps (ExpCoeffs[0]);
+    for (int c = 1; c < 8; c++)
+      p = _mm256_fmadd_ps (p, y, _mm256_set1_ps (ExpCoeffs[c]));
+    __m256i e = _mm256_slli_epi32 (_mm256_add_epi32 (_mm256_cvtps_epi32 (k),
+                                                     _mm256_set1_epi32 (127)),
+                                   23);
+    _mm256_storeu_ps (v + i, _mm256_mul_ps (p, _mm256_castsi256_ps (e)));
+  }
+  expSSE2 (v + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+void sqrtAVX2 (float* v, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps (v + i, _mm256_sqrt_ps (_mm256_loadu_ps (v + i)));
+  sqrtSSE2 (v + i, n - i);
+}
+
+#endif // PLSTIM_X86_KERNELS
+
+/// Array functions of an instruction set
+struct Kernels
+{
+  InstructionSet set;
+  ArrayFunction sin;
+  ArrayFunction exp;
+  ArrayFunction sqrt;
+};
+
+Kernels kernelsFor (InstructionSet set)
+{
+  switch (set) {
+#ifdef PLSTIM_X86_KERNELS
+  case InstructionSet::AVX2:
+    return {set, sinAVX2, expAVX2, sqrtAVX2};
+  case InstructionSet::SSE2:
+    return {set, sinSSE2, expSSE2, sqrtSSE2};
+#endif
+  default:
+    return {InstructionSet::Scalar, sinScalar, expScalar, sqrtScalar};
+  }
+}
+
+InstructionSet detectInstructionSet ()
+{
+#ifdef PLSTIM_X86_KERNELS
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+    return InstructionSet::AVX2;
+  if (__builtin_cpu_supports ("sse2"))
+    return InstructionSet::SSE2;
+#endif
+  return InstructionSet::Scalar;
+}
+
+/// Instruction set in use, changed while kernels may be running
+std::atomic<int>& currentSet ()
+{
+  static std::atomic<int> set (static_cast<int> (bestInstructionSet ()));
+  return set;
+}
+
+/// Functions of the instruction set in use, to be fetched once per image
+const Kernels& kernels ()
+{
+  static const Kernels table[] = {
+    kernelsFor (InstructionSet::Scalar),
+    kernelsFor (InstructionSet::SSE2),
+    kernelsFor (InstructionSet::AVX2),
+  };
+  return table[currentSet ().load ()];
+}
+
+/// Write gray levels around 0.5 in an image row
+void storeRow (QImage& image, int y, const float* values, float contrast)
+{
+  int width = image.width ();
+  float scale = 127.5f * contrast;
+  if (image.format () == QImage::Format_Grayscale8) {
+    auto line = image.scanLine (y);
+    for (int x = 0; x < width; x++)
+      line[x] = static_cast<uchar> (qBound (0, qRound (127.5f + scale * values[x]), 255));
+  }
+  else {
+    auto line = reinterpret_cast<QRgb*> (image.scanLine (y));
+    for (int x = 0; x < width; x++) {
+      int v = qBound (0, qRound (127.5f + scale * values[x]), 255);
+      line[x] = qRgb (v, v, v);
+    }
+  }
+}
+
+/// Row buffers and pixel positions around the image centre
+struct RowState
+{
+  explicit RowState (const QImage& image)
+    : width (image.width ()), height (image.height ()),
+      values (width), envelope (width)
+  {}
+
+  /// Horizontal position of a pixel centre
+  float px (int x) const { return x + 0.5f - 0.5f * width; }
+  /// Vertical position of a row centre, going up
+  float py (int y) const { return 0.5f * height - y - 0.5f; }
+
+  int width;
+  int height;
+  QVector<float> values;
+  QVector<float> envelope;
+};
+
+bool supported (const QImage& image)
+{
+  if (image.format () == QImage::Format_RGB32
+      || image.format () == QImage::Format_ARGB32
+      || image.format () == QImage::Format_Grayscale8)
+    return true;
+  qCritical () << "stimulus kernels do not handle image format"
+               << image.format ();
+  return false;
+}
+
+/// Fill with the mean gray level, for degenerate kernels
+void fillBackground (QImage& image)
+{
+  QVector<float> zeros (image.width (), 0);
+  for (int y = 0; y < image.height (); y++)
+    storeRow (image, y, zeros.constData (), 0);
+}
+
+} // anonymous namespace
+
+InstructionSet
+bestInstructionSet ()
+{
+  static const InstructionSet best = detectInstructionSet ();
+  return best;
+}
+
+InstructionSet
+instructionSet ()
+{
+  return kernels ().set;
+}
+
+void
+setInstructionSet (InstructionSet set)
+{
+  if (static_cast<int> (set) > static_cast<int> (bestInstructionSet ()))
+    set = bestInstructionSet ();
+  currentSet ().store (static_cast<int> (set));
+}
+
+const char*
+instructionSetName (InstructionSet set)
+{
+  switch (set) {
+  case InstructionSet::AVX2:
+    return "AVX2";
+  case InstructionSet::SSE2:
+    return "SSE2";
+  default:
+    return "scalar";
+  }
+}
+
+void
+sinArray (float* values, int count)
+{
+  kernels ().sin (values, count);
+}
+
+void
+paintGrating (QImage& image, float frequency, float phase,
+              float orientation, float contrast, float sigma)
+{
+  if (! supported (image))
+    return;
+
+  const auto& k = kernels ();
+  RowState row (image);
+  float* values = row.values.data ();
+  float* envelope = row.envelope.data ();
+  float fx = TwoPi * frequency * std::cos (orientation);
+  float fy = TwoPi * frequency * std::sin (orientation);
+  float envScale = sigma > 0 ? -1 / (2 * sigma * sigma) : 0;
+
+  for (int y = 0; y < row.height; y++) {
+    float py = row.py (y);
+    // Phase is linear along a row
+    float start = fx * row.px (0) + fy * py + phase;
+    for (int x = 0; x < row.width; x++)
+      values[x] = start + fx * x;
+    k.sin (values, row.width);
+
+    if (sigma > 0) {
+      for (int x = 0; x < row.width; x++) {
+        float px = row.px (x);
+        envelope[x] = envScale * (px * px + py * py);
+      }
+      k.exp (envelope, row.width);
+      for (int x = 0; x < row.width; x++)
+        values[x] *= envelope[x];
+    }
+    storeRow (image, y, values, contrast);
+  }
+}
+
+void
+paintGaussian (QImage& image, float sigma, float contrast)
+{
+  if (! supported (image))
+    return;
+  if (sigma <= 0) {
+    fillBackground (image);
+    return;
+  }
+
+  const auto& k = kernels ();
+  RowState row (image);
+  float* values = row.values.data ();
+  float scale = -1 / (2 * sigma * sigma);
+
+  for (int y = 0; y < row.height; y++) {
+    float py = row.py (y);
+    for (int x = 0; x < row.width; x++) {
+      float px = row.px (x);
+      values[x] = scale * (px * px + py * py);
+    }
+    k.exp (values, row.width);
+    storeRow (image, y, values, contrast);
+  }
+}
+
+void
+paintCheckerboard (QImage& image, float size, float contrast)
+{
+  if (! supported (image))
+    return;
+  if (size <= 0) {
+    fillBackground (image);
+    return;
+  }
+
+  RowState row (image);
+  float* values = row.values.data ();
+
+  for (int y = 0; y < row.height; y++) {
+    int cy = static_cast<int> (std::floor (row.py (y) / size));
+    for (int x = 0; x < row.width; x++) {
+      int cx = static_cast<int> (std::floor (row.px (x) / size));
+      values[x] = ((cx + cy) & 1) ? -1 : 1;
+    }
+    storeRow (image, y, values, contrast);
+  }
+}
+
+void
+paintRadialGrating (QImage& image, float frequency, float phase,
+                    float contrast)
+{
+  if (! supported (image))
+    return;
+
+  const auto& k = kernels ();
+  RowState row (image);
+  float* values = row.values.data ();
+  float fr = TwoPi * frequency;
+
+  for (int y = 0; y < row.height; y++) {
+    float py = row.py (y);
+    for (int x = 0; x < row.width; x++) {
+      float px = row.px (x);
+      values[x] = px * px + py * py;
+    }
+    k.sqrt (values, row.width);
+    for (int x = 0; x < row.width; x++)
+      values[x] = fr * values[x] + phase;
+    k.sin (values, row.width);
+    storeRow (image, y, values, contrast);
+  }
+}
+
+void
+StimulusKernel::paint (QImage& image) const
+{
+  switch (kind) {
+  case Grating:
+    paintGrating (image, frequency, phase, orientation, contrast, sigma);
+    break;
+  case Gaussian:
+    paintGaussian (image, sigma, contrast);
+    break;
+  case Checkerboard:
+    paintCheckerboard (image, size, contrast);
+    break;
+  case RadialGrating:
+    paintRadialGrating (image, frequency, phase, contrast);
+    break;
+  }
+}
+
+} // namespace plstim
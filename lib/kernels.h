@@ -0,0 +1,74 @@
+// lib/kernels.h – Native stimulus kernels
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#pragma once
+
+#include <QtGui>
+
+namespace plstim
+{
+
+/**
+ * Vector instruction sets used by the stimulus kernels, chosen at
+ * runtime among those supported by the processor.
+ */
+enum class InstructionSet { Scalar, SSE2, AVX2 };
+
+/// Best instruction set supported by the processor.
+InstructionSet bestInstructionSet ();
+/// Instruction set currently used by the kernels.
+InstructionSet instructionSet ();
+/**
+ * Use another instruction set, e.g. to compare implementations.
+ * Unsupported instruction sets fall back to the best supported one.
+ * Kernels already running finish their image with the previous one.
+ */
+void setInstructionSet (InstructionSet set);
+const char* instructionSetName (InstructionSet set);
+
+/// Replace an array of angles in radians by their sines.
+void sinArray (float* values, int count);
+
+/*
+ * Kernels fill a whole Format_RGB32 or Format_Grayscale8 image with
+ * gray levels around 0.5. Positions are in pixels from the image
+ * centre, y going up; angles are in radians, orientations
+ * counter-clockwise; contrasts from 0 to 1.
+ */
+
+/// Sinusoidal grating, in a Gaussian envelope (a Gabor) if sigma > 0.
+void paintGrating (QImage& image, float frequency, float phase,
+                   float orientation, float contrast, float sigma=0);
+/// Gaussian blob brighter than the background for positive contrasts.
+void paintGaussian (QImage& image, float sigma, float contrast);
+/// Checkerboard of square cells, the centre at a cell corner.
+void paintCheckerboard (QImage& image, float size, float contrast);
+/// Sinusoidal modulation of the distance to the centre.
+void paintRadialGrating (QImage& image, float frequency, float phase,
+                         float contrast);
+
+/// Kernel call, to be evaluated later in some image
+struct StimulusKernel
+{
+  enum Kind { Grating, Gaussian, Checkerboard, RadialGrating };
+
+  Kind kind = Grating;
+  float frequency = 0;
+  float phase = 0;
+  float orientation = 0;
+  float contrast = 1;
+  /// Envelope or blob deviation in pixels
+  float sigma = 0;
+  /// Checkerboard cell size in pixels
+  float size = 0;
+
+  void paint (QImage& image) const;
+};
+
+} // namespace plstim
+
+// Local Variables:
+// mode: c++
+// End:
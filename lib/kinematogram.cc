@@ -0,0 +1,249 @@
+// lib/kinematogram.cc – Random-dot kinematograms
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include <cmath>
+
+#include "kernels.h"
+#include "kinematogram.h"
+#include "qmltypes.h"
+#include "random.h"
+
+using namespace plstim;
+
+
+/// Where hidden dots are kept, far from any frame
+static const QPointF HiddenDot (-1e5, -1e5);
+
+
+Kinematogram::Kinematogram (QObject* parent)
+  : QObject (parent)
+  , m_count (100), m_width (256), m_height (256), m_circular (false)
+  , m_coherence (1), m_direction (0), m_speed (1), m_lifetime (0)
+  , m_dotSize (2), m_color (Qt::white), m_seed (0), m_logged (false)
+  , m_trial (0), m_trialSeed (0), m_seeded (false), m_frame (-1)
+  , m_loggedFrames (0)
+{
+}
+
+void
+Kinematogram::setCount (int count)
+{
+  m_count = qMax (0, count);
+  invalidate ();
+}
+
+void
+Kinematogram::setWidth (float width)
+{
+  m_width = width;
+  invalidate ();
+}
+
+void
+Kinematogram::setHeight (float height)
+{
+  m_height = height;
+  invalidate ();
+}
+
+void
+Kinematogram::setCoherence (float coherence)
+{
+  m_coherence = coherence;
+  invalidate ();
+}
+
+void
+Kinematogram::setDirection (float direction)
+{
+  m_direction = direction;
+  invalidate ();
+}
+
+void
+Kinematogram::setSpeed (float speed)
+{
+  m_speed = speed;
+  invalidate ();
+}
+
+void
+Kinematogram::setLifetime (int lifetime)
+{
+  m_lifetime = qMax (0, lifetime);
+  invalidate ();
+}
+
+void
+Kinematogram::setSeed (int seed)
+{
+  m_seed = seed;
+  m_seeded = false;
+  invalidate ();
+}
+
+void
+Kinematogram::invalidate ()
+{
+  // Frames already generated in the trial will be generated again
+  m_frame = -1;
+  m_log.clear ();
+  m_loggedFrames = 0;
+}
+
+void
+Kinematogram::startTrial (int trial)
+{
+  m_trial = trial;
+  m_seeded = false;
+  invalidate ();
+}
+
+float
+Kinematogram::uniform ()
+{
+  std::uniform_real_distribution<float> distrib (0, 1);
+  return distrib (m_twister);
+}
+
+void
+Kinematogram::reset ()
+{
+  // Trial seeds derive from the experiment seed, if any
+  if (! m_seeded) {
+    if (m_seed != 0) {
+      std::seed_seq seq {static_cast<quint32> (m_seed),
+                         static_cast<quint32> (m_trial)};
+      seq.generate (&m_trialSeed, &m_trialSeed + 1);
+    }
+    else {
+      RandomDevSeedSequence rdss;
+      rdss.generate (&m_trialSeed, &m_trialSeed + 1);
+    }
+    m_seeded = true;
+  }
+  m_twister.seed (m_trialSeed);
+
+  for (auto v : {&m_x, &m_y, &m_age, &m_coherent, &m_draw, &m_dx, &m_dy})
+    v->resize (m_count);
+  for (int i = 0; i < m_count; i++) {
+    m_x[i] = (uniform () - 0.5f) * m_width;
+    m_y[i] = (uniform () - 0.5f) * m_height;
+    // Spread the ages so that dots do not all move at once
+    m_age[i] = m_lifetime > 0 ? std::floor (uniform () * m_lifetime) : 0;
+    m_coherent[i] = 0;
+  }
+
+  invalidate ();
+  m_frame = 0;
+  appendLog ();
+}
+
+void
+Kinematogram::step ()
+{
+  int n = m_count;
+  float* x = m_x.data ();
+  float* y = m_y.data ();
+  float* age = m_age.data ();
+  float* coherent = m_coherent.data ();
+  float* draw = m_draw.data ();
+  float* dx = m_dx.data ();
+  float* dy = m_dy.data ();
+
+  // Random numbers first, the updates are then branch free
+  for (int i = 0; i < n; i++)
+    draw[i] = uniform ();
+  for (int i = 0; i < n; i++) {
+    float angle = 2 * M_PI * uniform ();
+    dy[i] = angle;
+    dx[i] = angle + M_PI / 2;
+  }
+  sinArray (dx, n);
+  sinArray (dy, n);
+
+  float cdx = m_speed * std::cos (radians (m_direction));
+  float cdy = -m_speed * std::sin (radians (m_direction));
+  for (int i = 0; i < n; i++) {
+    float c = draw[i] < m_coherence ? 1 : 0;
+    coherent[i] = c;
+    x[i] += c * cdx + (1 - c) * m_speed * dx[i];
+    y[i] += c * cdy - (1 - c) * m_speed * dy[i];
+    age[i] += 1;
+  }
+
+  // Wrap around the aperture
+  float w = qMax (m_width, 1.f);
+  float h = qMax (m_height, 1.f);
+  for (int i = 0; i < n; i++) {
+    x[i] -= w * std::floor ((x[i] + 0.5f * w) / w);
+    y[i] -= h * std::floor ((y[i] + 0.5f * h) / h);
+  }
+
+  if (m_lifetime > 0) {
+    for (int i = 0; i < n; i++) {
+      if (age[i] >= m_lifetime) {
+        x[i] = (uniform () - 0.5f) * m_width;
+        y[i] = (uniform () - 0.5f) * m_height;
+        age[i] = 0;
+      }
+    }
+  }
+}
+
+void
+Kinematogram::appendLog ()
+{
+  if (! m_logged || m_frame != m_loggedFrames)
+    return;
+  for (auto v : {&m_x, &m_y, &m_age, &m_coherent})
+    m_log << *v;
+  m_loggedFrames++;
+}
+
+void
+Kinematogram::seek (int frame)
+{
+  frame = qMax (0, frame);
+  if (m_frame < 0 || frame < m_frame)
+    reset ();
+  while (m_frame < frame) {
+    step ();
+    m_frame++;
+    appendLog ();
+  }
+}
+
+QPolygonF
+Kinematogram::points (int frame, const QPointF& centre, bool keepHidden)
+{
+  seek (frame);
+
+  QPolygonF points;
+  points.reserve (m_count);
+  float rx = 0.5f * m_width;
+  float ry = 0.5f * m_height;
+  for (int i = 0; i < m_count; i++) {
+    float u = m_x[i] / rx;
+    float v = m_y[i] / ry;
+    if (! m_circular || u * u + v * v <= 1)
+      points << centre + QPointF (m_x[i], m_y[i]);
+    else if (keepHidden)
+      points << HiddenDot;
+  }
+  return points;
+}
+
+void
+Kinematogram::draw (QObject* object, int frame, qreal x, qreal y)
+{
+  auto painter = qobject_cast<Painter*> (object);
+  if (painter == nullptr) {
+    qCritical () << "error: kinematograms can only be drawn by a painter";
+    return;
+  }
+  painter->drawPoints (points (frame, QPointF (x, y)),
+                       QPen (m_color, m_dotSize, Qt::SolidLine, Qt::RoundCap));
+}
@@ -0,0 +1,215 @@
+// lib/kinematogram.h – Random-dot kinematograms
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#pragma once
+
+#include <random>
+
+#include <QtGui>
+
+namespace plstim
+{
+
+/**
+ * Dots moving in an aperture, a fraction of them coherently.
+ *
+ * On each frame, every dot moves coherently with probability
+ * coherence, or else in a random direction. Dots leaving the
+ * aperture wrap around to the other side, and dots reaching their
+ * lifetime are moved to a random position. Circular apertures only
+ * show the dots inside the ellipse inscribed in the aperture.
+ *
+ * Dot positions are generated from a seed drawn for each trial, so
+ * that any frame can be generated again. Positions are in pixels
+ * from the aperture centre, y going down, speeds in pixels per frame
+ * and directions in degrees counter-clockwise from the right.
+ */
+class Kinematogram : public QObject
+{
+  Q_OBJECT
+  Q_PROPERTY (QString name READ name WRITE setName)
+  Q_PROPERTY (int count READ count WRITE setCount)
+  Q_PROPERTY (float width READ width WRITE setWidth)
+  Q_PROPERTY (float height READ height WRITE setHeight)
+  Q_PROPERTY (bool circular READ circular WRITE setCircular)
+  Q_PROPERTY (float coherence READ coherence WRITE setCoherence)
+  Q_PROPERTY (float direction READ direction WRITE setDirection)
+  Q_PROPERTY (float speed READ speed WRITE setSpeed)
+  Q_PROPERTY (int lifetime READ lifetime WRITE setLifetime)
+  Q_PROPERTY (float dotSize READ dotSize WRITE setDotSize)
+  Q_PROPERTY (QColor color READ color WRITE setColor)
+  Q_PROPERTY (int seed READ seed WRITE setSeed)
+  Q_PROPERTY (quint32 trialSeed READ trialSeed)
+  Q_PROPERTY (bool logged READ logged WRITE setLogged)
+
+public:
+  Kinematogram (QObject* parent=nullptr);
+
+  /// Name of the dot logs
+  QString name () const
+  { return m_name; }
+
+  void setName (const QString& name)
+  { m_name = name; }
+
+  int count () const
+  { return m_count; }
+
+  void setCount (int count);
+
+  /// Aperture width in pixels
+  float width () const
+  { return m_width; }
+
+  void setWidth (float width);
+
+  /// Aperture height in pixels
+  float height () const
+  { return m_height; }
+
+  void setHeight (float height);
+
+  bool circular () const
+  { return m_circular; }
+
+  void setCircular (bool circular)
+  { m_circular = circular; }
+
+  /// Probability of a coherent move, from 0 to 1
+  float coherence () const
+  { return m_coherence; }
+
+  void setCoherence (float coherence);
+
+  float direction () const
+  { return m_direction; }
+
+  void setDirection (float direction);
+
+  float speed () const
+  { return m_speed; }
+
+  void setSpeed (float speed);
+
+  /// Frames before a dot is moved at random, or zero
+  int lifetime () const
+  { return m_lifetime; }
+
+  void setLifetime (int lifetime);
+
+  /// Dot diameter in pixels
+  float dotSize () const
+  { return m_dotSize; }
+
+  void setDotSize (float size)
+  { m_dotSize = size; }
+
+  QColor color () const
+  { return m_color; }
+
+  void setColor (const QColor& color)
+  { m_color = color; }
+
+  /// Seed of the experiment, or zero for random trial seeds
+  int seed () const
+  { return m_seed; }
+
+  void setSeed (int seed);
+
+  /// Seed of the current trial, once its first frame is generated
+  quint32 trialSeed () const
+  { return m_trialSeed; }
+
+  /// Whether the state of each frame is kept for logging
+  bool logged () const
+  { return m_logged; }
+
+  void setLogged (bool logged)
+  {
+    m_logged = logged;
+    invalidate ();
+  }
+
+  /// Draw the dots of a frame around a position of a Painter.
+  Q_INVOKABLE void draw (QObject* painter, int frame,
+                         qreal x=0, qreal y=0);
+
+  /// Start a new trial, drawing new dots on the next frame.
+  void startTrial (int trial);
+
+  /// Generate the dots of a frame.
+  void seek (int frame);
+
+  /**
+   * Positions of the visible dots of a frame, around the given
+   * centre. Hidden dots are moved out of the frame when keepHidden.
+   */
+  QPolygonF points (int frame, const QPointF& centre,
+                    bool keepHidden=false);
+
+  /**
+   * State of the logged frames, frame by frame, each with count
+   * horizontal positions, vertical positions, ages and coherent move
+   * flags.
+   */
+  const QVector<float>& log () const
+  { return m_log; }
+
+  int loggedFrames () const
+  { return m_loggedFrames; }
+
+  /// Number of state values per dot and frame in the log
+  static const int LogFields = 4;
+
+protected:
+  /// Drop the generated dots.
+  void invalidate ();
+  /// Draw the initial dots.
+  void reset ();
+  void step ();
+  void appendLog ();
+  float uniform ();
+
+  QString m_name;
+  int m_count;
+  float m_width;
+  float m_height;
+  bool m_circular;
+  float m_coherence;
+  float m_direction;
+  float m_speed;
+  int m_lifetime;
+  float m_dotSize;
+  QColor m_color;
+  int m_seed;
+  bool m_logged;
+
+  int m_trial;
+  quint32 m_trialSeed;
+  /// Whether m_trialSeed was drawn for the trial
+  bool m_seeded;
+  std::mt19937 m_twister;
+  /// Frame currently generated, or -1
+  int m_frame;
+
+  // Dot state, as one array per variable
+  QVector<float> m_x;
+  QVector<float> m_y;
+  QVector<float> m_age;
+  QVector<float> m_coherent;
+  // Per step random numbers
+  QVector<float> m_draw;
+  QVector<float> m_dx;
+  QVector<float> m_dy;
+
+  QVector<float> m_log;
+  int m_loggedFrames;
+};
+
+} // namespace plstim
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,334 @@
+// lib/noise.cc – Filtered noise textures
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include <cmath>
+#include <complex>
+#include <memory>
+#include <random>
+
+#include "noise.h"
+#include "utils.h"
+
+namespace plstim
+{
+
+namespace
+{
+
+typedef std::complex<float> Complex;
+
+const float Pi = 3.14159265358979f;
+
+/// In place radix-2 transforms of a power of two size
+class Fft
+{
+public:
+  explicit Fft (int n)
+    : m_n (n), m_reversed (n), m_twiddles (n / 2)
+  {
+    int bits = 0;
+    while ((1 << bits) < n)
+      bits++;
+    for (int i = 0; i < n; i++) {
+      int r = 0;
+      for (int b = 0; b < bits; b++)
+        if (i & (1 << b))
+          r |= 1 << (bits - 1 - b);
+      m_reversed[i] = r;
+    }
+    // Twiddle factors computed in double precision
+    for (int k = 0; k < n / 2; k++) {
+      auto w = std::polar (1.0, -2 * M_PI * k / n);
+      m_twiddles[k] = Complex (w.real (), w.imag ());
+    }
+  }
+
+  /// Transform, without normalisation.
+  void transform (Complex* data, bool inverse) const
+  {
+    for (int i = 0; i < m_n; i++)
+      if (i < m_reversed[i])
+        std::swap (data[i], data[m_reversed[i]]);
+    for (int len = 2; len <= m_n; len *= 2) {
+      int half = len / 2;
+      int step = m_n / len;
+      for (int i = 0; i < m_n; i += len) {
+        for (int k = 0; k < half; k++) {
+          Complex w = m_twiddles[k * step];
+          if (inverse)
+            w = std::conj (w);
+          Complex u = data[i + k];
+          Complex v = data[i + k + half] * w;
+          data[i + k] = u + v;
+          data[i + k + half] = u - v;
+        }
+      }
+    }
+  }
+
+private:
+  int m_n;
+  QVector<int> m_reversed;
+  QVector<Complex> m_twiddles;
+};
+
+/// Filter and transforms of a frame size
+struct NoisePlan
+{
+  NoisePlan (int frameWidth, int frameHeight, const NoiseSpectrum& spectrum)
+    : frameWidth (frameWidth), frameHeight (frameHeight),
+      width (nextPowerOfTwo (frameWidth)),
+      height (nextPowerOfTwo (frameHeight)),
+      spectrum (spectrum), filter (width * height),
+      rows (width), columns (height)
+  {
+    for (int j = 0; j < height; j++) {
+      // Rows go down, frequencies up
+      float fy = -static_cast<float> (j <= height / 2 ? j : j - height) / height;
+      for (int i = 0; i < width; i++) {
+        float fx = static_cast<float> (i <= width / 2 ? i : i - width) / width;
+        // Nyquist bins stand for opposite frequencies, whose gains are
+        // averaged to keep the filter Hermitian-symmetric
+        float g = spectrum.gain (fx, fy);
+        if (2 * i == width && 2 * j == height)
+          g = (g + spectrum.gain (-fx, fy) + spectrum.gain (fx, -fy)
+               + spectrum.gain (-fx, -fy)) / 4;
+        else if (2 * i == width)
+          g = (g + spectrum.gain (-fx, fy)) / 2;
+        else if (2 * j == height)
+          g = (g + spectrum.gain (fx, -fy)) / 2;
+        filter[j * width + i] = g;
+      }
+    }
+  }
+
+  /// Two dimensional transform of a padded frame.
+  void transform (Complex* data, bool inverse) const
+  {
+    for (int j = 0; j < height; j++)
+      rows.transform (data + j * width, inverse);
+    QVector<Complex> column (height);
+    for (int i = 0; i < width; i++) {
+      for (int j = 0; j < height; j++)
+        column[j] = data[j * width + i];
+      columns.transform (column.data (), inverse);
+      for (int j = 0; j < height; j++)
+        data[j * width + i] = column[j];
+    }
+  }
+
+  int frameWidth;
+  int frameHeight;
+  /// Padded size
+  int width;
+  int height;
+  NoiseSpectrum spectrum;
+  QVector<float> filter;
+  Fft rows;
+  Fft columns;
+};
+
+typedef std::shared_ptr<const NoisePlan> NoisePlanPtr;
+
+/// Most recently used plans first
+const int CacheCapacity = 8;
+QMutex cacheMutex;
+QList<NoisePlanPtr> cache;
+
+NoisePlanPtr plan (int width, int height, const NoiseSpectrum& spectrum)
+{
+  QMutexLocker lock (&cacheMutex);
+  for (int i = 0; i < cache.size (); i++) {
+    const auto& p = cache.at (i);
+    if (p->frameWidth == width && p->frameHeight == height
+        && p->spectrum == spectrum) {
+      cache.move (i, 0);
+      return cache.first ();
+    }
+  }
+  auto p = std::make_shared<const NoisePlan> (width, height, spectrum);
+  cache.prepend (p);
+  while (cache.size () > CacheCapacity)
+    cache.removeLast ();
+  return p;
+}
+
+bool supported (const QImage& image)
+{
+  switch (image.format ()) {
+  case QImage::Format_RGB32:
+  case QImage::Format_ARGB32:
+  case QImage::Format_Grayscale8:
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+  case QImage::Format_Grayscale16:
+#endif
+    return true;
+  default:
+    qCritical () << "noise does not handle image format" << image.format ();
+    return false;
+  }
+}
+
+/// Write gray levels around 0.5 in an image row
+void storeRow (QImage& image, int y, const float* values, float contrast)
+{
+  int width = image.width ();
+  switch (image.format ()) {
+  case QImage::Format_Grayscale8: {
+    auto line = image.scanLine (y);
+    for (int x = 0; x < width; x++)
+      line[x] = static_cast<uchar> (qBound (0, qRound (127.5f * (1 + contrast * values[x])), 255));
+    break;
+  }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+  case QImage::Format_Grayscale16: {
+    auto line = reinterpret_cast<quint16*> (image.scanLine (y));
+    for (int x = 0; x < width; x++)
+      line[x] = static_cast<quint16> (qBound (0, qRound (32767.5f * (1 + contrast * values[x])), 65535));
+    break;
+  }
+#endif
+  default: {
+    auto line = reinterpret_cast<QRgb*> (image.scanLine (y));
+    for (int x = 0; x < width; x++) {
+      int v = qBound (0, qRound (127.5f * (1 + contrast * values[x])), 255);
+      line[x] = qRgb (v, v, v);
+    }
+    break;
+  }
+  }
+}
+
+/// Store the real or imaginary parts of a frame, at unit variance
+void storeFrame (QImage& image, const NoisePlan& p, const Complex* data,
+                 bool imaginary, float contrast)
+{
+  int w = p.frameWidth;
+  int h = p.frameHeight;
+  QVector<float> values (w * h);
+  double sum = 0;
+  double squares = 0;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      const auto& c = data[y * p.width + x];
+      float v = imaginary ? c.imag () : c.real ();
+      values[y * w + x] = v;
+      sum += v;
+      squares += static_cast<double> (v) * v;
+    }
+  }
+
+  // Padding makes the mean of the frame slightly off zero
+  double mean = sum / values.size ();
+  double variance = squares / values.size () - mean * mean;
+  float scale = variance > 0 ? 1 / std::sqrt (variance) : 0;
+  for (auto& v : values)
+    v = (v - mean) * scale;
+  for (int y = 0; y < h; y++)
+    storeRow (image, y, values.constData () + y * w, contrast);
+}
+
+void generate (QImage& first, QImage* second, const NoiseSpectrum& spectrum,
+               float contrast, quint32 firstSeed, quint32 secondSeed)
+{
+  if (! supported (first) || (second != nullptr && ! supported (*second)))
+    return;
+  if (second != nullptr && second->size () != first.size ()) {
+    qCritical () << "error: noise frames of different sizes";
+    return;
+  }
+  if (first.isNull ())
+    return;
+  auto p = plan (first.width (), first.height (), spectrum);
+
+  // Two real white noises as a single complex one
+  QVector<Complex> data (p->width * p->height);
+  std::normal_distribution<float> normal;
+  std::mt19937 real (firstSeed);
+  for (auto& c : data)
+    c.real (normal (real));
+  if (second != nullptr) {
+    std::mt19937 imag (secondSeed);
+    normal.reset ();
+    for (auto& c : data)
+      c.imag (normal (imag));
+  }
+
+  // Filters are real and symmetric, keeping both parts apart
+  p->transform (data.data (), false);
+  const float* gains = p->filter.constData ();
+  for (int i = 0; i < data.size (); i++)
+    data[i] *= gains[i];
+  p->transform (data.data (), true);
+
+  storeFrame (first, *p, data.constData (), false, contrast);
+  if (second != nullptr)
+    storeFrame (*second, *p, data.constData (), true, contrast);
+}
+
+} // anonymous namespace
+
+bool
+NoiseSpectrum::operator== (const NoiseSpectrum& other) const
+{
+  return exponent == other.exponent
+    && lowFrequency == other.lowFrequency
+    && highFrequency == other.highFrequency
+    && orientation == other.orientation
+    && orientationBandwidth == other.orientationBandwidth;
+}
+
+float
+NoiseSpectrum::gain (float fx, float fy) const
+{
+  float f = std::sqrt (fx * fx + fy * fy);
+  // No change of the mean luminance
+  if (f == 0 || f < lowFrequency || (highFrequency > 0 && f > highFrequency))
+    return 0;
+  float g = exponent != 0 ? std::pow (f, -exponent) : 1;
+  if (orientationBandwidth > 0) {
+    // Opposite frequencies share their orientation
+    float d = std::atan2 (fy, fx) - orientation;
+    d -= Pi * std::floor (d / Pi + 0.5f);
+    g *= std::exp (-d * d / (2 * orientationBandwidth * orientationBandwidth));
+  }
+  return g;
+}
+
+void
+paintNoise (QImage& image, const NoiseSpectrum& spectrum, float contrast,
+            quint32 seed)
+{
+  generate (image, nullptr, spectrum, contrast, seed, 0);
+}
+
+void
+paintNoise (QImage& first, QImage& second, const NoiseSpectrum& spectrum,
+            float contrast, quint32 firstSeed, quint32 secondSeed)
+{
+  generate (first, &second, spectrum, contrast, firstSeed, secondSeed);
+}
+
+QVector<float>
+noiseFilter (int width, int height, const NoiseSpectrum& spectrum)
+{
+  return plan (width, height, spectrum)->filter;
+}
+
+int
+noiseFilterCacheSize ()
+{
+  QMutexLocker lock (&cacheMutex);
+  return cache.size ();
+}
+
+void
+clearNoiseFilterCache ()
+{
+  QMutexLocker lock (&cacheMutex);
+  cache.clear ();
+}
+
+} // namespace plstim
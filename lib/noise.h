@@ -0,0 +1,67 @@
+// lib/noise.h – Filtered noise textures
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#pragma once
+
+#include <QtGui>
+
+namespace plstim
+{
+
+/**
+ * Amplitude spectrum of filtered noise: a power law of the spatial
+ * frequency, restricted to a band and around an orientation.
+ * Frequencies are in cycles per pixel, angles in radians.
+ */
+struct NoiseSpectrum
+{
+  /// Amplitude falls as 1/f^exponent: 0 for white, 1 for pink noise
+  float exponent = 0;
+  /// Pass band, a high frequency of zero meaning up to Nyquist
+  float lowFrequency = 0;
+  float highFrequency = 0;
+  /// Orientation of the passed components, as for gratings
+  float orientation = 0;
+  /// Deviation of the orientation filter, zero for isotropic noise
+  float orientationBandwidth = 0;
+
+  bool operator== (const NoiseSpectrum& other) const;
+
+  /// Gain at a spatial frequency, y going up.
+  float gain (float fx, float fy) const;
+};
+
+/**
+ * Fill an image with noise of the given spectrum, around the mean gray
+ * level with an RMS contrast. White noise drawn from the seed is
+ * transformed by FFT, filtered and transformed back. Images are
+ * Format_RGB32, Format_ARGB32 or grayscale.
+ */
+void paintNoise (QImage& image, const NoiseSpectrum& spectrum,
+                 float contrast, quint32 seed);
+
+/**
+ * Fill two images of the same size at the cost of one: their noises
+ * are the real and imaginary parts of a single complex transform.
+ */
+void paintNoise (QImage& first, QImage& second, const NoiseSpectrum& spectrum,
+                 float contrast, quint32 firstSeed, quint32 secondSeed);
+
+/**
+ * Filter gains for frames of the given size, padded to powers of two.
+ * Filters and transform tables are cached per size and spectrum.
+ */
+QVector<float> noiseFilter (int width, int height,
+                            const NoiseSpectrum& spectrum);
+
+/// Number of filters in the cache.
+int noiseFilterCacheSize ();
+void clearNoiseFilterCache ();
+
+} // namespace plstim
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,563 @@
+// lib/offscreendisplayer.cc – Headless stimulus displayer
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include "offscreendisplayer.h"
+#include "utils.h"
+
+namespace plstim
+{
+
+OffscreenDisplayer::OffscreenDisplayer(qreal refreshRate, Backend backend,
+				       QObject* parent)
+  : QObject(parent)
+  , m_backend(backend)
+  , m_refreshInterval(0)
+  , m_lastRetrace(0)
+  , m_width(0)
+  , m_height(0)
+  , m_surface(nullptr)
+  , m_context(nullptr)
+  , m_fbo(nullptr)
+  , m_blitter(nullptr)
+{
+  setRefreshRate(refreshRate);
+
+  if (m_backend == OpenGL && ! setupOpenGL()) {
+    qWarning() << "warning: no offscreen OpenGL, drawing frames on the CPU";
+    destroyOpenGL();
+    m_backend = Software;
+  }
+}
+
+OffscreenDisplayer::~OffscreenDisplayer()
+{
+  clear();
+  destroyOpenGL();
+}
+
+bool OffscreenDisplayer::setupOpenGL()
+{
+  // Surfaces need a GUI application, e.g. on the offscreen platform
+  if (qobject_cast<QGuiApplication*>(QCoreApplication::instance()) == nullptr)
+    return false;
+
+  m_surface = new QOffscreenSurface;
+  m_surface->create();
+  if (! m_surface->isValid())
+    return false;
+
+  m_context = new QOpenGLContext;
+  if (! m_context->create() || ! m_context->makeCurrent(m_surface))
+    return false;
+
+  m_blitter = new QOpenGLTextureBlitter;
+  return m_blitter->create();
+}
+
+void OffscreenDisplayer::destroyOpenGL()
+{
+  if (m_context != nullptr && m_context->makeCurrent(m_surface)) {
+    delete m_fbo;
+    delete m_blitter;
+    m_context->doneCurrent();
+  }
+  m_fbo = nullptr;
+  m_blitter = nullptr;
+  delete m_context;
+  m_context = nullptr;
+  delete m_surface;
+  m_surface = nullptr;
+}
+
+OffscreenDisplayer::Backend OffscreenDisplayer::backend() const
+{
+  return m_backend;
+}
+
+qreal OffscreenDisplayer::refreshRate() const
+{
+  return m_refreshInterval > 0 ? 1e9 / m_refreshInterval : 0;
+}
+
+void OffscreenDisplayer::setRefreshRate(qreal rate)
+{
+  m_refreshInterval = rate > 0 ? static_cast<qint64>(1e9 / rate) : 0;
+}
+
+QImage OffscreenDisplayer::lastFrame()
+{
+  if (m_backend == OpenGL) {
+    if (m_fbo == nullptr)
+      return QImage();
+    m_context->makeCurrent(m_surface);
+    return m_fbo->toImage();
+  }
+  return m_target;
+}
+
+OffscreenDisplayer::Frame OffscreenDisplayer::createFrame(const QImage& img)
+{
+  Frame frame;
+  if (m_backend == OpenGL) {
+    m_context->makeCurrent(m_surface);
+    frame.texture = new QOpenGLTexture(img, QOpenGLTexture::DontGenerateMipMaps);
+  }
+  else {
+    // Images may be painted in again, keep our own copy
+    frame.image = img.copy();
+  }
+  return frame;
+}
+
+OffscreenDisplayer::Frame OffscreenDisplayer::paintFrame(int width, int height,
+							const FrameDrawing& drawing)
+{
+  m_context->makeCurrent(m_surface);
+
+  // Multisampled for antialiasing, with the stencil paths need
+  QOpenGLFramebufferObjectFormat fmt;
+  fmt.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
+  fmt.setSamples(4);
+  QOpenGLFramebufferObject target(width, height, fmt);
+  target.bind();
+  auto f = m_context->functions();
+  f->glViewport(0, 0, width, height);
+  f->glClearColor(0, 0, 0, 0);
+  f->glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT);
+  {
+    // Top row first, as uploaded images
+    QOpenGLPaintDevice device(width, height);
+    device.setPaintFlipped(true);
+    QPainter painter(&device);
+    drawing(painter);
+  }
+  target.release();
+
+  Frame frame;
+  frame.fbo = new QOpenGLFramebufferObject(width, height);
+  QOpenGLFramebufferObject::blitFramebuffer(frame.fbo, &target);
+  return frame;
+}
+
+void OffscreenDisplayer::deleteFrame(const Frame& frame)
+{
+  // Kept while other series present it
+  const void* storage = frame.texture != nullptr
+    ? static_cast<const void*>(frame.texture) : frame.fbo;
+  if (storage != nullptr && m_frameShares.contains(storage)) {
+    m_keptFrames.insert(storage, frame);
+    return;
+  }
+
+  if (frame.texture != nullptr || frame.fbo != nullptr) {
+    m_context->makeCurrent(m_surface);
+    delete frame.texture;
+    delete frame.fbo;
+  }
+}
+
+qint64 OffscreenDisplayer::frameBytes(const Frame& frame) const
+{
+  // Textures are stored as 8 bits RGBA
+  if (frame.texture != nullptr)
+    return 4 * static_cast<qint64>(frame.texture->width()) * frame.texture->height();
+  if (frame.fbo != nullptr)
+    return 4 * static_cast<qint64>(frame.fbo->width()) * frame.fbo->height();
+  return static_cast<qint64>(frame.image.bytesPerLine()) * frame.image.height();
+}
+
+void OffscreenDisplayer::reportMemory(const QString& name)
+{
+  qint64 bytes = 0;
+  if (m_fixedFrames.contains(name))
+    bytes += frameBytes(m_fixedFrames[name]);
+  for (const auto& frame : m_animatedFrames.value(name))
+    bytes += frameBytes(frame);
+  if (m_streams.contains(name))
+    bytes += m_streams[name]->bytes();
+  emit frameMemoryChanged(name, bytes, true);
+}
+
+void OffscreenDisplayer::addFixedFrame(const QString& name, const QImage& img)
+{
+  if (m_fixedFrames.contains(name))
+    deleteFrame(m_fixedFrames.take(name));
+  m_fixedFrames.insert(name, createFrame(img));
+  reportMemory(name);
+}
+
+void OffscreenDisplayer::appendFrame(const QString& name, const Frame& frame)
+{
+  auto& frames = m_animatedFrames[name];
+  frames.append(frame);
+  if (m_frameSequences.contains(name))
+    m_frameSequences[name].append(frames.size() - 1);
+  reportMemory(name);
+}
+
+void OffscreenDisplayer::releaseFrame(const Frame& frame)
+{
+  // Images are shared by themselves
+  const void* storage = frame.texture != nullptr
+    ? static_cast<const void*>(frame.texture) : frame.fbo;
+  auto it = m_frameShares.find(storage);
+  if (storage == nullptr || it == m_frameShares.end() || --it.value() > 0)
+    return;
+  m_frameShares.erase(it);
+  if (m_keptFrames.contains(storage))
+    deleteFrame(m_keptFrames.take(storage));
+}
+
+OffscreenDisplayer::Frame OffscreenDisplayer::sequenceFrame(const QString& name,
+							    int index) const
+{
+  auto sequence = m_frameSequences.constFind(name);
+  if (sequence != m_frameSequences.constEnd()) {
+    if (index < 0 || index >= sequence->size())
+      return Frame();
+    index = sequence->at(index);
+  }
+  if (index < 0)
+    return m_sharedFrames.value(name).value(-1 - index);
+  return m_animatedFrames.value(name).value(index);
+}
+
+void OffscreenDisplayer::addAnimatedFrame(const QString& name, const QImage& img)
+{
+  appendFrame(name, createFrame(img));
+}
+
+void OffscreenDisplayer::repeatAnimatedFrame(const QString& name, int frame)
+{
+  // Stored frames were each presented once so far
+  if (! m_frameSequences.contains(name)) {
+    QVector<int> sequence;
+    for (int i = 0; i < m_animatedFrames.value(name).size(); i++)
+      sequence << i;
+    m_frameSequences.insert(name, sequence);
+  }
+  auto& sequence = m_frameSequences[name];
+  if (frame < 0 || frame >= sequence.size()) {
+    qCritical() << "??? no frame" << frame << "to repeat in" << name;
+    return;
+  }
+  sequence.append(sequence.at(frame));
+}
+
+void OffscreenDisplayer::shareAnimatedFrame(const QString& name,
+					    const QString& source, int frame)
+{
+  Frame shared = sequenceFrame(source, frame);
+  if (shared.image.isNull() && shared.texture == nullptr
+      && shared.fbo == nullptr) {
+    qCritical() << "??? no frame" << frame << "to share in" << source;
+    return;
+  }
+
+  // Stored frames were each presented once so far
+  const auto& stored = m_animatedFrames[name];
+  if (! m_frameSequences.contains(name)) {
+    QVector<int> sequence;
+    for (int i = 0; i < stored.size(); i++)
+      sequence << i;
+    m_frameSequences.insert(name, sequence);
+  }
+  auto& frames = m_sharedFrames[name];
+  m_frameSequences[name].append(-1 - frames.size());
+  frames.append(shared);
+  const void* storage = shared.texture != nullptr
+    ? static_cast<const void*>(shared.texture) : shared.fbo;
+  if (storage != nullptr)
+    m_frameShares[storage]++;
+}
+
+void OffscreenDisplayer::paintFixedFrame(const QString& name, int width,
+					 int height, QImage::Format format,
+					 const FrameDrawing& drawing)
+{
+  if (m_backend != OpenGL) {
+    Displayer::paintFixedFrame(name, width, height, format, drawing);
+    return;
+  }
+  if (m_fixedFrames.contains(name))
+    deleteFrame(m_fixedFrames.take(name));
+  m_fixedFrames.insert(name, paintFrame(width, height, drawing));
+  reportMemory(name);
+}
+
+void OffscreenDisplayer::paintAnimatedFrame(const QString& name, int width,
+					    int height, QImage::Format format,
+					    const FrameDrawing& drawing)
+{
+  if (m_backend != OpenGL) {
+    Displayer::paintAnimatedFrame(name, width, height, format, drawing);
+    return;
+  }
+  appendFrame(name, paintFrame(width, height, drawing));
+}
+
+void OffscreenDisplayer::deleteAnimatedFrames(const QString& name)
+{
+  if (! m_animatedFrames.contains(name) && ! m_streams.contains(name))
+    return;
+  for (const auto& frame : m_animatedFrames.take(name))
+    deleteFrame(frame);
+  for (const auto& frame : m_sharedFrames.take(name))
+    releaseFrame(frame);
+  m_frameSequences.remove(name);
+  m_streams.remove(name);
+  reportMemory(name);
+}
+
+void OffscreenDisplayer::addStreamedFrames(const QString& name, int frames,
+					   int width, int height,
+					   QImage::Format format,
+					   int lookahead,
+					   const FrameProducer& producer)
+{
+  deleteAnimatedFrames(name);
+  m_streams.insert(name, std::make_shared<FrameStream>(frames, width, height,
+						       format, lookahead,
+						       producer));
+  reportMemory(name);
+}
+
+void OffscreenDisplayer::deleteFrames(const QString& name)
+{
+  deleteAnimatedFrames(name);
+  m_frameLayers.remove(name);
+  if (! m_fixedFrames.contains(name))
+    return;
+  deleteFrame(m_fixedFrames.take(name));
+  emit frameMemoryChanged(name, 0, true);
+}
+
+void OffscreenDisplayer::clear()
+{
+  // All the frames go, shared or not
+  m_sharedFrames.clear();
+  m_frameShares.clear();
+  for (const auto& frame : m_keptFrames)
+    deleteFrame(frame);
+  m_keptFrames.clear();
+
+  for (auto it = m_fixedFrames.begin(); it != m_fixedFrames.end(); ++it) {
+    deleteFrame(it.value());
+    emit frameMemoryChanged(it.key(), 0, true);
+  }
+  m_fixedFrames.clear();
+  for (auto it = m_animatedFrames.begin(); it != m_animatedFrames.end(); ++it) {
+    for (const auto& frame : it.value())
+      deleteFrame(frame);
+    emit frameMemoryChanged(it.key(), 0, true);
+  }
+  m_animatedFrames.clear();
+  m_frameSequences.clear();
+  for (auto it = m_streams.begin(); it != m_streams.end(); ++it)
+    emit frameMemoryChanged(it.key(), 0, true);
+  m_streams.clear();
+  m_frameLayers.clear();
+}
+
+void OffscreenDisplayer::setTextureSize(int width, int height)
+{
+  if (width == m_width && height == m_height)
+    return;
+  m_width = width;
+  m_height = height;
+
+  if (m_backend == OpenGL) {
+    m_context->makeCurrent(m_surface);
+    delete m_fbo;
+    m_fbo = new QOpenGLFramebufferObject(width, height);
+  }
+  else {
+    m_target = QImage(width, height, QImage::Format_RGB32);
+    m_target.fill(Qt::black);
+  }
+}
+
+void OffscreenDisplayer::draw(const Frame& frame,
+			      const QVector<FrameLayer>& layers)
+{
+  if (m_backend == OpenGL) {
+    if (m_fbo == nullptr)
+      return;
+    m_context->makeCurrent(m_surface);
+    auto f = m_context->functions();
+    m_fbo->bind();
+    f->glViewport(0, 0, m_width, m_height);
+    f->glClearColor(0, 0, 0, 0);
+    f->glClear(GL_COLOR_BUFFER_BIT);
+    QRect viewport(0, 0, m_width, m_height);
+    m_blitter->bind();
+    if (frame.texture != nullptr || frame.fbo != nullptr) {
+      GLuint texture = frame.texture != nullptr
+	? frame.texture->textureId() : frame.fbo->texture();
+      m_blitter->blit(texture,
+		      QOpenGLTextureBlitter::targetTransform(viewport, viewport),
+		      QOpenGLTextureBlitter::OriginTopLeft);
+    }
+    if (! layers.isEmpty()) {
+      f->glEnable(GL_BLEND);
+      f->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      for (const auto& layer : layers) {
+	auto l = m_fixedFrames.value(layer.frame);
+	if (l.texture == nullptr && l.fbo == nullptr)
+	  continue;
+	GLuint texture = l.texture != nullptr
+	  ? l.texture->textureId() : l.fbo->texture();
+	m_blitter->blit(texture,
+			QOpenGLTextureBlitter::targetTransform(layer.rect, viewport),
+			QOpenGLTextureBlitter::OriginTopLeft);
+      }
+      f->glDisable(GL_BLEND);
+    }
+    m_blitter->release();
+    m_fbo->release();
+    // Stands for the buffer swap completion
+    f->glFinish();
+  }
+  else {
+    QPainter painter(&m_target);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    if (frame.image.isNull())
+      painter.fillRect(m_target.rect(), Qt::black);
+    else
+      painter.drawImage(0, 0, frame.image);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    for (const auto& layer : layers)
+      painter.drawImage(layer.rect, m_fixedFrames.value(layer.frame).image);
+  }
+}
+
+qint64 OffscreenDisplayer::waitForRetrace()
+{
+  qint64 now = monotonicNsecs();
+  if (m_refreshInterval <= 0)
+    return now;
+
+  // Retraces are regularly spaced on the monotonic clock, and
+  // frames drawn too late for a retrace wait for the next one
+  qint64 next = (now / m_refreshInterval + 1) * m_refreshInterval;
+  next = qMax(next, m_lastRetrace + m_refreshInterval);
+  QThread::usleep(static_cast<unsigned long>((next - now) / 1000));
+  m_lastRetrace = next;
+  return next;
+}
+
+void OffscreenDisplayer::present(const QString& name,
+				 const QVector<Frame>& frames)
+{
+  QVector<qint64> swaps;
+  auto layers = m_frameLayers.value(name);
+  for (const auto& frame : frames) {
+    draw(frame, layers);
+    swaps << waitForRetrace();
+  }
+  notifyShown(name, FrameTimings::fromSwapTimes(swaps, m_refreshInterval));
+}
+
+void OffscreenDisplayer::present(const QString& name, FrameStream& stream)
+{
+  // Painted again for each presentation
+  if (stream.position() > 0)
+    stream.rewind();
+
+  QVector<qint64> swaps;
+  auto layers = m_frameLayers.value(name);
+  for (;;) {
+    const QImage& img = stream.acquire();
+    if (img.isNull())
+      break;
+    {
+      // Texture or shallow copy dropped before the image is released
+      Frame frame;
+      if (m_backend == OpenGL)
+	frame = createFrame(img);
+      else
+	frame.image = img;
+      draw(frame, layers);
+      deleteFrame(frame);
+    }
+    stream.release();
+    swaps << waitForRetrace();
+  }
+
+  auto timings = FrameTimings::fromSwapTimes(swaps, m_refreshInterval);
+  timings.underruns = stream.underruns();
+  notifyShown(name, timings);
+}
+
+void OffscreenDisplayer::notifyShown(const QString& name,
+				     const FrameTimings& timings)
+{
+  // Notify once the caller is done with the presentation request
+  QMetaObject::invokeMethod(this, "framesShown", Qt::QueuedConnection,
+			    Q_ARG(QString, name),
+			    Q_ARG(plstim::FrameTimings, timings));
+}
+
+void OffscreenDisplayer::showFixedFrame(const QString& name)
+{
+  QVector<Frame> frames;
+  if (m_fixedFrames.contains(name))
+    frames << m_fixedFrames[name];
+  else if (m_frameLayers.contains(name))
+    frames << Frame();
+  else
+    qCritical() << "??? unknown fixed frame" << name;
+  present(name, frames);
+}
+
+void OffscreenDisplayer::showAnimatedFrames(const QString& name)
+{
+  if (m_streams.contains(name)) {
+    present(name, *m_streams[name]);
+    return;
+  }
+  if (! m_animatedFrames.contains(name))
+    qCritical() << "??? unknown animated frame" << name;
+  if (! m_frameSequences.contains(name)) {
+    present(name, m_animatedFrames.value(name));
+    return;
+  }
+
+  // Repeated frames share their storage
+  QVector<Frame> frames;
+  for (int i = 0; i < m_frameSequences[name].size(); i++)
+    frames << sequenceFrame(name, i);
+  present(name, frames);
+}
+
+void OffscreenDisplayer::setFrameLayers(const QString& name,
+					const QVector<FrameLayer>& layers)
+{
+  if (layers.isEmpty())
+    m_frameLayers.remove(name);
+  else
+    m_frameLayers.insert(name, layers);
+}
+
+void OffscreenDisplayer::begin()
+{
+  QMetaObject::invokeMethod(this, "exposed", Qt::QueuedConnection);
+}
+
+void OffscreenDisplayer::beginInline()
+{
+  begin();
+}
+
+void OffscreenDisplayer::end()
+{
+}
+
+QScreen* OffscreenDisplayer::displayScreen()
+{
+  return QGuiApplication::primaryScreen();
+}
+
+} // namespace plstim
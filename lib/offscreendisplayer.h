@@ -0,0 +1,160 @@
+// lib/offscreendisplayer.h – Headless stimulus displayer
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#pragma once
+
+#include <memory>
+
+#include <QtGui>
+
+#include "displayer.h"
+
+namespace plstim
+{
+
+/**
+ * Displayer presenting frames without any window.
+ *
+ * Frames are drawn in an OpenGL framebuffer object of an offscreen
+ * surface or, when OpenGL is not available, painted in an image on
+ * the CPU. Frame drawings are then also painted on the GPU. Vertical
+ * retraces are simulated at a given refresh rate, so that sessions
+ * can be run on headless machines to measure their throughput and
+ * presentation timings.
+ *
+ * Presentation blocks the calling thread until the simulated retrace
+ * of the last frame; framesShown() is then emitted asynchronously.
+ */
+class OffscreenDisplayer : public QObject, public Displayer
+{
+  Q_OBJECT
+public:
+  enum Backend { OpenGL, Software };
+
+  /**
+   * Create a displayer of the given refresh rate in Hz. The OpenGL
+   * backend falls back to the software one when no context can be
+   * created.
+   */
+  explicit OffscreenDisplayer(qreal refreshRate=60, Backend backend=OpenGL,
+			      QObject* parent=nullptr);
+  virtual ~OffscreenDisplayer();
+
+  /// Backend actually in use.
+  Backend backend() const;
+  /// Simulated refresh rate, zero to present frames as fast as possible.
+  qreal refreshRate() const;
+  void setRefreshRate(qreal rate);
+  /// Content of the last presented frame.
+  QImage lastFrame();
+
+  // Overrides from Displayer
+  virtual void addFixedFrame(const QString& name, const QImage& img) override;
+  virtual void showFixedFrame(const QString& name) override;
+  virtual void addAnimatedFrame(const QString& name, const QImage& img) override;
+  virtual void repeatAnimatedFrame(const QString& name, int frame) override;
+  virtual void shareAnimatedFrame(const QString& name, const QString& source,
+				  int frame) override;
+  virtual void paintFixedFrame(const QString& name, int width, int height,
+			       QImage::Format format,
+			       const FrameDrawing& drawing) override;
+  virtual void paintAnimatedFrame(const QString& name, int width, int height,
+				  QImage::Format format,
+				  const FrameDrawing& drawing) override;
+  virtual void showAnimatedFrames(const QString& name) override;
+  virtual void addStreamedFrames(const QString& name, int frames,
+				 int width, int height, QImage::Format format,
+				 int lookahead,
+				 const FrameProducer& producer) override;
+  virtual void setFrameLayers(const QString& name,
+			      const QVector<FrameLayer>& layers) override;
+  virtual void deleteAnimatedFrames(const QString& name) override;
+  virtual void deleteFrames(const QString& name) override;
+  virtual void setTextureSize(int width, int height) override;
+  virtual void clear() override;
+  virtual void begin() override;
+  virtual void beginInline() override;
+  virtual void end() override;
+  virtual QScreen* displayScreen() override;
+
+signals:
+  void exposed() override;
+  void keyPressed(QKeyEvent* evt) override;
+  void framesShown(const QString& name,
+		   const plstim::FrameTimings& timings) override;
+  void frameMemoryChanged(const QString& name, qint64 bytes,
+			  bool resident) override;
+
+private:
+  /// Frame image, or its texture with the OpenGL backend
+  struct Frame
+  {
+    QImage image;
+    QOpenGLTexture* texture = nullptr;
+    /// Target holding frames painted on the GPU
+    QOpenGLFramebufferObject* fbo = nullptr;
+  };
+
+  bool setupOpenGL();
+  void destroyOpenGL();
+  Frame createFrame(const QImage& img);
+  /// Paint a frame drawing on the GPU.
+  Frame paintFrame(int width, int height, const FrameDrawing& drawing);
+  /// Delete a stored frame, once no other series shares it.
+  void deleteFrame(const Frame& frame);
+  /// Release a frame shared from another series.
+  void releaseFrame(const Frame& frame);
+  /// Append a stored frame to an animated series.
+  void appendFrame(const QString& name, const Frame& frame);
+  /// Frame presented at an index of a series, or a null frame.
+  Frame sequenceFrame(const QString& name, int index) const;
+  qint64 frameBytes(const Frame& frame) const;
+  void reportMemory(const QString& name);
+  /// Draw a frame and its layers in the offscreen target and wait
+  /// for completion.
+  void draw(const Frame& frame, const QVector<FrameLayer>& layers);
+  /// Sleep until the next simulated retrace and return its time.
+  qint64 waitForRetrace();
+  void present(const QString& name, const QVector<Frame>& frames);
+  /// Present the frames of a stream as they are painted.
+  void present(const QString& name, FrameStream& stream);
+  /// Emit framesShown() once the caller is done with the presentation.
+  void notifyShown(const QString& name, const FrameTimings& timings);
+
+  Backend m_backend;
+  /// Interval between simulated retraces in ns, or zero
+  qint64 m_refreshInterval;
+  qint64 m_lastRetrace;
+  int m_width;
+  int m_height;
+  QMap<QString,Frame> m_fixedFrames;
+  QMap<QString,QVector<Frame>> m_animatedFrames;
+  /// Indices of the frames presented in turn, for series with
+  /// repeated frames, negative ones for shared frames
+  QMap<QString,QVector<int>> m_frameSequences;
+  /// Frames of other series presented by a series
+  QMap<QString,QVector<Frame>> m_sharedFrames;
+  /// Number of series sharing the textures or targets of frames, and
+  /// the frames of deleted series kept for them
+  QHash<const void*,int> m_frameShares;
+  QHash<const void*,Frame> m_keptFrames;
+  QMap<QString,std::shared_ptr<FrameStream>> m_streams;
+  QMap<QString,QVector<FrameLayer>> m_frameLayers;
+
+  // OpenGL backend
+  QOffscreenSurface* m_surface;
+  QOpenGLContext* m_context;
+  QOpenGLFramebufferObject* m_fbo;
+  QOpenGLTextureBlitter* m_blitter;
+
+  // Software backend
+  QImage m_target;
+};
+
+} // namespace plstim
+
+// Local Variables:
+// mode: c++
+// End:
@@ -5,3 +5,185 @@
 
 #include "qmltypes.h"
 
+using namespace plstim;
+
+
+void
+DisplayList::replay (QPainter& painter) const
+{
+  for (const auto& op : m_ops) {
+    switch (op.type) {
+    case Ellipse:
+      painter.drawEllipse (op.x, op.y, op.w, op.h);
+      break;
+    case Line:
+      painter.drawLine (op.x, op.y, op.w, op.h);
+      break;
+    case Text:
+      painter.drawText (op.x, op.y, op.w, op.h, op.flags, m_texts.at (op.arg));
+      break;
+    case TextAt:
+      painter.drawText (op.x, op.y, m_texts.at (op.arg));
+      break;
+    case Path:
+      painter.drawPath (m_paths.at (op.arg));
+      break;
+    case FillRect:
+      painter.fillRect (op.x, op.y, op.w, op.h, m_colors.at (op.arg));
+      break;
+    case Brush:
+      painter.setBrush (m_colors.at (op.arg));
+      break;
+    case SetPen:
+      painter.setPen (m_pens.at (op.arg));
+      break;
+    case Points:
+      painter.save ();
+      painter.setPen (m_pens.at (op.flags));
+      painter.drawPoints (m_points.at (op.arg));
+      painter.restore ();
+      break;
+    case Kernel:
+      Painter::drawKernel (painter, op.x, op.y, op.w, op.h,
+			   m_kernels.at (op.arg));
+      break;
+    }
+  }
+}
+
+QByteArray
+DisplayList::hash () const
+{
+  // Calls serialised with their arguments
+  QByteArray calls;
+  QDataStream stream (&calls, QIODevice::WriteOnly);
+  for (const auto& op : m_ops)
+    stream << static_cast<qint32> (op.type) << op.x << op.y << op.w << op.h
+	   << op.flags << op.arg;
+  stream << m_colors << m_pens << m_texts << m_paths << m_points;
+  for (const auto& k : m_kernels)
+    stream << static_cast<qint32> (k.kind) << k.frequency << k.phase
+	   << k.orientation << k.contrast << k.sigma << k.size;
+  return QCryptographicHash::hash (calls, QCryptographicHash::Sha1);
+}
+
+void
+Painter::drawKernel (QPainter& painter, int x, int y, int width, int height,
+		     const StimulusKernel& kernel)
+{
+  if (width <= 0 || height <= 0)
+    return;
+
+  // Straight in the frame bits when the patch covers whole pixels
+  auto device = painter.device ();
+  const auto& t = painter.transform ();
+  if (device != nullptr && device->devType () == QInternal::Image
+      && t.type () <= QTransform::TxTranslate && ! painter.hasClipping ()
+      && painter.opacity () == 1
+      && painter.compositionMode () == QPainter::CompositionMode_SourceOver) {
+    auto image = static_cast<QImage*> (device);
+    qreal dx = x + t.dx ();
+    qreal dy = y + t.dy ();
+    int left = qRound (dx);
+    int top = qRound (dy);
+    auto format = image->format ();
+    if (left == dx && top == dy && left >= 0 && top >= 0
+	&& left + width <= image->width ()
+	&& top + height <= image->height ()
+	&& image->devicePixelRatio () == 1
+	&& (format == QImage::Format_RGB32 || format == QImage::Format_ARGB32
+	    || format == QImage::Format_Grayscale8)) {
+      int bpl = image->bytesPerLine ();
+      QImage patch (image->bits () + top * bpl + left * image->depth () / 8,
+		    width, height, bpl, format);
+      kernel.paint (patch);
+      return;
+    }
+  }
+
+  QImage patch (width, height, QImage::Format_RGB32);
+  kernel.paint (patch);
+  painter.drawImage (x, y, patch);
+}
+
+void
+Painter::drawKernel (int x, int y, int width, int height,
+		     const StimulusKernel& kernel)
+{
+  if (m_painter)
+    drawKernel (*m_painter, x, y, width, height, kernel);
+  if (m_recording)
+    m_recording->drawKernel (x, y, width, height, kernel);
+}
+
+void
+Painter::drawGrating (int x, int y, int width, int height, qreal frequency,
+		      qreal phase, qreal orientation, qreal contrast)
+{
+  drawGabor (x, y, width, height, frequency, phase, orientation, contrast, 0);
+}
+
+void
+Painter::drawGabor (int x, int y, int width, int height, qreal frequency,
+		    qreal phase, qreal orientation, qreal contrast, qreal sigma)
+{
+  StimulusKernel k;
+  k.kind = StimulusKernel::Grating;
+  k.frequency = frequency;
+  k.phase = radians (phase);
+  k.orientation = radians (orientation);
+  k.contrast = contrast;
+  k.sigma = sigma;
+  drawKernel (x, y, width, height, k);
+}
+
+void
+Painter::drawGaussian (int x, int y, int width, int height, qreal sigma,
+		       qreal contrast)
+{
+  StimulusKernel k;
+  k.kind = StimulusKernel::Gaussian;
+  k.sigma = sigma;
+  k.contrast = contrast;
+  drawKernel (x, y, width, height, k);
+}
+
+void
+Painter::drawCheckerboard (int x, int y, int width, int height, qreal size,
+			   qreal contrast)
+{
+  StimulusKernel k;
+  k.kind = StimulusKernel::Checkerboard;
+  k.size = size;
+  k.contrast = contrast;
+  drawKernel (x, y, width, height, k);
+}
+
+void
+Painter::drawRadialGrating (int x, int y, int width, int height,
+			    qreal frequency, qreal phase, qreal contrast)
+{
+  StimulusKernel k;
+  k.kind = StimulusKernel::RadialGrating;
+  k.frequency = frequency;
+  k.phase = radians (phase);
+  k.contrast = contrast;
+  drawKernel (x, y, width, height, k);
+}
+
+void
+ElementArrayPage::setElement (int index, float x, float y, float orientation,
+			      float contrast, float size, int glyph)
+{
+  if (index < 0 || index >= count ()) {
+    qCritical () << "error: no element" << index << "in" << name ();
+    return;
+  }
+  float* attr = m_attributes.data () + ElementFrames::AttributeCount * index;
+  attr[ElementFrames::X] = x;
+  attr[ElementFrames::Y] = y;
+  attr[ElementFrames::Orientation] = radians (orientation);
+  attr[ElementFrames::Size] = size;
+  attr[ElementFrames::Contrast] = contrast;
+  attr[ElementFrames::Index] = glyph;
+}
@@ -8,6 +8,10 @@
 #include <QtGui>
 #include <QtQml>
 
+#include "displayer.h"
+#include "kernels.h"
+#include "kinematogram.h"
+#include "noise.h"
 #include "random.h"
 #include "setup.h"
 #include "utils.h"
@@ -205,33 +209,179 @@ protected:
 };
 
 
+/**
+ * Drawing calls recorded by a Painter, replayed without going back
+ * to the QML paint handler. Only coordinates and indices are stored
+ * per call; colours, pens, texts and paths go in side tables.
+ */
+class DisplayList
+{
+public:
+  DisplayList ()
+    : m_recorded (false)
+  {}
+
+  /// Whether a paint handler was fully recorded.
+  bool recorded () const
+  { return m_recorded; }
+
+  /// Mark the recording as complete.
+  void finish ()
+  { m_recorded = true; }
+
+  void clear ()
+  {
+    m_ops.clear ();
+    m_colors.clear ();
+    m_pens.clear ();
+    m_texts.clear ();
+    m_paths.clear ();
+    m_kernels.clear ();
+    m_points.clear ();
+    m_recorded = false;
+  }
+
+  /// Draw the recorded calls with a painter.
+  void replay (QPainter& painter) const;
+
+  /// Digest of the recorded calls, the same for identical drawings.
+  QByteArray hash () const;
+
+  void drawEllipse (int x, int y, int width, int height)
+  { append (Ellipse, x, y, width, height); }
+
+  void drawLine (int x1, int y1, int x2, int y2)
+  { append (Line, x1, y1, x2, y2); }
+
+  void drawText (int x, int y, int w, int h, int flags, const QString& text)
+  {
+    append (Text, x, y, w, h, flags, m_texts.size ());
+    m_texts << text;
+  }
+
+  void drawTextAt (int x, int y, const QString& text)
+  {
+    append (TextAt, x, y, 0, 0, 0, m_texts.size ());
+    m_texts << text;
+  }
+
+  void drawPath (const QPainterPath& path)
+  {
+    append (Path, 0, 0, 0, 0, 0, m_paths.size ());
+    m_paths << path;
+  }
+
+  void fillRect (int x, int y, int width, int height, const QColor& color)
+  {
+    append (FillRect, x, y, width, height, 0, m_colors.size ());
+    m_colors << color;
+  }
+
+  void setBrush (const QColor& color)
+  {
+    append (Brush, 0, 0, 0, 0, 0, m_colors.size ());
+    m_colors << color;
+  }
+
+  void setPen (const QPen& pen)
+  {
+    append (SetPen, 0, 0, 0, 0, 0, m_pens.size ());
+    m_pens << pen;
+  }
+
+  void drawPoints (const QPolygonF& points, const QPen& pen)
+  {
+    append (Points, 0, 0, 0, 0, m_pens.size (), m_points.size ());
+    m_pens << pen;
+    m_points << points;
+  }
+
+  /// Record a kernel call, only evaluated on replay.
+  void drawKernel (int x, int y, int width, int height,
+		   const StimulusKernel& kernel)
+  {
+    append (Kernel, x, y, width, height, 0, m_kernels.size ());
+    m_kernels << kernel;
+  }
+
+protected:
+  enum OpType { Ellipse, Line, Text, TextAt, Path, FillRect, Brush, SetPen,
+		Kernel, Points };
+
+  struct Op
+  {
+    OpType type;
+    int x, y, w, h;
+    int flags;
+    /// Index in the side table of the operation type
+    int arg;
+  };
+
+  void append (OpType type, int x, int y, int w, int h,
+	       int flags=0, int arg=0)
+  {
+    m_ops.append ({type, x, y, w, h, flags, arg});
+  }
+
+  QVector<Op> m_ops;
+  QVector<QColor> m_colors;
+  QVector<QPen> m_pens;
+  QVector<QString> m_texts;
+  QVector<QPainterPath> m_paths;
+  QVector<StimulusKernel> m_kernels;
+  QVector<QPolygonF> m_points;
+  bool m_recorded;
+};
+
+
 class Painter : public QObject
 {
   Q_OBJECT
 
 public:
   Painter (QPainter& painter, QObject* parent=nullptr)
-    : QObject (parent), m_painter (painter)
+    : QObject (parent), m_painter (&painter), m_recording (nullptr)
+  {}
+
+  /// Only record the drawing calls, to be replayed later.
+  explicit Painter (DisplayList* list, QObject* parent=nullptr)
+    : QObject (parent), m_painter (nullptr), m_recording (list)
   {}
 
+  /// Also record the drawing calls in a display list, if not nullptr.
+  void setRecording (DisplayList* list)
+  { m_recording = list; }
+
   Q_INVOKABLE STACK_ALIGNED void drawEllipse (int x, int y, int width, int height)
   {
-    m_painter.drawEllipse (x, y, width, height);
+    if (m_painter)
+      m_painter->drawEllipse (x, y, width, height);
+    if (m_recording)
+      m_recording->drawEllipse (x, y, width, height);
   }
 
   Q_INVOKABLE STACK_ALIGNED void drawLine (int x1, int y1, int x2, int y2)
   {
-    m_painter.drawLine (x1, y1, x2, y2);
+    if (m_painter)
+      m_painter->drawLine (x1, y1, x2, y2);
+    if (m_recording)
+      m_recording->drawLine (x1, y1, x2, y2);
   }
 
   Q_INVOKABLE STACK_ALIGNED void drawText (int x, int y, const QString& text)
   {
-    m_painter.drawText (x, y, text);
+    if (m_painter)
+      m_painter->drawText (x, y, text);
+    if (m_recording)
+      m_recording->drawTextAt (x, y, text);
   }
 
   Q_INVOKABLE STACK_ALIGNED void drawText (int x, int y, int w, int h, int flags, const QString& text)
   {
-    m_painter.drawText (x, y, w, h, flags, text);
+    if (m_painter)
+      m_painter->drawText (x, y, w, h, flags, text);
+    if (m_recording)
+      m_recording->drawText (x, y, w, h, flags, text);
   }
 
   Q_INVOKABLE STACK_ALIGNED void drawPath (PainterPath* path)
@@ -240,49 +390,115 @@ public:
     //PainterPath& p = path.value<PainterPath&> ();
     //const PainterPath* p = qobject_cast<const PainterPath*> (&path);
     //qDebug () << "GOT A FUCKING PATH at" << hex << (long) path;
-    m_painter.drawPath (*(path->path ()));
+    if (m_painter)
+      m_painter->drawPath (*(path->path ()));
+    if (m_recording)
+      m_recording->drawPath (*(path->path ()));
   }
 
   Q_INVOKABLE STACK_ALIGNED void fillRect (int x, int y, int width, int height, const QColor& color)
   {
-    m_painter.fillRect (x, y, width, height, color);
+    if (m_painter)
+      m_painter->fillRect (x, y, width, height, color);
+    if (m_recording)
+      m_recording->fillRect (x, y, width, height, color);
   }
 
   Q_INVOKABLE void setBrush (const QColor& color)
   {
-    m_painter.setBrush (color);
+    if (m_painter)
+      m_painter->setBrush (color);
+    if (m_recording)
+      m_recording->setBrush (color);
   }
 
   Q_INVOKABLE void setPen ()
   {
-    m_painter.setPen (Qt::NoPen);
+    setPen (QPen (Qt::NoPen));
   }
 
   Q_INVOKABLE void setPen (const QColor& color)
   {
-    m_painter.setPen (color);
+    setPen (QPen (color));
   }
 
   Q_INVOKABLE void setPen (const QPen& pen)
   {
-    m_painter.setPen (pen);
+    if (m_painter)
+      m_painter->setPen (pen);
+    if (m_recording)
+      m_recording->setPen (pen);
+  }
+
+  /// Draw points with a pen, keeping the current one.
+  void drawPoints (const QPolygonF& points, const QPen& pen)
+  {
+    if (m_painter) {
+      m_painter->save ();
+      m_painter->setPen (pen);
+      m_painter->drawPoints (points);
+      m_painter->restore ();
+    }
+    if (m_recording)
+      m_recording->drawPoints (points, pen);
   }
 
+  /*
+   * Stimuli computed natively in a rectangle, with gray levels
+   * around 0.5. Frequencies are in cycles per pixel, sizes in pixels,
+   * angles in degrees and contrasts from 0 to 1.
+   */
+
+  Q_INVOKABLE STACK_ALIGNED void drawGrating (int x, int y, int width, int height,
+					      qreal frequency, qreal phase,
+					      qreal orientation, qreal contrast);
+  Q_INVOKABLE STACK_ALIGNED void drawGabor (int x, int y, int width, int height,
+					    qreal frequency, qreal phase,
+					    qreal orientation, qreal contrast,
+					    qreal sigma);
+  Q_INVOKABLE STACK_ALIGNED void drawGaussian (int x, int y, int width, int height,
+					       qreal sigma, qreal contrast);
+  Q_INVOKABLE STACK_ALIGNED void drawCheckerboard (int x, int y, int width, int height,
+						   qreal size, qreal contrast);
+  Q_INVOKABLE STACK_ALIGNED void drawRadialGrating (int x, int y, int width, int height,
+						    qreal frequency, qreal phase,
+						    qreal contrast);
+
+  /// Compute a kernel in a rectangle of a painter.
+  static void drawKernel (QPainter& painter, int x, int y, int width, int height,
+			  const StimulusKernel& kernel);
+
 protected:
-  QPainter& m_painter;
+  void drawKernel (int x, int y, int width, int height,
+		   const StimulusKernel& kernel);
+
+  /// Painter drawing the calls, if not only recording
+  QPainter* m_painter;
+  DisplayList* m_recording;
 };
 
 
+class Layer;
+
 class Page : public QObject
 {
   Q_OBJECT
-  Q_ENUMS (PaintTime)
+  Q_ENUMS (PaintTime FrameFormat PaintBackend)
   Q_PROPERTY (QString name READ name WRITE setName)
   Q_PROPERTY (bool last READ last WRITE setLast)
   Q_PROPERTY (int duration READ duration WRITE setDuration)
   Q_PROPERTY (int frameCount READ frameCount WRITE setFrameCount)
   Q_PROPERTY (bool animated READ animated WRITE setAnimated)
   Q_PROPERTY (PaintTime paintTime READ paintTime WRITE setPaintTime)
+  Q_PROPERTY (FrameFormat frameFormat READ frameFormat WRITE setFrameFormat)
+  Q_PROPERTY (bool replay READ replay WRITE setReplay)
+  Q_PROPERTY (PaintBackend paintBackend READ paintBackend WRITE setPaintBackend)
+  Q_PROPERTY (bool transformed READ transformed WRITE setTransformed)
+  Q_PROPERTY (int lookahead READ lookahead WRITE setLookahead)
+  Q_PROPERTY (QQmlListProperty<plstim::Layer> layers READ layers)
+  Q_PROPERTY (bool cached READ cached WRITE setCached)
+  Q_PROPERTY (QStringList cacheParameters READ cacheParameters WRITE setCacheParameters)
+  Q_PROPERTY (QQmlListProperty<plstim::Page> branches READ branches)
   Q_PROPERTY (bool waitKey READ waitKey WRITE setWaitKey)
   Q_PROPERTY (QStringList acceptedKeys READ acceptedKeys WRITE setAcceptedKeys)
 #ifdef HAVE_EYELINK
@@ -301,11 +517,38 @@ public:
       MANUAL
     };
 
+  /// Pixel format in which frames are painted and stored
+  enum FrameFormat
+    {
+      /// Colour frames, 8 bits per channel
+      RGB,
+      /// Grayscale frames, 8 bits
+      LUMINANCE8,
+      /// Grayscale frames, 16 bits for high precision contrast
+      LUMINANCE16
+    };
+
+  /// Where frames are rasterised
+  enum PaintBackend
+    {
+      /// On the CPU, then uploaded
+      RASTER,
+      /// On the GPU, directly in the frame textures when supported,
+      /// and when fonts can be rendered outside the GUI thread
+      OPENGL
+    };
+
   Page (QObject* parent=nullptr)
     : QObject (parent)
     , m_last (false)
     , m_duration (0), m_frameCount (0)
     , m_animated (false), m_paintTime (EXPERIMENT)
+    , m_frameFormat (RGB)
+    , m_replay (false)
+    , m_paintBackend (RASTER)
+    , m_transformed (false)
+    , m_lookahead (0)
+    , m_cached (false)
     , m_waitKey (true)
 #ifdef HAVE_EYELINK
     , m_fixation (0)
@@ -368,6 +611,161 @@ public:
   void setPaintTime (PaintTime time)
   { m_paintTime = time; }
 
+  FrameFormat frameFormat () const
+  { return m_frameFormat; }
+
+  void setFrameFormat (FrameFormat format)
+  { m_frameFormat = format; }
+
+  /// Image format matching the frame format
+  QImage::Format imageFormat () const
+  {
+    switch (m_frameFormat) {
+    case LUMINANCE8:
+      return QImage::Format_Grayscale8;
+    case LUMINANCE16:
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+      return QImage::Format_Grayscale16;
+#else
+      // 16 bits grayscale images require Qt 5.13
+      return QImage::Format_Grayscale8;
+#endif
+    default:
+      return QImage::Format_RGB32;
+    }
+  }
+
+  /**
+   * Whether the paint handler is only called once, its drawing being
+   * replayed natively for the other frames and trials, until
+   * invalidate() is called. Animated frames then only differ by
+   * their frame transforms.
+   */
+  bool replay () const
+  { return m_replay; }
+
+  void setReplay (bool replay)
+  {
+    m_replay = replay;
+    m_displayList.clear ();
+  }
+
+  PaintBackend paintBackend () const
+  { return m_paintBackend; }
+
+  void setPaintBackend (PaintBackend backend)
+  { m_paintBackend = backend; }
+
+  /// Drawing recorded from the paint handler, if replay is enabled
+  DisplayList* displayList ()
+  { return &m_displayList; }
+
+  /// Call the paint handler again next time the page is painted.
+  Q_INVOKABLE void invalidate ()
+  { m_displayList.clear (); }
+
+  /**
+   * Move the drawing of an animated frame: scaled, rotated by angle
+   * degrees around the origin, then translated by (dx, dy).
+   */
+  Q_INVOKABLE void setFrameTransform (int frame, float dx, float dy,
+				      float angle=0, float scale=1)
+  {
+    if (frame >= m_frameTransforms.size ())
+      m_frameTransforms.resize (frame + 1);
+    QTransform t;
+    t.translate (dx, dy);
+    t.rotate (angle);
+    t.scale (scale, scale);
+    m_frameTransforms[frame] = t;
+  }
+
+  /// Scale the colours of a transformed frame around the mid gray level.
+  Q_INVOKABLE void setFrameContrast (int frame, float contrast)
+  {
+    while (frame >= m_frameContrasts.size ())
+      m_frameContrasts.append (1);
+    m_frameContrasts[frame] = contrast;
+  }
+
+  /// Remove all the frame transforms and contrasts.
+  Q_INVOKABLE void clearFrameTransforms ()
+  {
+    m_frameTransforms.clear ();
+    m_frameContrasts.clear ();
+  }
+
+  QTransform frameTransform (int frame) const
+  { return m_frameTransforms.value (frame); }
+
+  float frameContrast (int frame) const
+  { return frame < m_frameContrasts.size () ? m_frameContrasts.at (frame) : 1; }
+
+  /**
+   * Whether the frames of an animated page are its first frame, moved
+   * by the frame transforms and scaled by the frame contrasts while
+   * presenting, instead of each being painted and stored.
+   */
+  bool transformed () const
+  { return m_transformed; }
+
+  void setTransformed (bool transformed)
+  { m_transformed = transformed; }
+
+  /**
+   * Number of frames of an animated page painted ahead of their
+   * presentation by a producer thread, instead of all of them before
+   * the page is shown. Zero to paint all the frames beforehand.
+   */
+  int lookahead () const
+  { return m_lookahead; }
+
+  void setLookahead (int frames)
+  { m_lookahead = qMax (0, frames); }
+
+  /**
+   * Images drawn over the frames of the page, in order. Each layer is
+   * painted and uploaded on its own, at its paint time.
+   */
+  QQmlListProperty<plstim::Layer> layers ()
+  { return QQmlListProperty<Layer> (this, m_layers); }
+
+  const QList<Layer*>& layerList () const
+  { return m_layers; }
+
+  /// Whether the page paints its own frames, under its layers.
+  bool paintsFrames () const
+  { return isSignalConnected (QMetaMethod::fromSignal (&Page::paint)); }
+
+  /**
+   * Whether the frames painted per trial are kept for the next trials
+   * with the same values of the cache parameters, instead of being
+   * painted again.
+   */
+  bool cached () const
+  { return m_cached; }
+
+  void setCached (bool cached)
+  { m_cached = cached; }
+
+  /// Experiment properties the frames depend on, all the trial
+  /// parameters if empty
+  QStringList cacheParameters () const
+  { return m_cacheParameters; }
+
+  void setCacheParameters (const QStringList& names)
+  { m_cacheParameters = names; }
+
+  /**
+   * Pages which may be shown after this one, painted ahead while it
+   * waits for input. Their frames must not depend on the input.
+   */
+  QQmlListProperty<plstim::Page> branches ()
+  { return QQmlListProperty<Page> (this, m_branches); }
+
+  const QList<Page*>& branchList () const
+  { return m_branches; }
+
   bool waitKey () const
   { return m_waitKey; }
 
@@ -420,6 +818,18 @@ protected:
   int m_frameCount;
   bool m_animated;
   PaintTime m_paintTime;
+  FrameFormat m_frameFormat;
+  bool m_replay;
+  PaintBackend m_paintBackend;
+  DisplayList m_displayList;
+  QVector<QTransform> m_frameTransforms;
+  QVector<float> m_frameContrasts;
+  bool m_transformed;
+  int m_lookahead;
+  QList<Layer*> m_layers;
+  bool m_cached;
+  QStringList m_cacheParameters;
+  QList<Page*> m_branches;
   bool m_waitKey;
   QSet<int> m_acceptedKeys;
 #ifdef HAVE_EYELINK
@@ -439,16 +849,456 @@ signals:
 };
 
 
+/**
+ * Part of a page, painted on a transparent frame of its own and
+ * drawn over the page frames at (x, y). Layers are painted at their
+ * paint time, then only once invalidated, so that the static parts
+ * of a page are neither painted nor uploaded again.
+ */
+class Layer : public QObject
+{
+  Q_OBJECT
+  Q_PROPERTY (int x READ x WRITE setX)
+  Q_PROPERTY (int y READ y WRITE setY)
+  Q_PROPERTY (int width READ width WRITE setWidth)
+  Q_PROPERTY (int height READ height WRITE setHeight)
+  Q_PROPERTY (plstim::Page::PaintTime paintTime READ paintTime WRITE setPaintTime)
+  Q_PROPERTY (bool visible READ visible WRITE setVisible)
+
+public:
+  Layer (QObject* parent=nullptr)
+    : QObject (parent)
+    , m_x (0), m_y (0), m_width (0), m_height (0)
+    , m_paintTime (Page::EXPERIMENT)
+    , m_visible (true)
+    , m_stale (true)
+  {}
+
+  int x () const
+  { return m_x; }
+
+  void setX (int x)
+  { m_x = x; }
+
+  int y () const
+  { return m_y; }
+
+  void setY (int y)
+  { m_y = y; }
+
+  /// Size in pixels, zero for the frame size
+  int width () const
+  { return m_width; }
+
+  void setWidth (int width)
+  {
+    m_width = width;
+    m_stale = true;
+  }
+
+  int height () const
+  { return m_height; }
+
+  void setHeight (int height)
+  {
+    m_height = height;
+    m_stale = true;
+  }
+
+  Page::PaintTime paintTime () const
+  { return m_paintTime; }
+
+  void setPaintTime (Page::PaintTime time)
+  { m_paintTime = time; }
+
+  bool visible () const
+  { return m_visible; }
+
+  void setVisible (bool visible)
+  { m_visible = visible; }
+
+  /// Paint the layer again before the page is next shown.
+  Q_INVOKABLE void invalidate ()
+  { m_stale = true; }
+
+  bool stale () const
+  { return m_stale; }
+
+  /**
+   * Whether the layer is to be painted on an occasion: at its paint
+   * time (EXPERIMENT for setup changes, TRIAL for new trials, ON_SHOW
+   * when its page is shown), or on the next trial or show once
+   * invalidated.
+   */
+  bool needsPaint (Page::PaintTime occasion) const
+  {
+    return occasion == m_paintTime
+      || (m_stale && occasion != Page::EXPERIMENT);
+  }
+
+  void setPainted ()
+  { m_stale = false; }
+
+protected:
+  int m_x;
+  int m_y;
+  int m_width;
+  int m_height;
+  Page::PaintTime m_paintTime;
+  bool m_visible;
+  bool m_stale;
+
+signals:
+  void paint (plstim::Painter* painter);
+};
+
+
+/**
+ * Page showing a procedural stimulus, computed per pixel by the
+ * displayer instead of being painted. Animated stimuli drift at the
+ * given temporal frequency, their phase advancing every frame.
+ */
+class ShaderPage : public Page
+{
+  Q_OBJECT
+  Q_ENUMS (Stimulus)
+  Q_PROPERTY (Stimulus stimulus READ stimulus WRITE setStimulus)
+  Q_PROPERTY (float spatialFrequency READ spatialFrequency WRITE setSpatialFrequency)
+  Q_PROPERTY (float temporalFrequency READ temporalFrequency WRITE setTemporalFrequency)
+  Q_PROPERTY (float phase READ phase WRITE setPhase)
+  Q_PROPERTY (float orientation READ orientation WRITE setOrientation)
+  Q_PROPERTY (float plaidAngle READ plaidAngle WRITE setPlaidAngle)
+  Q_PROPERTY (float contrast READ contrast WRITE setContrast)
+  Q_PROPERTY (float sigma READ sigma WRITE setSigma)
+
+public:
+  enum Stimulus
+    {
+      GRATING,
+      /// Grating in a Gaussian envelope
+      GABOR,
+      /// Sum of two gratings
+      PLAID
+    };
+
+  ShaderPage (QObject* parent=nullptr)
+    : Page (parent)
+    , m_stimulus (GRATING)
+    , m_spatialFrequency (1), m_temporalFrequency (0)
+    , m_phase (0), m_orientation (0), m_plaidAngle (90)
+    , m_contrast (1), m_sigma (0)
+  {
+    // Parameters may depend on the trial
+    setPaintTime (TRIAL);
+  }
+
+  Stimulus stimulus () const
+  { return m_stimulus; }
+
+  void setStimulus (Stimulus stimulus)
+  { m_stimulus = stimulus; }
+
+  /// Spatial frequency in cycles per degree
+  float spatialFrequency () const
+  { return m_spatialFrequency; }
+
+  void setSpatialFrequency (float frequency)
+  { m_spatialFrequency = frequency; }
+
+  /// Drift frequency in cycles per second
+  float temporalFrequency () const
+  { return m_temporalFrequency; }
+
+  void setTemporalFrequency (float frequency)
+  { m_temporalFrequency = frequency; }
+
+  /// Phase of the first frame in degrees
+  float phase () const
+  { return m_phase; }
+
+  void setPhase (float phase)
+  { m_phase = phase; }
+
+  /// Orientation in degrees, counter-clockwise
+  float orientation () const
+  { return m_orientation; }
+
+  void setOrientation (float orientation)
+  { m_orientation = orientation; }
+
+  /// Angle between the plaid components in degrees
+  float plaidAngle () const
+  { return m_plaidAngle; }
+
+  void setPlaidAngle (float angle)
+  { m_plaidAngle = angle; }
+
+  /// Michelson contrast, from 0 to 1
+  float contrast () const
+  { return m_contrast; }
+
+  void setContrast (float contrast)
+  { m_contrast = contrast; }
+
+  /// Standard deviation of the Gaussian envelope in degrees
+  float sigma () const
+  { return m_sigma; }
+
+  void setSigma (float sigma)
+  { m_sigma = sigma; }
+
+protected:
+  Stimulus m_stimulus;
+  float m_spatialFrequency;
+  float m_temporalFrequency;
+  float m_phase;
+  float m_orientation;
+  float m_plaidAngle;
+  float m_contrast;
+  float m_sigma;
+};
+
+
+/**
+ * Page of random dots drawn by the displayer, as point sprites on
+ * the GPU, centred in the frame.
+ */
+class KinematogramPage : public Page
+{
+  Q_OBJECT
+  Q_PROPERTY (plstim::Kinematogram* dots READ dots WRITE setDots)
+
+public:
+  KinematogramPage (QObject* parent=nullptr)
+    : Page (parent), m_dots (nullptr)
+  {
+    // Dots are drawn anew on each trial
+    setPaintTime (TRIAL);
+  }
+
+  Kinematogram* dots () const
+  { return m_dots; }
+
+  void setDots (Kinematogram* dots)
+  { m_dots = dots; }
+
+protected:
+  Kinematogram* m_dots;
+};
+
+
+/**
+ * Page of identical elements drawn by the displayer, all at once on
+ * the GPU. Element attributes are set by the updateElements handler,
+ * called for each frame, in pixels from the top left corner of the
+ * frame and degrees counter-clockwise.
+ */
+class ElementArrayPage : public Page
+{
+  Q_OBJECT
+  Q_ENUMS (Shape)
+  Q_PROPERTY (Shape shape READ shape WRITE setShape)
+  Q_PROPERTY (int count READ count WRITE setCount)
+  Q_PROPERTY (float background READ background WRITE setBackground)
+  Q_PROPERTY (float frequency READ frequency WRITE setFrequency)
+  Q_PROPERTY (float sigma READ sigma WRITE setSigma)
+  Q_PROPERTY (QString glyphs READ glyphs WRITE setGlyphs)
+
+public:
+  enum Shape
+    {
+      DISC,
+      GABOR,
+      /// Character of glyphs
+      GLYPH
+    };
+
+  ElementArrayPage (QObject* parent=nullptr)
+    : Page (parent)
+    , m_shape (DISC), m_background (0.5), m_frequency (4)
+    , m_sigma (1.f / 6)
+  {
+    // Elements usually depend on the trial
+    setPaintTime (TRIAL);
+  }
+
+  Shape shape () const
+  { return m_shape; }
+
+  void setShape (Shape shape)
+  { m_shape = shape; }
+
+  /// Number of elements on every frame
+  int count () const
+  { return m_attributes.size () / ElementFrames::AttributeCount; }
+
+  void setCount (int count)
+  { m_attributes.resize (ElementFrames::AttributeCount * qMax (0, count)); }
+
+  /// Background gray level, from 0 to 1
+  float background () const
+  { return m_background; }
+
+  void setBackground (float background)
+  { m_background = background; }
+
+  /// Gabor frequency in cycles per element side
+  float frequency () const
+  { return m_frequency; }
+
+  void setFrequency (float frequency)
+  { m_frequency = frequency; }
+
+  /// Gabor envelope deviation, relative to the element side
+  float sigma () const
+  { return m_sigma; }
+
+  void setSigma (float sigma)
+  { m_sigma = sigma; }
+
+  /// Characters drawn by GLYPH elements, by index
+  QString glyphs () const
+  { return m_glyphs; }
+
+  void setGlyphs (const QString& glyphs)
+  { m_glyphs = glyphs; }
+
+  /**
+   * Set the attributes of an element of the current frame, contrast
+   * going from -1 to 1 around the background.
+   */
+  Q_INVOKABLE void setElement (int index, float x, float y,
+			       float orientation, float contrast,
+			       float size, int glyph=0);
+
+  /// Attributes of the elements, see ElementFrames::Attribute
+  const QVector<float>& attributes () const
+  { return m_attributes; }
+
+signals:
+  void updateElements (int frameNumber);
+
+protected:
+  Shape m_shape;
+  float m_background;
+  float m_frequency;
+  float m_sigma;
+  QString m_glyphs;
+  QVector<float> m_attributes;
+};
+
+
+/**
+ * Page of filtered noise, generated natively for each trial: white
+ * noise filtered by a power law of the spatial frequency, a band pass
+ * and an orientation filter. Frames are drawn from a trial seed,
+ * derived from the seed and trial number when seed is set.
+ */
+class NoisePage : public Page
+{
+  Q_OBJECT
+  Q_PROPERTY (float exponent READ exponent WRITE setExponent)
+  Q_PROPERTY (float lowFrequency READ lowFrequency WRITE setLowFrequency)
+  Q_PROPERTY (float highFrequency READ highFrequency WRITE setHighFrequency)
+  Q_PROPERTY (float orientation READ orientation WRITE setOrientation)
+  Q_PROPERTY (float orientationBandwidth READ orientationBandwidth WRITE setOrientationBandwidth)
+  Q_PROPERTY (float contrast READ contrast WRITE setContrast)
+  Q_PROPERTY (int seed READ seed WRITE setSeed)
+  Q_PROPERTY (quint32 trialSeed READ trialSeed)
+
+public:
+  NoisePage (QObject* parent=nullptr)
+    : Page (parent)
+    , m_exponent (0), m_lowFrequency (0), m_highFrequency (0)
+    , m_orientation (0), m_orientationBandwidth (0), m_contrast (0.2)
+    , m_seed (0), m_trialSeed (0)
+  {
+    // New noise on each trial
+    setPaintTime (TRIAL);
+  }
+
+  /// Amplitude falls as 1/f^exponent: 0 for white, 1 for pink noise
+  float exponent () const
+  { return m_exponent; }
+
+  void setExponent (float exponent)
+  { m_exponent = exponent; }
+
+  /// Pass band in cycles per degree, zero for no bound
+  float lowFrequency () const
+  { return m_lowFrequency; }
+
+  void setLowFrequency (float frequency)
+  { m_lowFrequency = frequency; }
+
+  float highFrequency () const
+  { return m_highFrequency; }
+
+  void setHighFrequency (float frequency)
+  { m_highFrequency = frequency; }
+
+  /// Orientation of the passed components in degrees, as for gratings
+  float orientation () const
+  { return m_orientation; }
+
+  void setOrientation (float orientation)
+  { m_orientation = orientation; }
+
+  /// Deviation of the orientation filter in degrees, zero for none
+  float orientationBandwidth () const
+  { return m_orientationBandwidth; }
+
+  void setOrientationBandwidth (float bandwidth)
+  { m_orientationBandwidth = bandwidth; }
+
+  /// RMS contrast
+  float contrast () const
+  { return m_contrast; }
+
+  void setContrast (float contrast)
+  { m_contrast = contrast; }
+
+  /// Seed of the experiment, or zero for random trial seeds
+  int seed () const
+  { return m_seed; }
+
+  void setSeed (int seed)
+  { m_seed = seed; }
+
+  /// Seed of the frames of the current trial
+  quint32 trialSeed () const
+  { return m_trialSeed; }
+
+  void setTrialSeed (quint32 seed)
+  { m_trialSeed = seed; }
+
+protected:
+  float m_exponent;
+  float m_lowFrequency;
+  float m_highFrequency;
+  float m_orientation;
+  float m_orientationBandwidth;
+  float m_contrast;
+  int m_seed;
+  quint32 m_trialSeed;
+};
+
+
 class Experiment : public QObject
 {
   Q_OBJECT
   Q_PROPERTY (QString name READ name WRITE setName NOTIFY nameChanged)
   Q_PROPERTY (int trialCount READ trialCount WRITE setTrialCount NOTIFY trialCountChanged)
   Q_PROPERTY (float size READ size WRITE setSize)
+  Q_PROPERTY (float height READ height WRITE setHeight)
   //Q_PROPERTY (int distance READ distance WRITE setDistance)
   //Q_PROPERTY (float refreshRate READ refreshRate WRITE setRefreshRate)
   Q_PROPERTY (float swapInterval READ swapInterval WRITE setSwapInterval)
+  Q_PROPERTY (bool pipelined READ pipelined WRITE setPipelined)
+  Q_PROPERTY (int cacheBudget READ cacheBudget WRITE setCacheBudget)
   Q_PROPERTY (int textureSize READ textureSize WRITE setTextureSize NOTIFY textureSizeChanged)
+  Q_PROPERTY (int textureWidth READ textureWidth NOTIFY textureSizeChanged)
+  Q_PROPERTY (int textureHeight READ textureHeight NOTIFY textureSizeChanged)
   Q_PROPERTY (QColor background READ background WRITE setBackground)
   Q_PROPERTY (QQmlListProperty<plstim::Page> pages READ pages)
   Q_PROPERTY (QVariantMap trialParameters READ trialParameters WRITE setTrialParameters)
@@ -459,7 +1309,12 @@ class Experiment : public QObject
   public:
   Experiment (QObject* parent=nullptr)
   : QObject (parent)
+    , m_height (0)
+    , m_textureWidth (0)
+    , m_textureHeight (0)
     , m_swapInterval (1)
+    , m_pipelined (false)
+    , m_cacheBudget (256)
     , m_setup (nullptr)
   {
     // Initialise the random number generator
@@ -476,6 +1331,13 @@ class Experiment : public QObject
   float size () const
   { return m_size; }
 
+  /// Stimulus height in degrees, or zero for a square stimulus
+  float height () const
+  { return m_height; }
+
+  void setHeight (float h)
+  { m_height = h; }
+
   void setTrialCount (int count)
   { m_trialCount = count; }
 
@@ -500,12 +1362,47 @@ class Experiment : public QObject
   void setSwapInterval (int interval)
   { m_swapInterval = interval; }
 
+  /**
+   * Whether the next trial is prepared (newTrial emitted and frames
+   * painted) once the stimuli of the current trial are shown, instead
+   * of between trials.
+   */
+  bool pipelined () const
+  { return m_pipelined; }
+
+  void setPipelined (bool pipelined)
+  { m_pipelined = pipelined; }
+
+  /// Memory for the frames of cached pages, in MiB
+  int cacheBudget () const
+  { return m_cacheBudget; }
+
+  void setCacheBudget (int megabytes)
+  { m_cacheBudget = megabytes; }
+
   int textureSize () const
   { return m_textureSize; }
 
   void setTextureSize (int size)
   { m_textureSize = size; }
 
+  /// Frame width in pixels
+  int textureWidth () const
+  { return m_textureWidth; }
+
+  /// Frame height in pixels
+  int textureHeight () const
+  { return m_textureHeight; }
+
+  /// Set the frame size, textureSize being the largest side
+  void setTextureDimensions (int width, int height)
+  {
+    m_textureWidth = width;
+    m_textureHeight = height;
+    m_textureSize = qMax (width, height);
+    emit textureSizeChanged (m_textureSize);
+  }
+
   Q_INVOKABLE int randint (int maxval)
   {
     std::uniform_int_distribution<int> distrib (0, maxval);
@@ -579,8 +1476,13 @@ protected:
   QString m_name;
   int m_trialCount;
   float m_size;
+  float m_height;
   int m_textureSize;
+  int m_textureWidth;
+  int m_textureHeight;
   float m_swapInterval;
+  bool m_pipelined;
+  int m_cacheBudget;
   QColor m_background;
   QList<plstim::Page*> m_pages;
   QVariantMap m_trialParameters;
@@ -20,6 +20,9 @@ class Setup : public QObject
     Q_PROPERTY (float refreshRate READ refreshRate WRITE setRefreshRate NOTIFY refreshRateChanged)
     Q_PROPERTY (int physicalWidth READ physicalWidth WRITE setPhysicalWidth NOTIFY physicalWidthChanged)
     Q_PROPERTY (int physicalHeight READ physicalHeight WRITE setPhysicalHeight NOTIFY physicalHeightChanged)
+    // Graphics memory for frames in MiB, zero for no limit, saved
+    // as vram_mb and applied to the displayer on change
+    Q_PROPERTY (int memoryBudget READ memoryBudget WRITE setMemoryBudget NOTIFY memoryBudgetChanged)
     // File system information
     Q_PROPERTY (QString dataDir READ dataDir WRITE setDataDir NOTIFY dataDirChanged)
 
@@ -31,6 +34,7 @@ signals:
     void refreshRateChanged (float rate);
     void physicalWidthChanged (int width);
     void physicalHeightChanged (int height);
+    void memoryBudgetChanged (int budget);
     void dataDirChanged (const QString& dataDir);
 
 public:
@@ -39,6 +43,7 @@ public:
 	, m_horizontalResolution (0), m_verticalResolution (0)
 	, m_distance (0), m_refreshRate (0)
 	, m_physicalWidth (0), m_physicalHeight (0)
+	, m_memoryBudget (0)
     {
       // By default, put the experiment datafiles in ‘My Documents’
       m_dataDir = QStandardPaths::writableLocation (QStandardPaths::DocumentsLocation) + QDir::separator () + "plstim-data";
@@ -107,6 +112,15 @@ public:
 	emit physicalHeightChanged (height);
     }
 
+    int memoryBudget () const
+    { return m_memoryBudget; }
+
+    void setMemoryBudget (int budget)
+    {
+	m_memoryBudget = budget;
+	emit memoryBudgetChanged (budget);
+    }
+
     const QString& dataDir () const
     { return m_dataDir; }
 
@@ -126,6 +140,7 @@ protected:
     float m_refreshRate;
     int m_physicalWidth;
     int m_physicalHeight;
+    int m_memoryBudget;
     QString m_dataDir;
 
 #if 0
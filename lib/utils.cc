@@ -6,6 +6,7 @@
 #include <QCoreApplication>
 #include <QTextCodec>
 
+#include "displayer.h"
 #include "setup.h"
 
 #include "qmltypes.h"
@@ -41,13 +42,63 @@ bool initialise ()
   qmlRegisterType<plstim::PainterPath> ("PlStim", 1, 0, "PainterPath");
   qmlRegisterUncreatableType<plstim::Painter> ("PlStim", 1, 0, "Painter", "Painter objects cannot be created from QML");
   qmlRegisterType<plstim::Page> ("PlStim", 1, 0, "Page");
+  qmlRegisterType<plstim::Layer> ("PlStim", 1, 0, "Layer");
+  qmlRegisterType<plstim::ShaderPage> ("PlStim", 1, 0, "ShaderPage");
+  qmlRegisterType<plstim::Kinematogram> ("PlStim", 1, 0, "Kinematogram");
+  qmlRegisterType<plstim::KinematogramPage> ("PlStim", 1, 0, "KinematogramPage");
+  qmlRegisterType<plstim::ElementArrayPage> ("PlStim", 1, 0, "ElementArrayPage");
+  qmlRegisterType<plstim::NoisePage> ("PlStim", 1, 0, "NoisePage");
   qmlRegisterType<plstim::Experiment> ("PlStim", 1, 0, "Experiment");
 
+  // Types sent across the presentation thread
+  qRegisterMetaType<plstim::FrameTimings> ("plstim::FrameTimings");
+
   initialised = true;
   return true;
 }
 
 
+qint64
+monotonicNsecs ()
+{
+  static const QElapsedTimer clock = [] {
+    QElapsedTimer t;
+    t.start ();
+    return t;
+  } ();
+  return clock.nsecsElapsed ();
+}
+
+
+PixelDifference
+pixelDifference (const QImage& a, const QImage& b)
+{
+  PixelDifference diff;
+  if (a.size () != b.size () || a.isNull ())
+    return diff;
+
+  QImage ra = a.convertToFormat (QImage::Format_RGB32);
+  QImage rb = b.convertToFormat (QImage::Format_RGB32);
+  qint64 total = 0;
+  for (int y = 0; y < ra.height (); y++) {
+    auto la = reinterpret_cast<const QRgb*> (ra.constScanLine (y));
+    auto lb = reinterpret_cast<const QRgb*> (rb.constScanLine (y));
+    for (int x = 0; x < ra.width (); x++) {
+      int dr = qAbs (qRed (la[x]) - qRed (lb[x]));
+      int dg = qAbs (qGreen (la[x]) - qGreen (lb[x]));
+      int db = qAbs (qBlue (la[x]) - qBlue (lb[x]));
+      int d = qMax (dr, qMax (dg, db));
+      if (d > 0)
+	diff.pixels++;
+      diff.maximum = qMax (diff.maximum, d);
+      total += dr + dg + db;
+    }
+  }
+  diff.mean = static_cast<double> (total) / (3.0 * ra.width () * ra.height ());
+  return diff;
+}
+
+
 QString
 keyToString (int k)
 {
@@ -7,6 +7,8 @@
 
 #include <cmath>
 
+class QImage;
+
 #ifndef STACK_ALIGNED
 #ifdef HAVE_WIN32
 #define STACK_ALIGNED __attribute__((force_align_arg_pointer))
@@ -38,6 +40,33 @@ sec2deg (float dst)
   return dst / 60;
 }
 
+/// Smallest power of two not lower than value
+static inline int
+nextPowerOfTwo (int value)
+{
+  int pot = 1;
+  while (pot < value)
+    pot <<= 1;
+  return pot;
+}
+
+/// Channel differences between two images
+struct PixelDifference
+{
+  /// Number of pixels differing in any channel
+  int pixels = 0;
+  /// Largest difference of a colour channel
+  int maximum = 0;
+  /// Mean difference of the colour channels
+  double mean = 0;
+};
+
+/// Compare two images of the same size, as 8 bits RGB.
+PixelDifference pixelDifference (const QImage& a, const QImage& b);
+
+/// Nanoseconds elapsed on a process-wide monotonic clock
+qint64 monotonicNsecs ();
+
 /// Convert a keycode to a named key
 QString keyToString (int k);
 
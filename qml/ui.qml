@@ -118,6 +118,9 @@ ApplicationWindow {
                 Label { text : "Refresh rate" }
                 Label { text : setup.refreshRate + " Hz" }
 
+                Label { text : "Frame memory budget" }
+                Label { text : setup.memoryBudget > 0 ? setup.memoryBudget + " MiB" : "unlimited" }
+
                 Label { text : "Data directory" }
                 Label { text : setup.dataDir }
             }
@@ -137,7 +140,20 @@ ApplicationWindow {
                 Label { text : xp ? xp.trialCount : "" }
 
                 Label { text : "Texture size" }
-                Label { text : xp ? xp.textureSize + "×" + xp.textureSize + " px" : "" }
+                Label { text : xp ? xp.textureWidth + "×" + xp.textureHeight + " px" : "" }
+
+                Label { text : "Frame memory" }
+                Label {
+                    text : {
+                        var lines = [];
+                        for (var name in engine.pageMemory) {
+                            var usage = engine.pageMemory[name];
+                            lines.push (name + ": " + (usage.bytes / 1048576).toFixed (1) + " MiB"
+                                        + (usage.resident ? "" : " (host)"));
+                        }
+                        return lines.join ("\n");
+                    }
+                }
             }
         }
 
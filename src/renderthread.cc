@@ -0,0 +1,2193 @@
+// src/renderthread.cc – Stimulus presentation thread
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include <limits>
+
+using namespace std;
+
+#include "renderthread.h"
+#include "texturepool.h"
+#include "uploadthread.h"
+#include "../lib/utils.h"
+using namespace plstim;
+
+#ifdef WIN32
+#include <windows.h>
+#include "GL/wglext.h"
+#endif
+
+// Grayscale frames are stored in the red channel only. Scheduled
+// frames sample the frame pixel moved back by frameTransform, and
+// scale its colour around the mid gray level.
+static const char *fshader_txt =
+    "varying vec2 tex_coord;\n"
+    "uniform sampler2D texture;\n"
+    "uniform bool luminance;\n"
+    "uniform vec2 coverage;\n"
+    "uniform vec2 frameSize;\n"
+    "uniform mat3 frameTransform;\n"
+    "uniform float contrast;\n"
+    "void main() {\n"
+    "  vec2 p = (frameTransform * vec3(tex_coord / coverage * frameSize, 1.0)).xy;\n"
+    "  if (any(lessThan(p, vec2(0.0))) || any(greaterThan(p, frameSize))) {\n"
+    "    gl_FragColor = vec4(0.0);\n"
+    "    return;\n"
+    "  }\n"
+    "  vec4 color = texture2D(texture, p / frameSize * coverage);\n"
+    "  color = luminance ? vec4(color.rrr, 1.0) : color;\n"
+    "  gl_FragColor = vec4(0.5 + contrast * (color.rgb - 0.5), color.a);\n"
+    "}\n";
+
+static const char *farray_shader_txt =
+    "#extension GL_EXT_texture_array : enable\n"
+    "varying vec2 tex_coord;\n"
+    "uniform sampler2DArray frames;\n"
+    "uniform float layer;\n"
+    "uniform bool luminance;\n"
+    "void main() {\n"
+    "  vec4 color = texture2DArray(frames, vec3(tex_coord, layer));\n"
+    "  gl_FragColor = luminance ? vec4(color.rrr, 1.0) : color;\n"
+    "}\n";
+
+// Procedural stimuli, see ProceduralStimulus::luminance ()
+static const char *fprocedural_shader_txt =
+    "varying vec2 tex_coord;\n"
+    "uniform vec2 coverage;\n"
+    "uniform vec2 size;\n"
+    "uniform int kind;\n"
+    "uniform float frequency;\n"
+    "uniform float phase;\n"
+    "uniform float orientation;\n"
+    "uniform float plaidAngle;\n"
+    "uniform float contrast;\n"
+    "uniform float sigma;\n"
+    "const float PI = 3.14159265358979;\n"
+    "float carrier(vec2 p, float theta) {\n"
+    "  return sin(2.0*PI*frequency*dot(p, vec2(cos(theta), sin(theta))) + phase);\n"
+    "}\n"
+    "void main() {\n"
+    // Pixel position from the frame centre, y going up
+    "  vec2 t = tex_coord / coverage;\n"
+    "  vec2 p = vec2(t.x - 0.5, 0.5 - t.y) * size;\n"
+    "  float l = carrier(p, orientation);\n"
+    "  if (kind == 2)\n"
+    "    l = 0.5*(l + carrier(p, orientation + plaidAngle));\n"
+    "  if (sigma > 0.0 && kind != 0)\n"
+    "    l *= exp(-dot(p, p)/(2.0*sigma*sigma));\n"
+    "  float v = 0.5 + 0.5*contrast*l;\n"
+    "  gl_FragColor = vec4(v, v, v, 1.0);\n"
+    "}\n";
+
+// Frames are centred by the uniforms, set on window or frame resize:
+// origin is the bottom left corner of the frame, extent its size and
+// coverage the part of padded textures holding the frame.
+static const char *vshader_txt =
+    "attribute vec2 ppos;\n"
+    "varying vec2 tex_coord;\n"
+    "uniform vec2 origin;\n"
+    "uniform vec2 extent;\n"
+    "uniform vec2 coverage;\n"
+    "void main() {\n"
+    "  gl_Position = vec4(ppos - 1.0, 0.0, 1.0);\n"
+    // Textures are stored top row first, flip them vertically
+    "  vec2 t = (ppos - origin) / extent;\n"
+    "  tex_coord = vec2(t.x, 1.0 - t.y) * coverage;\n"
+    "}\n";
+
+// Dots are placed in the frame by the same uniforms, from positions
+// in pixels from the top left corner of the frame
+static const char *vdot_shader_txt =
+    "#version 120\n"
+    "attribute vec2 ppos;\n"
+    "uniform vec2 origin;\n"
+    "uniform vec2 extent;\n"
+    "uniform vec2 size;\n"
+    "uniform float pointSize;\n"
+    "void main() {\n"
+    "  vec2 t = ppos / size;\n"
+    "  gl_Position = vec4(origin + extent * vec2(t.x, 1.0 - t.y) - 1.0, 0.0, 1.0);\n"
+    "  gl_PointSize = pointSize;\n"
+    "}\n";
+
+static const char *fdot_shader_txt =
+    "#version 120\n"
+    "uniform vec4 color;\n"
+    "void main() {\n"
+    "  vec2 c = gl_PointCoord - vec2(0.5);\n"
+    "  if (dot(c, c) > 0.25)\n"
+    "    discard;\n"
+    "  gl_FragColor = color;\n"
+    "}\n";
+
+// Elements are quads around their centre, in pixels from the top
+// left corner of the frame, rotated and scaled per instance. Corners
+// and coord are relative to the element side, y going up.
+static const char *velement_shader_txt =
+    "attribute vec2 ppos;\n"
+    "attribute vec4 element;\n"
+    "attribute vec2 look;\n"
+    "uniform vec2 origin;\n"
+    "uniform vec2 extent;\n"
+    "uniform vec2 size;\n"
+    "varying vec2 coord;\n"
+    "varying vec2 appearance;\n"
+    "void main() {\n"
+    "  float c = cos(element.z);\n"
+    "  float s = sin(element.z);\n"
+    "  vec2 r = element.w * vec2(c*ppos.x - s*ppos.y, s*ppos.x + c*ppos.y);\n"
+    "  vec2 t = (element.xy + vec2(r.x, -r.y)) / size;\n"
+    "  gl_Position = vec4(origin + extent * vec2(t.x, 1.0 - t.y) - 1.0, 0.0, 1.0);\n"
+    "  coord = ppos;\n"
+    "  appearance = look;\n"
+    "}\n";
+
+// Element shapes, see ElementFrames::luminance ()
+static const char *felement_shader_txt =
+    "uniform int shape;\n"
+    "uniform float background;\n"
+    "uniform float frequency;\n"
+    "uniform float sigma;\n"
+    "uniform sampler2D glyphs;\n"
+    "uniform float glyphCount;\n"
+    "varying vec2 coord;\n"
+    "varying vec2 appearance;\n"
+    "const float PI = 3.14159265358979;\n"
+    "void main() {\n"
+    "  float g = 1.0;\n"
+    "  float a = 1.0;\n"
+    "  if (shape == 0) {\n"
+    "    if (dot(coord, coord) > 0.25)\n"
+    "      discard;\n"
+    "  }\n"
+    "  else if (shape == 1) {\n"
+    "    g = exp(-dot(coord, coord)/(2.0*sigma*sigma))\n"
+    "      * sin(2.0*PI*frequency*coord.x);\n"
+    "  }\n"
+    "  else {\n"
+    // Glyph cells side by side, top row first
+    "    vec2 t = vec2((appearance.y + coord.x + 0.5)/glyphCount, 0.5 - coord.y);\n"
+    "    a = texture2D(glyphs, t).a;\n"
+    "  }\n"
+    "  float l = background * (1.0 + appearance.x * g);\n"
+    "  gl_FragColor = vec4(l, l, l, a);\n"
+    "}\n";
+
+/// Vertex attribute of the pixel position, in all programs
+static const int PposLocation = 0;
+/// Per element attributes: position, orientation and side, then
+/// contrast and glyph index
+static const int ElementLocation = 1;
+static const int LookLocation = 2;
+
+/**
+ * Add a shader to a program. Linked programs are cached on disk when
+ * possible, keyed by the driver and the sources, so that new contexts
+ * (e.g. when the window changes screen) do not compile again.
+ */
+static bool
+addShader (QOpenGLShaderProgram* program, QOpenGLShader::ShaderType type,
+           const char* source)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 9, 0)
+    return program->addCacheableShaderFromSourceCode (type, source);
+#else
+    return program->addShaderFromSourceCode (type, source);
+#endif
+}
+
+/**
+ * Build a program that presentation can do without. On failure, warn
+ * and return nullptr: the frames it would draw are painted instead.
+ */
+static QOpenGLShaderProgram*
+optionalProgram (const char* what, const char* vertex, const char* fragment,
+                 std::initializer_list<QPair<const char*,int>> attributes)
+{
+    auto program = new QOpenGLShaderProgram;
+    if (addShader (program, QOpenGLShader::Vertex, vertex)
+        && addShader (program, QOpenGLShader::Fragment, fragment)) {
+        for (const auto& attribute : attributes)
+            program->bindAttributeLocation (attribute.first, attribute.second);
+        if (program->link ())
+            return program;
+    }
+    qWarning () << "warning: could not build the" << what
+                << "program, painting them as frames:" << program->log ();
+    delete program;
+    return nullptr;
+}
+
+
+RenderThread::RenderThread (QWindow* window)
+    : m_window (window), m_uploader (nullptr), m_context (nullptr),
+      m_program (nullptr), m_arrayProgram (nullptr),
+      m_proceduralProgram (nullptr), m_dotProgram (nullptr),
+      m_elementProgram (nullptr),
+      tex_width (0), tex_height (0), win_width (0), win_height (0),
+      m_texloc (0), m_arrayTexloc (0), m_layerloc (0),
+      m_lumloc (0), m_arrayLumloc (0),
+      m_frameTransformloc (0), m_contrastloc (0),
+      m_currentFrame (nullptr), m_currentLayer (-1),
+      m_currentStimulusFrame (-1), m_currentDotsFrame (-1),
+      m_currentElementsFrame (-1), m_currentScheduleFrame (-1),
+      m_vao (0), m_vbo (0), m_elementQuad (0), m_layerQuad (0),
+      m_refreshInterval (0), m_syncFunctions (nullptr),
+      m_instanceFunctions (nullptr),
+      m_timestampsSupported (false), m_npotTextures (true),
+      m_memoryBudget (0), m_showCount (0)
+{
+    if (! QOpenGLContext::supportsThreadedOpenGL ())
+        qWarning () << "warning: platform does not advertise threaded OpenGL";
+}
+
+RenderThread::~RenderThread ()
+{
+    if (isRunning ()) {
+        stop ();
+        wait ();
+    }
+}
+
+void
+RenderThread::setUploader (UploadThread* uploader)
+{
+    m_uploader = uploader;
+}
+
+void
+RenderThread::post (const Command& cmd)
+{
+    if (m_uploader != nullptr)
+        m_uploader->post (cmd);
+    else
+        enqueue (cmd);
+}
+
+void
+RenderThread::enqueue (const Command& cmd)
+{
+    QMutexLocker locker (&m_mutex);
+    m_commands.enqueue (cmd);
+    m_cond.wakeOne ();
+}
+
+void
+RenderThread::post (Command::Type type, const QString& name)
+{
+    post (Command (type, name));
+}
+
+void
+RenderThread::setupOpenGL (QScreen* screen, const QSurfaceFormat& format)
+{
+    Command::Context args;
+    args.screen = screen;
+    args.format = format;
+    args.refreshRate = screen->refreshRate ();
+    post (Command::SetupOpenGL, QString (), args);
+}
+
+void
+RenderThread::addFixedFrame (const QString& name, const QImage& img)
+{
+    Command::Frame frame;
+    frame.image = img;
+    post (Command::AddFixedFrame, name, frame);
+}
+
+void
+RenderThread::addAnimatedFrame (const QString& name, const QImage& img)
+{
+    Command::Frame frame;
+    frame.image = img;
+    post (Command::AddAnimatedFrame, name, frame);
+}
+
+void
+RenderThread::repeatAnimatedFrame (const QString& name, int frame)
+{
+    Command::Repeat repeat;
+    repeat.frame = frame;
+    post (Command::RepeatAnimatedFrame, name, repeat);
+}
+
+void
+RenderThread::shareAnimatedFrame (const QString& name, const QString& source,
+                                  int frame)
+{
+    Command::Repeat repeat;
+    repeat.frame = frame;
+    repeat.source = source;
+    post (Command::ShareAnimatedFrame, name, repeat);
+}
+
+void
+RenderThread::paintFixedFrame (const QString& name, int width, int height,
+                               QImage::Format format,
+                               const FrameDrawing& drawing)
+{
+    Command::Frame frame;
+    frame.width = width;
+    frame.height = height;
+    frame.format = format;
+    frame.drawing = drawing;
+    post (Command::AddFixedFrame, name, frame);
+}
+
+void
+RenderThread::paintAnimatedFrame (const QString& name, int width, int height,
+                                  QImage::Format format,
+                                  const FrameDrawing& drawing)
+{
+    Command::Frame frame;
+    frame.width = width;
+    frame.height = height;
+    frame.format = format;
+    frame.drawing = drawing;
+    post (Command::AddAnimatedFrame, name, frame);
+}
+
+void
+RenderThread::addProceduralFrames (const QString& name,
+                                   const ProceduralStimulus& stimulus)
+{
+    post (Command::AddProceduralFrames, name, stimulus);
+}
+
+void
+RenderThread::addDotFrames (const QString& name, const DotFrames& dots)
+{
+    post (Command::AddDotFrames, name, dots);
+}
+
+void
+RenderThread::addElementFrames (const QString& name,
+                                const ElementFrames& elements)
+{
+    post (Command::AddElementFrames, name, elements);
+}
+
+void
+RenderThread::addStreamedFrames (const QString& name,
+                                 const std::shared_ptr<FrameStream>& stream)
+{
+    post (Command::AddStreamedFrames, name, stream);
+}
+
+void
+RenderThread::setFrameSchedule (const QString& name,
+                                const FrameSchedule& schedule)
+{
+    post (Command::SetFrameSchedule, name, schedule);
+}
+
+void
+RenderThread::setFrameLayers (const QString& name,
+                              const QVector<FrameLayer>& layers)
+{
+    post (Command::SetFrameLayers, name, layers);
+}
+
+void
+RenderThread::deleteAnimatedFrames (const QString& name)
+{
+    post (Command::DeleteAnimatedFrames, name);
+}
+
+void
+RenderThread::deleteFrames (const QString& name)
+{
+    post (Command::DeleteFrames, name);
+}
+
+void
+RenderThread::reserveAnimatedFrames (const QString& name, int count)
+{
+    post (Command::ReserveAnimatedFrames, name, count);
+}
+
+void
+RenderThread::setFramesEvictable (const QString& name, bool evictable)
+{
+    post (Command::SetFramesEvictable, name, evictable);
+}
+
+void
+RenderThread::setMemoryBudget (qint64 bytes)
+{
+    post (Command::SetMemoryBudget, QString (), bytes);
+}
+
+void
+RenderThread::prepareFrames (const QString& name)
+{
+    post (Command::PrepareFrames, name);
+}
+
+void
+RenderThread::prewarm ()
+{
+    post (Command::Prewarm);
+}
+
+void
+RenderThread::clear ()
+{
+    post (Command::Clear);
+}
+
+void
+RenderThread::setTextureSize (int twidth, int theight)
+{
+    post (Command::SetTextureSize, QString (), QSize (twidth, theight));
+}
+
+void
+RenderThread::resize (int width, int height)
+{
+    post (Command::Resize, QString (), QSize (width, height));
+}
+
+void
+RenderThread::showFixedFrame (const QString& name)
+{
+    post (Command::ShowFixedFrame, name);
+}
+
+void
+RenderThread::showAnimatedFrames (const QString& name)
+{
+    post (Command::ShowAnimatedFrames, name);
+}
+
+void
+RenderThread::renderNow ()
+{
+    post (Command::Render);
+}
+
+void
+RenderThread::stop ()
+{
+    post (Command::Stop);
+}
+
+void
+RenderThread::run ()
+{
+    for (;;) {
+        // Wait for the next command
+        Command cmd;
+        {
+            QMutexLocker locker (&m_mutex);
+            while (m_commands.isEmpty ())
+                m_cond.wait (&m_mutex);
+            cmd = m_commands.dequeue ();
+        }
+
+        if (cmd.type == Command::Stop) {
+            destroyOpenGL ();
+            return;
+        }
+        else if (cmd.type == Command::SetupOpenGL) {
+            auto args = cmd.arguments<Command::Context> ();
+            bool ok = execSetupOpenGL (args);
+            // The upload thread waits for its context in any case
+            if (m_uploader != nullptr)
+                m_uploader->setContext (ok ? createSharedContext (args) : nullptr);
+            continue;
+        }
+
+        // Window size and texture size may arrive before the context
+        if (cmd.type == Command::SetTextureSize) {
+            auto size = cmd.arguments<QSize> ();
+            if (size.width () == tex_width && size.height () == tex_height)
+                continue;
+            qDebug () << "!!! setting tex dims to" << size.width () << size.height ();
+            tex_width = size.width ();
+            tex_height = size.height ();
+            updateShaders ();
+            continue;
+        }
+        else if (cmd.type == Command::Resize) {
+            auto size = cmd.arguments<QSize> ();
+            win_width = size.width ();
+            win_height = size.height ();
+            updateShaders ();
+            continue;
+        }
+        else if (cmd.type == Command::SetFramesEvictable) {
+            m_memory[cmd.name].evictable = cmd.arguments<bool> ();
+            enforceBudget ();
+            continue;
+        }
+        else if (cmd.type == Command::SetMemoryBudget) {
+            m_memoryBudget = cmd.arguments<qint64> ();
+            enforceBudget ();
+            continue;
+        }
+
+        // Presentations are always notified, even without context
+        if (! m_opengl_initialized
+            && cmd.type != Command::ShowFixedFrame
+            && cmd.type != Command::ShowAnimatedFrames) {
+            qDebug () << "skipping render command on uninitialized context";
+            continue;
+        }
+
+        switch (cmd.type) {
+        case Command::AddFixedFrame:
+            execAddFixedFrame (cmd.name, cmd.arguments<Command::Frame> ());
+            break;
+        case Command::AddAnimatedFrame:
+            execAddAnimatedFrame (cmd.name, cmd.arguments<Command::Frame> ());
+            break;
+        case Command::RepeatAnimatedFrame:
+            execRepeatAnimatedFrame (cmd.name,
+                                     cmd.arguments<Command::Repeat> ().frame);
+            break;
+        case Command::ShareAnimatedFrame: {
+            auto repeat = cmd.arguments<Command::Repeat> ();
+            execShareAnimatedFrame (cmd.name, repeat.source, repeat.frame);
+            break;
+        }
+        case Command::DeleteAnimatedFrames:
+            execDeleteAnimatedFrames (cmd.name);
+            break;
+        case Command::DeleteFrames:
+            execDeleteFrames (cmd.name);
+            break;
+        case Command::AddProceduralFrames:
+            // Computed while shown, without any texture
+            m_proceduralFrames[cmd.name] = cmd.arguments<ProceduralStimulus> ();
+            break;
+        case Command::AddDotFrames: {
+            auto dots = cmd.arguments<DotFrames> ();
+            if (m_dotProgram == nullptr) {
+                execAddPaintedFrames (cmd.name, dots.frames,
+                                      dots.width, dots.height,
+                                      [&dots] (int frame) {
+                                          return Displayer::dotDrawing (dots, frame);
+                                      });
+                break;
+            }
+            // Positions are uploaded now, dots drawn while shown
+            m_dotFrames[cmd.name] = dots;
+            glDeleteBuffers (1, &m_dotBuffers[cmd.name]);
+            m_dotBuffers.remove (cmd.name);
+            dotBuffer (cmd.name);
+            break;
+        }
+        case Command::AddElementFrames:
+            execAddElementFrames (cmd.name, cmd.arguments<ElementFrames> ());
+            break;
+        case Command::AddStreamedFrames: {
+            // Painting already started in the producer thread
+            auto stream = cmd.arguments<std::shared_ptr<FrameStream>> ();
+            m_streams[cmd.name] = stream;
+            emit frameMemoryChanged (cmd.name, stream->bytes (), true);
+            break;
+        }
+        case Command::SetFrameSchedule:
+            // Applied to the fixed frame of the same name
+            m_frameSchedules[cmd.name] = cmd.arguments<FrameSchedule> ();
+            break;
+        case Command::SetFrameLayers: {
+            // Drawn from the fixed frames of the layers when shown
+            auto layers = cmd.arguments<QVector<FrameLayer>> ();
+            if (layers.isEmpty ())
+                m_frameLayers.remove (cmd.name);
+            else
+                m_frameLayers[cmd.name] = layers;
+            break;
+        }
+        case Command::Clear:
+            execClear ();
+            break;
+        case Command::ShowFixedFrame:
+            m_shownPage = cmd.name;
+            execShowFixedFrame (cmd.name);
+            break;
+        case Command::ShowAnimatedFrames:
+            m_shownPage = cmd.name;
+            execShowAnimatedFrames (cmd.name);
+            break;
+        case Command::PrepareFrames:
+            if (restoreFrames (cmd.name))
+                enforceBudget (cmd.name);
+            break;
+        case Command::Prewarm:
+            execPrewarm ();
+            break;
+        case Command::Render:
+            render ();
+            m_context->swapBuffers (m_window);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+bool
+RenderThread::execSetupOpenGL (const Command::Context& args)
+{
+    qDebug () << "RenderThread::setupOpenGL ()";
+
+    if (m_context != nullptr) {
+        qDebug () << "Deleting previous OpenGL context";
+        destroyOpenGL ();
+    }
+
+    qDebug () << "Creating a new OpenGL context";
+    m_context = new QOpenGLContext;
+    m_context->setScreen (args.screen);
+    m_context->setFormat (args.format);
+
+    if (! m_context->create ()) {
+      qCritical() << "error: could not create the OpenGL context";
+      return false;
+    }
+    if (! m_context->isValid ()) {
+      qCritical() << "error: created OpenGL context is invalid";
+      return false;
+    }
+
+    auto fmt = m_context->format();
+    qDebug() << "created context for OpenGL " << fmt.majorVersion() << "." << fmt.minorVersion() << "-" << fmt.profile();
+
+    // The context stays current in the render thread
+    if (! m_context->makeCurrent (m_window)) {
+        qCritical() << "error: could not use the OpenGL context";
+	return false;
+    }
+    if (! initializeOpenGLFunctions ()) {
+        qCritical() << "error: could not initialise the OpenGL functions";
+	return false;
+    }
+
+    // Timing facilities
+    m_refreshInterval = args.refreshRate > 0
+        ? static_cast<qint64> (1e9 / args.refreshRate) : 0;
+    if (fmt.version () >= qMakePair (3, 2)
+        || m_context->hasExtension ("GL_ARB_sync"))
+        m_syncFunctions = m_context->extraFunctions ();
+    else
+        qWarning () << "warning: no fence sync, falling back to glFinish";
+    QOpenGLTimerQuery probe;
+    m_timestampsSupported = probe.create ();
+    if (! m_timestampsSupported)
+        qWarning () << "warning: no GPU timestamp queries";
+    probe.destroy ();
+
+    // Frames are padded to powers of two only when required
+    m_npotTextures = QOpenGLTexture::hasFeature (QOpenGLTexture::NPOTTextures);
+    if (! m_npotTextures)
+        qWarning () << "warning: no non power of two textures, padding frames";
+
+    // Enables V-Sync
+#ifdef WIN32
+    auto wglSwapIntervalEXT = (PFNWGLSWAPINTERVALEXTPROC) wglGetProcAddress ("wglSwapIntervalEXT");
+    if (wglSwapIntervalEXT == NULL)
+        qCritical () << "error: could not get swap interval extension";
+    else
+        wglSwapIntervalEXT (1);
+#endif
+
+    // Create the shader programs, for fixed and animated frames, once
+    // per context: the frame placement is given as uniforms
+    m_program = new QOpenGLShaderProgram;
+    m_arrayProgram = new QOpenGLShaderProgram;
+    m_proceduralProgram = new QOpenGLShaderProgram;
+    for (auto program : {m_program, m_arrayProgram, m_proceduralProgram}) {
+        if (! addShader (program, QOpenGLShader::Vertex, vshader_txt)) {
+            qCritical () << "error: could not create the vertex shader";
+            return false;
+        }
+    }
+    if (! addShader (m_program, QOpenGLShader::Fragment, fshader_txt)) {
+        qCritical () << "error: could not create the fragment shader";
+        return false;
+    }
+    if (! addShader (m_arrayProgram, QOpenGLShader::Fragment,
+                     farray_shader_txt)) {
+        qCritical () << "error: could not create the texture array fragment shader";
+        return false;
+    }
+    if (! addShader (m_proceduralProgram, QOpenGLShader::Fragment,
+                     fprocedural_shader_txt)) {
+        qCritical () << "error: could not create the procedural fragment shader";
+        return false;
+    }
+    for (auto program : {m_program, m_arrayProgram, m_proceduralProgram}) {
+        program->bindAttributeLocation ("ppos", PposLocation);
+        if (! program->link ()) {
+            qCritical () << "error: could not link the shader program:"
+                         << program->log ();
+            return false;
+        }
+    }
+
+    // Dots have their own vertex shader
+    m_dotProgram = optionalProgram ("dot", vdot_shader_txt, fdot_shader_txt,
+                                    {{"ppos", PposLocation}});
+
+    // Elements too, with per instance attributes
+    m_elementProgram = optionalProgram ("element", velement_shader_txt,
+                                        felement_shader_txt,
+                                        {{"ppos", PposLocation},
+                                         {"element", ElementLocation},
+                                         {"look", LookLocation}});
+
+    // Instanced drawing of the elements, else one draw per element
+    if (fmt.version () >= qMakePair (3, 3))
+        m_instanceFunctions = m_context->extraFunctions ();
+    else
+        qWarning () << "warning: no instanced arrays, drawing elements one by one";
+
+    m_texloc = m_program->uniformLocation ("texture");
+    m_arrayTexloc = m_arrayProgram->uniformLocation ("frames");
+    m_layerloc = m_arrayProgram->uniformLocation ("layer");
+    m_lumloc = m_program->uniformLocation ("luminance");
+    m_frameTransformloc = m_program->uniformLocation ("frameTransform");
+    m_contrastloc = m_program->uniformLocation ("contrast");
+    m_arrayLumloc = m_arrayProgram->uniformLocation ("luminance");
+
+    // Create a vertex array object (VAO)
+    glGenVertexArrays (1, &m_vao);
+    glBindVertexArray (m_vao);
+    // Create the vertex buffer object (VBO) associated
+    glGenBuffers (1,&m_vbo);
+    glBindBuffer (GL_ARRAY_BUFFER,m_vbo);
+    qDebug () << "glBVA" << glGetError ();
+
+    // Corners of the element quad, shared by all the instances
+    static const GLfloat corners[12] = {
+        -0.5f, -0.5f, 0.5f, -0.5f, -0.5f, 0.5f,
+        -0.5f, 0.5f, 0.5f, -0.5f, 0.5f, 0.5f
+    };
+    glGenBuffers (1, &m_elementQuad);
+    glBindBuffer (GL_ARRAY_BUFFER, m_elementQuad);
+    glBufferData (GL_ARRAY_BUFFER, sizeof (corners), corners, GL_STATIC_DRAW);
+    glGenBuffers (1, &m_layerQuad);
+    glBindBuffer (GL_ARRAY_BUFFER, m_vbo);
+
+    // Black as default background colour
+    glClearColor (0, 0, 0, 0);
+
+    m_opengl_initialized = true;
+
+    // Window and texture sizes may already be known
+    updateShaders ();
+
+    return true;
+}
+
+QOpenGLContext*
+RenderThread::createSharedContext (const Command::Context& args)
+{
+    auto shared = new QOpenGLContext;
+    shared->setScreen (args.screen);
+    shared->setFormat (args.format);
+    shared->setShareContext (m_context);
+    bool ok = shared->create ();
+
+    // Context creation may have changed the current context
+    m_context->makeCurrent (m_window);
+
+    if (! ok) {
+        qCritical () << "error: could not create the upload context";
+        delete shared;
+        return nullptr;
+    }
+    shared->moveToThread (m_uploader);
+    return shared;
+}
+
+void
+RenderThread::destroyOpenGL ()
+{
+    if (m_context == nullptr)
+        return;
+
+    if (m_opengl_initialized) {
+        execClear ();
+        glDeleteBuffers (1, &m_vbo);
+        glDeleteBuffers (1, &m_elementQuad);
+        glDeleteBuffers (1, &m_layerQuad);
+        glDeleteVertexArrays (1, &m_vao);
+    }
+    else {
+        // Textures belong to a context we cannot use anymore
+        m_currentFrame = nullptr;
+        m_currentLayer = -1;
+        m_fixedFrames.clear ();
+        m_dotBuffers.clear ();
+        m_elementBuffers.clear ();
+        m_elementGlyphs.clear ();
+        m_animatedFrames.clear ();
+        m_streams.clear ();
+        m_streamTextures.clear ();
+        m_uploadFences.clear ();
+        m_memory.clear ();
+        m_textureShares.clear ();
+        m_keptTextures.clear ();
+    }
+
+    delete m_program;
+    m_program = nullptr;
+    delete m_arrayProgram;
+    m_arrayProgram = nullptr;
+    delete m_proceduralProgram;
+    m_proceduralProgram = nullptr;
+    delete m_dotProgram;
+    m_dotProgram = nullptr;
+    delete m_elementProgram;
+    m_elementProgram = nullptr;
+    m_instanceFunctions = nullptr;
+    qDeleteAll (m_timestampQueries);
+    m_timestampQueries.clear ();
+    m_syncFunctions = nullptr;
+
+    m_context->doneCurrent ();
+    delete m_context;
+    m_context = nullptr;
+    m_opengl_initialized = false;
+}
+
+QOpenGLTexture*
+RenderThread::frameTexture (const Command::Frame& frame)
+{
+    // Already uploaded by the upload thread
+    if (frame.texture != nullptr) {
+        if (frame.fence != nullptr)
+            m_uploadFences.insert (frame.texture, frame.fence);
+        return frame.texture;
+    }
+
+    // Synchronous upload, rows are flipped by the vertex shader
+    QImage img = frame.image;
+    if (img.isNull () && frame.drawing) {
+        img = QImage (frame.width, frame.height, frame.format);
+        Displayer::rasterise (img, frame.drawing);
+    }
+    if (! m_npotTextures) {
+        QImage padded (nextPowerOfTwo (img.width ()),
+                       nextPowerOfTwo (img.height ()), img.format ());
+        padded.fill (0);
+        QPainter painter (&padded);
+        painter.setCompositionMode (QPainter::CompositionMode_Source);
+        painter.drawImage (0, 0, img);
+        painter.end ();
+        img = padded;
+    }
+    auto tex = new QOpenGLTexture (img);
+    tex->setMinificationFilter (QOpenGLTexture::Linear);
+    tex->setMagnificationFilter (QOpenGLTexture::Linear);
+    return tex;
+}
+
+void
+RenderThread::releaseTexture (QOpenGLTexture* tex, bool recycle)
+{
+    if (tex == m_currentFrame)
+        m_currentFrame = nullptr;
+    auto fence = m_uploadFences.take (tex);
+    if (fence != nullptr && m_syncFunctions != nullptr)
+        m_syncFunctions->glDeleteSync (fence);
+
+    // Not presented anymore, the storage can be refilled
+    if (recycle && m_uploader != nullptr && m_uploader->pool ()->release (tex))
+        return;
+    delete tex;
+}
+
+void
+RenderThread::dropTexture (QOpenGLTexture* tex)
+{
+    if (m_textureShares.contains (tex))
+        m_keptTextures.insert (tex);
+    else
+        releaseTexture (tex);
+}
+
+void
+RenderThread::unshareTexture (QOpenGLTexture* tex)
+{
+    auto it = m_textureShares.find (tex);
+    if (it == m_textureShares.end () || --it.value () > 0)
+        return;
+    m_textureShares.erase (it);
+    if (m_keptTextures.remove (tex))
+        releaseTexture (tex);
+}
+
+void
+RenderThread::execAddFixedFrame (const QString& name,
+                                 const Command::Frame& frame)
+{
+    qDebug () << "RenderThread::addFixedFrame ()" << name;
+
+    // Recycle existing texture
+    if (m_fixedFrames.contains (name)) {
+        qDebug () << "releasing existing homonymous texture";
+        releaseTexture (m_fixedFrames[name]);
+    }
+
+    m_fixedFrames[name] = frameTexture (frame);
+    // Kept until shown
+    m_memory[name].spilled.clear ();
+    m_memory[name].lastShown = 0;
+    reportMemory (name);
+    enforceBudget ();
+}
+
+void
+RenderThread::execAddAnimatedFrame (const QString& name,
+                                    const Command::Frame& frame)
+{
+    auto& frames = m_animatedFrames[name];
+
+    // Uploaded in a layer of the series texture array
+    if (frame.texture != nullptr
+        && frame.texture->target () == QOpenGLTexture::Target2DArray) {
+        // The upload thread moved the frames to a larger array
+        if (frames.array != frame.texture) {
+            if (frames.array != nullptr)
+                dropTexture (frames.array);
+            frames.array = frame.texture;
+            reportMemory (name);
+            enforceBudget ();
+        }
+        // A fence covers all the uploads preceding it
+        if (frame.fence != nullptr) {
+            auto previous = m_uploadFences.take (frame.texture);
+            if (previous != nullptr && m_syncFunctions != nullptr)
+                m_syncFunctions->glDeleteSync (previous);
+            m_uploadFences.insert (frame.texture, frame.fence);
+        }
+        frames.count = frame.layer + 1;
+    }
+    else {
+        frames.textures.append (frameTexture (frame));
+        reportMemory (name);
+        enforceBudget ();
+    }
+    if (! frames.sequence.isEmpty ())
+        frames.sequence.append (frames.stored () - 1);
+}
+
+void
+RenderThread::execAddPaintedFrames (const QString& name, int frames,
+                                    int width, int height,
+                                    const std::function<FrameDrawing (int)>& drawing)
+{
+    // Rasterised now, like frames added as drawings
+    Command::Frame frame;
+    frame.width = width;
+    frame.height = height;
+    for (int i = 0; i < qMax (1, frames); i++) {
+        frame.drawing = drawing (i);
+        if (frames <= 0)
+            execAddFixedFrame (name, frame);
+        else
+            execAddAnimatedFrame (name, frame);
+    }
+}
+
+void
+RenderThread::execRepeatAnimatedFrame (const QString& name, int frame)
+{
+    auto& frames = m_animatedFrames[name];
+    // Stored frames were each presented once so far
+    if (frames.sequence.isEmpty ())
+        for (int i = 0; i < frames.stored (); i++)
+            frames.sequence.append (i);
+    if (frame < 0 || frame >= frames.sequence.size ()) {
+        qCritical () << "??? no frame" << frame << "to repeat in" << name;
+        return;
+    }
+    frames.sequence.append (frames.sequence.at (frame));
+}
+
+void
+RenderThread::execShareAnimatedFrame (const QString& name,
+                                      const QString& source, int frame)
+{
+    // Evicted frames come back, and stay while shared
+    if (restoreFrames (source))
+        enforceBudget (source);
+
+    SharedFrame shared;
+    const auto& stored = m_animatedFrames.value (source);
+    int count = stored.sequence.isEmpty ()
+        ? stored.stored () : stored.sequence.size ();
+    if (frame >= 0 && frame < count) {
+        int index = stored.sequence.isEmpty () ? frame : stored.sequence.at (frame);
+        if (index < 0)
+            shared = stored.shared.at (-1 - index);
+        else if (stored.array != nullptr)
+            shared = SharedFrame { stored.array, index };
+        else if (index < stored.textures.size ())
+            shared = SharedFrame { stored.textures.at (index), -1 };
+    }
+    if (shared.texture == nullptr) {
+        qCritical () << "??? no frame" << frame << "to share in" << source;
+        return;
+    }
+
+    auto& frames = m_animatedFrames[name];
+    // Stored frames were each presented once so far
+    if (frames.sequence.isEmpty ())
+        for (int i = 0; i < frames.stored (); i++)
+            frames.sequence.append (i);
+    frames.sequence.append (-1 - frames.shared.size ());
+    frames.shared.append (shared);
+    m_textureShares[shared.texture]++;
+}
+
+void
+RenderThread::execDeleteAnimatedFrames (const QString& name)
+{
+    m_proceduralFrames.remove (name);
+    m_frameSchedules.remove (name);
+    if (m_dotFrames.remove (name) > 0) {
+        glDeleteBuffers (1, &m_dotBuffers[name]);
+        m_dotBuffers.remove (name);
+    }
+    if (m_elementFrames.remove (name) > 0)
+        deleteElementResources (name);
+    if (m_streams.remove (name) > 0)
+        emit frameMemoryChanged (name, 0, true);
+    if (m_animatedFrames.contains (name)) {
+	auto frames = m_animatedFrames.take (name);
+	for (auto tex : frames.textures)
+            dropTexture (tex);
+        if (frames.array != nullptr)
+            dropTexture (frames.array);
+        for (const auto& shared : frames.shared)
+            unshareTexture (shared.texture);
+        m_memory[name].spilled.clear ();
+        emit frameMemoryChanged (name, 0, true);
+    }
+    // The next frames are kept until shown
+    if (m_memory.contains (name))
+        m_memory[name].lastShown = 0;
+}
+
+void
+RenderThread::execDeleteFrames (const QString& name)
+{
+    execDeleteAnimatedFrames (name);
+    m_frameLayers.remove (name);
+    if (m_fixedFrames.contains (name)) {
+        releaseTexture (m_fixedFrames.take (name));
+        emit frameMemoryChanged (name, 0, true);
+    }
+    m_memory.remove (name);
+}
+
+void
+RenderThread::execClear ()
+{
+    qDebug () << "RenderThread::clear ()";
+
+    // Destroy fixed frame textures
+    for (auto it = m_fixedFrames.begin (); it != m_fixedFrames.end (); ++it) {
+        releaseTexture (it.value (), false);
+        emit frameMemoryChanged (it.key (), 0, true);
+    }
+    m_fixedFrames.clear ();
+
+    // Destroy animated frame textures, shared or not
+    m_textureShares.clear ();
+    for (auto tex : m_keptTextures)
+        releaseTexture (tex, false);
+    m_keptTextures.clear ();
+    for (auto it = m_animatedFrames.begin (); it != m_animatedFrames.end (); ++it) {
+	for (auto tex : it->textures)
+            releaseTexture (tex, false);
+        if (it->array != nullptr)
+            releaseTexture (it->array, false);
+        emit frameMemoryChanged (it.key (), 0, true);
+    }
+    m_animatedFrames.clear ();
+    m_proceduralFrames.clear ();
+    m_frameSchedules.clear ();
+    m_frameLayers.clear ();
+    m_dotFrames.clear ();
+    deleteDotBuffers ();
+    for (const auto& name : m_elementFrames.keys ())
+        deleteElementResources (name);
+    m_elementFrames.clear ();
+    for (const auto& name : m_streams.keys ())
+        emit frameMemoryChanged (name, 0, true);
+    m_streams.clear ();
+    releaseStreamTextures ();
+    m_memory.clear ();
+}
+
+void
+RenderThread::updateShaders ()
+{
+    if (! m_opengl_initialized
+        || tex_width == 0 || win_width == 0 || win_height == 0) {
+        qDebug () << "Not updating shaders!!! size is: " << win_width << win_height;
+	return;
+    }
+
+    qDebug () << "*** updating the shaders";
+
+    GLint gl_width = win_width;
+    GLint gl_height = win_height;
+
+    glViewport (0, 0, gl_width, gl_height);
+
+    // Compute the offset to center the stimulus
+    GLfloat txw = static_cast<GLfloat> (tex_width) / gl_width;
+    GLfloat txh = static_cast<GLfloat> (tex_height) / gl_height;
+
+    GLfloat ofx = tex_width > gl_width ? 0.0f : 1.0f - txw;
+    GLfloat ofy = tex_height > gl_height ? 0.0f : 1.0f - txh;
+
+    GLfloat txm = ofx;
+    GLfloat txM = ofx + 2.0f * txw;
+    GLfloat tym = ofy;
+    GLfloat tyM = ofy + 2.0f * txh;
+
+    // Part of padded textures covered by the frame
+    GLfloat tsx = 1.0f;
+    GLfloat tsy = 1.0f;
+    if (! m_npotTextures) {
+        tsx = static_cast<GLfloat> (tex_width) / nextPowerOfTwo (tex_width);
+        tsy = static_cast<GLfloat> (tex_height) / nextPowerOfTwo (tex_height);
+    }
+
+    // Place the frame, without recompiling anything
+    m_frameOrigin = QVector2D (ofx, ofy);
+    m_frameExtent = QVector2D (2.0f * txw, 2.0f * txh);
+    m_frameCoverage = QVector2D (tsx, tsy);
+    for (auto program : {m_proceduralProgram, m_arrayProgram, m_program}) {
+        program->bind ();
+        program->setUniformValue ("origin", ofx, ofy);
+        program->setUniformValue ("extent", 2.0f * txw, 2.0f * txh);
+        program->setUniformValue ("coverage", tsx, tsy);
+    }
+    if (m_dotProgram != nullptr) {
+        m_dotProgram->bind ();
+        m_dotProgram->setUniformValue ("origin", ofx, ofy);
+        m_dotProgram->setUniformValue ("extent", 2.0f * txw, 2.0f * txh);
+    }
+    m_program->bind ();
+    m_program->setUniformValue ("frameSize", static_cast<GLfloat> (tex_width),
+                                static_cast<GLfloat> (tex_height));
+    if (m_elementProgram != nullptr) {
+        m_elementProgram->bind ();
+        m_elementProgram->setUniformValue ("origin", ofx, ofy);
+        m_elementProgram->setUniformValue ("extent", 2.0f * txw, 2.0f * txh);
+    }
+
+    glActiveTexture (GL_TEXTURE0);
+    int ppos = PposLocation;
+
+    // Triangle covering half the texture
+    vertices[0] = txm;
+    vertices[1] = tym;
+    vertices[2] = txM;
+    vertices[3] = tym;
+    vertices[4] = txm;
+    vertices[5] = tyM;
+
+    // Other half triangle
+    vertices[6] = txm;
+    vertices[7] = tyM;
+    vertices[8] = txM;
+    vertices[9] = tym;
+    vertices[10] = txM;
+    vertices[11] = tyM;
+
+    glBufferData (GL_ARRAY_BUFFER, 12*sizeof(GLfloat), vertices, GL_STATIC_DRAW);
+    glVertexAttribPointer (ppos, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray (ppos);
+    qDebug () << "glEnVeAP err:" << glGetError ();
+}
+
+void
+RenderThread::execShowFixedFrame (const QString& name)
+{
+    if (m_proceduralFrames.contains (name)) {
+        execShowProceduralFrames (name);
+        return;
+    }
+    if (m_dotFrames.contains (name)) {
+        execShowDotFrames (name);
+        return;
+    }
+    if (m_elementFrames.contains (name)) {
+        execShowElementFrames (name);
+        return;
+    }
+
+    m_swapTimes.clear ();
+    // Pages may only be made of layers
+    if (! m_fixedFrames.contains (name) && ! m_frameLayers.contains (name)) {
+	qCritical () << "??? unknown fixed frame" << name;
+    }
+    else if (m_opengl_initialized) {
+        qDebug () << "showing fixed frame" << name;
+        if (restoreFrames (name)) {
+            qWarning () << "warning: restoring evicted frames" << name << "at show time";
+            enforceBudget (name);
+        }
+        m_memory[name].lastShown = ++m_showCount;
+        m_currentFrame = m_fixedFrames.value (name);
+        m_currentLayer = -1;
+        m_currentStimulusFrame = -1;
+        m_currentDotsFrame = -1;
+        m_currentElementsFrame = -1;
+        m_currentScheduleFrame = -1;
+        render ();
+        swapAndWait (0);
+    }
+    // Always notify so that the engine never waits forever
+    emit framesShown (name, collectTimings (m_swapTimes.size ()));
+}
+
+void
+RenderThread::execShowAnimatedFrames (const QString& name)
+{
+    if (m_frameSchedules.contains (name)) {
+        execShowScheduledFrames (name);
+        return;
+    }
+    if (m_proceduralFrames.contains (name)) {
+        execShowProceduralFrames (name);
+        return;
+    }
+    if (m_dotFrames.contains (name)) {
+        execShowDotFrames (name);
+        return;
+    }
+    if (m_elementFrames.contains (name)) {
+        execShowElementFrames (name);
+        return;
+    }
+    if (m_streams.contains (name)) {
+        execShowStreamedFrames (name);
+        return;
+    }
+
+    qDebug () << "showing animated frames" << name;
+    m_swapTimes.clear ();
+    if (! m_animatedFrames.contains (name)) {
+	qCritical () << "??? unknown animated frame" << name;
+    }
+    else if (m_opengl_initialized) {
+        if (restoreFrames (name)) {
+            qWarning () << "warning: restoring evicted frames" << name << "at show time";
+            enforceBudget (name);
+        }
+        m_memory[name].lastShown = ++m_showCount;
+        m_currentStimulusFrame = -1;
+        m_currentDotsFrame = -1;
+        m_currentElementsFrame = -1;
+        m_currentScheduleFrame = -1;
+	const auto& frames = m_animatedFrames[name];
+        // Repeated frames are stored once
+        int count = frames.sequence.isEmpty ()
+            ? frames.stored () : frames.sequence.size ();
+	for (int i = 0; i < count; i++) {
+            int index = frames.sequence.isEmpty () ? i : frames.sequence.at (i);
+            if (index < 0) {
+                const auto& shared = frames.shared.at (-1 - index);
+                m_currentFrame = shared.texture;
+                m_currentLayer = shared.layer;
+            }
+            else if (frames.array != nullptr) {
+                m_currentFrame = frames.array;
+                m_currentLayer = index;
+            }
+            else {
+                m_currentFrame = frames.textures.at (index);
+                m_currentLayer = -1;
+            }
+	    render ();
+	    swapAndWait (i);
+	}
+    }
+
+    auto timings = collectTimings (m_swapTimes.size ());
+    qDebug () << "animated frames" << name << ":" << timings.frames
+              << "frames," << timings.dropped << "dropped, max interval"
+              << (timings.maxInterval / 1000) << "µs";
+    emit framesShown (name, timings);
+}
+
+void
+RenderThread::execShowStreamedFrames (const QString& name)
+{
+    qDebug () << "showing streamed frames" << name;
+    m_swapTimes.clear ();
+    auto stream = m_streams[name];
+    // Painted again for each presentation
+    if (stream->position () > 0)
+        stream->rewind ();
+
+    int underruns = 0;
+    if (m_opengl_initialized) {
+        // Frames are staged by the upload thread in a ring of
+        // textures, up to the lookahead past the one shown, else
+        // uploaded here to one texture while the other is shown
+        int slots = m_uploader != nullptr ? stream->lookahead () + 1 : 2;
+        QOpenGLTexture::TextureFormat format = QOpenGLTexture::RGBA8_UNorm;
+        if (stream->format () == QImage::Format_Grayscale8)
+            format = QOpenGLTexture::R8_UNorm;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+        else if (stream->format () == QImage::Format_Grayscale16)
+            format = QOpenGLTexture::R16_UNorm;
+#endif
+        int width = stream->size ().width ();
+        int height = stream->size ().height ();
+        if (! m_npotTextures) {
+            width = nextPowerOfTwo (width);
+            height = nextPowerOfTwo (height);
+        }
+        if (! m_streamTextures.isEmpty ()
+            && (m_streamTextures.first ()->format () != format
+                || m_streamTextures.first ()->width () != width
+                || m_streamTextures.first ()->height () != height))
+            releaseStreamTextures ();
+        auto tf = texelFormat (format);
+        while (m_streamTextures.size () < slots) {
+            auto tex = new QOpenGLTexture (QOpenGLTexture::Target2D);
+            tex->setSize (width, height);
+            tex->setFormat (format);
+            tex->setMinificationFilter (QOpenGLTexture::Linear);
+            tex->setMagnificationFilter (QOpenGLTexture::Linear);
+            tex->allocateStorage (tf.pixels, tf.type);
+            m_streamTextures.append (tex);
+        }
+
+        m_memory[name].lastShown = ++m_showCount;
+        m_currentStimulusFrame = -1;
+        m_currentDotsFrame = -1;
+        m_currentElementsFrame = -1;
+        m_currentScheduleFrame = -1;
+        m_currentLayer = -1;
+        bool staged = m_uploader != nullptr
+            && m_uploader->startStream (stream, m_streamTextures.mid (0, slots));
+        for (int i = 0; ; i++) {
+            if (staged) {
+                // Only bound here, waited for by the GPU
+                auto frame = m_uploader->takeStreamFrame ();
+                if (frame.texture == nullptr)
+                    break;
+                if (frame.late)
+                    underruns++;
+                if (frame.fence != nullptr)
+                    m_uploadFences.insert (frame.texture, frame.fence);
+                m_currentFrame = frame.texture;
+            }
+            else {
+                // Acquired once the previous frame is on screen
+                const QImage& img = stream->acquire ();
+                if (img.isNull ())
+                    break;
+                m_currentFrame = m_streamTextures.at (i % 2);
+                uploadStreamedFrame (m_currentFrame, img);
+                stream->release ();
+            }
+            render ();
+            swapAndWait (i);
+            // Read by the GPU once the swap is processed
+            if (staged)
+                m_uploader->releaseStreamFrame ();
+        }
+        if (staged) {
+            for (const auto& frame : m_uploader->stopStream ())
+                if (frame.fence != nullptr && m_syncFunctions != nullptr)
+                    m_syncFunctions->glDeleteSync (frame.fence);
+        }
+        else {
+            underruns = stream->underruns ();
+        }
+    }
+
+    auto timings = collectTimings (m_swapTimes.size ());
+    timings.underruns = underruns;
+    qDebug () << "streamed frames" << name << ":" << timings.frames
+              << "frames," << timings.dropped << "dropped,"
+              << timings.underruns << "underruns";
+    emit framesShown (name, timings);
+}
+
+void
+RenderThread::uploadStreamedFrame (QOpenGLTexture* tex, const QImage& img)
+{
+    auto tf = texelFormat (tex->format ());
+    QImage converted;
+    const QImage* src = &img;
+    if (tf.bytesPerTexel == 4 && img.format () != QImage::Format_RGB32
+        && img.format () != QImage::Format_ARGB32) {
+        converted = img.convertToFormat (QImage::Format_RGB32);
+        src = &converted;
+    }
+
+    // Rows are flipped by the vertex shader
+    tex->bind ();
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, src->bytesPerLine () / tf.bytesPerTexel);
+    glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, src->width (), src->height (),
+                     tf.pixels, tf.type, src->constBits ());
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+}
+
+void
+RenderThread::releaseStreamTextures ()
+{
+    for (auto tex : m_streamTextures)
+        releaseTexture (tex, false);
+    m_streamTextures.clear ();
+}
+
+void
+RenderThread::execShowScheduledFrames (const QString& name)
+{
+    qDebug () << "showing scheduled frames" << name;
+    m_swapTimes.clear ();
+    if (! m_fixedFrames.contains (name)) {
+        qCritical () << "??? no frame for the schedule" << name;
+    }
+    else if (m_opengl_initialized) {
+        if (restoreFrames (name)) {
+            qWarning () << "warning: restoring evicted frames" << name << "at show time";
+            enforceBudget (name);
+        }
+        m_memory[name].lastShown = ++m_showCount;
+        m_currentStimulusFrame = -1;
+        m_currentDotsFrame = -1;
+        m_currentElementsFrame = -1;
+        m_currentSchedule = name;
+        int count = m_frameSchedules[name].frames;
+        for (int i = 0; i < count; i++) {
+            // Evictions may have replaced the texture
+            m_currentFrame = m_fixedFrames[name];
+            m_currentLayer = -1;
+            m_currentScheduleFrame = i;
+            render ();
+            swapAndWait (i);
+        }
+    }
+    emit framesShown (name, collectTimings (m_swapTimes.size ()));
+}
+
+void
+RenderThread::execShowProceduralFrames (const QString& name)
+{
+    qDebug () << "showing procedural frames" << name;
+    m_swapTimes.clear ();
+    if (m_opengl_initialized) {
+        m_currentStimulus = m_proceduralFrames[name];
+        m_currentFrame = nullptr;
+        m_currentLayer = -1;
+        m_currentDotsFrame = -1;
+        m_currentElementsFrame = -1;
+        int count = qMax (1, m_currentStimulus.frames);
+        for (int i = 0; i < count; i++) {
+            m_currentStimulusFrame = i;
+            render ();
+            swapAndWait (i);
+        }
+    }
+    emit framesShown (name, collectTimings (m_swapTimes.size ()));
+}
+
+void
+RenderThread::execShowDotFrames (const QString& name)
+{
+    qDebug () << "showing dot frames" << name;
+    m_swapTimes.clear ();
+    if (m_opengl_initialized) {
+        m_currentDots = name;
+        m_currentFrame = nullptr;
+        m_currentLayer = -1;
+        m_currentStimulusFrame = -1;
+        m_currentElementsFrame = -1;
+        int count = qMax (1, m_dotFrames[name].frames);
+        for (int i = 0; i < count; i++) {
+            m_currentDotsFrame = i;
+            render ();
+            swapAndWait (i);
+        }
+    }
+    emit framesShown (name, collectTimings (m_swapTimes.size ()));
+}
+
+GLuint
+RenderThread::dotBuffer (const QString& name)
+{
+    auto it = m_dotBuffers.find (name);
+    if (it != m_dotBuffers.end ())
+        return it.value ();
+
+    // All the frames go in a single buffer
+    const auto& positions = m_dotFrames[name].positions;
+    GLuint buffer = 0;
+    glGenBuffers (1, &buffer);
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+    glBufferData (GL_ARRAY_BUFFER, positions.size () * sizeof (GLfloat),
+                  positions.constData (), GL_STATIC_DRAW);
+    glBindBuffer (GL_ARRAY_BUFFER, m_vbo);
+    m_dotBuffers.insert (name, buffer);
+    return buffer;
+}
+
+void
+RenderThread::deleteDotBuffers ()
+{
+    for (auto buffer : m_dotBuffers)
+        glDeleteBuffers (1, &buffer);
+    m_dotBuffers.clear ();
+}
+
+void
+RenderThread::renderDots ()
+{
+    const auto& dots = m_dotFrames[m_currentDots];
+    m_dotProgram->bind ();
+    m_dotProgram->setUniformValue ("size", static_cast<GLfloat> (dots.width),
+                                   static_cast<GLfloat> (dots.height));
+    m_dotProgram->setUniformValue ("pointSize", dots.dotSize);
+    m_dotProgram->setUniformValue ("color", dots.color);
+
+    // Point sprites sized by the vertex shader, always enabled in core
+    // profiles
+    glEnable (GL_PROGRAM_POINT_SIZE);
+    if (m_context->format ().profile () != QSurfaceFormat::CoreProfile)
+        glEnable (GL_POINT_SPRITE);
+    glBindBuffer (GL_ARRAY_BUFFER, dotBuffer (m_currentDots));
+    quintptr offset = 2 * sizeof (GLfloat) * dots.count * m_currentDotsFrame;
+    glVertexAttribPointer (PposLocation, 2, GL_FLOAT, GL_FALSE, 0,
+                           reinterpret_cast<const void*> (offset));
+    glDrawArrays (GL_POINTS, 0, dots.count);
+
+    // Back to the frame quad
+    glBindBuffer (GL_ARRAY_BUFFER, m_vbo);
+    glVertexAttribPointer (PposLocation, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+}
+
+void
+RenderThread::execAddElementFrames (const QString& name,
+                                    const ElementFrames& elements)
+{
+    deleteElementResources (name);
+    if (m_opengl_initialized && m_elementProgram == nullptr) {
+        execAddPaintedFrames (name, elements.frames,
+                              elements.width, elements.height,
+                              [&elements] (int frame) {
+                                  return Displayer::elementDrawing (elements, frame);
+                              });
+        return;
+    }
+
+    // Attributes are uploaded now, elements drawn while shown
+    m_elementFrames[name] = elements;
+    if (! m_opengl_initialized)
+        return;
+    if (m_instanceFunctions != nullptr) {
+        GLuint buffer = 0;
+        glGenBuffers (1, &buffer);
+        glBindBuffer (GL_ARRAY_BUFFER, buffer);
+        glBufferData (GL_ARRAY_BUFFER,
+                      elements.attributes.size () * sizeof (GLfloat),
+                      elements.attributes.constData (), GL_STATIC_DRAW);
+        glBindBuffer (GL_ARRAY_BUFFER, m_vbo);
+        m_elementBuffers.insert (name, buffer);
+    }
+    if (elements.shape == ElementFrames::Glyph && ! elements.glyphs.isNull ()) {
+        auto tex = new QOpenGLTexture (elements.glyphs,
+                                       QOpenGLTexture::DontGenerateMipMaps);
+        tex->setMinificationFilter (QOpenGLTexture::Linear);
+        tex->setMagnificationFilter (QOpenGLTexture::Linear);
+        tex->setWrapMode (QOpenGLTexture::ClampToEdge);
+        m_elementGlyphs.insert (name, tex);
+    }
+}
+
+void
+RenderThread::deleteElementResources (const QString& name)
+{
+    auto buffer = m_elementBuffers.take (name);
+    if (buffer != 0)
+        glDeleteBuffers (1, &buffer);
+    delete m_elementGlyphs.take (name);
+}
+
+void
+RenderThread::execShowElementFrames (const QString& name)
+{
+    qDebug () << "showing element frames" << name;
+    m_swapTimes.clear ();
+    if (m_opengl_initialized) {
+        m_currentElements = name;
+        m_currentFrame = nullptr;
+        m_currentLayer = -1;
+        m_currentStimulusFrame = -1;
+        m_currentDotsFrame = -1;
+        int count = qMax (1, m_elementFrames[name].frames);
+        for (int i = 0; i < count; i++) {
+            m_currentElementsFrame = i;
+            render ();
+            swapAndWait (i);
+        }
+    }
+    emit framesShown (name, collectTimings (m_swapTimes.size ()));
+}
+
+void
+RenderThread::renderElements ()
+{
+    const auto& elements = m_elementFrames[m_currentElements];
+
+    // Uniform background over the frame only
+    GLfloat bg = elements.background;
+    glEnable (GL_SCISSOR_TEST);
+    glScissor (qMax (0, (win_width - tex_width) / 2),
+               qMax (0, (win_height - tex_height) / 2),
+               tex_width, tex_height);
+    glClearColor (bg, bg, bg, 1);
+    glClear (GL_COLOR_BUFFER_BIT);
+    glClearColor (0, 0, 0, 0);
+    glDisable (GL_SCISSOR_TEST);
+    if (elements.count == 0)
+        return;
+
+    m_elementProgram->bind ();
+    m_elementProgram->setUniformValue ("size", static_cast<GLfloat> (elements.width),
+                                       static_cast<GLfloat> (elements.height));
+    m_elementProgram->setUniformValue ("shape", static_cast<int> (elements.shape));
+    m_elementProgram->setUniformValue ("background", elements.background);
+    m_elementProgram->setUniformValue ("frequency", elements.frequency);
+    m_elementProgram->setUniformValue ("sigma", elements.sigma);
+    m_elementProgram->setUniformValue ("glyphCount",
+                                       static_cast<GLfloat> (qMax (1, elements.glyphCount)));
+    auto glyphs = m_elementGlyphs.value (m_currentElements);
+    if (glyphs != nullptr)
+        glyphs->bind ();
+    m_elementProgram->setUniformValue ("glyphs", 0);
+    glEnable (GL_BLEND);
+    glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    glBindBuffer (GL_ARRAY_BUFFER, m_elementQuad);
+    glVertexAttribPointer (PposLocation, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+    auto buffer = m_elementBuffers.value (m_currentElements);
+    if (m_instanceFunctions != nullptr && buffer != 0) {
+        // A single draw for all the elements of the frame
+        GLsizei stride = ElementFrames::AttributeCount * sizeof (GLfloat);
+        quintptr offset = stride * elements.count * m_currentElementsFrame;
+        quintptr lookOffset = offset + ElementFrames::Contrast * sizeof (GLfloat);
+        glBindBuffer (GL_ARRAY_BUFFER, buffer);
+        glVertexAttribPointer (ElementLocation, 4, GL_FLOAT, GL_FALSE, stride,
+                               reinterpret_cast<const void*> (offset));
+        glVertexAttribPointer (LookLocation, 2, GL_FLOAT, GL_FALSE, stride,
+                               reinterpret_cast<const void*> (lookOffset));
+        glEnableVertexAttribArray (ElementLocation);
+        glEnableVertexAttribArray (LookLocation);
+        m_instanceFunctions->glVertexAttribDivisor (ElementLocation, 1);
+        m_instanceFunctions->glVertexAttribDivisor (LookLocation, 1);
+        m_instanceFunctions->glDrawArraysInstanced (GL_TRIANGLES, 0, 6,
+                                                    elements.count);
+        m_instanceFunctions->glVertexAttribDivisor (ElementLocation, 0);
+        m_instanceFunctions->glVertexAttribDivisor (LookLocation, 0);
+        glDisableVertexAttribArray (ElementLocation);
+        glDisableVertexAttribArray (LookLocation);
+    }
+    else {
+        // Constant attributes, changed between draws
+        const float* attr = elements.frame (m_currentElementsFrame);
+        for (int i = 0; i < elements.count;
+             i++, attr += ElementFrames::AttributeCount) {
+            glVertexAttrib4f (ElementLocation, attr[ElementFrames::X],
+                              attr[ElementFrames::Y],
+                              attr[ElementFrames::Orientation],
+                              attr[ElementFrames::Size]);
+            glVertexAttrib2f (LookLocation, attr[ElementFrames::Contrast],
+                              attr[ElementFrames::Index]);
+            glDrawArrays (GL_TRIANGLES, 0, 6);
+        }
+    }
+    glDisable (GL_BLEND);
+
+    // Back to the frame quad
+    glBindBuffer (GL_ARRAY_BUFFER, m_vbo);
+    glVertexAttribPointer (PposLocation, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+}
+
+void
+RenderThread::swapAndWait (int frame)
+{
+    m_context->swapBuffers (m_window);
+
+    // GPU clock timestamp of the swap
+    if (m_timestampsSupported) {
+        while (m_timestampQueries.size () <= frame) {
+            auto query = new QOpenGLTimerQuery;
+            query->create ();
+            m_timestampQueries.append (query);
+        }
+        m_timestampQueries.at (frame)->recordTimestamp ();
+    }
+
+    // Block until the GPU processed the swap
+    if (m_syncFunctions != nullptr) {
+        GLsync fence = m_syncFunctions->glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        m_syncFunctions->glClientWaitSync (fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                           100000000);  // 100 ms
+        m_syncFunctions->glDeleteSync (fence);
+    }
+    else {
+        glFinish ();
+    }
+
+    m_swapTimes.append (monotonicNsecs ());
+}
+
+FrameTimings
+RenderThread::collectTimings (int frames)
+{
+    auto timings = FrameTimings::fromSwapTimes (m_swapTimes, m_refreshInterval);
+
+    // GPU timestamps are not disturbed by thread scheduling, so
+    // prefer them to detect missed retraces
+    if (m_timestampsSupported && frames > 1) {
+        QVector<qint64> gpuTimes;
+        gpuTimes.reserve (frames);
+        for (int i = 0; i < frames; i++)
+            gpuTimes.append (m_timestampQueries.at (i)->waitForResult ());
+        auto gpuTimings = FrameTimings::fromSwapTimes (gpuTimes, m_refreshInterval);
+        timings.dropped = gpuTimings.dropped;
+        timings.maxInterval = gpuTimings.maxInterval;
+    }
+
+    return timings;
+}
+
+void
+RenderThread::render ()
+{
+    glClear (GL_COLOR_BUFFER_BIT);
+    renderFrame ();
+    if (m_frameLayers.contains (m_shownPage))
+        renderLayers ();
+}
+
+void
+RenderThread::renderFrame ()
+{
+    if (m_currentDotsFrame >= 0) {
+        renderDots ();
+        return;
+    }
+    if (m_currentElementsFrame >= 0) {
+        renderElements ();
+        return;
+    }
+
+    // Procedural stimuli are computed per pixel
+    if (m_currentStimulusFrame >= 0) {
+        const auto& stim = m_currentStimulus;
+        m_proceduralProgram->bind ();
+        m_proceduralProgram->setUniformValue ("size", static_cast<GLfloat> (stim.width),
+                                              static_cast<GLfloat> (stim.height));
+        m_proceduralProgram->setUniformValue ("kind", static_cast<int> (stim.kind));
+        m_proceduralProgram->setUniformValue ("frequency", stim.frequency);
+        m_proceduralProgram->setUniformValue ("phase", stim.phase + m_currentStimulusFrame * stim.phaseStep);
+        m_proceduralProgram->setUniformValue ("orientation", stim.orientation);
+        m_proceduralProgram->setUniformValue ("plaidAngle", stim.plaidAngle);
+        m_proceduralProgram->setUniformValue ("contrast", stim.contrast);
+        m_proceduralProgram->setUniformValue ("sigma", stim.sigma);
+        glDrawArrays (GL_TRIANGLES, 0, 6);
+        return;
+    }
+
+    if (m_currentFrame == nullptr) {
+        if (! m_frameLayers.contains (m_shownPage))
+            qDebug () << "render() with no effect (no frame)";
+	return;
+    }
+
+    waitForUpload (m_currentFrame);
+
+    // Animated series are layers of a single texture array
+    auto format = m_currentFrame->format ();
+    bool luminance = format == QOpenGLTexture::R8_UNorm
+        || format == QOpenGLTexture::R16_UNorm;
+    m_currentFrame->bind ();
+    if (m_currentLayer < 0) {
+        m_program->bind ();
+        glUniform1i (m_texloc, 0);
+        glUniform1i (m_lumloc, luminance);
+
+        // Scheduled frames are moved back to the frame pixels
+        QTransform inverse;
+        GLfloat contrast = 1;
+        if (m_currentScheduleFrame >= 0) {
+            const auto& schedule = m_frameSchedules[m_currentSchedule];
+            inverse = schedule.transform (m_currentScheduleFrame).inverted ();
+            contrast = schedule.contrast (m_currentScheduleFrame);
+        }
+        m_program->setUniformValue (m_frameTransformloc, inverse);
+        glUniform1f (m_contrastloc, contrast);
+    }
+    else {
+        m_arrayProgram->bind ();
+        glUniform1i (m_arrayTexloc, 0);
+        glUniform1f (m_layerloc, m_currentLayer);
+        glUniform1i (m_arrayLumloc, luminance);
+    }
+    glDrawArrays (GL_TRIANGLES, 0, 6);
+}
+
+void
+RenderThread::renderLayers ()
+{
+    if (tex_width == 0 || tex_height == 0)
+        return;
+
+    m_program->bind ();
+    glUniform1i (m_texloc, 0);
+    glUniform1f (m_contrastloc, 1);
+    m_program->setUniformValue (m_frameTransformloc, QTransform ());
+    glEnable (GL_BLEND);
+    glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBindBuffer (GL_ARRAY_BUFFER, m_layerQuad);
+    glVertexAttribPointer (PposLocation, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+    for (const auto& layer : m_frameLayers[m_shownPage]) {
+        auto tex = m_fixedFrames.value (layer.frame);
+        const auto& r = layer.rect;
+        if (tex == nullptr || r.isEmpty ())
+            continue;
+        waitForUpload (tex);
+        m_memory[layer.frame].lastShown = m_showCount;
+
+        // Layer rectangle in the frame, y going up
+        QVector2D scale (m_frameExtent.x () / tex_width,
+                         m_frameExtent.y () / tex_height);
+        QVector2D origin = m_frameOrigin
+            + scale * QVector2D (r.x (), tex_height - r.y () - r.height ());
+        QVector2D extent = scale * QVector2D (r.width (), r.height ());
+        GLfloat quad[12] = {
+            origin.x (), origin.y (),
+            origin.x () + extent.x (), origin.y (),
+            origin.x (), origin.y () + extent.y (),
+            origin.x (), origin.y () + extent.y (),
+            origin.x () + extent.x (), origin.y (),
+            origin.x () + extent.x (), origin.y () + extent.y ()
+        };
+        glBufferData (GL_ARRAY_BUFFER, sizeof (quad), quad, GL_STREAM_DRAW);
+
+        // Layer textures are padded like frames
+        QVector2D coverage (1, 1);
+        if (! m_npotTextures)
+            coverage = QVector2D (static_cast<float> (r.width ()) / nextPowerOfTwo (r.width ()),
+                                  static_cast<float> (r.height ()) / nextPowerOfTwo (r.height ()));
+        auto format = tex->format ();
+        glUniform1i (m_lumloc, format == QOpenGLTexture::R8_UNorm
+                     || format == QOpenGLTexture::R16_UNorm);
+        m_program->setUniformValue ("origin", origin);
+        m_program->setUniformValue ("extent", extent);
+        m_program->setUniformValue ("coverage", coverage);
+        m_program->setUniformValue ("frameSize", static_cast<GLfloat> (r.width ()),
+                                    static_cast<GLfloat> (r.height ()));
+        tex->bind ();
+        glDrawArrays (GL_TRIANGLES, 0, 6);
+    }
+    glDisable (GL_BLEND);
+
+    // Back to the frame placement
+    m_program->setUniformValue ("origin", m_frameOrigin);
+    m_program->setUniformValue ("extent", m_frameExtent);
+    m_program->setUniformValue ("coverage", m_frameCoverage);
+    m_program->setUniformValue ("frameSize", static_cast<GLfloat> (tex_width),
+                                static_cast<GLfloat> (tex_height));
+    glBindBuffer (GL_ARRAY_BUFFER, m_vbo);
+    glVertexAttribPointer (PposLocation, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+}
+
+void
+RenderThread::waitForUpload (QOpenGLTexture* tex)
+{
+    // Make the GPU wait for the texture upload to complete
+    auto fence = m_uploadFences.take (tex);
+    if (fence != nullptr && m_syncFunctions != nullptr) {
+        m_syncFunctions->glWaitSync (fence, 0, GL_TIMEOUT_IGNORED);
+        m_syncFunctions->glDeleteSync (fence);
+    }
+}
+
+void
+RenderThread::execPrewarm ()
+{
+    qDebug () << "RenderThread::prewarm ()";
+
+    // Sample every frame texture once in a small offscreen target
+    auto shownFrame = m_currentFrame;
+    auto shownLayer = m_currentLayer;
+    auto shownStimulusFrame = m_currentStimulusFrame;
+    auto shownDotsFrame = m_currentDotsFrame;
+    auto shownElementsFrame = m_currentElementsFrame;
+    auto shownScheduleFrame = m_currentScheduleFrame;
+    auto shownPage = m_shownPage;
+    m_shownPage.clear ();
+    m_currentStimulusFrame = -1;
+    m_currentDotsFrame = -1;
+    m_currentElementsFrame = -1;
+    m_currentScheduleFrame = -1;
+    QOpenGLFramebufferObject fbo (16, 16);
+    fbo.bind ();
+    glViewport (0, 0, fbo.width (), fbo.height ());
+
+    for (auto tex : m_fixedFrames) {
+        m_currentFrame = tex;
+        m_currentLayer = -1;
+        render ();
+    }
+    for (const auto& frames : m_animatedFrames) {
+        if (frames.array != nullptr) {
+            m_currentFrame = frames.array;
+            m_currentLayer = 0;
+            render ();
+        }
+        for (auto tex : frames.textures) {
+            m_currentFrame = tex;
+            m_currentLayer = -1;
+            render ();
+        }
+    }
+
+    // Procedural stimuli only need their program to be ready
+    auto shownStimulus = m_currentStimulus;
+    for (const auto& stim : m_proceduralFrames) {
+        m_currentStimulus = stim;
+        m_currentStimulusFrame = 0;
+        render ();
+    }
+    m_currentStimulusFrame = -1;
+    auto shownDots = m_currentDots;
+    for (auto it = m_dotFrames.begin (); it != m_dotFrames.end (); ++it) {
+        m_currentDots = it.key ();
+        m_currentDotsFrame = 0;
+        render ();
+    }
+    m_currentDotsFrame = -1;
+    auto shownElements = m_currentElements;
+    for (auto it = m_elementFrames.begin (); it != m_elementFrames.end (); ++it) {
+        m_currentElements = it.key ();
+        m_currentElementsFrame = 0;
+        render ();
+    }
+    glFinish ();
+
+    fbo.release ();
+    glViewport (0, 0, win_width, win_height);
+    m_currentFrame = shownFrame;
+    m_currentLayer = shownLayer;
+    m_currentStimulus = shownStimulus;
+    m_currentStimulusFrame = shownStimulusFrame;
+    m_currentDots = shownDots;
+    m_currentDotsFrame = shownDotsFrame;
+    m_currentElements = shownElements;
+    m_currentElementsFrame = shownElementsFrame;
+    m_currentScheduleFrame = shownScheduleFrame;
+    m_shownPage = shownPage;
+}
+
+QOpenGLTexture**
+RenderThread::evictableSlot (const QString& name)
+{
+    auto fixed = m_fixedFrames.find (name);
+    if (fixed != m_fixedFrames.end ())
+        return &fixed.value ();
+
+    // Animated series stored in a texture array
+    auto animated = m_animatedFrames.find (name);
+    if (animated != m_animatedFrames.end () && animated->textures.isEmpty ()
+        && animated->shared.isEmpty ()
+        && ! m_textureShares.contains (animated->array))
+        return &animated->array;
+    return nullptr;
+}
+
+qint64
+RenderThread::framesBytes (const QString& name)
+{
+    qint64 bytes = 0;
+    auto fixed = m_fixedFrames.value (name);
+    if (fixed != nullptr)
+        bytes += textureBytes (fixed);
+    auto animated = m_animatedFrames.find (name);
+    if (animated != m_animatedFrames.end ()) {
+        if (animated->array != nullptr)
+            bytes += textureBytes (animated->array);
+        for (auto tex : animated->textures)
+            bytes += textureBytes (tex);
+    }
+    return bytes;
+}
+
+qint64
+RenderThread::residentBytes ()
+{
+    qint64 bytes = m_uploader != nullptr ? m_uploader->pool ()->freeBytes () : 0;
+    for (auto it = m_fixedFrames.constBegin (); it != m_fixedFrames.constEnd (); ++it)
+        bytes += framesBytes (it.key ());
+    for (auto it = m_animatedFrames.constBegin (); it != m_animatedFrames.constEnd (); ++it)
+        bytes += framesBytes (it.key ());
+    for (auto tex : m_keptTextures)
+        bytes += textureBytes (tex);
+    return bytes;
+}
+
+void
+RenderThread::reportMemory (const QString& name)
+{
+    auto it = m_memory.constFind (name);
+    if (it != m_memory.constEnd () && ! it->spilled.isEmpty ()) {
+        qint64 bytes = static_cast<qint64> (it->width) * it->height * it->layers
+            * texelFormat (it->format).bytesPerTexel;
+        emit frameMemoryChanged (name, bytes, false);
+    }
+    else {
+        emit frameMemoryChanged (name, framesBytes (name), true);
+    }
+}
+
+qint64
+RenderThread::evictFrames (const QString& name)
+{
+    auto slot = evictableSlot (name);
+    if (slot == nullptr || *slot == nullptr)
+        return 0;
+    auto tex = *slot;
+    auto tf = texelFormat (tex->format ());
+    qint64 bytes = textureBytes (tex);
+
+    // Read the texels back, tightly packed
+    QByteArray texels (static_cast<int> (bytes), Qt::Uninitialized);
+    waitForUpload (tex);
+    tex->bind ();
+    glPixelStorei (GL_PACK_ALIGNMENT, 1);
+    glGetTexImage (tex->target (), 0, tf.pixels, tf.type, texels.data ());
+    glPixelStorei (GL_PACK_ALIGNMENT, 4);
+    tex->release ();
+
+    // Fast compression, frames are mostly uniform backgrounds
+    auto& entry = m_memory[name];
+    entry.spilled = qCompress (texels, 1);
+    entry.target = tex->target ();
+    entry.format = tex->format ();
+    entry.width = tex->width ();
+    entry.height = tex->height ();
+    entry.layers = tex->layers ();
+    qDebug () << "evicted frames" << name << ":" << bytes << "bytes,"
+              << entry.spilled.size () << "compressed";
+
+    releaseTexture (tex, false);
+    *slot = nullptr;
+    reportMemory (name);
+    return bytes;
+}
+
+bool
+RenderThread::restoreFrames (const QString& name)
+{
+    auto slot = evictableSlot (name);
+    auto it = m_memory.find (name);
+    if (slot == nullptr || it == m_memory.end () || it->spilled.isEmpty ())
+        return false;
+    auto& entry = it.value ();
+    auto tf = texelFormat (entry.format);
+
+    // Recycled storage if available, not given back to the pool nor
+    // counted in its statistics
+    QOpenGLTexture* tex = nullptr;
+    if (m_uploader != nullptr)
+        tex = m_uploader->pool ()->acquireUncounted (entry.target, entry.format,
+                                                     entry.width, entry.height,
+                                                     entry.layers);
+    if (tex == nullptr) {
+        tex = new QOpenGLTexture (entry.target);
+        tex->setSize (entry.width, entry.height);
+        if (entry.target == QOpenGLTexture::Target2DArray)
+            tex->setLayers (entry.layers);
+        tex->setFormat (entry.format);
+        tex->setMinificationFilter (QOpenGLTexture::Linear);
+        tex->setMagnificationFilter (QOpenGLTexture::Linear);
+        tex->allocateStorage (tf.pixels, tf.type);
+    }
+
+    QByteArray texels = qUncompress (entry.spilled);
+    tex->bind ();
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+    if (entry.target == QOpenGLTexture::Target2DArray)
+        glTexSubImage3D (GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+                         entry.width, entry.height, entry.layers,
+                         tf.pixels, tf.type, texels.constData ());
+    else
+        glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, entry.width, entry.height,
+                         tf.pixels, tf.type, texels.constData ());
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+    tex->release ();
+    qDebug () << "restored evicted frames" << name;
+
+    entry.spilled.clear ();
+    *slot = tex;
+    reportMemory (name);
+    return true;
+}
+
+void
+RenderThread::enforceBudget (const QString& keep)
+{
+    if (m_memoryBudget <= 0 || ! m_opengl_initialized)
+        return;
+    qint64 used = residentBytes ();
+    if (used <= m_memoryBudget)
+        return;
+
+    // Recycled storage goes first
+    if (m_uploader != nullptr) {
+        for (auto tex : m_uploader->pool ()->takeFree ()) {
+            used -= textureBytes (tex);
+            delete tex;
+        }
+    }
+
+    // Then the least recently shown evictable frames. Frames not
+    // shown yet may still be filled by the upload thread.
+    while (used > m_memoryBudget) {
+        QString victim;
+        quint64 oldest = std::numeric_limits<quint64>::max ();
+        for (auto it = m_memory.constBegin (); it != m_memory.constEnd (); ++it) {
+            if (! it->evictable || it.key () == keep
+                || it->lastShown == 0 || it->lastShown >= oldest)
+                continue;
+            auto slot = evictableSlot (it.key ());
+            if (slot == nullptr || *slot == nullptr || *slot == m_currentFrame)
+                continue;
+            victim = it.key ();
+            oldest = it->lastShown;
+        }
+        if (victim.isNull ()) {
+            qWarning () << "warning: frames exceed the memory budget by"
+                        << (used - m_memoryBudget) << "bytes";
+            break;
+        }
+        used -= evictFrames (victim);
+    }
+}
+
+// vim: sw=4
@@ -0,0 +1,441 @@
+// src/renderthread.h – Stimulus presentation thread
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#pragma once
+
+#include <memory>
+
+#include <QtGui>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFunctions_3_0>
+#include <QOpenGLTimerQuery>
+
+#include "../lib/displayer.h"
+
+namespace plstim
+{
+
+class UploadThread;
+
+/**
+ * Thread owning the OpenGL context of a stimulus window.
+ *
+ * All the presentation work (shaders, drawing, buffer swaps) is done
+ * here, so that blocking buffer swaps never stall the GUI thread.
+ * Public methods only queue commands and may be called from any
+ * thread; commands are executed in order. When an upload thread is
+ * attached, commands first go through it so that textures are
+ * uploaded before the commands using them.
+ */
+class RenderThread : public QThread, protected QOpenGLFunctions_3_0
+{
+  Q_OBJECT
+public:
+  explicit RenderThread (QWindow* window);
+  virtual ~RenderThread ();
+
+  /// Route commands through an upload thread sharing our context.
+  void setUploader (UploadThread* uploader);
+
+  /// (Re-)create the OpenGL context for the given screen.
+  void setupOpenGL (QScreen* screen, const QSurfaceFormat& format);
+  void addFixedFrame (const QString& name, const QImage& img);
+  void addAnimatedFrame (const QString& name, const QImage& img);
+  /// Present an earlier frame of a series again, without a new texture.
+  void repeatAnimatedFrame (const QString& name, int frame);
+  /// Present a frame of another series, sharing its texture.
+  void shareAnimatedFrame (const QString& name, const QString& source,
+                           int frame);
+  void addProceduralFrames (const QString& name,
+                            const ProceduralStimulus& stimulus);
+  void addDotFrames (const QString& name, const DotFrames& dots);
+  void addElementFrames (const QString& name, const ElementFrames& elements);
+  /// Present the frames of a stream as they are painted.
+  void addStreamedFrames (const QString& name,
+                          const std::shared_ptr<FrameStream>& stream);
+  /// Animate the fixed frame of the same name while shown.
+  void setFrameSchedule (const QString& name, const FrameSchedule& schedule);
+  /// Draw fixed frames over the frames of a page while shown.
+  void setFrameLayers (const QString& name, const QVector<FrameLayer>& layers);
+  /// Add frames drawn on the GPU by the upload thread, if any.
+  void paintFixedFrame (const QString& name, int width, int height,
+                        QImage::Format format, const FrameDrawing& drawing);
+  void paintAnimatedFrame (const QString& name, int width, int height,
+                           QImage::Format format, const FrameDrawing& drawing);
+  void deleteAnimatedFrames (const QString& name);
+  void deleteFrames (const QString& name);
+  void reserveAnimatedFrames (const QString& name, int count);
+  void setFramesEvictable (const QString& name, bool evictable);
+  void setMemoryBudget (qint64 bytes);
+  void prepareFrames (const QString& name);
+  void prewarm ();
+  void clear ();
+  void setTextureSize (int twidth, int theight);
+  /// Notify of a new window size.
+  void resize (int width, int height);
+  void showFixedFrame (const QString& name);
+  void showAnimatedFrames (const QString& name);
+  /// Redraw the current frame.
+  void renderNow ();
+  /// Terminate the thread once pending commands are done.
+  void stop ();
+
+signals:
+  /// Sent once a fixed frame, or the last frame of an animated
+  /// series, has been presented on screen.
+  void framesShown (const QString& name, const plstim::FrameTimings& timings);
+  /// Sent when the memory used by the frames of a page changed.
+  void frameMemoryChanged (const QString& name, qint64 bytes, bool resident);
+
+protected:
+  virtual void run () override;
+
+public:
+  struct Command
+  {
+    enum Type {
+      SetupOpenGL,
+      AddFixedFrame,
+      AddAnimatedFrame,
+      RepeatAnimatedFrame,
+      ShareAnimatedFrame,
+      DeleteAnimatedFrames,
+      DeleteFrames,
+      ReserveAnimatedFrames,
+      AddProceduralFrames,
+      AddDotFrames,
+      AddElementFrames,
+      AddStreamedFrames,
+      SetFrameSchedule,
+      SetFrameLayers,
+      SetFramesEvictable,
+      SetMemoryBudget,
+      PrepareFrames,
+      Prewarm,
+      Clear,
+      SetTextureSize,
+      Resize,
+      ShowFixedFrame,
+      ShowAnimatedFrames,
+      Render,
+      Stop
+    };
+
+    /// Arguments of SetupOpenGL
+    struct Context
+    {
+      QScreen* screen = nullptr;
+      QSurfaceFormat format;
+      qreal refreshRate = 0;
+    };
+
+    /// Arguments of AddFixedFrame and AddAnimatedFrame
+    struct Frame
+    {
+      QImage image;
+      /// Drawing of the frame, replacing image
+      FrameDrawing drawing;
+      QImage::Format format = QImage::Format_RGB32;
+      int width = 0;
+      int height = 0;
+      /// Texture uploaded by the upload thread, replacing image
+      QOpenGLTexture* texture = nullptr;
+      /// Layer of texture holding the frame, for texture arrays
+      int layer = 0;
+      /// Upload completion fence for texture
+      GLsync fence = nullptr;
+    };
+
+    /// Arguments of RepeatAnimatedFrame and ShareAnimatedFrame
+    struct Repeat
+    {
+      /// Frame of a series presented again
+      int frame = 0;
+      /// Series holding the frame, for ShareAnimatedFrame
+      QString source;
+    };
+
+    Command (Type t=Render, const QString& n=QString (),
+             const QVariant& a=QVariant ())
+      : type (t), name (n), args (a)
+    {}
+
+    /// Arguments of the command, of the type it expects.
+    template <typename T>
+    T arguments () const
+    { return args.value<T> (); }
+
+    Type type;
+    QString name;
+    /**
+     * Arguments depending on the type: Context, Frame, Repeat, the
+     * stimulus of AddProceduralFrames, AddDotFrames, AddElementFrames,
+     * AddStreamedFrames, SetFrameSchedule and SetFrameLayers, the
+     * frame count of ReserveAnimatedFrames, the flag of
+     * SetFramesEvictable, the bytes of SetMemoryBudget, or the size of
+     * SetTextureSize and Resize.
+     */
+    QVariant args;
+  };
+
+private:
+  friend class UploadThread;
+
+  void post (const Command& cmd);
+  void post (Command::Type type, const QString& name=QString ());
+  template <typename T>
+  void post (Command::Type type, const QString& name, const T& args)
+  { post (Command (type, name, QVariant::fromValue (args))); }
+  /// Queue a command for immediate execution in the render thread.
+  void enqueue (const Command& cmd);
+
+  // Executed in the render thread
+  bool execSetupOpenGL (const Command::Context& args);
+  /// Create a context sharing our objects for the upload thread.
+  QOpenGLContext* createSharedContext (const Command::Context& args);
+  QOpenGLTexture* frameTexture (const Command::Frame& frame);
+  /**
+   * Drop a texture and its pending upload fence. Unless recycle is
+   * false, the texture goes back to the upload pool when possible,
+   * otherwise it is deleted.
+   */
+  void releaseTexture (QOpenGLTexture* tex, bool recycle=true);
+  /// Release a texture of a series, kept while other series share it.
+  void dropTexture (QOpenGLTexture* tex);
+  /// Stop sharing a texture, released once no series presents it.
+  void unshareTexture (QOpenGLTexture* tex);
+  void execAddFixedFrame (const QString& name, const Command::Frame& frame);
+  void execAddAnimatedFrame (const QString& name, const Command::Frame& frame);
+  void execRepeatAnimatedFrame (const QString& name, int frame);
+  void execShareAnimatedFrame (const QString& name, const QString& source,
+                               int frame);
+  /**
+   * Add a fixed frame, or an animated series if frames > 0, painted
+   * here from drawings, for stimuli whose program is not available.
+   */
+  void execAddPaintedFrames (const QString& name, int frames,
+                             int width, int height,
+                             const std::function<FrameDrawing (int)>& drawing);
+  void execDeleteAnimatedFrames (const QString& name);
+  void execDeleteFrames (const QString& name);
+  void execClear ();
+  void execShowFixedFrame (const QString& name);
+  void execShowAnimatedFrames (const QString& name);
+  void execShowScheduledFrames (const QString& name);
+  void execShowProceduralFrames (const QString& name);
+  void execShowDotFrames (const QString& name);
+  /// Buffer of the dot positions of a series, uploaded on first use.
+  GLuint dotBuffer (const QString& name);
+  void deleteDotBuffers ();
+  void renderDots ();
+  /// Upload the attributes and glyphs of elements.
+  void execAddElementFrames (const QString& name,
+                             const ElementFrames& elements);
+  void deleteElementResources (const QString& name);
+  void execShowElementFrames (const QString& name);
+  void renderElements ();
+  void execShowStreamedFrames (const QString& name);
+  /// Copy the image of a streamed frame to a texture of the ring,
+  /// without upload thread.
+  void uploadStreamedFrame (QOpenGLTexture* tex, const QImage& img);
+  void releaseStreamTextures ();
+  void execPrewarm ();
+  /// Make the GPU wait for the upload of a texture, if pending.
+  void waitForUpload (QOpenGLTexture* tex);
+  /**
+   * Slot of the single texture holding evictable frames, or nullptr.
+   * Textures of series sharing frames are not evicted.
+   */
+  QOpenGLTexture** evictableSlot (const QString& name);
+  qint64 framesBytes (const QString& name);
+  /// Graphics memory used by all the frames and recycled textures.
+  qint64 residentBytes ();
+  void reportMemory (const QString& name);
+  /// Move frames to host memory, returns the freed graphics memory.
+  qint64 evictFrames (const QString& name);
+  bool restoreFrames (const QString& name);
+  /**
+   * Evict least recently shown frames, except keep, until within
+   * budget. Frames never shown since added are not evicted, series
+   * being still filled by the upload thread.
+   */
+  void enforceBudget (const QString& keep=QString ());
+  /// Place the frames in the window, through the shader uniforms.
+  void updateShaders ();
+  void render ();
+  /// Draw the current frame, without clearing.
+  void renderFrame ();
+  /// Blend the layers of the shown page over its frame.
+  void renderLayers ();
+  /// Swap the buffers and wait for the swap to be processed.
+  void swapAndWait (int frame);
+  /// Summarise the swaps of the last presentation.
+  FrameTimings collectTimings (int frames);
+  void destroyOpenGL ();
+
+  QWindow* m_window;
+  UploadThread* m_uploader;
+
+  // Command queue shared with the posting threads
+  QMutex m_mutex;
+  QWaitCondition m_cond;
+  QQueue<Command> m_commands;
+
+  // Only accessed from the render thread
+  QOpenGLContext* m_context;
+  /// Frame of another series
+  struct SharedFrame
+  {
+    QOpenGLTexture* texture = nullptr;
+    /// Layer of texture, -1 for 2D textures
+    int layer = -1;
+  };
+  /// Frames of an animated series
+  struct AnimatedFrames
+  {
+    /// Texture array holding one frame per layer
+    QOpenGLTexture* array = nullptr;
+    /// Number of layers of array in use
+    int count = 0;
+    /// Individual textures, without upload thread
+    QVector<QOpenGLTexture*> textures;
+    /// Layers or textures presented in turn, if frames are repeated,
+    /// or shared frames at -1 - index if negative
+    QVector<int> sequence;
+    /// Frames of other series presented by this one
+    QVector<SharedFrame> shared;
+
+    /// Number of stored frames.
+    int stored () const
+    { return array != nullptr ? count : textures.size (); }
+  };
+
+  /// Graphics memory bookkeeping of the frames of a page
+  struct FrameMemory
+  {
+    bool evictable = false;
+    /// Presentation count when last shown, zero if not shown since added
+    quint64 lastShown = 0;
+    /// Compressed texels of evicted frames
+    QByteArray spilled;
+    // Shape of the evicted texture
+    QOpenGLTexture::Target target = QOpenGLTexture::Target2D;
+    QOpenGLTexture::TextureFormat format = QOpenGLTexture::RGBA8_UNorm;
+    int width = 0;
+    int height = 0;
+    int layers = 1;
+  };
+
+  QMap<QString,QOpenGLTexture*> m_fixedFrames;
+  QMap<QString,AnimatedFrames> m_animatedFrames;
+  /// Stimuli computed while shown, kept across contexts
+  QMap<QString,ProceduralStimulus> m_proceduralFrames;
+  /// Animations of fixed frames, applied while shown
+  QMap<QString,FrameSchedule> m_frameSchedules;
+  /// Fixed frames drawn over the frames of pages
+  QMap<QString,QVector<FrameLayer>> m_frameLayers;
+  /// Dots drawn as point sprites while shown
+  QMap<QString,DotFrames> m_dotFrames;
+  QHash<QString,GLuint> m_dotBuffers;
+  /// Elements drawn as instanced quads while shown
+  QMap<QString,ElementFrames> m_elementFrames;
+  QHash<QString,GLuint> m_elementBuffers;
+  QHash<QString,QOpenGLTexture*> m_elementGlyphs;
+  /// Frames painted while shown, uploaded in turn to a ring of
+  /// textures kept across presentations
+  QMap<QString,std::shared_ptr<FrameStream>> m_streams;
+  QVector<QOpenGLTexture*> m_streamTextures;
+  QHash<QString,FrameMemory> m_memory;
+  /// Number of series sharing frames of a texture
+  QHash<QOpenGLTexture*,int> m_textureShares;
+  /// Shared textures whose series were deleted
+  QSet<QOpenGLTexture*> m_keptTextures;
+  /// Graphics memory limit in bytes, or zero
+  qint64 m_memoryBudget;
+  quint64 m_showCount;
+  QOpenGLShaderProgram* m_program;
+  /// Program sampling a layer of a texture array
+  QOpenGLShaderProgram* m_arrayProgram;
+  /// Program computing procedural stimuli
+  QOpenGLShaderProgram* m_proceduralProgram;
+  /// Program drawing round point sprites, if available
+  QOpenGLShaderProgram* m_dotProgram;
+  /// Program drawing element quads, if available
+  QOpenGLShaderProgram* m_elementProgram;
+  int tex_width;
+  int tex_height;
+  int win_width;
+  int win_height;
+  GLfloat vertices[12];
+  int m_texloc;
+  int m_arrayTexloc;
+  int m_layerloc;
+  /// Locations of the grayscale frame flags
+  int m_lumloc;
+  int m_arrayLumloc;
+  int m_frameTransformloc;
+  int m_contrastloc;
+  QOpenGLTexture* m_currentFrame;
+  /// Layer of m_currentFrame to draw, -1 for 2D textures
+  int m_currentLayer;
+  /// Procedural stimulus drawn instead of m_currentFrame, if its
+  /// frame is not -1
+  ProceduralStimulus m_currentStimulus;
+  int m_currentStimulusFrame;
+  /// Dots drawn instead of m_currentFrame, if their frame is not -1
+  QString m_currentDots;
+  int m_currentDotsFrame;
+  /// Elements drawn instead of m_currentFrame, if their frame is not -1
+  QString m_currentElements;
+  int m_currentElementsFrame;
+  /// Frame of the schedule applied to m_currentFrame, or -1
+  QString m_currentSchedule;
+  int m_currentScheduleFrame;
+  /// Page being presented, for its layers
+  QString m_shownPage;
+  /// Placement of the frames set by updateShaders ()
+  QVector2D m_frameOrigin;
+  QVector2D m_frameExtent;
+  QVector2D m_frameCoverage;
+  GLuint m_vao;
+  GLuint m_vbo;
+  /// Corners of the element quad
+  GLuint m_elementQuad;
+  /// Quad of the layer being drawn
+  GLuint m_layerQuad;
+  bool m_opengl_initialized = false;
+
+  /// Expected interval between vertical retraces in ns
+  qint64 m_refreshInterval;
+  /// Fence sync functions, if supported
+  QOpenGLExtraFunctions* m_syncFunctions;
+  /// Instanced drawing functions, if supported
+  QOpenGLExtraFunctions* m_instanceFunctions;
+  /// GPU timestamp queries, one per frame of a presentation
+  QVector<QOpenGLTimerQuery*> m_timestampQueries;
+  bool m_timestampsSupported;
+  /// Whether textures may have any size, else frames are padded
+  bool m_npotTextures;
+  /// CPU completion time of each swap of a presentation
+  QVector<qint64> m_swapTimes;
+  /// Uploads not yet waited for
+  QHash<QOpenGLTexture*,GLsync> m_uploadFences;
+};
+
+} // namespace plstim
+
+Q_DECLARE_METATYPE(plstim::RenderThread::Command::Context)
+Q_DECLARE_METATYPE(plstim::RenderThread::Command::Frame)
+Q_DECLARE_METATYPE(plstim::RenderThread::Command::Repeat)
+Q_DECLARE_METATYPE(plstim::ProceduralStimulus)
+Q_DECLARE_METATYPE(plstim::DotFrames)
+Q_DECLARE_METATYPE(plstim::ElementFrames)
+Q_DECLARE_METATYPE(plstim::FrameSchedule)
+Q_DECLARE_METATYPE(plstim::FrameLayer)
+Q_DECLARE_METATYPE(std::shared_ptr<plstim::FrameStream>)
+
+// Local Variables:
+// mode: c++
+// End:
@@ -3,31 +3,14 @@
 // Copyright © 2012–2015 University of California, Irvine
 // Licensed under the Simplified BSD License.
 
-#include <iomanip>
-#include <sstream>
-
-using namespace std;
-
 #include "stimwindow.h"
 using namespace plstim;
 
-#ifdef WIN32
-#include <windows.h>
-#include "GL/wglext.h"
-#endif
-
-static const char *fshader_txt = 
-    "varying vec2 tex_coord;\n"
-    "uniform sampler2D texture;\n"
-    "void main() {\n"
-    "  gl_FragColor = texture2D(texture, tex_coord);\n"
-    "}\n";
-
 
 StimWindow::StimWindow (QScreen* scr)
-    : QWindow (scr), m_context (nullptr), m_vshader (nullptr),
-      tex_width (0), tex_height (0),
-      m_texloc (0), m_currentFrame (nullptr)
+    : QWindow (scr), m_renderer (nullptr), m_uploader (nullptr),
+      m_uploadSurface (nullptr),
+      tex_width (0), tex_height (0)
 {
     // Create a floatting window surface
     setFlags (Qt::Dialog);
@@ -52,6 +35,22 @@ StimWindow::StimWindow (QScreen* scr)
     // Create the window, allocating resources for it
     create ();
     qDebug () << "StimWindow screen currently on: " << screen ()->name ();
+
+    // Offscreen surfaces must be created in the GUI thread
+    m_uploadSurface = new QOffscreenSurface (screen ());
+    m_uploadSurface->setFormat (fmt);
+    m_uploadSurface->create ();
+
+    // Start the presentation and upload threads
+    m_renderer = new RenderThread (this);
+    connect (m_renderer, &RenderThread::framesShown,
+             this, &StimWindow::framesShown);
+    connect (m_renderer, &RenderThread::frameMemoryChanged,
+             this, &StimWindow::frameMemoryChanged);
+    m_uploader = new UploadThread (m_renderer, m_uploadSurface);
+    m_renderer->setUploader (m_uploader);
+    m_renderer->start (QThread::HighestPriority);
+    m_uploader->start ();
     setupOpenGL ();
 
     // Re-create an OpenGL context when screen is changed
@@ -61,177 +60,180 @@ StimWindow::StimWindow (QScreen* scr)
             });
 }
 
+StimWindow::~StimWindow ()
+{
+    // Stop goes through the upload thread to the render thread
+    m_renderer->stop ();
+    m_uploader->wait ();
+    m_renderer->wait ();
+    delete m_uploader;
+    delete m_renderer;
+    delete m_uploadSurface;
+}
+
 void
 StimWindow::setupOpenGL ()
 {
     qDebug () << "StimWindow::setupOpenGL ()";
+    m_renderer->setupOpenGL (screen (), format ());
+}
 
-    if (m_context != nullptr) {
-        qDebug () << "Deleting previous OpenGL context";
-        delete m_context;
-    }
-
-    qDebug () << "Creating a new OpenGL context";
-    m_context = new QOpenGLContext (this);
-    m_context->setScreen (screen ());
-    m_context->setFormat (format ());  // TODO: why not format()
-
-    if (! m_context->create ()) {
-      qCritical() << "error: could not create the OpenGL context";
-      return;
-    }
-    if (! m_context->isValid ()) {
-      qCritical() << "error: created OpenGL context is invalid";
-      return;
-    }
-
-    auto fmt = m_context->format();
-    qDebug() << "created context for OpenGL " << fmt.majorVersion() << "." << fmt.minorVersion() << "-" << fmt.profile();
+QImage
+StimWindow::frameBuffer (int width, int height, QImage::Format format)
+{
+    return m_uploader->frameBuffer (width, height, format);
+}
 
-    // Initialize the new OpenGL context
-    if (! m_context->makeCurrent (this)) {
-        qCritical() << "error: could not use the OpenGL context";
-	return;
-    }
-    if (! initializeOpenGLFunctions ()) {
-        qCritical() << "error: could not initialise the OpenGL functions";
-	return;
-    }
+int
+StimWindow::maxFrameBuffers ()
+{
+    return UploadThread::MaxPixelBuffers;
+}
 
-    // Enables V-Sync
-#ifdef WIN32
-    auto wglSwapIntervalEXT = (PFNWGLSWAPINTERVALEXTPROC) wglGetProcAddress ("wglSwapIntervalEXT");
-    if (wglSwapIntervalEXT == NULL)
-        qCritical () << "error: could not get swap interval extension";
-    else
-        wglSwapIntervalEXT (1);
-#endif
+void
+StimWindow::addFixedFrame (const QString& name, const QImage& img)
+{
+    qDebug () << "StimWindow::addFixedFrame ()" << name;
+    m_renderer->addFixedFrame (name, img);
+}
 
-    // Create a shader program
-    m_program = new QOpenGLShaderProgram (this);
-    if (! m_program->addShaderFromSourceCode (QOpenGLShader::Fragment,
-	    fshader_txt)) {
-        qCritical () << "error: could not create the fragment shader:" << endl;
-        return;
-    }
+void
+StimWindow::addAnimatedFrame (const QString& name, const QImage& img)
+{
+    m_renderer->addAnimatedFrame (name, img);
+}
 
-    // Create a vertex array object (VAO)
-    glGenVertexArrays (1, &m_vao);
-    glBindVertexArray (m_vao);
-    // Create the vertex buffer object (VBO) associated
-    glGenBuffers (1,&m_vbo);
-    glBindBuffer (GL_ARRAY_BUFFER,m_vbo);
-    qDebug () << "glBVA" << glGetError ();
+void
+StimWindow::repeatAnimatedFrame (const QString& name, int frame)
+{
+    m_renderer->repeatAnimatedFrame (name, frame);
+}
 
-    // TODO: update shaders on stimwindow move?
+void
+StimWindow::shareAnimatedFrame (const QString& name, const QString& source,
+                                int frame)
+{
+    m_renderer->shareAnimatedFrame (name, source, frame);
+}
 
-    // Black as default background colour
-    glClearColor (0, 0, 0, 0);
+void
+StimWindow::addProceduralFrames (const QString& name,
+                                 const ProceduralStimulus& stimulus)
+{
+    m_renderer->addProceduralFrames (name, stimulus);
+}
 
-    m_context->doneCurrent ();
+void
+StimWindow::addDotFrames (const QString& name, const DotFrames& dots)
+{
+    m_renderer->addDotFrames (name, dots);
+}
 
-    m_opengl_initialized = true;
+void
+StimWindow::addElementFrames (const QString& name,
+                              const ElementFrames& elements)
+{
+    m_renderer->addElementFrames (name, elements);
 }
 
-static QOpenGLTexture*
-bindTexture (const QImage& img)
+void
+StimWindow::addScheduledFrames (const QString& name, const QImage& img,
+                                const FrameSchedule& schedule)
 {
-    // Convert pixel data from Qt to OpenGL format
-    auto tex = new QOpenGLTexture (img.mirrored ());
-    tex->setMinificationFilter (QOpenGLTexture::Linear);
-    tex->setMagnificationFilter (QOpenGLTexture::Linear);
-    tex->bind ();
-    return tex;
+    // A single texture, moved by the renderer on each frame
+    addFixedFrame (name, img);
+    m_renderer->setFrameSchedule (name, schedule);
 }
 
 void
-StimWindow::addFixedFrame (const QString& name, const QImage& img)
+StimWindow::addStreamedFrames (const QString& name, int frames,
+                               int width, int height, QImage::Format format,
+                               int lookahead, const FrameProducer& producer)
 {
-    qDebug () << "StimWindow::addFixedFrame ()" << name;
-    
-    if (! m_context->makeCurrent (this))
-        qCritical () << "error: cannot use OpenGL context";
-
-    // Delete existing texture
-    if (m_fixedFrames.contains (name)) {
-        qDebug () << "deleting existing homonymous texture";
-        auto tex = m_fixedFrames[name];
-        delete tex;
-    }
+    // Painting starts now, presented by the renderer as it goes
+    m_renderer->addStreamedFrames (name,
+                                   std::make_shared<FrameStream> (frames, width, height,
+                                                                  format, lookahead,
+                                                                  producer));
+}
 
-    // Bind the freame to a texture
-    m_fixedFrames[name] = bindTexture (img);
+void
+StimWindow::setFrameLayers (const QString& name,
+                            const QVector<FrameLayer>& layers)
+{
+    m_renderer->setFrameLayers (name, layers);
+}
 
-    m_context->doneCurrent ();
+void
+StimWindow::paintFixedFrame (const QString& name, int width, int height,
+                             QImage::Format format, const FrameDrawing& drawing)
+{
+    m_renderer->paintFixedFrame (name, width, height, format, drawing);
 }
 
 void
-StimWindow::addAnimatedFrame (const QString& name, const QImage& img)
+StimWindow::paintAnimatedFrame (const QString& name, int width, int height,
+                                QImage::Format format, const FrameDrawing& drawing)
 {
-    if (! m_context->makeCurrent (this))
-        qCritical () << "error: cannot use OpenGL context";
+    m_renderer->paintAnimatedFrame (name, width, height, format, drawing);
+}
 
-    auto& frames = m_animatedFrames[name];
+void
+StimWindow::deleteAnimatedFrames (const QString& name)
+{
+    m_renderer->deleteAnimatedFrames (name);
+}
 
-    //img.save (QString("%1-%2.png").arg(name).arg(frames.size ()));
+void
+StimWindow::deleteFrames (const QString& name)
+{
+    m_renderer->deleteFrames (name);
+}
 
-    frames.append (bindTexture (img));
+void
+StimWindow::reserveAnimatedFrames (const QString& name, int count)
+{
+    m_renderer->reserveAnimatedFrames (name, count);
+}
 
-    m_context->doneCurrent ();
+TexturePoolStats
+StimWindow::texturePoolStats ()
+{
+    TexturePoolStats stats;
+    stats.hits = m_uploader->pool ()->hits ();
+    stats.misses = m_uploader->pool ()->misses ();
+    return stats;
 }
 
 void
-StimWindow::deleteAnimatedFrames (const QString& name)
+StimWindow::setFramesEvictable (const QString& name, bool evictable)
 {
-    if (m_animatedFrames.contains (name)) {
-	m_context->makeCurrent (this);
+    m_renderer->setFramesEvictable (name, evictable);
+}
 
-	auto& frames = m_animatedFrames[name];
-	for (auto tex : frames)
-            delete tex;
+void
+StimWindow::setMemoryBudget (qint64 bytes)
+{
+    m_renderer->setMemoryBudget (bytes);
+}
 
-	frames.clear ();
-	m_animatedFrames.remove (name);
+void
+StimWindow::prepareFrames (const QString& name)
+{
+    m_renderer->prepareFrames (name);
+}
 
-        m_context->doneCurrent ();
-    }
+void
+StimWindow::prewarm ()
+{
+    m_renderer->prewarm ();
 }
 
 void
 StimWindow::clear ()
 {
     qDebug () << "StimWindow::clear ()";
-
-    if (m_context == nullptr) {
-      qDebug() << "skipping clearing of uninitialized StimWindow";
-      return;
-    }
-
-    m_context->makeCurrent (this);
-    
-    // Unset current frame
-    m_currentFrame = 0;
-
-    // Destroy fixed frame textures
-    QMapIterator<QString,QOpenGLTexture*> it (m_fixedFrames);
-    while (it.hasNext ()) {
-	it.next ();
-	auto tex = it.value ();
-        delete tex;
-    }
-    m_fixedFrames.clear ();
-
-    // Destroy animated frame textures
-    QMapIterator<QString,QVector<QOpenGLTexture*>> jt (m_animatedFrames);
-    while (jt.hasNext ()) {
-	jt.next ();
-	const QVector<QOpenGLTexture*>& vec = jt.value ();
-	for (QOpenGLTexture* t : vec)
-            delete t;
-    }
-    m_animatedFrames.clear ();
-
-    m_context->doneCurrent ();
+    m_renderer->clear ();
 }
 
 bool
@@ -264,10 +266,6 @@ StimWindow::event (QEvent* evt)
 void StimWindow::exposeEvent(QExposeEvent*)
 {
   qDebug() << "exposing the StimWindow" << endl;
-  if (m_context == nullptr) {
-    this->setupOpenGL();
-  }
-        
   emit exposed();
   
   //qDebug () << "stimwindow::expose";
@@ -316,117 +314,16 @@ StimWindow::setTextureSize (int twidth, int theight)
   if (twidth == tex_width && theight == tex_height)
     return;
 
-  qDebug () << "!!! setting tex dims to" << twidth << theight;
-
   tex_width = twidth;
   tex_height = theight;
 
-  updateShaders ();
+  m_renderer->setTextureSize (twidth, theight);
 }
 
 void
 StimWindow::updateShaders ()
 {
-    //if (! isExposed () || tex_width == 0) {
-    if (tex_width == 0 || width () == 0 || height () == 0) {
-        qDebug () << "Not updating shaders!!! size is: " << width () << height ();
-	return;
-    }
-
-    qDebug () << "*** updating the shaders";
-
-    GLint gl_width = width ();
-    GLint gl_height = height ();
-
-    if (! m_context->makeCurrent (this))
-        qCritical () << "error: could not use the OpenGL context";
-    
-    // Create an identity vertex shader
-    glViewport (0, 0, gl_width, gl_height);
-
-    // Compute the offset to center the stimulus
-    GLfloat txw = static_cast<GLfloat> (tex_width) / gl_width;
-    GLfloat txh = static_cast<GLfloat> (tex_height) / gl_height;
-
-    GLfloat ofx = tex_width > gl_width ? 0.0f : 1.0f - txw;
-    GLfloat ofy = tex_height > gl_height ? 0.0f : 1.0f - txh;
-
-    GLfloat txm = ofx;
-    GLfloat txM = ofx + 2.0f * txw;
-    GLfloat tym = ofy;
-    GLfloat tyM = ofy + 2.0f * txh;
-
-    GLfloat tgw2_ratio = 2.0f * txw;
-    GLfloat tgh2_ratio = 2.0f * txh;
-
-    stringstream ss;
-    ss << fixed << setprecision(12)
-       << "const mat4 proj_matrix = mat4("
-       << (2.0/gl_width) << ", 0.0, 0.0, -1.0," << endl
-       << "0.0, " << -(2.0/gl_height) << ", 0.0, 1.0," << endl
-       << "0.0, 0.0, -1.0, 0.0," << endl
-       << "0.0, 0.0, 0.0, 1.0);" << endl
-       << "attribute vec2 ppos;" << endl
-       << "varying vec2 tex_coord;" << endl
-       << "void main () {" << endl
-       << "  gl_Position = vec4(ppos.x-1.0, ppos.y-1.0, 0.0, 1.0);" << endl
-       << "  tex_coord = vec2((ppos.x-" << ofx << ")/" << tgw2_ratio
-       << ", (ppos.y-"<<ofy<<")/" << tgh2_ratio << ");" << endl
-       << "}" << endl;
-    auto vshader_str = ss.str();
-    const char* vshader_txt = vshader_str.c_str();
-    //qDebug () << vshader_txt;
-    
-    // Remove previous vertex shader
-    if (m_vshader != nullptr) {
-        qDebug () << "Removing previous vertex shader";
-	m_program->removeShader (m_vshader);
-	delete m_vshader;
-    }
-
-    // Create a new vertex shader
-    m_vshader = new QOpenGLShader (QOpenGLShader::Vertex);
-    if (! m_vshader->compileSourceCode (vshader_txt))
-        qCritical () << "error: could not compile the vertex shader";
-    if (! m_program->addShader (m_vshader))
-        qCritical () << "error: could not add the vertex shader";
-    if (! m_program->link ())
-        qCritical () << "error: could not link the shader program";
-    if (! m_program->bind ())
-        qCritical () << "error: could not bind the shader program";
-
-    // Get the texture location
-    glActiveTexture (GL_TEXTURE0);
-    qDebug () << "glActTex err:" << glGetError ();
-
-    m_texloc = m_program->uniformLocation ("texture");
-    qDebug () << "texture located at:" << m_texloc;
-    int ppos = m_program->attributeLocation ("ppos");
-    qDebug () << "ppos attribute located at:" << ppos;
-    qDebug () << "pposattloc err:" << glGetError ();
-
-    // Triangle covering half the texture
-    vertices[0] = txm;
-    vertices[1] = tym;
-    vertices[2] = txM;
-    vertices[3] = tym;
-    vertices[4] = txm;
-    vertices[5] = tyM;
-
-    // Other half triangle
-    vertices[6] = txm;
-    vertices[7] = tyM;
-    vertices[8] = txM;
-    vertices[9] = tym;
-    vertices[10] = txM;
-    vertices[11] = tyM;
-
-    glBufferData (GL_ARRAY_BUFFER, 12*sizeof(GLfloat), vertices, GL_STATIC_DRAW);
-    glVertexAttribPointer (ppos, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray (ppos);
-    qDebug () << "glEnVeAP err:" << glGetError ();
-
-    m_context->doneCurrent ();
+    m_renderer->resize (width (), height ());
 }
 
 void
@@ -440,89 +337,18 @@ StimWindow::resizeEvent (QResizeEvent* evt)
 void
 StimWindow::showFixedFrame (const QString& name)
 {
-    if (! m_fixedFrames.contains (name)) {
-	qCritical () << "??? unknown fixed frame" << name;
-    }
-    else {
-        qDebug () << "showing fixed frame" << name;
-        m_currentFrame = m_fixedFrames[name];
-        renderNow ();
-    }
+    m_renderer->showFixedFrame (name);
 }
 
 void
 StimWindow::showAnimatedFrames (const QString& name)
 {
-    qDebug () << "showing animated frames" << name;
-    if (! m_animatedFrames.contains (name)) {
-	qCritical () << "??? unknown animated frame" << name;
-    }
-    else {
-        if (! m_context->makeCurrent (this)) {
-            qDebug () << "Could not make" << this << "the current context";
-            return;
-        }
-
-	auto& frames = m_animatedFrames[name];
-
-        QElapsedTimer timer;
-        timer.start ();
-	for (auto frame : frames) {
-	    m_currentFrame = frame;
-	    render ();
-	    m_context->swapBuffers (this);
-            /*for (int i = 0; i < 10; i++) {
-              render ();
-              m_context->swapBuffers (this);
-            }*/
-	}
-        qint64 nsecs = timer.nsecsElapsed ();
-        qDebug () << "animated frames shown in" << (nsecs/1000000) << "ms";
-
-        m_context->doneCurrent ();
-    }
-}
-
-void
-StimWindow::render ()
-{
-    //qDebug () << "StimWindow::render ()";
-    glClear (GL_COLOR_BUFFER_BIT);
-    //qDebug () << "glClear errors:" << glGetError ();
-
-    if (m_currentFrame == nullptr) {
-	qDebug () << "render() with no effect (no frame)";
-	return;
-    }
-
-    m_currentFrame->bind ();
-    //qDebug () << "    current frame: " << m_currentFrame << ", texloc: " << m_texloc;
-    //glBindTexture (GL_TEXTURE_2D, m_currentFrame);
-    //qDebug () << "BindTexture errors:" << glGetError ();
-    glUniform1i (m_texloc, 0);
-    //qDebug () << "uniform1i errors: " << glGetError ();
-    glDrawArrays (GL_TRIANGLES, 0, 6);
-
-    //glDrawElements (GL_TRIANGLES, 6, 
-
-    //qDebug () << glGetError ();
+    m_renderer->showAnimatedFrames (name);
 }
 
 void StimWindow::renderNow()
 {
-  if (! m_opengl_initialized)
-    return;
-    //qDebug () << "stimwindow::rendernow";
-    //if (! isExposed ())
-	//return;
-
-    // Render the frame, and swap the buffers
-    //qDebug () << "rendering and swapping";
-    m_context->makeCurrent (this);
-    //qDebug () << "make current errors:" << glGetError ();
-    render ();
-    m_context->swapBuffers (this);
-    m_context->doneCurrent ();
+    m_renderer->renderNow ();
 }
 
 void StimWindow::begin()
@@ -6,31 +6,65 @@
 #pragma once
 
 #include <QtGui>
-#include <QOpenGLFunctions_3_0>
 
 #ifdef HAVE_POWERMATE
 #include "powermate.h"
 #endif // HAVE_POWERMATE
 
 #include "../lib/displayer.h"
+#include "renderthread.h"
+#include "uploadthread.h"
 
 namespace plstim
 {
-class StimWindow : public QWindow, public Displayer,
-		   protected QOpenGLFunctions_3_0
+class StimWindow : public QWindow, public Displayer
 {
   Q_OBJECT
 public:
   explicit StimWindow (QScreen* scr=nullptr);
+  virtual ~StimWindow ();
 
   // Overrides from Displayer
+  virtual QImage frameBuffer (int width, int height,
+                              QImage::Format format=QImage::Format_RGB32) override;
+  virtual int maxFrameBuffers () override;
   virtual void addFixedFrame (const QString& name, const QImage& img) override;
   virtual void showFixedFrame (const QString& name) override;
   virtual void addAnimatedFrame (const QString& name, const QImage& img) override;
+  virtual void repeatAnimatedFrame (const QString& name, int frame) override;
+  virtual void shareAnimatedFrame (const QString& name, const QString& source,
+                                   int frame) override;
+  virtual void addProceduralFrames (const QString& name,
+                                    const ProceduralStimulus& stimulus) override;
+  virtual void addDotFrames (const QString& name,
+                             const DotFrames& dots) override;
+  virtual void addElementFrames (const QString& name,
+                                 const ElementFrames& elements) override;
+  virtual void addScheduledFrames (const QString& name, const QImage& img,
+                                   const FrameSchedule& schedule) override;
+  virtual void addStreamedFrames (const QString& name, int frames,
+                                  int width, int height, QImage::Format format,
+                                  int lookahead,
+                                  const FrameProducer& producer) override;
+  virtual void setFrameLayers (const QString& name,
+                               const QVector<FrameLayer>& layers) override;
+  virtual void paintFixedFrame (const QString& name, int width, int height,
+                                QImage::Format format,
+                                const FrameDrawing& drawing) override;
+  virtual void paintAnimatedFrame (const QString& name, int width, int height,
+                                   QImage::Format format,
+                                   const FrameDrawing& drawing) override;
   virtual void showAnimatedFrames (const QString& name) override;
   virtual void deleteAnimatedFrames (const QString& name) override;
+  virtual void deleteFrames (const QString& name) override;
+  virtual void reserveAnimatedFrames (const QString& name, int count) override;
   virtual void setTextureSize (int twidth, int theight) override;
   virtual void clear () override;
+  virtual TexturePoolStats texturePoolStats () override;
+  virtual void setFramesEvictable (const QString& name, bool evictable) override;
+  virtual void setMemoryBudget (qint64 bytes) override;
+  virtual void prepareFrames (const QString& name) override;
+  virtual void prewarm () override;
   virtual void begin() override;
   virtual void beginInline() override;
   virtual void end() override;
@@ -38,9 +72,11 @@ public:
 signals:
   void exposed() override;
   void keyPressed (QKeyEvent* evt) override;
-  
-public:
-  void render ();
+  void framesShown (const QString& name,
+                    const plstim::FrameTimings& timings) override;
+  void frameMemoryChanged (const QString& name, qint64 bytes,
+                           bool resident) override;
+
 public slots:
   void renderNow ();
   void updateShaders ();
@@ -58,19 +94,13 @@ protected:
 
   void setupOpenGL ();
 private:
-  QOpenGLContext* m_context;
-  QMap<QString,QOpenGLTexture*> m_fixedFrames;
-  QMap<QString,QVector<QOpenGLTexture*>> m_animatedFrames;
-  QOpenGLShaderProgram* m_program;
-  QOpenGLShader* m_vshader;
+  /// Presentation thread owning the OpenGL context
+  RenderThread* m_renderer;
+  /// Texture upload thread and its surface
+  UploadThread* m_uploader;
+  QOffscreenSurface* m_uploadSurface;
   int tex_width;
   int tex_height;
-  GLfloat vertices[12];
-  int m_texloc;
-  QOpenGLTexture* m_currentFrame;
-  GLuint m_vao;
-  GLuint m_vbo;
-  bool m_opengl_initialized = false;
 };
 } // namespace plstim
 
@@ -0,0 +1,163 @@
+// src/texturepool.cc – Recycling of frame textures
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include "texturepool.h"
+using namespace plstim;
+
+
+namespace plstim
+{
+
+TexelFormat
+texelFormat (QOpenGLTexture::TextureFormat format)
+{
+    switch (format) {
+    // Grayscale frames only use the red channel
+    case QOpenGLTexture::R8_UNorm:
+        return TexelFormat { QOpenGLTexture::Red, QOpenGLTexture::UInt8, 1 };
+    case QOpenGLTexture::R16_UNorm:
+        return TexelFormat { QOpenGLTexture::Red, QOpenGLTexture::UInt16, 2 };
+    // Matching the QImage::Format_RGB32 memory layout
+    default:
+        return TexelFormat { QOpenGLTexture::BGRA,
+                             QOpenGLTexture::UInt32_RGBA8_Rev, 4 };
+    }
+}
+
+qint64
+textureBytes (QOpenGLTexture* tex)
+{
+    return static_cast<qint64> (tex->width ()) * tex->height ()
+        * tex->layers () * texelFormat (tex->format ()).bytesPerTexel;
+}
+
+uint
+qHash (const TexturePool::Key& key, uint seed)
+{
+    return ::qHash (static_cast<int> (key.target), seed)
+        ^ ::qHash (static_cast<int> (key.format), seed)
+        ^ ::qHash ((key.width << 16) ^ key.height, seed)
+        ^ ::qHash (key.layers, seed);
+}
+
+} // namespace plstim
+
+bool
+TexturePool::Key::operator== (const Key& other) const
+{
+    return target == other.target && format == other.format
+        && width == other.width && height == other.height
+        && layers == other.layers;
+}
+
+TexturePool::Key
+TexturePool::keyOf (QOpenGLTexture* tex)
+{
+    return Key { tex->target (), tex->format (),
+                 tex->width (), tex->height (), tex->layers () };
+}
+
+TexturePool::TexturePool ()
+    : m_hits (0), m_misses (0)
+{
+}
+
+QOpenGLTexture*
+TexturePool::acquire (QOpenGLTexture::Target target,
+                      QOpenGLTexture::TextureFormat format,
+                      int width, int height, int layers)
+{
+    return take (Key { target, format, width, height, layers }, true);
+}
+
+QOpenGLTexture*
+TexturePool::acquireUncounted (QOpenGLTexture::Target target,
+                               QOpenGLTexture::TextureFormat format,
+                               int width, int height, int layers)
+{
+    return take (Key { target, format, width, height, layers }, false);
+}
+
+QOpenGLTexture*
+TexturePool::take (const Key& key, bool counted)
+{
+    QMutexLocker locker (&m_mutex);
+    auto it = m_free.find (key);
+    if (it == m_free.end ()) {
+        if (counted)
+            m_misses++;
+        return nullptr;
+    }
+
+    if (counted)
+        m_hits++;
+    auto tex = it.value ();
+    m_free.erase (it);
+    return tex;
+}
+
+void
+TexturePool::adopt (QOpenGLTexture* tex)
+{
+    QMutexLocker locker (&m_mutex);
+    m_textures.insert (tex);
+}
+
+bool
+TexturePool::release (QOpenGLTexture* tex)
+{
+    QMutexLocker locker (&m_mutex);
+    if (! m_textures.contains (tex))
+        return false;
+    m_free.insert (keyOf (tex), tex);
+    return true;
+}
+
+QList<QOpenGLTexture*>
+TexturePool::clear ()
+{
+    QMutexLocker locker (&m_mutex);
+    auto free = m_free.values ();
+    m_free.clear ();
+    m_textures.clear ();
+    return free;
+}
+
+QList<QOpenGLTexture*>
+TexturePool::takeFree ()
+{
+    QMutexLocker locker (&m_mutex);
+    auto free = m_free.values ();
+    m_free.clear ();
+    for (auto tex : free)
+        m_textures.remove (tex);
+    return free;
+}
+
+qint64
+TexturePool::freeBytes () const
+{
+    QMutexLocker locker (&m_mutex);
+    qint64 bytes = 0;
+    for (auto tex : m_free)
+        bytes += textureBytes (tex);
+    return bytes;
+}
+
+qint64
+TexturePool::hits () const
+{
+    QMutexLocker locker (&m_mutex);
+    return m_hits;
+}
+
+qint64
+TexturePool::misses () const
+{
+    QMutexLocker locker (&m_mutex);
+    return m_misses;
+}
+
+// vim: sw=4
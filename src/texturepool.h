@@ -0,0 +1,112 @@
+// src/texturepool.h – Recycling of frame textures
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#pragma once
+
+#include <QtGui>
+
+namespace plstim
+{
+
+/// Pixel transfer format of frame textures.
+struct TexelFormat
+{
+  QOpenGLTexture::PixelFormat pixels;
+  QOpenGLTexture::PixelType type;
+  int bytesPerTexel;
+};
+
+/// Transfer format matching the storage of a frame texture.
+TexelFormat texelFormat (QOpenGLTexture::TextureFormat format);
+
+/// Graphics memory used by a frame texture, in bytes.
+qint64 textureBytes (QOpenGLTexture* tex);
+
+/**
+ * Textures of the current context given back for reuse.
+ *
+ * Frames of a page usually have the same shape from one trial to
+ * the next, so their storage is handed back here once not presented
+ * anymore and refilled instead of being reallocated. Textures are
+ * keyed by target, format, size and number of layers.
+ *
+ * Textures are created and deleted by the upload thread, and given
+ * back by the render thread: all the methods are thread safe.
+ */
+class TexturePool
+{
+public:
+  TexturePool ();
+
+  /**
+   * Take a free texture of the given shape.
+   * Returns nullptr if there is none, the caller should then create
+   * it and adopt() it.
+   */
+  QOpenGLTexture* acquire (QOpenGLTexture::Target target,
+                           QOpenGLTexture::TextureFormat format,
+                           int width, int height, int layers=1);
+  /**
+   * Take a free texture like acquire(), without counting a hit or a
+   * miss: for storage that is not part of the steady state of
+   * uploads, such as frames restored from host memory.
+   */
+  QOpenGLTexture* acquireUncounted (QOpenGLTexture::Target target,
+                                    QOpenGLTexture::TextureFormat format,
+                                    int width, int height, int layers=1);
+  /// Make a newly created texture part of the pool.
+  void adopt (QOpenGLTexture* tex);
+  /**
+   * Give a texture back for reuse. Returns false if the texture is
+   * not part of the pool, in which case the caller should delete it.
+   */
+  bool release (QOpenGLTexture* tex);
+  /**
+   * Forget all the textures, returning the free ones to be deleted
+   * with their context current. Textures in use are not part of the
+   * pool anymore.
+   */
+  QList<QOpenGLTexture*> clear ();
+  /**
+   * Take all the free textures out of the pool, to be deleted in a
+   * context sharing their objects.
+   */
+  QList<QOpenGLTexture*> takeFree ();
+
+  /// Graphics memory held by the free textures.
+  qint64 freeBytes () const;
+
+  /// Number of acquire() calls served from the pool.
+  qint64 hits () const;
+  /// Number of acquire() calls that required an allocation.
+  qint64 misses () const;
+
+private:
+  struct Key
+  {
+    QOpenGLTexture::Target target;
+    QOpenGLTexture::TextureFormat format;
+    int width;
+    int height;
+    int layers;
+
+    bool operator== (const Key& other) const;
+  };
+  friend uint qHash (const Key& key, uint seed);
+  static Key keyOf (QOpenGLTexture* tex);
+  QOpenGLTexture* take (const Key& key, bool counted);
+
+  mutable QMutex m_mutex;
+  QMultiHash<Key,QOpenGLTexture*> m_free;
+  QSet<QOpenGLTexture*> m_textures;
+  qint64 m_hits;
+  qint64 m_misses;
+};
+
+} // namespace plstim
+
+// Local Variables:
+// mode: c++
+// End:
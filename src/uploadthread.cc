@@ -0,0 +1,901 @@
+// src/uploadthread.cc – Asynchronous texture uploads
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#include "uploadthread.h"
+#include "../lib/utils.h"
+using namespace plstim;
+
+
+/// Texture storage and transfer of a frame image format
+struct FrameFormat
+{
+    /// Image format transferred as is
+    QImage::Format image;
+    QOpenGLTexture::TextureFormat texture;
+    QOpenGLTexture::PixelFormat pixels;
+    QOpenGLTexture::PixelType type;
+    int bytesPerPixel;
+};
+
+static FrameFormat
+frameFormat (QImage::Format format)
+{
+    QOpenGLTexture::TextureFormat texture;
+    switch (format) {
+    // Grayscale frames only use the red channel
+    case QImage::Format_Grayscale8:
+        texture = QOpenGLTexture::R8_UNorm;
+        break;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+    case QImage::Format_Grayscale16:
+        texture = QOpenGLTexture::R16_UNorm;
+        break;
+#endif
+    // Same layout, layers keep their alpha channel
+    case QImage::Format_ARGB32:
+        texture = QOpenGLTexture::RGBA8_UNorm;
+        break;
+    // Storage matching the QImage::Format_RGB32 memory layout
+    default:
+        format = QImage::Format_RGB32;
+        texture = QOpenGLTexture::RGBA8_UNorm;
+        break;
+    }
+
+    auto tf = texelFormat (texture);
+    return FrameFormat { format, texture, tf.pixels, tf.type, tf.bytesPerTexel };
+}
+
+/// Whether a command adds a frame, with Frame arguments
+static bool
+isFrame (const RenderThread::Command& cmd)
+{
+    return cmd.type == RenderThread::Command::AddFixedFrame
+        || cmd.type == RenderThread::Command::AddAnimatedFrame;
+}
+
+UploadThread::UploadThread (RenderThread* renderer, QOffscreenSurface* surface)
+    : m_renderer (renderer), m_surface (surface),
+      m_mapFormat (QImage::Format_RGB32),
+      m_bufferCount (0), m_streaming (false), m_buffersReturned (false),
+      m_newContext (nullptr), m_contextReceived (false),
+      m_streamStaged (0), m_streamTaken (0), m_streamReleased (0),
+      m_staging (false),
+      m_context (nullptr), m_syncFunctions (nullptr),
+      m_npotTextures (true),
+      m_paintTarget (nullptr), m_resolveTarget (nullptr)
+{
+}
+
+UploadThread::~UploadThread ()
+{
+    if (isRunning ()) {
+        post (RenderThread::Command (RenderThread::Command::Stop));
+        wait ();
+    }
+}
+
+void
+UploadThread::post (const RenderThread::Command& cmd)
+{
+    QMutexLocker locker (&m_mutex);
+    RenderThread::Command posted = cmd;
+    auto frame = isFrame (cmd) ? cmd.arguments<RenderThread::Command::Frame> ()
+        : RenderThread::Command::Frame ();
+    const uchar* bits = frame.image.constBits ();
+    if (! frame.image.isNull ()) {
+        // Painted in a buffer whose context is gone, keep a copy
+        if (m_abandonedBuffers.take (bits) != nullptr) {
+            frame.image = frame.image.copy ();
+            posted.args = QVariant::fromValue (frame);
+            m_buffersReturned = true;
+        }
+        // Painting is over, the buffer can be transferred
+        else if (auto buf = m_lentBuffers.take (bits)) {
+            m_postedBuffers.insert (bits, buf);
+            m_bufferReady.wakeAll ();
+        }
+    }
+    m_commands.enqueue (posted);
+    m_cond.wakeOne ();
+}
+
+void
+UploadThread::setContext (QOpenGLContext* context)
+{
+    QMutexLocker locker (&m_mutex);
+    m_newContext = context;
+    m_contextReceived = true;
+    m_contextReady.wakeAll ();
+}
+
+TexturePool*
+UploadThread::pool ()
+{
+    return &m_pool;
+}
+
+QImage
+UploadThread::frameBuffer (int width, int height, QImage::Format format)
+{
+    QMutexLocker locker (&m_mutex);
+    QElapsedTimer waited;
+    waited.start ();
+    while (m_streaming && frameFormat (format).image == format) {
+        // Lend a mapped buffer of the right size
+        for (int i = 0; i < m_freeBuffers.size (); i++) {
+            auto buf = m_freeBuffers.at (i);
+            if (buf->width == width && buf->height == height
+                && buf->format == format) {
+                m_freeBuffers.removeAt (i);
+                m_lentBuffers.insert (buf->data, buf);
+                return QImage (buf->data, width, height, buf->bytesPerLine,
+                               format);
+            }
+        }
+
+        // Ask the upload thread for a new mapping, unless all the
+        // buffers are in flight
+        if (! m_freeBuffers.isEmpty () || m_bufferCount < MaxPixelBuffers) {
+            m_mapRequest = QSize (width, height);
+            m_mapFormat = format;
+            m_cond.wakeOne ();
+        }
+        qint64 left = BufferTimeout - waited.elapsed ();
+        if (left <= 0 || ! m_bufferReady.wait (&m_mutex, left)) {
+            qWarning () << "warning: no pixel buffer available, painting in client memory";
+            break;
+        }
+    }
+
+    // No pixel buffer available, frames will be copied
+    return QImage (width, height, format);
+}
+
+bool
+UploadThread::startStream (const std::shared_ptr<FrameStream>& stream,
+                           const QVector<QOpenGLTexture*>& textures)
+{
+    QMutexLocker locker (&m_mutex);
+    if (! m_streaming || textures.isEmpty ())
+        return false;
+    m_stream = stream;
+    m_streamTextures = textures;
+    m_streamStaged = 0;
+    m_streamTaken = 0;
+    m_streamReleased = 0;
+    m_stagedFrames.clear ();
+    // Painted frames are staged at once
+    stream->setNotifier ([this] {
+        QMutexLocker locker (&m_mutex);
+        m_cond.wakeOne ();
+    });
+    m_cond.wakeOne ();
+
+    // Frames painted already are staged before the first is shown
+    while (streamReady () || m_staging)
+        m_streamChanged.wait (&m_mutex);
+    return true;
+}
+
+UploadThread::StagedFrame
+UploadThread::takeStreamFrame ()
+{
+    QMutexLocker locker (&m_mutex);
+    StagedFrame staged;
+    if (m_stream == nullptr || m_streamTaken >= m_stream->frameCount ())
+        return staged;
+    bool late = m_stagedFrames.isEmpty ();
+    while (m_stream != nullptr && m_stagedFrames.isEmpty ())
+        m_streamChanged.wait (&m_mutex);
+    // Staging stopped with the context
+    if (m_stagedFrames.isEmpty ())
+        return staged;
+    staged = m_stagedFrames.dequeue ();
+    staged.late = late;
+    m_streamTaken++;
+    return staged;
+}
+
+void
+UploadThread::releaseStreamFrame ()
+{
+    QMutexLocker locker (&m_mutex);
+    if (m_streamReleased < m_streamTaken) {
+        m_streamReleased++;
+        m_cond.wakeOne ();
+    }
+}
+
+QList<UploadThread::StagedFrame>
+UploadThread::stopStream ()
+{
+    QMutexLocker locker (&m_mutex);
+    // The frame being staged writes to our textures
+    while (m_staging)
+        m_streamChanged.wait (&m_mutex);
+    if (m_stream != nullptr)
+        m_stream->setNotifier (nullptr);
+    m_stream.reset ();
+    m_streamTextures.clear ();
+    QList<StagedFrame> left = m_stagedFrames;
+    m_stagedFrames.clear ();
+    return left;
+}
+
+bool
+UploadThread::streamReady () const
+{
+    // At most one frame per texture ahead of the released ones
+    return m_stream != nullptr && ! m_staging
+        && m_streamStaged < m_stream->frameCount ()
+        && m_streamStaged - m_streamReleased < m_streamTextures.size ()
+        && m_stream->ready ();
+}
+
+void
+UploadThread::run ()
+{
+    for (;;) {
+        // Wait for the next command or mapping request
+        RenderThread::Command cmd;
+        QSize mapRequest;
+        QImage::Format mapFormat;
+        bool returned = false;
+        {
+            QMutexLocker locker (&m_mutex);
+            while (m_commands.isEmpty () && ! m_mapRequest.isValid ()
+                   && ! streamReady () && ! m_buffersReturned)
+                m_cond.wait (&m_mutex);
+            // Painting threads waiting for a buffer come first, then
+            // the frames being presented
+            if (m_mapRequest.isValid ()) {
+                mapRequest = m_mapRequest;
+                mapFormat = m_mapFormat;
+                m_mapRequest = QSize ();
+            }
+            else if (streamReady ()) {
+                m_staging = true;
+            }
+            else if (m_buffersReturned) {
+                m_buffersReturned = false;
+                returned = true;
+            }
+            else {
+                cmd = m_commands.dequeue ();
+            }
+        }
+
+        if (mapRequest.isValid ()) {
+            execMapBuffer (mapRequest.width (), mapRequest.height (), mapFormat);
+            continue;
+        }
+        if (m_staging) {
+            execStageFrame ();
+            continue;
+        }
+        if (returned) {
+            deleteAbandonedContexts ();
+            continue;
+        }
+
+        switch (cmd.type) {
+        case RenderThread::Command::SetupOpenGL:
+            execSetupOpenGL (cmd);
+            break;
+        case RenderThread::Command::AddFixedFrame:
+        case RenderThread::Command::AddAnimatedFrame:
+            upload (cmd);
+            m_renderer->enqueue (cmd);
+            break;
+        case RenderThread::Command::ReserveAnimatedFrames:
+            m_reservedFrames[cmd.name] = cmd.arguments<int> ();
+            break;
+        case RenderThread::Command::DeleteAnimatedFrames:
+        case RenderThread::Command::DeleteFrames:
+            // The next frames of the series go to a fresh array
+            m_filling.remove (cmd.name);
+            m_renderer->enqueue (cmd);
+            break;
+        case RenderThread::Command::ShowFixedFrame:
+        case RenderThread::Command::ShowAnimatedFrames:
+            // Shown series are complete and may be evicted by the
+            // render thread, frames are only added after a deletion
+            m_filling.remove (cmd.name);
+            m_renderer->enqueue (cmd);
+            break;
+        case RenderThread::Command::Clear:
+            clearTextures ();
+            m_renderer->enqueue (cmd);
+            break;
+        case RenderThread::Command::Stop:
+            destroyOpenGL ();
+            deleteAbandonedContexts ();
+            m_renderer->enqueue (cmd);
+            return;
+        default:
+            m_renderer->enqueue (cmd);
+            break;
+        }
+    }
+}
+
+void
+UploadThread::execSetupOpenGL (const RenderThread::Command& cmd)
+{
+    // Objects of the previous context die with it
+    destroyOpenGL ();
+
+    // The render thread creates both contexts
+    {
+        QMutexLocker locker (&m_mutex);
+        m_contextReceived = false;
+    }
+    m_renderer->enqueue (cmd);
+    QOpenGLContext* context;
+    {
+        QMutexLocker locker (&m_mutex);
+        while (! m_contextReceived)
+            m_contextReady.wait (&m_mutex);
+        context = m_newContext;
+        m_newContext = nullptr;
+    }
+
+    if (context == nullptr) {
+        qWarning () << "warning: no upload context, uploading from the render thread";
+        return;
+    }
+
+    m_context = context;
+    if (! m_context->makeCurrent (m_surface)) {
+        qCritical () << "error: could not use the upload context";
+        delete m_context;
+        m_context = nullptr;
+        return;
+    }
+    if (! initializeOpenGLFunctions ()) {
+        qCritical () << "error: could not initialise the upload OpenGL functions";
+        m_context->doneCurrent ();
+        delete m_context;
+        m_context = nullptr;
+        return;
+    }
+
+    auto fmt = m_context->format ();
+    if (fmt.version () >= qMakePair (3, 2)
+        || m_context->hasExtension ("GL_ARB_sync"))
+        m_syncFunctions = m_context->extraFunctions ();
+    m_npotTextures = QOpenGLTexture::hasFeature (QOpenGLTexture::NPOTTextures);
+
+    QMutexLocker locker (&m_mutex);
+    m_streaming = true;
+}
+
+void
+UploadThread::destroyOpenGL ()
+{
+    QList<PixelBuffer*> buffers;
+    QList<PixelBuffer*> abandoned;
+    {
+        QMutexLocker locker (&m_mutex);
+        m_streaming = false;
+        m_bufferReady.wakeAll ();
+
+        // Let the painting threads post the buffers lent to them
+        QElapsedTimer waited;
+        waited.start ();
+        while (! m_lentBuffers.isEmpty ()) {
+            qint64 left = BufferTimeout - waited.elapsed ();
+            if (left <= 0 || ! m_bufferReady.wait (&m_mutex, left))
+                break;
+        }
+
+        // Frames of a stream are not staged anymore
+        if (m_stream != nullptr) {
+            m_stream->setNotifier (nullptr);
+            m_stream.reset ();
+            m_streamTextures.clear ();
+            m_streamChanged.wakeAll ();
+        }
+
+        // Frames posted but not transferred yet are kept in client memory
+        for (auto& cmd : m_commands) {
+            if (! isFrame (cmd))
+                continue;
+            auto frame = cmd.arguments<RenderThread::Command::Frame> ();
+            if (! frame.image.isNull ()
+                && m_postedBuffers.contains (frame.image.constBits ())) {
+                frame.image = frame.image.copy ();
+                cmd.args = QVariant::fromValue (frame);
+            }
+        }
+
+        // Buffers still painted in keep their mapping, copied when posted
+        if (! m_lentBuffers.isEmpty ()) {
+            qWarning () << "warning:" << m_lentBuffers.size ()
+                        << "pixel buffers still painted in, keeping their context";
+            for (auto buf : m_lentBuffers)
+                m_abandonedBuffers.insert (buf->data, buf);
+            abandoned = m_lentBuffers.values ();
+            m_lentBuffers.clear ();
+        }
+
+        buffers = m_freeBuffers + m_postedBuffers.values ();
+        m_freeBuffers.clear ();
+        m_postedBuffers.clear ();
+        m_bufferCount = 0;
+    }
+
+    if (m_context == nullptr) {
+        qDeleteAll (buffers);
+        return;
+    }
+
+    clearTextures ();
+    delete m_paintTarget;
+    m_paintTarget = nullptr;
+    delete m_resolveTarget;
+    m_resolveTarget = nullptr;
+
+    for (auto buf : buffers) {
+        if (buf->data != nullptr) {
+            glBindBuffer (GL_PIXEL_UNPACK_BUFFER, buf->id);
+            glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+        }
+        glDeleteBuffers (1, &buf->id);
+        delete buf;
+    }
+    glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+
+    m_syncFunctions = nullptr;
+    m_context->doneCurrent ();
+    // Deleting the context would unmap the abandoned buffers, it is
+    // deleted with them once they are all posted
+    if (abandoned.isEmpty ()) {
+        delete m_context;
+    }
+    else {
+        QMutexLocker locker (&m_mutex);
+        m_abandonedContexts.insert (m_context, abandoned);
+        // Some may have been posted meanwhile
+        m_buffersReturned = true;
+    }
+    m_context = nullptr;
+}
+
+void
+UploadThread::deleteAbandonedContexts ()
+{
+    QHash<QOpenGLContext*,QList<PixelBuffer*>> released;
+    {
+        QMutexLocker locker (&m_mutex);
+        for (auto it = m_abandonedContexts.begin ();
+             it != m_abandonedContexts.end (); ) {
+            bool lent = false;
+            for (auto buf : it.value ())
+                lent = lent || m_abandonedBuffers.contains (buf->data);
+            if (lent) {
+                ++it;
+                continue;
+            }
+            released.insert (it.key (), it.value ());
+            it = m_abandonedContexts.erase (it);
+        }
+    }
+    if (released.isEmpty ())
+        return;
+
+    // Buffers are unmapped and deleted in their own context
+    for (auto it = released.constBegin (); it != released.constEnd (); ++it) {
+        auto context = it.key ();
+        if (context->makeCurrent (m_surface)) {
+            auto f = context->extraFunctions ();
+            for (auto buf : it.value ()) {
+                f->glBindBuffer (GL_PIXEL_UNPACK_BUFFER, buf->id);
+                f->glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+                f->glDeleteBuffers (1, &buf->id);
+            }
+            f->glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+            context->doneCurrent ();
+        }
+        qDebug () << "deleting an abandoned upload context and"
+                  << it.value ().size () << "pixel buffers";
+        qDeleteAll (it.value ());
+        delete context;
+    }
+    if (m_context != nullptr)
+        m_context->makeCurrent (m_surface);
+}
+
+bool
+UploadThread::mapBuffer (PixelBuffer* buf)
+{
+    GLsizeiptr size = buf->bytesPerLine * buf->height;
+    glBindBuffer (GL_PIXEL_UNPACK_BUFFER, buf->id);
+    // Orphan the previous storage, possibly still being transferred
+    glBufferData (GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    buf->data = static_cast<uchar*> (
+        glMapBufferRange (GL_PIXEL_UNPACK_BUFFER, 0, size,
+                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+    glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+    return buf->data != nullptr;
+}
+
+void
+UploadThread::execMapBuffer (int width, int height, QImage::Format format)
+{
+    PixelBuffer* buf = nullptr;
+    {
+        QMutexLocker locker (&m_mutex);
+        // Let the painting thread fall back to client memory
+        if (! m_streaming) {
+            m_bufferReady.wakeAll ();
+            return;
+        }
+
+        // Recycle a free buffer of another size
+        if (! m_freeBuffers.isEmpty ()) {
+            buf = m_freeBuffers.takeFirst ();
+        }
+        else if (m_bufferCount < MaxPixelBuffers) {
+            buf = new PixelBuffer { 0, 0, 0, format, 0, nullptr };
+            m_bufferCount++;
+        }
+        // Let the painting thread wait for an upload to give a buffer back
+        else {
+            m_bufferReady.wakeAll ();
+            return;
+        }
+    }
+
+    if (buf->id == 0) {
+        glGenBuffers (1, &buf->id);
+    }
+    else if (buf->data != nullptr) {
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, buf->id);
+        glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+        buf->data = nullptr;
+    }
+    // Rows aligned on 4 bytes, as expected by default by OpenGL
+    buf->width = width;
+    buf->height = height;
+    buf->format = format;
+    buf->bytesPerLine = (width * frameFormat (format).bytesPerPixel + 3) & ~3;
+    bool ok = mapBuffer (buf);
+
+    QMutexLocker locker (&m_mutex);
+    if (ok) {
+        m_freeBuffers.append (buf);
+    }
+    else {
+        qCritical () << "error: could not map a pixel buffer, disabling streaming";
+        glDeleteBuffers (1, &buf->id);
+        delete buf;
+        m_bufferCount--;
+        m_streaming = false;
+    }
+    m_bufferReady.wakeAll ();
+}
+
+void
+UploadThread::execStageFrame ()
+{
+    std::shared_ptr<FrameStream> stream;
+    QOpenGLTexture* tex;
+    {
+        QMutexLocker locker (&m_mutex);
+        stream = m_stream;
+        tex = m_streamTextures.at (m_streamStaged % m_streamTextures.size ());
+    }
+
+    // Painted already, copied to a pixel buffer if possible so that
+    // the producer can paint the next frames during the transfer
+    const QImage& frame = stream->acquire ();
+    auto buf = stagingBuffer (frame.width (), frame.height (), frame.format ());
+    QImage mapped;
+    if (buf != nullptr) {
+        int rowBytes = frame.width () * frameFormat (frame.format ()).bytesPerPixel;
+        for (int y = 0; y < frame.height (); y++)
+            memcpy (buf->data + y * buf->bytesPerLine, frame.constScanLine (y),
+                    rowBytes);
+        mapped = QImage (buf->data, frame.width (), frame.height (),
+                         buf->bytesPerLine, frame.format ());
+        stream->release ();
+    }
+    tex->bind ();
+    transfer (buf != nullptr ? mapped : frame, GL_TEXTURE_2D, 0);
+    tex->release ();
+    if (buf == nullptr)
+        stream->release ();
+
+    // Let the render thread wait for the transfer
+    GLsync fence = nullptr;
+    if (m_syncFunctions != nullptr) {
+        fence = m_syncFunctions->glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush ();
+    }
+    else {
+        glFinish ();
+    }
+
+    QMutexLocker locker (&m_mutex);
+    StagedFrame staged;
+    staged.texture = tex;
+    staged.fence = fence;
+    m_stagedFrames.enqueue (staged);
+    m_streamStaged++;
+    m_staging = false;
+    m_streamChanged.wakeAll ();
+}
+
+UploadThread::PixelBuffer*
+UploadThread::stagingBuffer (int width, int height, QImage::Format format)
+{
+    if (frameFormat (format).image != format)
+        return nullptr;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // Map a buffer of this shape if none is free
+        if (attempt > 0)
+            execMapBuffer (width, height, format);
+        QMutexLocker locker (&m_mutex);
+        if (! m_streaming)
+            return nullptr;
+        for (int i = 0; i < m_freeBuffers.size (); i++) {
+            auto buf = m_freeBuffers.at (i);
+            if (buf->width == width && buf->height == height
+                && buf->format == format) {
+                // Taken back by transfer ()
+                m_freeBuffers.removeAt (i);
+                m_postedBuffers.insert (buf->data, buf);
+                return buf;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void
+UploadThread::upload (RenderThread::Command& cmd)
+{
+    // Let the render thread upload the image itself
+    if (m_context == nullptr)
+        return;
+
+    auto frame = cmd.arguments<RenderThread::Command::Frame> ();
+    QOpenGLTexture* tex;
+    int layer = 0;
+    QImage::Format format = frame.drawing ? frame.format : frame.image.format ();
+    int width = frame.drawing ? frame.width : frame.image.width ();
+    int height = frame.drawing ? frame.height : frame.image.height ();
+
+    // Animated frames go to a layer of the series array
+    if (cmd.type == RenderThread::Command::AddAnimatedFrame)
+        tex = frameArray (cmd.name, format, width, height, &layer);
+    else
+        tex = createTexture (QOpenGLTexture::Target2D, format, width, height);
+
+    // Drawings are painted in place, falling back to the CPU
+    if (frame.drawing && ! draw (frame, tex, layer)) {
+        frame.image = QImage (width, height, format);
+        Displayer::rasterise (frame.image, frame.drawing);
+    }
+    if (! frame.image.isNull ()) {
+        tex->bind ();
+        transfer (frame.image, tex->target (), layer);
+        tex->release ();
+    }
+
+    // Let the render thread wait for the transfer
+    if (m_syncFunctions != nullptr) {
+        frame.fence = m_syncFunctions->glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush ();
+    }
+    else {
+        glFinish ();
+    }
+
+    frame.texture = tex;
+    frame.layer = layer;
+    frame.image = QImage ();
+    frame.drawing = nullptr;
+    cmd.args = QVariant::fromValue (frame);
+}
+
+bool
+UploadThread::draw (const RenderThread::Command::Frame& frame,
+                    QOpenGLTexture* tex, int layer)
+{
+    // Multisampled target for antialiasing, with the stencil paths need
+    QSize size (frame.width, frame.height);
+    GLenum internal = frameFormat (frame.format).texture == QOpenGLTexture::R16_UNorm
+        ? GL_RGBA16 : GL_RGBA8;
+    if (m_paintTarget == nullptr || m_paintTarget->size () != size
+        || m_paintTarget->format ().internalTextureFormat () != internal) {
+        delete m_paintTarget;
+        delete m_resolveTarget;
+        QOpenGLFramebufferObjectFormat fmt;
+        fmt.setInternalTextureFormat (internal);
+        fmt.setAttachment (QOpenGLFramebufferObject::CombinedDepthStencil);
+        fmt.setSamples (PaintSamples);
+        m_paintTarget = new QOpenGLFramebufferObject (size, fmt);
+        m_resolveTarget = new QOpenGLFramebufferObject (size, internal);
+    }
+    if (! m_paintTarget->isValid () || ! m_resolveTarget->isValid ()) {
+        qWarning () << "warning: cannot paint frames on the GPU";
+        return false;
+    }
+
+    // Frames are stored top row first
+    m_paintTarget->bind ();
+    glViewport (0, 0, frame.width, frame.height);
+    glClearColor (0, 0, 0, 0);
+    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+    {
+        QOpenGLPaintDevice device (size);
+        device.setPaintFlipped (true);
+        QPainter painter (&device);
+        frame.drawing (painter);
+    }
+
+    // Resolve the samples, then copy to the frame texture format
+    QOpenGLFramebufferObject::blitFramebuffer (m_resolveTarget, m_paintTarget);
+    glBindFramebuffer (GL_READ_FRAMEBUFFER, m_resolveTarget->handle ());
+    tex->bind ();
+    if (tex->target () == QOpenGLTexture::Target2DArray)
+        glCopyTexSubImage3D (GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer,
+                             0, 0, frame.width, frame.height);
+    else
+        glCopyTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0,
+                             0, 0, frame.width, frame.height);
+    tex->release ();
+    glBindFramebuffer (GL_FRAMEBUFFER, m_context->defaultFramebufferObject ());
+    return true;
+}
+
+void
+UploadThread::transfer (const QImage& image, GLenum target, int layer)
+{
+    PixelBuffer* buf;
+    {
+        QMutexLocker locker (&m_mutex);
+        buf = m_postedBuffers.take (image.constBits ());
+    }
+
+    // Asynchronous transfer from the pixel buffer
+    auto ff = frameFormat (image.format ());
+    QImage img;
+    const void* pixels = nullptr;
+    if (buf != nullptr) {
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, buf->id);
+        glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+        buf->data = nullptr;
+    }
+    // Copy from client memory
+    else {
+        img = image.format () == ff.image
+            ? image : image.convertToFormat (ff.image);
+        glPixelStorei (GL_UNPACK_ROW_LENGTH, img.bytesPerLine () / ff.bytesPerPixel);
+        pixels = img.constBits ();
+    }
+
+    if (target == GL_TEXTURE_2D_ARRAY)
+        glTexSubImage3D (target, 0, 0, 0, layer,
+                         image.width (), image.height (), 1,
+                         ff.pixels, ff.type, pixels);
+    else
+        glTexSubImage2D (target, 0, 0, 0, image.width (), image.height (),
+                         ff.pixels, ff.type, pixels);
+
+    if (buf == nullptr) {
+        glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+        return;
+    }
+    glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // Give the buffer back for painting
+    bool ok = mapBuffer (buf);
+    QMutexLocker locker (&m_mutex);
+    if (ok && m_streaming) {
+        m_freeBuffers.append (buf);
+    }
+    else {
+        glDeleteBuffers (1, &buf->id);
+        delete buf;
+        m_bufferCount--;
+    }
+    m_bufferReady.wakeAll ();
+}
+
+QOpenGLTexture*
+UploadThread::frameArray (const QString& name, QImage::Format format,
+                          int width, int height, int* layer)
+{
+    // First frame since the series was deleted
+    auto it = m_filling.find (name);
+    if (it == m_filling.end ()) {
+        int reserved = qMax (1, m_reservedFrames.value (name));
+        auto array = createTexture (QOpenGLTexture::Target2DArray,
+                                    format, width, height, reserved);
+        it = m_filling.insert (name, SeriesArray {array, 0});
+    }
+
+    // More frames than announced
+    auto& series = it.value ();
+    if (series.count == series.array->layers ())
+        series.array = growArray (series.array, format);
+
+    *layer = series.count++;
+    return series.array;
+}
+
+QOpenGLTexture*
+UploadThread::createTexture (QOpenGLTexture::Target target,
+                             QImage::Format format,
+                             int width, int height, int layers)
+{
+    // Frames fill the top left corner of padded textures
+    if (! m_npotTextures) {
+        width = nextPowerOfTwo (width);
+        height = nextPowerOfTwo (height);
+    }
+
+    auto ff = frameFormat (format);
+    auto tex = m_pool.acquire (target, ff.texture, width, height, layers);
+    if (tex != nullptr)
+        return tex;
+
+    // Immutable storage when supported, refilled by later uploads
+    tex = new QOpenGLTexture (target);
+    tex->setSize (width, height);
+    if (target == QOpenGLTexture::Target2DArray)
+        tex->setLayers (layers);
+    tex->setFormat (ff.texture);
+    tex->setMinificationFilter (QOpenGLTexture::Linear);
+    tex->setMagnificationFilter (QOpenGLTexture::Linear);
+    tex->allocateStorage (ff.pixels, ff.type);
+    m_pool.adopt (tex);
+    return tex;
+}
+
+QOpenGLTexture*
+UploadThread::growArray (QOpenGLTexture* array, QImage::Format format)
+{
+    int layers = array->layers ();
+    qWarning () << "warning: animated series exceeds its" << layers
+                << "reserved frames";
+    auto larger = createTexture (QOpenGLTexture::Target2DArray, format,
+                                 array->width (), array->height (),
+                                 2 * layers);
+
+    // Copy the frames already uploaded, on the GPU
+    GLuint fbo;
+    glGenFramebuffers (1, &fbo);
+    glBindFramebuffer (GL_READ_FRAMEBUFFER, fbo);
+    larger->bind ();
+    for (int i = 0; i < layers; i++) {
+        glFramebufferTextureLayer (GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                   array->textureId (), 0, i);
+        glCopyTexSubImage3D (GL_TEXTURE_2D_ARRAY, 0, 0, 0, i,
+                             0, 0, array->width (), array->height ());
+    }
+    larger->release ();
+    glBindFramebuffer (GL_READ_FRAMEBUFFER, m_context->defaultFramebufferObject ());
+    glDeleteFramebuffers (1, &fbo);
+
+    // The render thread gives the previous array back as it switches
+    glFinish ();
+    return larger;
+}
+
+void
+UploadThread::clearTextures ()
+{
+    // Textures still presented are deleted by the render thread
+    qDeleteAll (m_pool.clear ());
+    m_filling.clear ();
+    m_reservedFrames.clear ();
+}
+
+// vim: sw=4
@@ -0,0 +1,214 @@
+// src/uploadthread.h – Asynchronous texture uploads
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+
+#pragma once
+
+#include <QtGui>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFunctions_3_0>
+
+#include "renderthread.h"
+#include "texturepool.h"
+
+namespace plstim
+{
+
+/**
+ * Thread uploading frames to textures ahead of their presentation.
+ *
+ * Sits in front of a RenderThread, with an OpenGL context sharing
+ * its objects: frame images are streamed through pixel buffer
+ * objects, then the frame commands are forwarded to the render
+ * thread with the uploaded texture and a fence to wait for.
+ *
+ * Frames are best painted directly in the mapped memory of a pixel
+ * buffer, obtained with frameBuffer(), saving any copy on the CPU.
+ * Frame drawings may also be painted here on the GPU, into the
+ * frame textures, without any image or transfer.
+ *
+ * Animated series are uploaded in the layers of a texture array.
+ * Textures are given back to a pool by the render thread once not
+ * presented anymore, and refilled by later uploads of the same shape.
+ *
+ * Frames of a stream being presented are staged in a ring of
+ * textures of the render thread as soon as they are painted, ahead
+ * of the frames being shown, so that presenting them only binds
+ * their texture.
+ */
+class UploadThread : public QThread, protected QOpenGLFunctions_3_0
+{
+  Q_OBJECT
+public:
+  /// Maximal number of pixel buffers in flight.
+  static const int MaxPixelBuffers = 8;
+  /// Samples per pixel of frames painted on the GPU.
+  static const int PaintSamples = 4;
+  /// Longest wait for a pixel buffer, in milliseconds.
+  static const int BufferTimeout = 1000;
+
+  UploadThread (RenderThread* renderer, QOffscreenSurface* surface);
+  virtual ~UploadThread ();
+
+  /**
+   * Get an image in mapped pixel buffer memory to paint a frame in.
+   * The image must be given to the render thread as a new frame
+   * and not be used afterwards. Blocks while all the pixel buffers
+   * are in flight, at most BufferTimeout before falling back to an
+   * image in client memory. Formats other than QImage::Format_RGB32
+   * and grayscale are not streamed and will be converted on upload.
+   */
+  QImage frameBuffer (int width, int height, QImage::Format format);
+
+  /// Queue a render thread command, uploading its image if any.
+  void post (const RenderThread::Command& cmd);
+
+  /// Receive the context created for us by the render thread.
+  void setContext (QOpenGLContext* context);
+
+  /// Textures of the current upload context available for reuse.
+  TexturePool* pool ();
+
+  /// Frame of a stream staged in a texture
+  struct StagedFrame
+  {
+    /// Texture holding the frame, nullptr past the last frame
+    QOpenGLTexture* texture = nullptr;
+    /// Transfer completion fence
+    GLsync fence = nullptr;
+    /// Whether the frame was not staged yet when taken
+    bool late = false;
+  };
+
+  /**
+   * Stage the frames of a stream in turn in the given textures, as
+   * soon as they are painted and one of the textures is released.
+   * Returns once the frames painted so far are staged, or false if
+   * frames cannot be staged, e.g. without context.
+   */
+  bool startStream (const std::shared_ptr<FrameStream>& stream,
+                    const QVector<QOpenGLTexture*>& textures);
+  /// Wait for the next staged frame of the stream.
+  StagedFrame takeStreamFrame ();
+  /// Release the texture of the oldest frame taken.
+  void releaseStreamFrame ();
+  /// Stop staging, and get the frames staged but not taken.
+  QList<StagedFrame> stopStream ();
+
+protected:
+  virtual void run () override;
+
+private:
+  /// Texture array being filled
+  struct SeriesArray
+  {
+    QOpenGLTexture* array;
+    /// Number of layers filled
+    int count;
+  };
+
+  struct PixelBuffer
+  {
+    GLuint id;
+    int width;
+    int height;
+    QImage::Format format;
+    int bytesPerLine;
+    /// Mapped memory, or nullptr
+    uchar* data;
+  };
+
+  void execSetupOpenGL (const RenderThread::Command& cmd);
+  void execMapBuffer (int width, int height, QImage::Format format);
+  /// Whether the next frame of the stream can be staged.
+  bool streamReady () const;
+  void execStageFrame ();
+  /// Take a mapped pixel buffer of the given shape, or nullptr.
+  PixelBuffer* stagingBuffer (int width, int height, QImage::Format format);
+  void upload (RenderThread::Command& cmd);
+  /// Transfer an image to a texture, or a layer of a texture array.
+  void transfer (const QImage& image, GLenum target, int layer);
+  /// Paint a frame drawing in a texture, or a layer of a texture array.
+  bool draw (const RenderThread::Command::Frame& frame, QOpenGLTexture* tex,
+             int layer);
+  /// Get the array in which to upload the next frame of a series.
+  QOpenGLTexture* frameArray (const QString& name, QImage::Format format,
+                              int width, int height, int* layer);
+  /// Get a texture holding frames of the given size, from the pool if possible.
+  QOpenGLTexture* createTexture (QOpenGLTexture::Target target,
+                                 QImage::Format format,
+                                 int width, int height, int layers=1);
+  /// Copy an array in a new one with twice as many layers.
+  QOpenGLTexture* growArray (QOpenGLTexture* array, QImage::Format format);
+  /// Delete the pooled textures and forget the arrays being filled.
+  void clearTextures ();
+  /// Orphan and map a pixel buffer to be painted in again.
+  bool mapBuffer (PixelBuffer* buf);
+  /// Delete the abandoned contexts whose buffers were all posted.
+  void deleteAbandonedContexts ();
+  void destroyOpenGL ();
+
+  RenderThread* m_renderer;
+  QOffscreenSurface* m_surface;
+
+  // State shared with the posting threads
+  QMutex m_mutex;
+  QWaitCondition m_cond;
+  QQueue<RenderThread::Command> m_commands;
+  /// Requested mapping size, if any, and format
+  QSize m_mapRequest;
+  QImage::Format m_mapFormat;
+  /// Signaled when a pixel buffer becomes available
+  QWaitCondition m_bufferReady;
+  QList<PixelBuffer*> m_freeBuffers;
+  /// Buffers being painted in, then posted and waiting for transfer
+  QHash<const uchar*,PixelBuffer*> m_lentBuffers;
+  QHash<const uchar*,PixelBuffer*> m_postedBuffers;
+  /// Buffers still lent when their context was destroyed
+  QHash<const uchar*,PixelBuffer*> m_abandonedBuffers;
+  /// Destroyed contexts and their abandoned buffers, kept until all
+  /// these buffers are posted
+  QHash<QOpenGLContext*,QList<PixelBuffer*>> m_abandonedContexts;
+  /// Whether abandoned buffers were posted since the last check
+  bool m_buffersReturned;
+  int m_bufferCount;
+  /// Whether pixel buffers can be lent for painting
+  bool m_streaming;
+  /// Context handed over by the render thread
+  QWaitCondition m_contextReady;
+  QOpenGLContext* m_newContext;
+  bool m_contextReceived;
+  /// Textures created in the current context
+  TexturePool m_pool;
+  /// Stream being staged, in a ring of textures
+  std::shared_ptr<FrameStream> m_stream;
+  QVector<QOpenGLTexture*> m_streamTextures;
+  /// Frames staged, taken and released
+  int m_streamStaged;
+  int m_streamTaken;
+  int m_streamReleased;
+  QQueue<StagedFrame> m_stagedFrames;
+  /// Whether a frame is being staged
+  bool m_staging;
+  /// Signaled when a frame is staged or staging stops
+  QWaitCondition m_streamChanged;
+
+  // Only accessed from the upload thread
+  QOpenGLContext* m_context;
+  QOpenGLExtraFunctions* m_syncFunctions;
+  /// Whether textures may have any size, else frames are padded
+  bool m_npotTextures;
+  /// Announced number of frames per series
+  QHash<QString,int> m_reservedFrames;
+  QHash<QString,SeriesArray> m_filling;
+  /// Multisampled target of frame drawings, and its resolved samples
+  QOpenGLFramebufferObject* m_paintTarget;
+  QOpenGLFramebufferObject* m_resolveTarget;
+};
+
+} // namespace plstim
+
+// Local Variables:
+// mode: c++
+// End:
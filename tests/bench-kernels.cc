@@ -0,0 +1,99 @@
+// tests/bench-kernels.cc – Compare native stimulus kernels to JavaScript
+//
+// Copyright © 2012–2015 University of California, Irvine
+// Licensed under the Simplified BSD License.
+//
+// Usage: plstim-bench [size] [repetitions]
+
+#include <algorithm>
+
+#include <QtCore>
+#include <QtQml>
+
+#include "../lib/kernels.h"
+#include "../lib/qmltypes.h"
+#include "../lib/utils.h"
+
+using namespace plstim;
+
+namespace
+{
+
+/// Gabor drawn pixel by pixel, as paint handlers had to
+const char* gabor_js = R"(
+(function (size, sigma, frequency) {
+  for (var y = 0; y < size; y++) {
+    for (var x = 0; x < size; x++) {
+      var px = x + 0.5 - size/2;
+      var py = size/2 - y - 0.5;
+      var env = Math.exp (-(px*px + py*py) / (2*sigma*sigma));
+      var l = 0.5 + 0.5 * env * Math.sin (2*Math.PI*frequency*px);
+      painter.fillRect (x, y, 1, 1, Qt.rgba (l, l, l, 1));
+    }
+  }
+}))";
+
+/// Median duration of a call in milliseconds
+template<typename F> double
+measure (int repetitions, F f)
+{
+  QVector<double> times;
+  QElapsedTimer timer;
+  for (int i = 0; i < repetitions; i++) {
+    timer.start ();
+    f ();
+    times << timer.nsecsElapsed () / 1e6;
+  }
+  std::sort (times.begin (), times.end ());
+  return times[times.size () / 2];
+}
+
+} // anonymous namespace
+
+int
+main (int argc, char* argv[])
+{
+  QCoreApplication app (argc, argv);
+  plstim::initialise ();
+
+  auto args = app.arguments ();
+  int size = args.size () > 1 ? args[1].toInt () : 256;
+  int repetitions = args.size () > 2 ? args[2].toInt () : 20;
+  const qreal sigma = size / 6.0;
+  const qreal frequency = 8.0 / size;
+
+  QImage image (size, size, QImage::Format_RGB32);
+  QPainter qpainter (&image);
+  Painter painter (qpainter);
+
+  QTextStream out (stdout);
+  out << "Gabor of " << size << "x" << size << " pixels, median of "
+      << repetitions << " runs\n";
+
+  QQmlEngine engine;
+  QQmlEngine::setObjectOwnership (&painter, QQmlEngine::CppOwnership);
+  engine.globalObject ().setProperty ("painter", engine.newQObject (&painter));
+  auto gabor = engine.evaluate (gabor_js);
+  double js = measure (qMax (1, repetitions / 10), [&] {
+      gabor.call ({size, sigma, frequency});
+  });
+  out << qSetFieldWidth (24) << left << "JavaScript" << qSetFieldWidth (0)
+      << js << " ms\n";
+
+  for (int set = 0; set <= static_cast<int> (bestInstructionSet ()); set++) {
+    setInstructionSet (static_cast<InstructionSet> (set));
+    QString name = instructionSetName (instructionSet ());
+    double kernel = measure (repetitions, [&] {
+        paintGrating (image, frequency, 0, 0, 1, sigma);
+    });
+    double painted = measure (repetitions, [&] {
+        painter.drawGabor (0, 0, size, size, frequency, 0, 0, 1, sigma);
+    });
+    out << qSetFieldWidth (24) << left << name + " kernel" << qSetFieldWidth (0)
+        << kernel << " ms (" << js / kernel << "x)\n"
+        << qSetFieldWidth (24) << left << name + " Painter.drawGabor"
+        << qSetFieldWidth (0) << painted << " ms (" << js / painted << "x)\n";
+  }
+
+  return 0;
+}
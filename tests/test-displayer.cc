@@ -0,0 +1,60 @@
+#include "catch.hpp"
+
+#include "../lib/displayer.h"
+using namespace plstim;
+
+
+TEST_CASE( "frame timings", "[library]" ) {
+
+  const qint64 refresh = 10000000;	// 100 Hz
+
+  SECTION( "no frame" ) {
+    auto t = FrameTimings::fromSwapTimes(QVector<qint64>(), refresh);
+    REQUIRE( t.frames == 0 );
+    REQUIRE( t.dropped == 0 );
+  }
+
+  SECTION( "regular swaps" ) {
+    QVector<qint64> swaps { 5, 5+refresh, 5+2*refresh, 5+3*refresh };
+    auto t = FrameTimings::fromSwapTimes(swaps, refresh);
+    REQUIRE( t.onset == 5 );
+    REQUIRE( t.frames == 4 );
+    REQUIRE( t.dropped == 0 );
+    REQUIRE( t.maxInterval == refresh );
+  }
+
+  SECTION( "missed retraces" ) {
+    QVector<qint64> swaps { 0, refresh, 3*refresh, 4*refresh+refresh/4 };
+    auto t = FrameTimings::fromSwapTimes(swaps, refresh);
+    REQUIRE( t.dropped == 1 );
+    REQUIRE( t.maxInterval == 2*refresh );
+  }
+}
+
+TEST_CASE( "procedural stimuli", "[library]" ) {
+
+  ProceduralStimulus stim;
+  stim.frequency = 0.1f;	// 10 pixels per cycle
+  stim.contrast = 0.5f;
+
+  SECTION( "grating" ) {
+    REQUIRE( stim.luminance(0, 0, 0) == Approx(0.5) );
+    REQUIRE( stim.luminance(2.5f, 0, 0) == Approx(0.75) );
+    // Vertical bars do not vary along y
+    REQUIRE( stim.luminance(2.5f, 7, 0) == Approx(0.75) );
+  }
+
+  SECTION( "drift" ) {
+    stim.phaseStep = M_PI/2;
+    REQUIRE( stim.luminance(0, 0, 1) == Approx(0.75) );
+    REQUIRE( stim.luminance(0, 0, 3) == Approx(0.25) );
+  }
+
+  SECTION( "gabor" ) {
+    stim.kind = ProceduralStimulus::Gabor;
+    stim.sigma = 5;
+    REQUIRE( stim.luminance(2.5f, 0, 0) < 0.75 );
+    REQUIRE( stim.luminance(2.5f, 0, 0) > 0.5 );
+    REQUIRE( stim.luminance(52.5f, 0, 0) == Approx(0.5) );
+  }
+}
@@ -0,0 +1,223 @@
+#include "catch.hpp"
+
+#include "../lib/engine.h"
+#include "../lib/offscreendisplayer.h"
+using namespace plstim;
+
+
+/// Engine loading experiments from QML sources, with its internals
+class TestEngine : public Engine
+{
+public:
+  explicit TestEngine(Displayer* displayer)
+    : Engine(displayer)
+  {}
+
+  bool load(const QByteArray& qml)
+  {
+    m_component = new QQmlComponent(&m_engine);
+    m_component->setData(qml, QUrl());
+    experimentReady();
+    return m_experiment != nullptr;
+  }
+
+  const QByteArray& preparedRecord() const
+  { return m_preparedRecord; }
+
+  using Engine::prepareTrial;
+  using Engine::frameName;
+  using Engine::frameSet;
+};
+
+/// Setup of the engines, kept out of the user settings
+static void useTestSettings()
+{
+  QStandardPaths::setTestModeEnabled(true);
+  QSettings settings;
+  settings.setValue("setups/test/rate", 60);
+  settings.sync();
+}
+
+/// Let the engine go through a few event loop turns
+static void processEvents()
+{
+  for (int i = 0; i < 8; i++)
+    QCoreApplication::processEvents();
+}
+
+/// Send a key press as the displayer would
+static void pressKey(OffscreenDisplayer& displayer, int key)
+{
+  QKeyEvent evt(QEvent::KeyPress, key, Qt::NoModifier);
+  emit displayer.keyPressed(&evt);
+}
+
+/// Colour of the first pixel of a frame, once shown
+static QRgb shownPixel(OffscreenDisplayer& displayer, const QString& name)
+{
+  displayer.showFixedFrame(name);
+  return displayer.lastFrame().pixel(0, 0);
+}
+
+static const char* const pipelinedExperiment = R"(
+import PlStim 1.0
+
+Experiment {
+  trialCount: 4
+  pipelined: true
+  property int shade: 0
+  property Vector offsets: Vector { length: 2 }
+  trialParameters: { "shade": 0, "offsets": 0 }
+  onNewTrial: {
+    shade += 50;
+    offsets.set(0, shade);
+    offsets.set(1, -shade);
+  }
+
+  Page {
+    name: "stim"
+    paintTime: Page.TRIAL
+    onPaint: painter.fillRect(0, 0, 1, 1, Qt.rgba(shade / 255, 0, 0, 1))
+  }
+}
+)";
+
+
+TEST_CASE( "trial preparation", "[library]" ) {
+
+  useTestSettings();
+  OffscreenDisplayer displayer(0, OffscreenDisplayer::Software);
+  TestEngine engine(&displayer);
+  REQUIRE( engine.load(pipelinedExperiment) );
+  auto page = engine.experiment()->page(0);
+
+  QList<int> prepared;
+  QObject::connect(&engine, &Engine::preparedTrialChanged,
+		   [&prepared] (int trial) { prepared << trial; });
+
+  SECTION( "parameters" ) {
+    engine.prepareTrial(0);
+    REQUIRE( engine.preparedTrial() == 0 );
+    REQUIRE( prepared == QList<int>({0}) );
+
+    // Recorded when prepared, vectors within their length
+    auto record = engine.preparedRecord().constData();
+    auto shade = reinterpret_cast<const float*>(record + engine.trial_offsets["shade"]);
+    auto offsets = reinterpret_cast<const float*>(record + engine.trial_offsets["offsets"]);
+    REQUIRE( *shade == 50 );
+    REQUIRE( offsets[0] == 50 );
+    REQUIRE( offsets[1] == -50 );
+    REQUIRE( static_cast<size_t>(engine.preparedRecord().size()) == engine.record_size );
+  }
+
+  SECTION( "frame sets" ) {
+    // Consecutive trials paint in alternate sets
+    engine.prepareTrial(0);
+    engine.prepareTrial(1);
+    REQUIRE( prepared == QList<int>({0, 1}) );
+    REQUIRE( engine.frameName(page, engine.frameSet(0)) == "stim" );
+    REQUIRE( engine.frameName(page, engine.frameSet(1)) == "stim#1" );
+    REQUIRE( qRed(shownPixel(displayer, "stim")) == 50 );
+    REQUIRE( qRed(shownPixel(displayer, "stim#1")) == 100 );
+
+    // The set of the trial shown last is painted anew
+    engine.prepareTrial(2);
+    REQUIRE( qRed(shownPixel(displayer, "stim")) == 150 );
+    REQUIRE( qRed(shownPixel(displayer, "stim#1")) == 100 );
+  }
+
+  engine.unloadExperiment();
+}
+
+static const char* const branchingExperiment = R"(
+import PlStim 1.0
+
+Experiment {
+  trialCount: 1
+  property int correctPaints: 0
+  property int incorrectPaints: 0
+
+  Page {
+    name: "question"
+    acceptedKeys: ["Left", "Right"]
+    branches: [correct, incorrect]
+    onKeyPress: showPage(key == "Left" ? correct : incorrect)
+  }
+
+  Page {
+    id: correct
+    name: "correct"
+    paintTime: Page.ON_SHOW
+    onPaint: {
+      correctPaints++;
+      painter.fillRect(0, 0, 1, 1, "lime");
+    }
+  }
+
+  Page {
+    id: incorrect
+    name: "incorrect"
+    paintTime: Page.ON_SHOW
+    onPaint: {
+      incorrectPaints++;
+      painter.fillRect(0, 0, 1, 1, "red");
+    }
+  }
+}
+)";
+
+
+TEST_CASE( "branches", "[library]" ) {
+
+  useTestSettings();
+  OffscreenDisplayer displayer(0, OffscreenDisplayer::Software);
+  TestEngine engine(&displayer);
+  REQUIRE( engine.load(branchingExperiment) );
+  auto xp = engine.experiment();
+
+  SECTION( "painted ahead" ) {
+    engine.runSessionInline();
+    processEvents();
+    REQUIRE( engine.isRunning() );
+    REQUIRE( xp->property("correctPaints").toInt() == 1 );
+    REQUIRE( xp->property("incorrectPaints").toInt() == 1 );
+
+    // The branch taken is shown without being painted again
+    pressKey(displayer, Qt::Key_Left);
+    processEvents();
+    REQUIRE( xp->property("correctPaints").toInt() == 1 );
+    REQUIRE( displayer.lastFrame().pixel(0, 0) == QColor(Qt::green).rgb() );
+  }
+
+  SECTION( "rejected keys" ) {
+    // A key not accepted before the first event loop turn of the page
+    engine.runSessionInline();
+    QObject::connect(&displayer, &OffscreenDisplayer::exposed,
+		     [&displayer] { pressKey(displayer, Qt::Key_Up); });
+    processEvents();
+    REQUIRE( engine.isRunning() );
+    REQUIRE( xp->property("correctPaints").toInt() == 1 );
+    REQUIRE( xp->property("incorrectPaints").toInt() == 1 );
+
+    // Still shown without being painted again
+    pressKey(displayer, Qt::Key_Right);
+    processEvents();
+    REQUIRE( xp->property("incorrectPaints").toInt() == 1 );
+    REQUIRE( displayer.lastFrame().pixel(0, 0) == QColor(Qt::red).rgb() );
+  }
+
+  SECTION( "accepted keys" ) {
+    // Response before the first event loop turn of the page
+    engine.runSessionInline();
+    QObject::connect(&displayer, &OffscreenDisplayer::exposed,
+		     [&displayer] { pressKey(displayer, Qt::Key_Left); });
+    processEvents();
+    REQUIRE( engine.isRunning() );
+
+    // The branch taken is painted once shown, the other never
+    REQUIRE( xp->property("correctPaints").toInt() == 1 );
+    REQUIRE( xp->property("incorrectPaints").toInt() == 0 );
+  }
+
+  engine.unloadExperiment();
+}
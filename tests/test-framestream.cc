@@ -0,0 +1,103 @@
+#include "catch.hpp"
+
+#include "../lib/framestream.h"
+using namespace plstim;
+
+
+TEST_CASE( "frame stream", "[library]" ) {
+
+  QMutex mutex;
+  auto producer = [] (int frame, QImage& img) {
+    img.fill(qRgb(frame, frame, frame));
+  };
+
+  SECTION( "frames in order" ) {
+    FrameStream stream(10, 4, 4, QImage::Format_RGB32, 3, producer);
+    REQUIRE( stream.lookahead() == 3 );
+    for (int i = 0; i < 10; i++) {
+      const QImage& img = stream.acquire();
+      REQUIRE( qRed(img.pixel(0, 0)) == i );
+      stream.release();
+    }
+    REQUIRE( stream.acquire().isNull() );
+    REQUIRE( stream.position() == 10 );
+  }
+
+  SECTION( "back-pressure" ) {
+    QSemaphore paintedFrames;
+    int consumed = 0;
+    bool ahead = false;
+    FrameStream stream(10, 4, 4, QImage::Format_RGB32, 3,
+		       [&] (int frame, QImage& img) {
+			 img.fill(Qt::white);
+			 // Only the ring is painted ahead
+			 QMutexLocker lock(&mutex);
+			 if (frame >= consumed + 3)
+			   ahead = true;
+			 paintedFrames.release();
+		       });
+    paintedFrames.acquire(3);
+    REQUIRE( stream.bytes() == 3 * 4 * 4 * 4 );
+
+    // Counted as consumed before the producer may go on
+    for (int i = 0; i < 10; i++) {
+      stream.acquire();
+      {
+	QMutexLocker lock(&mutex);
+	consumed++;
+      }
+      stream.release();
+    }
+    REQUIRE( paintedFrames.available() == 7 );
+    QMutexLocker lock(&mutex);
+    REQUIRE( ! ahead );
+  }
+
+  SECTION( "ready frames" ) {
+    FrameStream stream(2, 4, 4, QImage::Format_RGB32, 2, producer);
+    stream.acquire();
+    REQUIRE( stream.ready() );
+    stream.release();
+    stream.acquire();
+    stream.release();
+    REQUIRE( ! stream.ready() );
+
+    // Notified of each painted frame
+    QSemaphore notified;
+    stream.setNotifier([&notified] { notified.release(); });
+    stream.rewind();
+    notified.acquire(2);
+    REQUIRE( stream.ready() );
+    REQUIRE( stream.position() == 0 );
+  }
+
+  SECTION( "underruns" ) {
+    // The first frame is painted once the consumer waits for it
+    QAtomicInt gated(1);
+    QAtomicPointer<FrameStream> consumer;
+    FrameStream stream(4, 4, 4, QImage::Format_RGB32, 2,
+		       [&] (int frame, QImage& img) {
+			 while (frame == 0 && gated.loadAcquire()
+				&& (consumer.loadAcquire() == nullptr
+				    || consumer.loadAcquire()->underruns() == 0))
+			   QThread::yieldCurrentThread();
+			 img.fill(Qt::white);
+		       });
+    consumer.storeRelease(&stream);
+    for (int i = 0; i < 4; i++) {
+      stream.acquire();
+      stream.release();
+    }
+    REQUIRE( stream.underruns() > 0 );
+
+    // Counted again from the first frame, painted before acquired
+    gated.storeRelease(0);
+    QSemaphore paintedFrames;
+    stream.setNotifier([&paintedFrames] { paintedFrames.release(); });
+    stream.rewind();
+    REQUIRE( stream.position() == 0 );
+    paintedFrames.acquire();
+    stream.acquire();
+    REQUIRE( stream.underruns() == 0 );
+  }
+}
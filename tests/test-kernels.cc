@@ -0,0 +1,97 @@
+#include "catch.hpp"
+
+#include "../lib/kernels.h"
+#include "../lib/qmltypes.h"
+#include "../lib/utils.h"
+using namespace plstim;
+
+
+TEST_CASE( "stimulus kernels", "[library]" ) {
+
+  QImage img(64, 48, QImage::Format_Grayscale8);
+
+  SECTION( "grating" ) {
+    // Vertical bars of 16 pixels, peaking 4 pixels right of the centre
+    paintGrating(img, 1.0/16, 0, 0, 1);
+    REQUIRE( qGray(img.pixel(32 + 4, 10)) > 250 );
+    REQUIRE( qGray(img.pixel(32 - 5, 20)) < 5 );
+    REQUIRE( img.pixel(32 + 4, 10) == img.pixel(32 + 4, 40) );
+  }
+
+  SECTION( "gaussian" ) {
+    paintGaussian(img, 4, 1);
+    REQUIRE( qGray(img.pixel(32, 24)) > 250 );
+    REQUIRE( qGray(img.pixel(0, 0)) == 128 );
+  }
+
+  SECTION( "checkerboard" ) {
+    paintCheckerboard(img, 8, 0.5);
+    REQUIRE( qGray(img.pixel(32, 23)) == 191 );
+    REQUIRE( qGray(img.pixel(40, 23)) == 64 );
+    REQUIRE( qGray(img.pixel(40, 24)) == 191 );
+  }
+}
+
+TEST_CASE( "kernel instruction sets", "[library]" ) {
+
+  auto best = bestInstructionSet();
+  QImage scalar(67, 31, QImage::Format_RGB32);
+  QImage vector(67, 31, QImage::Format_RGB32);
+
+  auto paint = [](QImage& img) {
+    paintGrating(img, 0.07, 1, 0.4, 0.9, 10);
+  };
+  setInstructionSet(InstructionSet::Scalar);
+  paint(scalar);
+  setInstructionSet(best);
+  paint(vector);
+
+  // Approximations stay within a gray level
+  REQUIRE( instructionSet() == best );
+  REQUIRE( pixelDifference(scalar, vector).maximum <= 1 );
+}
+
+TEST_CASE( "painter kernels", "[library]" ) {
+
+  QImage painted(32, 32, QImage::Format_RGB32);
+  painted.fill(0);
+  DisplayList list;
+
+  QPainter painter(&painted);
+  Painter wrapped(painter);
+  wrapped.setRecording(&list);
+  wrapped.drawGabor(4, 4, 24, 24, 0.1, 0, 45, 1, 6);
+  painter.end();
+  list.finish();
+
+  QImage patch(24, 24, QImage::Format_RGB32);
+  paintGrating(patch, 0.1, 0, radians(45), 1, 6);
+  REQUIRE( painted.copy(4, 4, 24, 24) == patch );
+  REQUIRE( painted.pixel(0, 0) == qRgb(0, 0, 0) );
+
+  // Kernels are evaluated again on replay
+  QImage replayed(32, 32, QImage::Format_RGB32);
+  replayed.fill(0);
+  QPainter p(&replayed);
+  list.replay(p);
+  p.end();
+  REQUIRE( replayed == painted );
+}
+
+TEST_CASE( "painter kernels in place", "[library]" ) {
+
+  // Grayscale frames are written directly, through translations
+  QImage painted(32, 32, QImage::Format_Grayscale8);
+  painted.fill(0);
+  QPainter painter(&painted);
+  painter.translate(2, 1);
+  Painter wrapped(painter);
+  wrapped.drawGaussian(2, 3, 24, 24, 5, 1);
+  painter.end();
+
+  QImage patch(24, 24, QImage::Format_Grayscale8);
+  paintGaussian(patch, 5, 1);
+  REQUIRE( painted.copy(4, 4, 24, 24) == patch );
+  REQUIRE( qGray(painted.pixel(3, 3)) == 0 );
+  REQUIRE( qGray(painted.pixel(28, 28)) == 0 );
+}
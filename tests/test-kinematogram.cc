@@ -0,0 +1,68 @@
+#include "catch.hpp"
+
+#include "../lib/kinematogram.h"
+using namespace plstim;
+
+
+TEST_CASE( "kinematogram", "[library]" ) {
+
+  Kinematogram dots;
+  dots.setCount(50);
+  dots.setWidth(100);
+  dots.setHeight(80);
+  dots.setSpeed(3);
+  dots.setSeed(42);
+  dots.startTrial(7);
+  QPointF centre(0, 0);
+
+  SECTION( "seeded trials" ) {
+    auto first = dots.points(5, centre);
+    quint32 seed = dots.trialSeed();
+    REQUIRE( first.size() == 50 );
+
+    // Earlier frames are generated again from the trial seed
+    dots.points(0, centre);
+    REQUIRE( dots.points(5, centre) == first );
+    REQUIRE( dots.trialSeed() == seed );
+
+    dots.startTrial(8);
+    REQUIRE( dots.points(5, centre) != first );
+  }
+
+  SECTION( "coherent motion" ) {
+    dots.setCoherence(1);
+    dots.setDirection(90);
+    auto before = dots.points(3, centre);
+    auto after = dots.points(4, centre);
+    for (int i = 0; i < before.size(); i++) {
+      // Upwards, unless wrapped around
+      double dy = after[i].y() - before[i].y();
+      REQUIRE( after[i].x() == Approx(before[i].x()) );
+      REQUIRE( (dy == Approx(-3) || dy == Approx(80 - 3)) );
+    }
+  }
+
+  SECTION( "aperture" ) {
+    dots.setCoherence(0.5);
+    dots.setLifetime(4);
+    dots.setCircular(true);
+    auto points = dots.points(20, centre);
+    REQUIRE( points.size() < 50 );
+    for (const auto& p : points) {
+      REQUIRE( p.x()*p.x()/2500 + p.y()*p.y()/1600 <= 1.0001 );
+    }
+    REQUIRE( dots.points(20, centre, true).size() == 50 );
+  }
+
+  SECTION( "log" ) {
+    dots.setLogged(true);
+    auto points = dots.points(9, centre);
+    REQUIRE( dots.loggedFrames() == 10 );
+    const auto& log = dots.log();
+    REQUIRE( log.size() == 10 * Kinematogram::LogFields * 50 );
+    // Horizontal then vertical positions of the last frame
+    int last = 9 * Kinematogram::LogFields * 50;
+    REQUIRE( log[last + 2] == Approx(points[2].x()) );
+    REQUIRE( log[last + 50 + 2] == Approx(points[2].y()) );
+  }
+}
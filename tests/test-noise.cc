@@ -0,0 +1,97 @@
+#include "catch.hpp"
+
+#include "../lib/noise.h"
+using namespace plstim;
+
+
+/// Mean and standard deviation of the gray levels of an image
+static QPair<double,double>
+grayStatistics(const QImage& img)
+{
+  double sum = 0;
+  double squares = 0;
+  for (int y = 0; y < img.height(); y++) {
+    for (int x = 0; x < img.width(); x++) {
+      int v = qGray(img.pixel(x, y));
+      sum += v;
+      squares += v * v;
+    }
+  }
+  double n = img.width() * img.height();
+  double mean = sum / n;
+  return qMakePair(mean, std::sqrt(squares / n - mean * mean));
+}
+
+TEST_CASE( "noise", "[library]" ) {
+
+  clearNoiseFilterCache();
+  NoiseSpectrum spectrum;
+  spectrum.exponent = 1;
+  QImage img(100, 60, QImage::Format_RGB32);
+
+  SECTION( "contrast" ) {
+    paintNoise(img, spectrum, 0.2f, 42);
+    auto stats = grayStatistics(img);
+    REQUIRE( stats.first == Approx(127.5).epsilon(0.01) );
+    REQUIRE( stats.second / stats.first == Approx(0.2).epsilon(0.02) );
+  }
+
+  SECTION( "seeds" ) {
+    QImage other(img.size(), img.format());
+    paintNoise(img, spectrum, 0.2f, 42);
+    paintNoise(other, spectrum, 0.2f, 42);
+    REQUIRE( img == other );
+    paintNoise(other, spectrum, 0.2f, 43);
+    REQUIRE( img != other );
+  }
+
+  SECTION( "pairs" ) {
+    // Frames of a pair are filtered apart
+    QImage first(img.size(), img.format());
+    QImage second(img.size(), img.format());
+    paintNoise(first, second, spectrum, 0.2f, 1, 2);
+    paintNoise(img, spectrum, 0.2f, 2);
+    for (int y = 0; y < img.height(); y++)
+      for (int x = 0; x < img.width(); x++)
+	REQUIRE( qAbs(qGray(img.pixel(x, y)) - qGray(second.pixel(x, y))) <= 1 );
+  }
+
+  SECTION( "orientation" ) {
+    // Vertical stripes vary along rows only
+    spectrum.lowFrequency = 0.05f;
+    spectrum.highFrequency = 0.1f;
+    spectrum.orientationBandwidth = 0.1f;
+    paintNoise(img, spectrum, 0.3f, 5);
+    int dx = 0;
+    int dy = 0;
+    for (int y = 0; y + 1 < img.height(); y++) {
+      for (int x = 0; x + 1 < img.width(); x++) {
+	dx += qAbs(qGray(img.pixel(x + 1, y)) - qGray(img.pixel(x, y)));
+	dy += qAbs(qGray(img.pixel(x, y + 1)) - qGray(img.pixel(x, y)));
+      }
+    }
+    REQUIRE( dx > 4 * dy );
+  }
+
+  SECTION( "filter cache" ) {
+    auto filter = noiseFilter(100, 60, spectrum);
+    REQUIRE( filter.size() == 128 * 64 );
+    REQUIRE( filter[0] == 0 );
+    REQUIRE( noiseFilterCacheSize() == 1 );
+    paintNoise(img, spectrum, 0.2f, 1);
+    REQUIRE( noiseFilterCacheSize() == 1 );
+    noiseFilter(64, 64, spectrum);
+    REQUIRE( noiseFilterCacheSize() == 2 );
+  }
+
+  SECTION( "hermitian filter" ) {
+    // Oriented spectra differ at opposite Nyquist frequencies
+    spectrum.orientation = 0.5f;
+    spectrum.orientationBandwidth = 0.3f;
+    auto filter = noiseFilter(16, 8, spectrum);
+    for (int j = 0; j < 8; j++)
+      for (int i = 0; i < 16; i++)
+	REQUIRE( filter[j * 16 + i]
+		 == Approx(filter[(8 - j) % 8 * 16 + (16 - i) % 16]) );
+  }
+}
@@ -0,0 +1,181 @@
+#include "catch.hpp"
+
+#include "../lib/offscreendisplayer.h"
+using namespace plstim;
+
+
+TEST_CASE( "offscreen displayer", "[library]" ) {
+
+  const qreal rate = 100;
+  const qint64 refresh = 10000000;
+
+  OffscreenDisplayer displayer(rate, OffscreenDisplayer::Software);
+  REQUIRE( displayer.backend() == OffscreenDisplayer::Software );
+  displayer.setTextureSize(8, 4);
+
+  QList<FrameTimings> shown;
+  QObject::connect(&displayer, &OffscreenDisplayer::framesShown,
+		   [&shown] (const QString&, const FrameTimings& t) {
+		     shown << t;
+		   });
+
+  SECTION( "animated frames" ) {
+    for (auto color : { Qt::red, Qt::green, Qt::blue }) {
+      QImage img(8, 4, QImage::Format_RGB32);
+      img.fill(color);
+      displayer.addAnimatedFrame("frames", img);
+    }
+    displayer.showAnimatedFrames("frames");
+
+    // Notified asynchronously
+    REQUIRE( shown.isEmpty() );
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( shown.first().frames == 3 );
+    REQUIRE( shown.first().maxInterval >= refresh );
+    REQUIRE( shown.first().onset % refresh == 0 );
+    REQUIRE( displayer.lastFrame().pixel(3, 2) == QColor(Qt::blue).rgb() );
+  }
+
+  SECTION( "element frames" ) {
+    ElementFrames elements;
+    elements.width = 8;
+    elements.height = 4;
+    elements.count = 1;
+    elements.background = 0.5f;
+    // A white disc covering the left half, over mid-gray
+    elements.attributes = { 2, 2, 0, 4, 1, 0 };
+    displayer.addElementFrames("elements", elements);
+    displayer.showFixedFrame("elements");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( qGray(displayer.lastFrame().pixel(2, 2)) == 255 );
+    REQUIRE( qGray(displayer.lastFrame().pixel(6, 2)) == 128 );
+  }
+
+  SECTION( "scheduled frames" ) {
+    QImage img(8, 4, QImage::Format_RGB32);
+    img.fill(Qt::black);
+    for (int y = 0; y < 4; y++)
+      for (int x = 0; x < 4; x++)
+	img.setPixel(x, y, qRgb(255, 255, 255));
+    FrameSchedule schedule;
+    schedule.append(QTransform());
+    schedule.append(QTransform::fromTranslate(4, 0), 0.5f);
+    displayer.addScheduledFrames("scheduled", img, schedule);
+    displayer.showAnimatedFrames("scheduled");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( shown.first().frames == 2 );
+    // Moved right at half contrast, nothing left behind
+    REQUIRE( qGray(displayer.lastFrame().pixel(6, 2)) == 191 );
+    REQUIRE( qGray(displayer.lastFrame().pixel(1, 2)) == 0 );
+  }
+
+  SECTION( "repeated frames" ) {
+    qint64 bytes = 0;
+    QObject::connect(&displayer, &OffscreenDisplayer::frameMemoryChanged,
+		     [&bytes] (const QString&, qint64 b, bool) { bytes = b; });
+    QImage red(8, 4, QImage::Format_RGB32);
+    red.fill(Qt::red);
+    QImage blue(8, 4, QImage::Format_RGB32);
+    blue.fill(Qt::blue);
+    displayer.addAnimatedFrame("repeated", red);
+    displayer.addAnimatedFrame("repeated", blue);
+    displayer.repeatAnimatedFrame("repeated", 0);
+    displayer.repeatAnimatedFrame("repeated", 2);
+    // Only the distinct frames are stored
+    REQUIRE( bytes == 2 * red.bytesPerLine() * red.height() );
+    displayer.showAnimatedFrames("repeated");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( shown.first().frames == 4 );
+    REQUIRE( displayer.lastFrame().pixel(3, 2) == QColor(Qt::red).rgb() );
+  }
+
+  SECTION( "shared frames" ) {
+    QImage red(8, 4, QImage::Format_RGB32);
+    red.fill(Qt::red);
+    QImage blue(8, 4, QImage::Format_RGB32);
+    blue.fill(Qt::blue);
+    displayer.addAnimatedFrame("first", red);
+    displayer.addAnimatedFrame("first", blue);
+    displayer.repeatAnimatedFrame("first", 1);
+    displayer.addAnimatedFrame("second", blue);
+    displayer.shareAnimatedFrame("second", "first", 2);
+    displayer.shareAnimatedFrame("second", "first", 0);
+    // Kept once the other series is gone
+    displayer.deleteAnimatedFrames("first");
+    displayer.showAnimatedFrames("second");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( shown.first().frames == 3 );
+    REQUIRE( displayer.lastFrame().pixel(3, 2) == QColor(Qt::red).rgb() );
+  }
+
+  SECTION( "streamed frames" ) {
+    displayer.addStreamedFrames("streamed", 5, 8, 4, QImage::Format_RGB32, 2,
+				[] (int frame, QImage& img) {
+				  img.fill(qRgb(0, 0, 50 * frame));
+				});
+    displayer.showAnimatedFrames("streamed");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( shown.first().frames == 5 );
+    REQUIRE( qBlue(displayer.lastFrame().pixel(3, 2)) == 200 );
+
+    // Painted again for each presentation
+    displayer.showAnimatedFrames("streamed");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 2 );
+    REQUIRE( shown.last().frames == 5 );
+  }
+
+  SECTION( "layers" ) {
+    QImage base(8, 4, QImage::Format_RGB32);
+    base.fill(Qt::blue);
+    displayer.addFixedFrame("layered", base);
+    QImage layer(2, 2, QImage::Format_ARGB32);
+    layer.fill(qRgba(255, 0, 0, 255));
+    layer.setPixel(1, 1, qRgba(0, 0, 0, 0));
+    displayer.addFixedFrame("layered/layer0", layer);
+    displayer.setFrameLayers("layered",
+			     { FrameLayer { "layered/layer0", QRect(4, 2, 2, 2) } });
+    displayer.showFixedFrame("layered");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( shown.first().frames == 1 );
+    // Blended at its place, transparent pixels left alone
+    REQUIRE( displayer.lastFrame().pixel(4, 2) == QColor(Qt::red).rgb() );
+    REQUIRE( displayer.lastFrame().pixel(5, 3) == QColor(Qt::blue).rgb() );
+    REQUIRE( displayer.lastFrame().pixel(1, 1) == QColor(Qt::blue).rgb() );
+
+    // Pages may only have layers
+    displayer.setFrameLayers("bare",
+			     { FrameLayer { "layered/layer0", QRect(0, 0, 2, 2) } });
+    displayer.showFixedFrame("bare");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 2 );
+    REQUIRE( shown.last().frames == 1 );
+    REQUIRE( displayer.lastFrame().pixel(0, 0) == QColor(Qt::red).rgb() );
+    REQUIRE( displayer.lastFrame().pixel(4, 2) == QColor(Qt::black).rgb() );
+  }
+
+  SECTION( "deleted frames" ) {
+    QImage img(8, 4, QImage::Format_RGB32);
+    img.fill(Qt::red);
+    displayer.addFixedFrame("cached", img);
+    displayer.deleteFrames("cached");
+    displayer.showFixedFrame("cached");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( shown.first().frames == 0 );
+  }
+
+  SECTION( "unknown frame" ) {
+    displayer.showFixedFrame("missing");
+    QCoreApplication::processEvents();
+    REQUIRE( shown.size() == 1 );
+    REQUIRE( shown.first().frames == 0 );
+  }
+}
@@ -0,0 +1,79 @@
+#include "catch.hpp"
+
+#include "../lib/qmltypes.h"
+using namespace plstim;
+
+
+TEST_CASE( "display list", "[library]" ) {
+
+  QImage painted(32, 32, QImage::Format_RGB32);
+  painted.fill(0);
+  DisplayList list;
+
+  // Paint through the QML wrapper while recording
+  QPainter painter(&painted);
+  Painter wrapped(painter);
+  wrapped.setRecording(&list);
+  wrapped.fillRect(0, 0, 16, 32, Qt::red);
+  wrapped.setBrush(Qt::green);
+  wrapped.drawEllipse(18, 4, 10, 10);
+  wrapped.setPen(Qt::blue);
+  wrapped.drawLine(0, 31, 31, 31);
+  painter.end();
+  list.finish();
+
+  SECTION( "replay" ) {
+    QImage replayed(32, 32, QImage::Format_RGB32);
+    replayed.fill(0);
+    QPainter p(&replayed);
+    list.replay(p);
+    p.end();
+    REQUIRE( list.recorded() );
+    REQUIRE( replayed == painted );
+  }
+
+  SECTION( "hash" ) {
+    DisplayList same;
+    same.fillRect(0, 0, 16, 32, Qt::red);
+    same.setBrush(Qt::green);
+    same.drawEllipse(18, 4, 10, 10);
+    same.setPen(QPen(QColor(Qt::blue)));
+    same.drawLine(0, 31, 31, 31);
+    REQUIRE( same.hash() == list.hash() );
+    same.drawLine(0, 0, 31, 0);
+    REQUIRE( same.hash() != list.hash() );
+  }
+
+  SECTION( "clear" ) {
+    list.clear();
+    REQUIRE( ! list.recorded() );
+  }
+}
+
+TEST_CASE( "pixel difference", "[library]" ) {
+
+  QImage a(4, 4, QImage::Format_RGB32);
+  a.fill(qRgb(10, 20, 30));
+  QImage b = a.copy();
+
+  SECTION( "identical" ) {
+    auto d = pixelDifference(a, b);
+    REQUIRE( d.pixels == 0 );
+    REQUIRE( d.maximum == 0 );
+  }
+
+  SECTION( "one pixel" ) {
+    b.setPixel(1, 2, qRgb(10, 20, 42));
+    auto d = pixelDifference(a, b);
+    REQUIRE( d.pixels == 1 );
+    REQUIRE( d.maximum == 12 );
+    REQUIRE( d.mean == Approx(12.0 / (3*16)) );
+  }
+
+  SECTION( "grayscale" ) {
+    QImage g(4, 4, QImage::Format_Grayscale8);
+    g.fill(20);
+    a.fill(qRgb(20, 20, 20));
+    REQUIRE( pixelDifference(a, g).pixels == 0 );
+  }
+}